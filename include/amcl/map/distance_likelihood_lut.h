@@ -0,0 +1,52 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef AMCL_MAP_DISTANCE_LIKELIHOOD_LUT_H
+#define AMCL_MAP_DISTANCE_LIKELIHOOD_LUT_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace badger_amcl
+{
+
+// A function of the distance to the nearest obstacle, tabulated at each
+// distance step a map stores, so a sensor model can look up the likelihood
+// of a beam endpoint from the step instead of evaluating the function.
+class DistanceLikelihoodLUT
+{
+public:
+  // Tabulate fn at step_count + 1 distances evenly spaced from 0 to max_distance
+  void update(const std::function<double(double)>& fn, double max_distance, uint32_t step_count);
+  void clear();
+  bool empty() const;
+
+  double get(uint32_t step) const
+  {
+    return values_[step];
+  }
+
+private:
+  std::vector<double> values_;
+};
+
+}  // namespace amcl
+
+#endif  // AMCL_MAP_DISTANCE_LIKELIHOOD_LUT_H
@@ -0,0 +1,127 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef AMCL_MAP_DISTANCES_LUT_CACHE_H
+#define AMCL_MAP_DISTANCES_LUT_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace badger_amcl
+{
+
+// Incremental 64 bit FNV-1a hash, for keying cached lookup tables on the
+// map contents and parameters they were built from.
+class FNVHash
+{
+public:
+  FNVHash();
+  void add(const void* data, size_t size);
+  template <typename T>
+  void add(const T& value)
+  {
+    add(&value, sizeof(value));
+  }
+  uint64_t get() const;
+
+private:
+  uint64_t hash_;
+};
+
+// A distances lookup table stored in a file, as a header followed by one or
+// more arrays.  The file is mapped read only when loaded, so large tables are
+// ready at once and the pages are shared with any other process mapping the
+// same file.  The header holds a format version, the key of the map the table
+// was built from, the size of each array and a checksum; a file that does not
+// match is ignored.
+class DistancesLUTCache
+{
+public:
+  struct Section
+  {
+    const void* data;
+    size_t size;
+  };
+
+  // The file is named from name and key, in directory dir
+  DistancesLUTCache(const std::string& dir, const std::string& name, uint64_t key);
+
+  std::string getPath() const;
+
+  // Map the file, and point each section at its array.  Returns false if
+  // there is no valid cache for the key.  The arrays stay valid as long as
+  // the returned mapping is held.
+  bool load(std::vector<Section>* sections, std::shared_ptr<const void>* mapping) const;
+
+  // Write the sections to a temporary file and rename it into place, so a
+  // reader never sees a partial file.
+  bool save(const std::vector<Section>& sections) const;
+
+private:
+  static constexpr uint32_t VERSION = 1;
+
+  std::string path_;
+  uint64_t key_;
+};
+
+// A distances lookup table in a named shared memory segment, so several
+// localizers on one host can use one copy of the same map's table.  The
+// first process to ask for a key builds the table and publishes it; the
+// others wait for it and map it read only.  The segment counts the
+// processes mapping it and is unlinked when the last one lets go, so a
+// table for a map no one uses any more does not outlive its users.  A
+// changed map has another key, and so another segment.
+class SharedDistancesLUT
+{
+public:
+  typedef DistancesLUTCache::Section Section;
+
+  // The segment is named from name and key
+  SharedDistancesLUT(const std::string& name, uint64_t key);
+  ~SharedDistancesLUT();
+
+  std::string getName() const;
+
+  // Map the table another process has published, and point each section at
+  // its array.  The arrays stay valid as long as the returned mapping is
+  // held.  If there is no table yet, returns false and holds the segment
+  // locked until publish is called or this is destroyed, so other processes
+  // wait for this one to build the table rather than building it too.
+  bool attach(std::vector<Section>* sections, std::shared_ptr<const void>* mapping);
+
+  // Copy the sections into the segment and make it available, after attach
+  // returned false.  shared_sections point at the copies.
+  bool publish(const std::vector<Section>& sections, std::vector<Section>* shared_sections,
+               std::shared_ptr<const void>* mapping);
+
+private:
+  static constexpr uint32_t VERSION = 1;
+
+  std::string name_;
+  uint64_t key_;
+  // Locked segment this process is to publish into, or -1
+  int fd_;
+};
+
+}  // namespace amcl
+
+#endif  // AMCL_MAP_DISTANCES_LUT_CACHE_H
@@ -22,13 +22,33 @@
 #define AMCL_MAP_MAP_H
 
 #include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include <pcl/point_types.h>
 
+#include "pf/thread_pool.h"
+
 namespace badger_amcl
 {
 
+enum DistancesLUTBuilderType
+{
+  DISTANCES_LUT_BRUSHFIRE,
+  DISTANCES_LUT_EDT
+};
+
+// How the cells of the distances lookup table are ordered in memory.  Tiled
+// stores the grid as square tiles, one after another, so cells near each
+// other share cache lines and pages.
+enum DistancesLUTLayout
+{
+  DISTANCES_LUT_ROW_MAJOR,
+  DISTANCES_LUT_TILED
+};
+
 class Map
 {
 public:
@@ -42,8 +62,37 @@ public:
 
   virtual bool isDistancesLUTCreated();
   virtual pcl::PointXYZ getOrigin();
+  // Choose how the distances lookup table is built
+  void setDistancesLUTBuilder(DistancesLUTBuilderType builder);
+  // Threads used to build the distances lookup table
+  void setThreadPool(std::shared_ptr<ThreadPool> thread_pool);
+  // Directory to load built distances lookup tables from and save them to; empty disables the cache
+  void setDistancesLUTCacheDir(const std::string& dir);
+  // Share the distances lookup table with other processes using the same map on this host
+  void setShareDistancesLUT(bool share);
+  // Choose the memory layout of the distances lookup table; takes effect when it is next built
+  void setDistancesLUTLayout(DistancesLUTLayout layout);
 
 protected:
+  // Squared distance transform of a sampled function in one dimension, after
+  // Felzenszwalb and Huttenlocher.  Sets d[q] = min over p of (q - p)^2 + f[p].
+  // v and z are workspace of at least n and n + 1 entries.
+  static void distanceTransform1D(const float* f, int n, float* d, int* v, double* z);
+
+  // Tiles are TILE_SIZE cells square, and stored row major, as are the cells in a tile
+  static constexpr int TILE_SHIFT = 4;
+  static constexpr int TILE_SIZE = 1 << TILE_SHIFT;
+  static constexpr int TILE_MASK = TILE_SIZE - 1;
+  static int computeTileCount(int cells)
+  {
+    return (cells + TILE_MASK) >> TILE_SHIFT;
+  }
+  static uint32_t computeTiledIndex(int i, int j, int tiles_x)
+  {
+    uint32_t tile = uint32_t(j >> TILE_SHIFT) * tiles_x + (i >> TILE_SHIFT);
+    return (tile << (2 * TILE_SHIFT)) | ((j & TILE_MASK) << TILE_SHIFT) | (i & TILE_MASK);
+  }
+
   // Map origin; the map is a viewport onto a conceptual larger map.
   pcl::PointXYZ origin_;
   double resolution_;
@@ -51,6 +100,13 @@ protected:
   // likelihood field
   double max_distance_to_object_;
   std::atomic<bool> distances_lut_created_;
+  DistancesLUTBuilderType distances_lut_builder_;
+  std::shared_ptr<ThreadPool> thread_pool_;
+  std::string distances_lut_cache_dir_;
+  bool share_distances_lut_;
+  DistancesLUTLayout distances_lut_layout_;
+  // Keeps a distances lookup table loaded from outside the process mapped
+  std::shared_ptr<const void> distances_lut_mapping_;
 };
 }  // namespace amcl
 
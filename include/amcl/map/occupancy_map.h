@@ -27,19 +27,31 @@
 #include <queue>
 #include <vector>
 
+#include "map/distances_lut_cache.h"
 #include "map/map.h"
 
 namespace badger_amcl
 {
 
-// Description for a single map cell.
-enum MapCellState
+// Description for a single map cell.  One byte, as there is one per cell
+// of a possibly scaled up map.
+enum MapCellState : int8_t
 {
   CELL_FREE = -1,
   CELL_UNKNOWN = 0,
   CELL_OCCUPIED = 1
 };
 
+// How the distances lookup table stores each cell.  The integer types
+// store the distance in steps of max distance / the type's max, which cuts
+// the table to a half or a quarter the size for at most half a step of error.
+enum DistancesLUTPrecision
+{
+  DISTANCES_LUT_FLOAT,
+  DISTANCES_LUT_UINT16,
+  DISTANCES_LUT_UINT8
+};
+
 class CachedDistanceOccupancyMap
 {
 public:
@@ -62,27 +74,80 @@ public:
   // Convert from world coords to map coords
   virtual void convertWorldToMap(const std::vector<double>& world_coords,
                                  std::vector<int>* map_coords);
+  // As convertWorldToMap, without vectors, for the per beam loops
+  void convertWorldToMap(double x, double y, int* i, int* j)
+  {
+    *i = std::floor((x - origin_.x) / resolution_ + 0.5) + size_x_ / 2;
+    *j = std::floor((y - origin_.y) / resolution_ + 0.5) + size_y_ / 2;
+  }
   // Test to see if the given map coords lie within the absolute map bounds.
   virtual bool isValid(const std::vector<int>& coords);
   virtual void setOrigin(const pcl::PointXYZ& origin);
   virtual std::vector<int> getSize();
   virtual void setSize(std::vector<int> size_vec);
-  // Update the distance values
+  // Update the distance values.  Does nothing if they are already up to date
+  // for the cells and parameters, as for a map built before it is handed to
+  // the sensor model.
   virtual void updateDistancesLUT(double max_distance_to_object);
-  // Extract a single range reading from the map
+  // Replace the states of a width by height patch of cells starting at
+  // min_i, min_j with states, given row by row, and update the distances of
+  // the cells near enough to the patch to change.  Those distances come from
+  // the exact transform, whichever builder built the rest of the table.
+  // Sets the min (inclusive) and max (exclusive) corners of the cells whose
+  // states or distances may have changed: the patch, widened by the
+  // distances' reach if there is a distances table.
+  virtual void applyPatch(int min_i, int min_j, int width, int height, const std::vector<MapCellState>& states,
+                          std::vector<int>* updated_min, std::vector<int>* updated_max);
+  // Build the clearance table calcRange uses to skip over open space.  Does
+  // nothing if it is already up to date.  Setting a cell drops the table, and
+  // applyPatch keeps it up to date.
+  virtual void updateClearanceLUT();
+  // Extract a single range reading from the map.  Safe to call from several threads.
   virtual double calcRange(double ox, double oy, double oa, double max_range);
+  // Cast rays of up to max_range from the centre of each free cell at
+  // bearing_count evenly spaced bearings, and keep the ranges for
+  // lookupRange.  Loaded from the cache directory if it holds the table, and
+  // saved there once built.  Does nothing if already built for these
+  // parameters.  Setting cells drops the table, and applyPatch recasts the
+  // rays that could pass through the patch.
+  virtual void updateRangeLUT(double max_range, int bearing_count);
+  // The range calcRange gives from the centre of the given pose's cell, at
+  // the nearest tabulated bearing, up to max_range.  Casts the ray instead
+  // if there is no table for the cell, or the table saw no hit and max_range
+  // reaches past the table's.  Safe to call from several threads.
+  double lookupRange(double ox, double oy, double oa, double max_range);
   // Compute the cell index for the given map coords.
   virtual unsigned int computeCellIndex(int i, int j);
   virtual double getMaxDistanceToObject();
   virtual MapCellState getCellState(int i, int j);
   virtual void setCellState(int index, MapCellState state);
-  // This function is called very frequently.
+  void setDistancesLUTPrecision(DistancesLUTPrecision precision);
+  // This function is called very frequently, from several threads at once.
   // Do not make it virtual as this would hinder performance.
   float getDistanceToObject(int i, int j);
+  // The distance to the nearest object in steps of the max distance over
+  // getDistanceStepCount, exact for the integer precisions and rounded for
+  // float.  Off the map is the last step.
+  uint32_t getDistanceStep(int i, int j);
+  uint32_t getDistanceStepCount();
 
 protected:
   struct OccupancyMapCellData;
 
+  // Fill the distances lookup table with an exact separable distance transform
+  virtual void computeDistancesWithEDT();
+  // Replace the float table with the configured integer one, if any
+  virtual void quantizeDistancesLUT();
+  // Copy a table mapped from a cache or shared memory into this process, so
+  // it can be changed without changing it for anyone else
+  virtual void copyMappedDistancesLUT();
+  virtual size_t getDistancesLUTEntrySize();
+  // Key for the cached distances lookup table, from everything it depends on
+  virtual uint64_t computeDistancesLUTKey();
+  // Use a distances lookup table mapped from a cache or shared memory
+  virtual bool useDistancesLUT(const std::vector<DistancesLUTCache::Section>& sections,
+                               std::shared_ptr<const void> mapping);
+
   virtual void iterateObstacleCells(std::priority_queue<OccupancyMapCellData>& q,
                                     std::vector<bool>& marked);
   virtual void iterateEmptyCells(std::priority_queue<OccupancyMapCellData>& q,
@@ -95,9 +160,44 @@ protected:
 
   // The map occupancy data, stored as a grid
   std::vector<MapCellState> cells_;
+  // Whether cells were set since the distances were last updated
+  bool cells_changed_;
 
-  // The map distance data, stored as a grid
+  // The map distance data, stored as a grid.  Built into distances_lut_ and
+  // possibly quantized into quantized_distances_lut_, or mapped from a cache
+  // or shared memory; distances_lut_data_ points at whichever is in use, and
+  // distances_lut_data_precision_ says how to read it.
   std::vector<float> distances_lut_;
+  std::vector<uint8_t> quantized_distances_lut_;
+  const void* distances_lut_data_;
+  DistancesLUTPrecision distances_lut_precision_;
+  DistancesLUTPrecision distances_lut_data_precision_;
+  // Distance of one step of a quantized table, or of getDistanceStep for a float table
+  float distances_lut_scale_;
+  uint32_t distance_step_count_;
+  // Layout of the table in use, and its size in cells including any padding
+  DistancesLUTLayout distances_lut_data_layout_;
+  int distances_lut_tiles_x_;
+  size_t distances_lut_size_;
+
+  // Distance in cells from each cell to the nearest cell that stops a ray,
+  // that is one that is not free or is off the map, rounded down and capped
+  // at 255.  Row major, and empty until updateClearanceLUT is called.
+  std::vector<uint8_t> clearance_lut_;
+
+  // Expected ranges, range_lut_bearing_count_ per free cell in steps of
+  // range_lut_scale_, for the cells with a row in range_lut_rows_.  Built
+  // into range_lut_ or mapped from a cache; range_lut_data_ points at
+  // whichever is in use, and is null when there is no table.
+  std::vector<uint32_t> range_lut_rows_;
+  std::vector<uint16_t> range_lut_;
+  const uint16_t* range_lut_data_;
+  // Rows in the table, including those of cells a patch made not free
+  size_t range_lut_row_count_;
+  std::shared_ptr<const void> range_lut_mapping_;
+  int range_lut_bearing_count_;
+  double range_lut_max_range_;
+  double range_lut_scale_;
 
   CachedDistanceOccupancyMap cdm_;
 
@@ -115,11 +215,42 @@ protected:
   };
 
 private:
+  uint32_t computeDistancesLUTIndex(int i, int j)
+  {
+    if (distances_lut_data_layout_ == DISTANCES_LUT_TILED)
+      return computeTiledIndex(i, j, distances_lut_tiles_x_);
+    return i + j * uint32_t(size_x_);
+  }
+  // Write a distance in the table in use, at its precision
+  void storeDistance(uint32_t index, float d);
+  // Exact distances in cells of the cells in [min_i, max_i) by [min_j, max_j),
+  // from the cells in the same box for which is_obstacle(state) is true.
+  // Distances past radius are clamped to just past it.  The row pass leaves
+  // squared distances in buffer(i, j), and the column pass hands each cell's
+  // distance to store(i, j, d).
+  template <typename IsObstacle, typename Buffer, typename Store>
+  void computeBoxDistancesWithEDT(int min_i, int min_j, int max_i, int max_j, int radius, IsObstacle is_obstacle,
+                                  Buffer buffer, Store store);
+  // Distance to store for a distance in cells from the transform
+  float cellsToDistance(double cells)
+  {
+    return cells <= cdm_.cell_radius_ ? cells * resolution_ : max_distance_to_object_;
+  }
+  // Recompute the clearances of the cells in [min_i, max_i) by [min_j, max_j)
+  void computeClearances(int min_i, int min_j, int max_i, int max_j);
+  // Key for the cached range lookup table, from everything it depends on
+  uint64_t computeRangeLUTKey();
+  // Free the range lookup table
+  void dropRangeLUT();
+  // The range table entry for the ray from the centre of cell i, j at bearing
+  uint16_t computeRangeLUTEntry(int i, int j, int bearing);
+  // Recast the rays that could pass through the patch from min_i, min_j to
+  // max_i, max_j (exclusive) after it is applied, giving the cells it freed
+  // new rows
+  void patchRangeLUT(int min_i, int min_j, int max_i, int max_j, const std::vector<uint32_t>& freed_cells);
   inline void setDistanceToObject(int i, int j, float d);
   inline void updateNode(int i, int j, const OccupancyMapCellData& current_cell,
                          std::priority_queue<OccupancyMapCellData>& q, std::vector<bool>& marked);
-  std::vector<int> map_vec_;
-  std::vector<double> world_vec_;
 };
 }  // namespace amcl
 
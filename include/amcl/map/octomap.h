@@ -20,16 +20,20 @@
 #ifndef AMCL_MAP_OCTOMAP_H
 #define AMCL_MAP_OCTOMAP_H
 
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <limits>
 #include <memory>
 #include <queue>
+#include <utility>
 #include <vector>
 
 #include <octomap/OcTree.h>
 #include <ros/node_handle.h>
 #include <ros/publisher.h>
 
+#include "map/distances_lut_cache.h"
 #include "map/map.h"
 
 namespace badger_amcl
@@ -68,6 +72,13 @@ public:
   // Convert from world coords to map coords
   virtual void convertWorldToMap(const std::vector<double>& world_coords,
                                  std::vector<int>* map_coords);
+  // As convertWorldToMap, without vectors, for the per point loops
+  void convertWorldToMap(double x, double y, double z, int* i, int* j, int* k)
+  {
+    *i = std::floor(x / resolution_ + 0.5);
+    *j = std::floor(y / resolution_ + 0.5);
+    *k = std::floor(z / resolution_ + 0.5);
+  }
   // Test to see if the given map coords lie within the absolute map bounds.
   virtual bool isPoseValid(const int i, const int j);
   virtual bool isVoxelValid(const int i, const int j, const int k);
@@ -79,6 +90,28 @@ public:
   // This function is called very frequently.
   // Do not make it virtual as this would hinder performance.
   double getDistanceToObject(int i, int j, int k);
+  // The distance to the nearest object in steps of the max distance over
+  // getDistanceStepCount, as stored.  Off the map is the last step.
+  uint32_t getDistanceStep(int i, int j, int k);
+  uint32_t getDistanceStepCount();
+  // As getDistanceToObject and getDistanceStep, for the per point loops once
+  // the distances LUT is created.  There are no bounds checks: coordinates
+  // are clamped into the guard band around the map, whose outer face is all
+  // at the max distance.
+  double getDistanceToObjectFast(int i, int j, int k) const
+  {
+    return getDistanceStepFast(i, j, k) * max_distance_ratio_;
+  }
+  uint32_t getDistanceStepFast(int i, int j, int k) const
+  {
+    int i_shifted = std::min(std::max(i, lut_min_cells_[0]), lut_max_cells_[0]) - lut_min_cells_[0];
+    int j_shifted = std::min(std::max(j, lut_min_cells_[1]), lut_max_cells_[1]) - lut_min_cells_[1];
+    int k_shifted = std::min(std::max(k, lut_min_cells_[2]), lut_max_cells_[2]) - lut_min_cells_[2];
+    uint32_t pose_index = pose_indices_layout_ == DISTANCES_LUT_TILED
+                              ? computeTiledIndex(i_shifted, j_shifted, pose_tiles_x_)
+                              : uint32_t(j_shifted) * map_cells_width_ + i_shifted;
+    return distance_ratios_data_[pose_indices_data_[pose_index] + k_shifted];
+  }
 
 protected:
   const std::vector<std::vector<int>> SHIFTS = {{-1, 0, 0}, {0, -1, 0}, {0, 0, -1}, {1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
@@ -87,21 +120,46 @@ protected:
   using CellDataQueue = std::queue<OctoMapCellData>;
   static constexpr double EPSILON = std::numeric_limits<double>::epsilon();
 
+  virtual void buildDistancesLUT();
+  // Fill the distances lookup table with an exact separable distance transform
+  virtual void computeDistancesWithEDT();
+  virtual void collectOccupiedVoxels(std::vector<std::vector<std::pair<int, int>>>* occupied_rows);
+  // Key for the cached distances lookup table, from everything it depends on
+  virtual uint64_t computeDistancesLUTKey();
+  // Use a distances lookup table mapped from a cache or shared memory
+  virtual bool useDistancesLUT(const std::vector<DistancesLUTCache::Section>& sections,
+                               std::shared_ptr<const void> mapping);
   virtual void iterateObstacleCells(CellDataQueue& q);
   virtual void iterateEmptyCells(CellDataQueue& q);
   virtual void enqueue(const int shift_index, const OctoMapCellData& current_cell, CellDataQueue& q);
   virtual inline uint32_t makePoseIndex(int i, int j);
+  virtual void updateCroppedSize();
+  virtual void sortColumnsByPose();
   virtual inline void setDistanceToObject(int i, int j, int k, double d);
+  bool isVoxelInDistancesLUT(int i, int j, int k);
 
   std::shared_ptr<octomap::OcTree> octree_;
+  // Built into the vectors, or mapped from a cache or shared memory; the
+  // data pointers point at whichever is in use.
   std::vector<uint32_t> pose_indices_;
   std::vector<uint8_t> distance_ratios_;
+  const uint32_t* pose_indices_data_;
+  const uint8_t* distance_ratios_data_;
   // Map dimensions (number of cells)
   std::vector<double> map_min_bounds_, map_max_bounds_;
   std::vector<int> cropped_min_cells_, cropped_max_cells_;
+  // Bounds of the distances lookup table: the cropped map with a guard band
+  // all around, one voxel wider than the max distance, so the outer face of
+  // the band is at the max distance from any obstacle in the map
+  int lut_min_cells_[3];
+  int lut_max_cells_[3];
   CachedDistanceOctoMap cdm_;
+  // Width of the distances lookup table, in cells
   int map_cells_width_;
+  // Poses including any padding of the last tiles
   uint32_t num_poses_;
+  DistancesLUTLayout pose_indices_layout_;
+  int pose_tiles_x_;
   int num_z_column_indices_;
   double max_distance_ratio_;
 
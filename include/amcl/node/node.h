@@ -56,6 +56,8 @@
 #include "map/map.h"
 #include "node/node_nd.h"
 #include "pf/particle_filter.h"
+#include "pf/random.h"
+#include "pf/thread_pool.h"
 #include "sensors/odom.h"
 
 namespace badger_amcl
@@ -81,11 +83,19 @@ public:
   Node();
   void initFromNewMap(std::shared_ptr<Map> new_map, bool use_init_pose);
   void updateFreeSpaceIndices(std::vector<std::pair<int, int>> fsi);
+  // Replace the free space indices from min (inclusive) to max (exclusive) with fsi
+  void updateFreeSpaceIndices(const std::vector<std::pair<int, int>>& fsi, const std::vector<int>& min,
+                              const std::vector<int>& max);
   void initOdomIntegrator();
   bool getOdomPose(const ros::Time& t, Eigen::Vector3d* map_pose);
   std::string getOdomFrameId();
   std::string getBaseFrameId();
   std::shared_ptr<ParticleFilter> getPfPtr();
+  std::shared_ptr<ThreadPool> getThreadPool();
+  DistancesLUTBuilderType getDistancesLUTBuilder();
+  std::string getDistancesLUTCacheDir();
+  bool getShareDistancesLUT();
+  DistancesLUTLayout getDistancesLUTLayout();
   void publishParticleCloud();
   void updatePose(const Eigen::Vector3d& max_hyp_mean, const ros::Time& stamp);
   void updateOdomToMapTransform(const tf2::Transform& odom_to_map);
@@ -97,6 +107,8 @@ public:
 private:
   void reconfigureCB(AMCLConfig& config, uint32_t level);
   bool globalLocalizationCallback(std_srvs::Empty::Request& req, std_srvs::Empty::Response& res);
+  // Recount free_space_row_ends_ after the rows change
+  void countFreeSpaceIndices();
   // Generate a random pose in a free space on the map
   Eigen::Vector3d randomFreeSpacePose();
   Eigen::Vector3d uniformPoseGenerator();
@@ -194,6 +206,14 @@ private:
   // Particle filter
   std::shared_ptr<ParticleFilter> pf_;
   double pf_err_, pf_z_;
+  // Threads shared by the sample updates
+  std::shared_ptr<ThreadPool> thread_pool_;
+  DistancesLUTBuilderType distances_lut_builder_;
+  // Where built distances LUTs are kept for reuse; empty disables the cache
+  std::string distances_lut_cache_dir_;
+  // Use one copy of the distances LUT with the other localizers on this host
+  bool share_distances_lut_;
+  DistancesLUTLayout distances_lut_layout_;
   bool odom_init_;
   Eigen::Vector3d pf_odom_pose_;
   double d_thresh_, a_thresh_;
@@ -222,7 +242,14 @@ private:
   double alpha_slow_, alpha_fast_;
   double uniform_pose_starting_weight_threshold_;
   double uniform_pose_deweight_multiplier_;
-  std::vector<std::pair<int, int>> free_space_indices_;
+  // Free space cells bucketed by row, from free_space_min_row_ up, so an
+  // update only rewrites the rows it touches.  free_space_row_ends_ holds
+  // the number of cells in each row and the rows before it.
+  std::vector<std::vector<std::pair<int, int>>> free_space_rows_;
+  std::vector<size_t> free_space_row_ends_;
+  int free_space_min_row_;
+  // Random numbers for drawing free space poses
+  RandomStream random_stream_;
 };
 
 }  // namespace amcl
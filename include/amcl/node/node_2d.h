@@ -26,10 +26,13 @@
 #include <string>
 #include <vector>
 
+#include <map_msgs/OccupancyGridUpdate.h>
 #include <message_filters/subscriber.h>
 #include <nav_msgs/OccupancyGrid.h>
 #include <sensor_msgs/LaserScan.h>
+#include <ros/callback_queue.h>
 #include <ros/duration.h>
+#include <ros/spinner.h>
 #include <ros/subscriber.h>
 #include <ros/time.h>
 #include <ros/timer.h>
@@ -65,6 +68,7 @@ private:
   bool updateNodePf(const ros::Time& stamp, int scanner_index, bool* force_publication);
   bool updateScanner(const sensor_msgs::LaserScanConstPtr& planar_scan, int scanner_index, bool* resampled);
   void updateFreeSpaceIndices();
+  std::vector<std::pair<int, int>> findFreeSpaceIndices(const std::vector<int>& min, const std::vector<int>& max);
   void resampleParticles();
   bool resamplePose(const ros::Time& stamp);
   void getMaxWeightPose(double* max_weight_rtn, Eigen::Vector3d* max_pose);
@@ -73,14 +77,17 @@ private:
   void deactivateGlobalLocalizationParams();
   int getFrameToScannerIndex(const std::string& scanner_frame_id);
   void mapMsgReceived(const nav_msgs::OccupancyGridConstPtr& msg);
-  void initFromNewMap();
+  // Apply a patch to the current map in place, keeping the particle filter
+  void mapUpdateReceived(const map_msgs::OccupancyGridUpdateConstPtr& msg);
+  void initFromNewMap(bool use_initial_pose);
   std::shared_ptr<OccupancyMap> convertMap(const nav_msgs::OccupancyGrid& map_msg);
   void checkScanReceived(const ros::TimerEvent& event);
   bool initFrameToScanner(const std::string& scanner_frame_id, tf2::Transform* scanner_pose, int* scanner_index);
   void updateScannerPose(const tf2::Transform& scanner_pose, int scanner_index);
   bool initLatestScanData(const sensor_msgs::LaserScanConstPtr& planar_scan, int scanner_index);
   bool getAngleStats(const sensor_msgs::LaserScanConstPtr& planar_scan, double* angle_min, double* angle_increment);
-  void updateLatestScanData(const sensor_msgs::LaserScanConstPtr& planar_scan, double angle_min, double angle_increment);
+  void updateLatestScanData(const sensor_msgs::LaserScanConstPtr& planar_scan, int scanner_index,
+                            double angle_min, double angle_increment);
   bool updatePf(const sensor_msgs::LaserScanConstPtr& planar_scan, int scanner_index, bool* resampled);
   bool resamplePf(const sensor_msgs::LaserScanConstPtr& planar_scan);
 
@@ -96,12 +103,19 @@ private:
   std::shared_ptr<PlanarData> latest_scan_data_;
   std::shared_ptr<PFSampleSet> fake_sample_set_;
   std::shared_ptr<ParticleFilter> pf_;
-  PFSample fake_sample_;
   PlanarScanner scanner_;
   PlanarModelType model_type_;
   ros::NodeHandle nh_;
   ros::NodeHandle private_nh_;
+  // Maps are received and built on their own thread, so scans are matched
+  // against the old map until the new one is ready
+  ros::NodeHandle map_nh_;
+  ros::CallbackQueue map_queue_;
+  ros::AsyncSpinner map_spinner_;
+  std::shared_ptr<ThreadPool> map_thread_pool_;
   ros::Subscriber map_sub_;
+  ros::Subscriber map_updates_sub_;
+  std::string map_frame_id_;
   ros::Timer check_scanner_timer_;
   ros::Time latest_scan_received_ts_;
   ros::Duration check_scanner_interval_;
@@ -109,10 +123,12 @@ private:
   tf2_ros::TransformListener tf_listener_;
   int max_beams_;
   int map_scale_up_factor_;
+  DistancesLUTPrecision distances_lut_precision_;
   int resample_interval_;
   int resample_count_;
   bool first_map_received_;
   bool first_map_only_;
+  bool keep_pose_on_new_map_;
   bool do_beamskip_;
   bool force_update_;  // used to temporarily let amcl update samples even when no motion occurs...
   double beam_skip_distance_, beam_skip_threshold_, beam_skip_error_threshold_;
@@ -125,6 +141,8 @@ private:
   double sensor_min_range_;
   double sensor_max_range_;
   double sensor_likelihood_max_dist_;
+  int range_lut_bearing_count_;
+  double range_lut_max_range_;
   double off_map_factor_;
   double z_hit_, z_short_, z_max_, z_rand_, sigma_hit_, lambda_short_;
   double non_free_space_factor_;
@@ -29,8 +29,10 @@
 #include <message_filters/subscriber.h>
 #include <nav_msgs/OccupancyGrid.h>
 #include <octomap_msgs/Octomap.h>
+#include <ros/callback_queue.h>
 #include <ros/duration.h>
 #include <ros/node_handle.h>
+#include <ros/spinner.h>
 #include <ros/subscriber.h>
 #include <ros/time.h>
 #include <ros/timer.h>
@@ -43,6 +45,7 @@
 #include "badger_amcl/AMCLConfig.h"
 #include "map/octomap.h"
 #include "node/node_nd.h"
+#include "sensors/point_cloud_preprocessor.h"
 #include "sensors/point_cloud_scanner.h"
 
 namespace badger_amcl
@@ -67,26 +70,31 @@ private:
   bool updateNodePf(const ros::Time& stamp, int scanner_index, bool* force_publication);
   void occupancyMapMsgReceived(const nav_msgs::OccupancyGridConstPtr& msg);
   void octoMapMsgReceived(const octomap_msgs::OctomapConstPtr& msg);
-  void initFromNewMap();
+  // Build a map from msg, within the occupancy map bounds if it waits for
+  // them, and swap it in.  new_bounds says msg is the current octomap, and
+  // only the bounds changed.  Called on the map thread.
+  void swapInMap(const octomap_msgs::OctomapConstPtr& msg, bool new_bounds);
+  void initFromNewMap(bool use_initial_pose);
   std::shared_ptr<OctoMap> convertMap(const octomap_msgs::Octomap& map_msg);
   bool initFrameToScanner(const sensor_msgs::PointCloud2ConstPtr& point_cloud_scan, int* scanner_index);
   bool updatePf(const sensor_msgs::PointCloud2ConstPtr& point_cloud_scan, int scanner_index, bool* resampled);
   bool resamplePf(const sensor_msgs::PointCloud2ConstPtr& point_cloud_scan);
-  void makePointCloudFromScan(const sensor_msgs::PointCloud2ConstPtr& point_cloud_scan,
-                              pcl::PointCloud<pcl::PointXYZ>::Ptr point_cloud);
   void updateFreeSpaceIndices();
-  void updateLatestScanData(const pcl::PointCloud<pcl::PointXYZ>::Ptr point_cloud, int scanner_index);
-  void updateScanner(const sensor_msgs::PointCloud2ConstPtr& point_cloud_scan, int scanner_index, bool* resampled);
+  // The scanner's transform to the footprint, looked up the first time its frame is seen
+  bool getScannerToFootprintTransform(const std::string& frame_id, geometry_msgs::Transform* tf);
+  std::shared_ptr<PointCloudData> preprocessScan(const sensor_msgs::PointCloud2ConstPtr& point_cloud_scan,
+                                                 const geometry_msgs::Transform& scanner_to_footprint_tf);
+  void updateScanner(std::shared_ptr<PointCloudData> scan_data, int scanner_index, bool* resampled);
   void resampleParticles();
   bool resamplePose(const ros::Time& stamp);
   void getMaxWeightPose(double* max_weight, Eigen::Vector3d* max_pose);
   bool updatePose(const Eigen::Vector3d& max_hyp_mean, const ros::Time& stamp);
   bool isMapInitialized();
   void deactivateGlobalLocalizationParams();
-  int getFrameToScannerIndex(const std::string& scanner_frame_id);
+  int getFrameToScannerIndex(const std::string& scanner_frame_id,
+                             const geometry_msgs::Transform& scanner_to_footprint_tf);
   bool getFootprintToFrameTransform(const std::string& scanner_frame_id, geometry_msgs::Transform* stampedTransform);
   int initFrameToScanner();
-  void initLatestScanData(const sensor_msgs::PointCloud2ConstPtr& point_cloud_scan, int scanner_index);
   void checkScanReceived(const ros::TimerEvent& event);
 
   std::shared_ptr<OctoMap> map_;
@@ -102,14 +110,28 @@ private:
   std::vector<std::shared_ptr<PointCloudScanner> > scanners_;
   std::vector<double> occupancy_map_min_, occupancy_map_max_;
   std::vector<bool> scanners_update_;
-  PFSample fake_sample_;
   PointCloudModelType model_type_;
   PointCloudScanner scanner_;
+  // Scans are preprocessed outside the configuration mutex, under this one,
+  // on the thread the scan arrived on
+  std::mutex preprocess_mutex_;
+  PointCloudPreprocessor preprocessor_;
+  std::map<std::string, geometry_msgs::Transform> scanner_to_footprint_tfs_;
   Node* node_;
   ros::NodeHandle nh_;
   ros::NodeHandle private_nh_;
+  // Maps are received and built on their own thread, so scans are matched
+  // against the old map until the new one is ready
+  ros::NodeHandle map_nh_;
+  ros::CallbackQueue map_queue_;
+  ros::AsyncSpinner map_spinner_;
+  std::shared_ptr<ThreadPool> map_thread_pool_;
   ros::Subscriber occupancy_map_sub_;
   ros::Subscriber octo_map_sub_;
+  // The last octomap, when waiting for occupancy map bounds, to rebuild it
+  // within new ones.  Only used on the map thread.
+  octomap_msgs::OctomapConstPtr octomap_msg_;
+  std::string map_frame_id_;
   ros::Duration scanner_check_interval_;
   ros::Timer check_scanner_timer_;
   ros::Time latest_scan_received_ts_;
@@ -123,6 +145,7 @@ private:
   bool first_octomap_received_;
   bool occupancy_bounds_received_;
   bool first_map_only_;
+  bool keep_pose_on_new_map_;
   bool wait_for_occupancy_map_;
   bool force_update_;  // used to temporarily let amcl update samples even when no motion occurs...
   double scanner_height_;
@@ -20,6 +20,8 @@
 #ifndef AMCL_NODE_NODE_ND_H
 #define AMCL_NODE_NODE_ND_H
 
+#include <string>
+
 #include <Eigen/Dense>
 
 #include "badger_amcl/AMCLConfig.h"
@@ -34,6 +36,15 @@ public:
   virtual void reconfigure(AMCLConfig& config) = 0;
   virtual void globalLocalizationCallback() = 0;
   virtual double scorePose(const Eigen::Vector3d& p) = 0;
+
+  // Whether the particles carry over when a new map replaces the current
+  // one.  There are none to keep before the first map, and their poses mean
+  // nothing in a map with another frame.
+  static bool keepPoseOnNewMap(bool map_received, bool keep_pose_on_new_map, const std::string& map_frame_id,
+                               const std::string& new_map_frame_id)
+  {
+    return map_received and keep_pose_on_new_map and new_map_frame_id == map_frame_id;
+  }
 };
 
 }  // namespace amcl
@@ -0,0 +1,85 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef AMCL_PF_ALIGNED_ALLOCATOR_H
+#define AMCL_PF_ALIGNED_ALLOCATOR_H
+
+#include <stdlib.h>
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace badger_amcl
+{
+
+// Size of a cache line on the platforms we run on
+constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+// Allocator returning memory aligned to a given boundary, for buffers that are
+// walked by vectorized loops.
+template <typename T, std::size_t Alignment = CACHE_LINE_SIZE>
+class AlignedAllocator
+{
+public:
+  typedef T value_type;
+
+  template <typename U>
+  struct rebind
+  {
+    typedef AlignedAllocator<U, Alignment> other;
+  };
+
+  AlignedAllocator() = default;
+
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+  T* allocate(std::size_t n)
+  {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, Alignment, n * sizeof(T)) != 0)
+      throw std::bad_alloc();
+    return static_cast<T*>(ptr);
+  }
+
+  void deallocate(T* ptr, std::size_t)
+  {
+    free(ptr);
+  }
+};
+
+template <typename T, typename U, std::size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&)
+{
+  return true;
+}
+
+template <typename T, typename U, std::size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&)
+{
+  return false;
+}
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+}  // namespace amcl
+
+#endif  // AMCL_PF_ALIGNED_ALLOCATOR_H
@@ -21,12 +21,15 @@
 #ifndef AMCL_PF_PARTICLE_FILTER_H
 #define AMCL_PF_PARTICLE_FILTER_H
 
+#include <cstdint>
 #include <memory>
 #include <vector>
 
 #include <Eigen/Dense>
 
-#include <pf/pf_kdtree.h>
+#include <pf/aligned_allocator.h>
+#include <pf/pf_alias_table.h>
+#include <pf/pf_hash_grid.h>
 
 namespace badger_amcl
 {
@@ -37,15 +40,53 @@ enum PFResampleModelType
   PF_RESAMPLE_SYSTEMATIC,
 };
 
-// Information for a single sample
-struct PFSample
-{
-  // Pose represented by this sample
-  Eigen::Vector3d pose;
+// Number of samples in each block of a parallel loop over a sample set.
+// This is fixed so sums over the samples do not depend on the thread count.
+constexpr int PF_SAMPLE_BLOCK_SIZE = 64;
 
-  // Weight for this pose
-  double weight;
+// Poses and weights for the samples in a set.  These are stored as a
+// structure of arrays, each cache line aligned, so that the per-sample loops
+// in the filter and the sensor models can be vectorized.
+// The weights are normalized.  During a sensor update the models add to
+// the log weights instead, which are not.
+class PFSampleArray
+{
+public:
+  void resize(int count);
+  int size() const { return static_cast<int>(x_.size()); }
+
+  Eigen::Vector3d getPose(int i) const { return Eigen::Vector3d(x_[i], y_[i], yaw_[i]); }
+  void setPose(int i, const Eigen::Vector3d& pose)
+  {
+    x_[i] = pose[0];
+    y_[i] = pose[1];
+    yaw_[i] = pose[2];
+  }
+
+  double getWeight(int i) const { return weight_[i]; }
+  void setWeight(int i, double weight) { weight_[i] = weight; }
+  double getLogWeight(int i) const { return log_weight_[i]; }
+  void setLogWeight(int i, double log_weight) { log_weight_[i] = log_weight; }
+  // Histogram bin the sample was inserted into
+  int getBin(int i) const { return bin_[i]; }
+  void setBin(int i, int bin) { bin_[i] = bin; }
+
+  // Component arrays, for loops over all samples
+  double* x() { return x_.data(); }
+  double* y() { return y_.data(); }
+  double* yaw() { return yaw_.data(); }
+  double* weight() { return weight_.data(); }
+  double* log_weight() { return log_weight_.data(); }
+  const double* x() const { return x_.data(); }
+  const double* y() const { return y_.data(); }
+  const double* yaw() const { return yaw_.data(); }
+  const double* weight() const { return weight_.data(); }
+  const double* log_weight() const { return log_weight_.data(); }
+  const int* bin() const { return bin_.data(); }
 
+private:
+  AlignedVector<double> x_, y_, yaw_, weight_, log_weight_;
+  AlignedVector<int> bin_;
 };
 
 // Information for a cluster of samples
@@ -71,10 +112,10 @@ struct PFSampleSet
 {
   // The samples
   int sample_count;
-  std::vector<PFSample> samples;
+  PFSampleArray samples;
 
-  // A kdtree encoding the histogram
-  std::shared_ptr<PFKDTree> kdtree;
+  // A hash grid encoding the histogram
+  std::shared_ptr<PFHashGrid> histogram;
 
   // Clusters
   int cluster_count, cluster_max_count;
@@ -84,6 +125,9 @@ struct PFSampleSet
   Eigen::Vector3d mean;
   Eigen::Matrix3d cov;
   int converged;
+
+  // Unweighted mean and bounds of the sample positions, for the convergence check
+  Eigen::Vector2d position_mean, position_min, position_max;
 };
 
 class SensorData;
@@ -105,9 +149,11 @@ public:
   // Initialize the filter using a function to generate initial poses
   void initWithPoseFn(std::function<Eigen::Vector3d()> pose_fn);
 
-  // Update the filter with some new sensor observation
-  void updateSensor(std::function<double(std::shared_ptr<SensorData>,
-                                         std::shared_ptr<PFSampleSet>)> sensor_fn_ptr,
+  // Update the filter with some new sensor observation.  sensor_fn adds the
+  // log likelihood of the observation to each sample's log weight, and
+  // returns false if it could not be applied.
+  void updateSensor(std::function<bool(std::shared_ptr<SensorData>,
+                                       std::shared_ptr<PFSampleSet>)> sensor_fn_ptr,
                     std::shared_ptr<SensorData> sensor_data);
 
   // Resample the distribution
@@ -129,11 +175,14 @@ public:
   // getter for whether the particle filter has converged
   bool isConverged();
 
-private:
   // Compute the required number of samples, given that there are k bins
-  // with samples in them.
+  // with samples in them.  k is the histogram's getLeafCount.
   int resampleLimit(int k);
 
+private:
+
+  static double logAddExp(double a, double b);
+
   double resampleSystematic(double w_diff);
   double resampleMultinomial(double w_diff);
 
@@ -148,9 +197,8 @@ private:
   void computeClusterStatsForSet(std::shared_ptr<PFSampleSet> sample_set);
   void initCluster(PFCluster* cluster);
   void normalizeCluster(PFCluster* cluster);
-  int getClusterIndexOfSampleInSet(std::shared_ptr<PFSampleSet> set, PFSample* sample);
-  void addSampleStatsToCluster(const PFSample*, PFCluster* cluster);
-  void addSampleStatsToSet(const PFSample* sample, double* weight, double* m, double* c);
+  void addSampleStats(double x, double y, double cos_yaw, double sin_yaw, double weight, double* total_weight,
+                      double m[], double c[]);
   void computeSetStats(double weight, const double m[], const double c[],
                        std::shared_ptr<PFSampleSet> set);
 
@@ -159,8 +207,9 @@ private:
   // This min and max number of samples
   int min_samples_, max_samples_;
 
-  // Running averages, slow and fast, of likelihood
-  double w_slow_, w_fast_;
+  // Logs of the running averages, slow and fast, of likelihood.
+  // Negative infinity means no average has been taken yet.
+  double log_w_slow_, log_w_fast_;
 
   // Function used to draw random pose samples
   std::function<Eigen::Vector3d()> random_pose_fn_;
@@ -178,6 +227,13 @@ private:
   int current_set_;
   std::vector<std::shared_ptr<PFSampleSet>> sets_;
 
+  // Alias table used by multinomial resampling
+  PFAliasTable alias_table_;
+
+  // Counts of initializations and resamples, which number their random streams
+  uint64_t init_count_;
+  uint64_t resample_count_;
+
   bool converged_;
 };
 
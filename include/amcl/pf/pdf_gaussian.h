@@ -23,6 +23,8 @@
 
 #include <Eigen/Dense>
 
+#include "pf/random.h"
+
 namespace badger_amcl
 {
 
@@ -31,9 +33,9 @@ namespace badger_amcl
 class PDFGaussian
 {
 public:
-  // Create a gaussian pdf
-  PDFGaussian(const Eigen::Vector3d& x, const Eigen::Matrix3d& cx);
-  // Constructor used to seed random for testing
+  // Create a gaussian pdf, sampled with rng
+  PDFGaussian(const Eigen::Vector3d& x, const Eigen::Matrix3d& cx, const RandomStream& rng);
+  // Constructor with its own seed, for testing
   PDFGaussian(const Eigen::Vector3d& x, const Eigen::Matrix3d& cx, int seed);
 
   // Generate a sample from the the pdf.
@@ -43,7 +45,7 @@ public:
   // deviation sigma.
   // We use the polar form of the Box-Muller transformation, explained here:
   //   http://www.taygeta.com/random/gaussian.html
-  static double draw(double sigma);
+  static double draw(double sigma, RandomStream* rng);
 
 private:
   // Decompose a covariance matrix [a] into a rotation matrix [r] and a diagonal
@@ -57,6 +59,8 @@ private:
   // Decomposed covariance matrix (rotation * diagonal)
   Eigen::Matrix3d cr_;
   Eigen::Vector3d cd_;
+
+  RandomStream rng_;
 };
 
 }  // namespace amcl
@@ -0,0 +1,50 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef AMCL_PF_PF_ALIAS_TABLE_H
+#define AMCL_PF_PF_ALIAS_TABLE_H
+
+#include <vector>
+
+namespace badger_amcl
+{
+
+// Walker's alias method for drawing indices in proportion to their weights.
+// Building the table is linear in the number of weights (Vose's construction)
+// and each draw is constant time.
+class PFAliasTable
+{
+public:
+  // Build the table for the given weights.  Weights need not be normalized.
+  void build(const double* weights, int count);
+
+  // Draw an index using a uniform random number in [0, 1)
+  int draw(double r) const;
+
+private:
+  std::vector<double> prob_;
+  std::vector<int> alias_;
+
+  // Work lists, kept to avoid reallocating on every build
+  std::vector<int> small_, large_;
+};
+
+}  // namespace amcl
+
+#endif  // AMCL_PF_PF_ALIAS_TABLE_H
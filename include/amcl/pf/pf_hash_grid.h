@@ -0,0 +1,88 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef AMCL_PF_PF_HASH_GRID_H
+#define AMCL_PF_PF_HASH_GRID_H
+
+#include <cstdint>
+#include <vector>
+
+#include <Eigen/Dense>
+
+namespace badger_amcl
+{
+
+struct PFHashGridBin
+{
+  int key[3];
+  double value;
+  int cluster;
+};
+
+// Histogram of sample poses over (x, y, yaw) bins, used for KLD sampling and
+// clustering.  Bins live in a dense array in insertion order, and an open
+// addressing table maps bin keys to their index in that array.  Yaw bins wrap
+// around, so samples either side of +/- pi fall in neighbouring bins.
+class PFHashGrid
+{
+public:
+  PFHashGrid();
+  void clear();
+  // Add a pose to the histogram, and return the index of its bin
+  int insertPose(const Eigen::Vector3d& pose, double value);
+  // Label connected bins with cluster ids, in order of first insertion
+  void cluster();
+  int getCluster(const Eigen::Vector3d& pose);
+  // Cluster label of a bin returned by insertPose, without a table lookup
+  int getBinCluster(int bin);
+  int getClusterCount();
+  // Number of occupied bins, the k of the KLD bound.  PFKDTree's count was
+  // of its childless nodes only, which is fewer than its bins.
+  int getLeafCount();
+
+private:
+  struct Slot
+  {
+    uint32_t stamp;
+    int bin;
+  };
+
+  void computeKey(const Eigen::Vector3d& pose, int key[]);
+  uint32_t hashKey(const int key[]);
+  int findBin(const int key[]);
+  void grow();
+
+  double cell_size_[3];
+  int yaw_bins_;
+
+  std::vector<PFHashGridBin> bins_;
+
+  // Slots are only valid if their stamp matches stamp_, so clearing the
+  // table is a counter increment rather than a pass over every slot.
+  std::vector<Slot> slots_;
+  uint32_t mask_;
+  uint32_t stamp_;
+
+  int cluster_count_;
+  std::vector<int> queue_;
+};
+
+}  // namespace amcl
+
+#endif  // AMCL_PF_PF_HASH_GRID_H
@@ -31,6 +31,7 @@ namespace badger_amcl
 
 struct PFKDTreeNode
 {
+  int index;
   int depth;
   int pivot_dim;
   int key[3];
@@ -45,16 +46,20 @@ class PFKDTree
 public:
   PFKDTree();
   void clearKDTree();
-  void insertPose(const Eigen::Vector3d& pose, double value);
+  // Add a pose to the histogram, and return the index of its bin
+  int insertPose(const Eigen::Vector3d& pose, double value);
   void cluster();
   int getCluster(const Eigen::Vector3d& pose);
+  // Cluster label of a bin returned by insertPose, without searching the tree
+  int getBinCluster(int bin);
+  int getClusterCount();
   int getLeafCount();
 
 private:
   bool equals(int key_a[], int key_b[]);
-  PFKDTreeNode* insertNode(PFKDTreeNode* node, int key[], double value, int depth);
+  PFKDTreeNode* insertNode(PFKDTreeNode* node, int key[], double value, int depth, int* index);
   PFKDTreeNode* makeLeafNode(int key[], double value, int depth);
-  void traverseNode(PFKDTreeNode* node, int key[], double value, int depth);
+  void traverseNode(PFKDTreeNode* node, int key[], double value, int depth, int* index);
   PFKDTreeNode* findNode(PFKDTreeNode* node, int key[]);
   void clusterNode(PFKDTreeNode* node);
 
@@ -62,6 +67,7 @@ private:
   PFKDTreeNode* root_;
   std::deque<PFKDTreeNode> nodes_;
   int leaf_count_;
+  int cluster_count_;
 };
 
 }  // namespace amcl
@@ -0,0 +1,95 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef AMCL_PF_RANDOM_H
+#define AMCL_PF_RANDOM_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace badger_amcl
+{
+
+// A stream of random numbers from the Philox4x32-10 counter based generator
+// (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3", 2011).
+// Each block of output is a function of the seed, the stream id and the
+// position in the stream only, so streams need no shared state and any number
+// of them can be drawn from on different threads.
+class RandomStream
+{
+public:
+  RandomStream();
+  RandomStream(uint64_t seed, uint64_t stream);
+
+  // The raw generator: four 32 bit outputs for a counter and key
+  static std::array<uint32_t, 4> philox(std::array<uint32_t, 4> counter, std::array<uint32_t, 2> key);
+
+  // Uniform on [0, 1)
+  double uniform();
+
+  // Standard normal
+  double gaussian();
+
+private:
+  uint32_t next();
+
+  std::array<uint32_t, 2> key_;
+  uint64_t stream_;
+  uint64_t position_;
+  std::array<uint32_t, 4> block_;
+  int block_index_;
+  double spare_gaussian_;
+  bool has_spare_gaussian_;
+};
+
+// What a stream is drawn for.  Each owner numbers its own streams, so the
+// stream an object gets does not depend on what else was created before it.
+enum RandomStreamOwner
+{
+  RANDOM_STREAM_NODE = 1,
+  RANDOM_STREAM_INIT,
+  RANDOM_STREAM_RESAMPLE,
+  RANDOM_STREAM_ODOM,
+  RANDOM_STREAM_PREPROCESS,
+};
+
+// Hands out the random streams for the filter, all derived from one seed.
+// A stream id is made of its owner, a sequence number the owner keeps, such
+// as a count of its updates, and an index within the sequence, such as the
+// sample index.  Given the seed and the same sequence of updates a run is
+// reproduced exactly, whatever the number of threads or the order objects
+// are created in.
+class RandomService
+{
+public:
+  static void seed(uint64_t seed);
+  static uint64_t getSeed();
+
+  // Sequences are taken modulo 2^32 and indices modulo 2^24
+  static uint64_t makeStreamId(RandomStreamOwner owner, uint64_t sequence, uint64_t index);
+  static RandomStream createStream(RandomStreamOwner owner, uint64_t sequence, uint64_t index = 0);
+
+private:
+  static std::atomic<uint64_t> seed_;
+};
+
+}  // namespace amcl
+
+#endif  // AMCL_PF_RANDOM_H
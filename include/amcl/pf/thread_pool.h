@@ -0,0 +1,85 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef AMCL_PF_THREAD_POOL_H
+#define AMCL_PF_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace badger_amcl
+{
+
+// Persistent worker threads for data parallel loops.
+//
+// Loops are split into blocks of a size chosen by the caller, not by the
+// number of threads, so the per-block results of parallelSum are always added
+// in the same order and the sum does not depend on the thread count.
+// The calling thread works on blocks too.  One loop runs at a time; concurrent
+// callers wait their turn.  Loop bodies must not call back into the same pool.
+class ThreadPool
+{
+public:
+  // Run loops on num_threads threads, counting the caller.
+  // Zero uses one thread per hardware thread.
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int getNumThreads() const;
+
+  // Call fn(begin, end) over [0, count) in blocks of block_size
+  void parallelFor(int count, int block_size, const std::function<void(int, int)>& fn);
+
+  // Call fn(begin, end) over [0, count) in blocks of block_size, and return
+  // the sum of the results added in block order.
+  double parallelSum(int count, int block_size, const std::function<double(int, int)>& fn);
+
+private:
+  void run(int num_blocks, const std::function<void(int)>& block_fn);
+  void runBlocks();
+  void workerLoop();
+
+  std::vector<std::thread> workers_;
+
+  // Held by the caller for the duration of a loop
+  std::mutex run_mutex_;
+
+  // Protects the job state below
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  const std::function<void(int)>* job_;
+  int job_blocks_;
+  std::atomic<int> next_block_;
+  int busy_workers_;
+  uint64_t generation_;
+  bool stop_;
+};
+
+}  // namespace amcl
+
+#endif  // AMCL_PF_THREAD_POOL_H
@@ -24,7 +24,9 @@
 
 #include <Eigen/Dense>
 
+#include "pf/aligned_allocator.h"
 #include "pf/particle_filter.h"
+#include "pf/thread_pool.h"
 #include "sensors/sensor.h"
 
 namespace badger_amcl
@@ -56,7 +58,7 @@ class Odom : public Sensor
 {
   // Default constructor
 public:
-  Odom() = default;
+  Odom();
 
   void setModelDiff(double alpha1, double alpha2, double alpha3, double alpha4);
 
@@ -66,6 +68,9 @@ public:
 
   void setModel(OdomModelType type, double alpha1, double alpha2, double alpha3, double alpha4, double alpha5 = 0);
 
+  // Set the threads the sample poses are updated on
+  void setThreadPool(std::shared_ptr<ThreadPool> thread_pool);
+
   // Update the filter based on the action model.  Returns true if the filter
   // has been updated.
   virtual bool updateAction(std::shared_ptr<ParticleFilter> pf, std::shared_ptr<SensorData> data);
@@ -78,6 +83,13 @@ private:
 
   // Drift parameters
   double alpha1_, alpha2_, alpha3_, alpha4_, alpha5_;
+
+  std::shared_ptr<ThreadPool> thread_pool_;
+
+  // Standard normal noise for the samples, three draws per sample
+  AlignedVector<double> noise_;
+  // Numbers the random streams of each update
+  uint64_t update_count_;
 };
 
 }  // namespace amcl
@@ -26,8 +26,10 @@
 
 #include <Eigen/Dense>
 
+#include "map/distance_likelihood_lut.h"
 #include "map/occupancy_map.h"
 #include "pf/particle_filter.h"
+#include "pf/thread_pool.h"
 #include "sensors/sensor.h"
 
 namespace badger_amcl
@@ -41,16 +43,40 @@ enum PlanarModelType
   PLANAR_MODEL_LIKELIHOOD_FIELD_GOMPERTZ,
 };
 
+// Bearings of the beams of a scan in the base frame, and their cosines and
+// sines.  The same for every scan from a scanner while its angles stay the
+// same, so one copy is shared by them.
+struct PlanarBearings
+{
+  double angle_min;
+  double angle_increment;
+  std::vector<double> angles;
+  std::vector<double> cos;
+  std::vector<double> sin;
+};
+
 // Planar sensor data
 class PlanarData : public SensorData
 {
 public:
+  PlanarData() : endpoints_step_(0) {}
   virtual ~PlanarData() = default;
   // Planar range data (range, bearing tuples)
   int range_count_;
   double range_max_;
   std::vector<double> ranges_;
-  std::vector<double> angles_;
+  std::shared_ptr<const PlanarBearings> bearings_;
+
+  // Filled in by the scanner once per scan for the likelihood field models:
+  // the endpoints in the base frame of every step'th beam that is neither
+  // max range nor NaN, for a scanner at endpoints_scanner_pose_, and the
+  // index of each among every step'th beam.  endpoints_step_ is zero until
+  // then.
+  int endpoints_step_;
+  Eigen::Vector3d endpoints_scanner_pose_;
+  std::vector<double> endpoints_x_;
+  std::vector<double> endpoints_y_;
+  std::vector<int> endpoint_beams_;
 };
 
 // Planar sensor model
@@ -61,6 +87,10 @@ public:
 
   void init(int max_beams, std::shared_ptr<OccupancyMap> map);
 
+  // Set the threads the sample weights are computed on.  Copies of this
+  // scanner share the pool.
+  void setThreadPool(std::shared_ptr<ThreadPool> thread_pool);
+
   void setModelBeam(double z_hit, double z_short, double z_max, double z_rand, double sigma_hit, double labda_short);
 
   void setModelLikelihoodField(double z_hit, double z_rand, double sigma_hit, double max_distance_to_object);
@@ -81,13 +111,28 @@ public:
   //   The formula is non_free_space_factor += (1.0 - non_free_space_factor) * (distance_to_non_free_space / radius)
   void setMapFactors(double off_map_factor, double non_free_space_factor, double non_free_space_radius);
 
+  // Look up each beam's contribution to the likelihood field models from a
+  // table over the map's distance steps, instead of computing it.
+  void setUseLikelihoodLUT(bool use_likelihood_lut);
+
+  // Look up the beam model's expected ranges in a table the map builds over
+  // bearing_count bearings for rays up to max_range, instead of casting a
+  // ray per beam.  Takes effect when the beam model is next set; a bearing
+  // count of zero casts every ray.
+  void setRangeLUT(int bearing_count, double max_range);
+
+  // Bearings of a scan's beams in the base frame, from the scan's first
+  // bearing and increment there.  Kept from scan to scan while they are the
+  // same, so their cosines and sines are only computed when they change.
+  std::shared_ptr<const PlanarBearings> getBearings(double angle_min, double angle_increment, int range_count);
+
   // Update the filter based on the sensor model.  Returns true if the
   // filter has been updated.
   bool updateSensor(std::shared_ptr<ParticleFilter> pf, std::shared_ptr<SensorData> data);
 
-  // Update a sample set based on the sensor model.
-  // Returns total weights of particles, or 0.0 on failure.
-  double applyModelToSampleSet(std::shared_ptr<SensorData> data, std::shared_ptr<PFSampleSet> set);
+  // Update a sample set based on the sensor model, adding the log likelihood
+  // of the data to each sample's log weight.  Returns false on failure.
+  bool applyModelToSampleSet(std::shared_ptr<SensorData> data, std::shared_ptr<PFSampleSet> set);
 
   // Set the scanner's pose after construction
   void setPlanarScannerPose(const Eigen::Vector3d& scanner_pose);
@@ -97,19 +142,26 @@ public:
 
 private:
   // Determine the probability for the given pose
-  double calcBeamModel(std::shared_ptr<PlanarData> data, std::shared_ptr<PFSampleSet> set);
+  void calcBeamModel(std::shared_ptr<PlanarData> data, std::shared_ptr<PFSampleSet> set);
 
   // Determine the probability for the given pose
-  double calcLikelihoodFieldModel(std::shared_ptr<PlanarData> data, std::shared_ptr<PFSampleSet> set);
+  void calcLikelihoodFieldModel(std::shared_ptr<PlanarData> data, std::shared_ptr<PFSampleSet> set);
 
   // Determine the probability for the given pose - more probablistic model
-  double calcLikelihoodFieldModelProb(std::shared_ptr<PlanarData> data, std::shared_ptr<PFSampleSet> set);
+  void calcLikelihoodFieldModelProb(std::shared_ptr<PlanarData> data, std::shared_ptr<PFSampleSet> set);
 
   // Determine the probability for the given pose and apply a Gompertz function
-  double calcLikelihoodFieldModelGompertz(std::shared_ptr<PlanarData> data, std::shared_ptr<PFSampleSet> set);
+  void calcLikelihoodFieldModelGompertz(std::shared_ptr<PlanarData> data, std::shared_ptr<PFSampleSet> set);
+
+  void recalcWeight(std::shared_ptr<PFSampleSet> set);
+
+  // Compute the scan's beam endpoints for the likelihood field models, taking
+  // every step'th beam, unless they are already computed for this scanner
+  void updateEndpoints(std::shared_ptr<PlanarData> data, int step);
 
-  double recalcWeight(std::shared_ptr<PFSampleSet> set);
-  void clearTempData(int max_samples, int max_obs);
+  // Tabulate the current model's per beam term, if not done for these
+  // parameters and range_max already
+  void updateLikelihoodLUT(double range_max);
 
   Eigen::Vector3d coordAdd(const Eigen::Vector3d& a, const Eigen::Vector3d& b);
 
@@ -133,9 +185,8 @@ private:
   double beam_skip_error_threshold_;
 
   // temp data that is kept before observations are integrated to each particle (requried for beam skipping)
-  int max_samples_;
-  int max_obs_;
-  std::vector<std::vector<double>> temp_obs_;
+  // One row of max_beams_ observations per sample
+  std::vector<double> temp_obs_;
 
   // Scanner model params
   // Mixture params for the components of the model; must sum to 1
@@ -160,11 +211,18 @@ private:
   double non_free_space_factor_;
   double non_free_space_radius_;
 
-  // Vector to store converted map coordinates.
-  // Making this a class variable reduces the number of
-  // times we need to create an instance of this vector.
-  std::vector<int> map_vec_;
-  std::vector<double> world_vec_;
+  // Cleared whenever the model or map changes
+  bool use_likelihood_lut_;
+  DistanceLikelihoodLUT likelihood_lut_;
+  double likelihood_lut_range_max_;
+
+  int range_lut_bearing_count_;
+  double range_lut_max_range_;
+
+  // Bearings of this scanner's last scan
+  std::shared_ptr<const PlanarBearings> bearings_;
+
+  std::shared_ptr<ThreadPool> thread_pool_;
 };
 
 }  // namespace amcl
@@ -0,0 +1,121 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef AMCL_SENSORS_POINT_CLOUD_PREPROCESSOR_H
+#define AMCL_SENSORS_POINT_CLOUD_PREPROCESSOR_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <sensor_msgs/PointCloud2.h>
+#include <tf2/LinearMath/Transform.h>
+
+#include "pf/random.h"
+#include "sensors/point_cloud_scanner.h"
+
+namespace badger_amcl
+{
+
+enum PointCloudSubsampleType
+{
+  // Every step'th point
+  POINT_CLOUD_SUBSAMPLE_STRIDE,
+  // Points drawn at random, without replacement
+  POINT_CLOUD_SUBSAMPLE_RANDOM,
+  // Each point the farthest from those already taken
+  POINT_CLOUD_SUBSAMPLE_FARTHEST,
+};
+
+// Counts and time of the last scan through the preprocessor
+struct PointCloudPreprocessorStats
+{
+  int input_count;
+  int voxel_count;
+  int band_count;
+  int output_count;
+  double seconds;
+};
+
+// Reduces an incoming scan to the points the point cloud scanner scores,
+// once per scan.  The points in each voxel of a grid are averaged, which
+// evens out the density of near and far returns; those outside a band of
+// heights above the footprint, such as the floor and ceiling, are dropped;
+// and what is left is subsampled to at most a maximum count.  The points
+// are read in place from the message buffer and stay in the scanner frame;
+// only those kept are copied out.
+class PointCloudPreprocessor
+{
+public:
+  PointCloudPreprocessor();
+
+  // Average the points in each voxel of this size, in the scanner frame.
+  // Zero keeps every point.
+  void setVoxelSize(double voxel_size);
+
+  // Keep the points from min_height to max_height above the footprint.
+  // There is no band if max_height is not above min_height.
+  void setHeightBand(double min_height, double max_height);
+
+  void setSubsampleType(PointCloudSubsampleType subsample_type);
+
+  void setMaxPoints(int max_points);
+
+  // Fill the points of data from cloud, for a scanner at
+  // scanner_to_footprint_tf.  Returns false if cloud has no float x, y
+  // and z fields.
+  bool process(const sensor_msgs::PointCloud2& cloud, const tf2::Transform& scanner_to_footprint_tf,
+               PointCloudData* data);
+
+  const PointCloudPreprocessorStats& getStats() const;
+
+private:
+  // Points is any of the point sources defined in the source file
+  template <typename Points>
+  void averageVoxels(const Points& points);
+  template <typename Points>
+  void selectPoints(const Points& points, const tf2::Transform& scanner_to_footprint_tf, PointCloudData* data);
+  template <typename Points>
+  void subsample(const Points& points);
+  template <typename Points>
+  void subsampleFarthest(const Points& points);
+
+  double voxel_size_;
+  double min_height_;
+  double max_height_;
+  PointCloudSubsampleType subsample_type_;
+  int max_points_;
+  // Each scan draws from a stream of its own, numbered by scan_count_
+  uint64_t scan_count_;
+  RandomStream rng_;
+  PointCloudPreprocessorStats stats_;
+
+  // Working storage, kept from scan to scan
+  std::vector<std::pair<uint64_t, int>> voxel_keys_;
+  std::vector<float> voxel_x_;
+  std::vector<float> voxel_y_;
+  std::vector<float> voxel_z_;
+  std::vector<int> indices_;
+  std::vector<int> selected_;
+  std::vector<float> distances_;
+};
+
+}  // namespace amcl
+
+#endif  // AMCL_SENSORS_POINT_CLOUD_PREPROCESSOR_H
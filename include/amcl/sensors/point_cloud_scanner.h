@@ -21,14 +21,15 @@
 #define AMCL_SENSORS_POINT_CLOUD_SCANNER_H
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <Eigen/Dense>
-#include <pcl/point_types.h>
-#include <pcl/point_cloud.h>
 #include <tf2/transform_datatypes.h>
 #include <tf2/LinearMath/Transform.h>
 #include <tf2_ros/transform_broadcaster.h>
 
+#include "map/distance_likelihood_lut.h"
 #include "map/octomap.h"
 #include "pf/particle_filter.h"
 #include "sensors/sensor.h"
@@ -45,9 +46,22 @@ enum PointCloudModelType
 class PointCloudData : public SensorData
 {
 public:
+  PointCloudData() : footprint_points_valid_(false) {}
   virtual ~PointCloudData() = default;
   std::string frame_id_;
-  pcl::PointCloud<pcl::PointXYZ> points_;
+  // The points in the scanner frame, one array per axis
+  std::vector<float> points_x_;
+  std::vector<float> points_y_;
+  std::vector<float> points_z_;
+
+  // Filled in by the scanner once per scan: the points in the footprint
+  // frame, for a scanner at footprint_points_tf_, one array per axis.
+  // footprint_points_valid_ is false until then.
+  bool footprint_points_valid_;
+  tf2::Transform footprint_points_tf_;
+  std::vector<float> footprint_x_;
+  std::vector<float> footprint_y_;
+  std::vector<float> footprint_z_;
 };
 
 class PointCloudScanner : public Sensor
@@ -66,12 +80,26 @@ public:
   // filter has been updated.
   bool updateSensor(std::shared_ptr<ParticleFilter> pf, std::shared_ptr<SensorData> data);
 
-  // Update a sample set based on the sensor model.
-  // Returns total weights of particles, or 0.0 on failure.
-  double applyModelToSampleSet(std::shared_ptr<SensorData> data, std::shared_ptr<PFSampleSet> set);
+  // Update a sample set based on the sensor model, adding the log likelihood
+  // of the data to each sample's log weight.  Returns false on failure.
+  bool applyModelToSampleSet(std::shared_ptr<SensorData> data, std::shared_ptr<PFSampleSet> set);
 
   void setMapFactors(double off_map_factor, double non_free_space_factor, double non_free_space_radius);
 
+  // Look up each point's contribution to the model from a table over the
+  // map's distance steps, instead of computing it.
+  void setUseLikelihoodLUT(bool use_likelihood_lut);
+
+  // Score samples in bins of about yaw_bin_width radians of yaw, rotating
+  // the points once per bin into voxel offsets and then shifting them by
+  // each sample's position in whole voxels.  Faster when many samples share
+  // a yaw, at the cost of up to half a bin of yaw and a voxel of position.
+  // A width of zero scores each sample at its exact pose.
+  void setYawBinWidth(double yaw_bin_width);
+  // The bin a sample of the given yaw is scored in, while binning.  Bin n is
+  // centred on n times the width, taken around the circle.
+  int computeYawBin(double yaw);
+
   // Set the scanner's pose after construction
   void setPointCloudScannerToFootprintTF(geometry_msgs::Transform tf_msg);
 
@@ -80,11 +108,21 @@ public:
 
 private:
   // Determine the probability for the given pose
-  double calcPointCloudModel(std::shared_ptr<PointCloudData> data, std::shared_ptr<PFSampleSet> set);
-  double calcPointCloudModelGompertz(std::shared_ptr<PointCloudData> data, std::shared_ptr<PFSampleSet> set);
-  double recalcWeight(std::shared_ptr<PFSampleSet> set);
-  void getMapCloud(std::shared_ptr<PointCloudData> data, const Eigen::Vector3d& pose,
-                   pcl::PointCloud<pcl::PointXYZ>& map_cloud);
+  void calcPointCloudModel(std::shared_ptr<PointCloudData> data, std::shared_ptr<PFSampleSet> set);
+  void calcPointCloudModelGompertz(std::shared_ptr<PointCloudData> data, std::shared_ptr<PFSampleSet> set);
+  void recalcWeight(std::shared_ptr<PFSampleSet> set);
+  // Tabulate the current model's per point term, if not done already
+  void updateLikelihoodLUT();
+  // Transform the scan's points into the footprint frame, unless they are
+  // already transformed for this scanner pose
+  void updateFootprintPoints(std::shared_ptr<PointCloudData> data);
+  // Fill sample_order_ with the order to score the samples in, grouped by
+  // yaw bin when binning
+  void orderSamples(std::shared_ptr<PFSampleSet> set);
+  // Call point_fn(i, j, k) with the voxel each of the scan's points falls
+  // in for a sample at pose
+  template <typename PointFn>
+  void forEachPointVoxel(std::shared_ptr<PointCloudData> data, const Eigen::Vector3d& pose, PointFn point_fn);
 
   std::shared_ptr<OctoMap> map_;
   PointCloudModelType model_type_;
@@ -110,13 +148,23 @@ private:
   // Max beams to consider
   int max_beams_;
 
+  // Cleared whenever the model or map changes
+  bool use_likelihood_lut_;
+  DistanceLikelihoodLUT likelihood_lut_;
+
   tf2::Transform point_cloud_scanner_to_footprint_tf_;
 
-  // Vector to store converted map coordinates.
-  // Making this a class variable reduces the number of
-  // times we need to create an instance of this vector.
-  std::vector<int> map_vec_;
-  std::vector<double> world_vec_;
+  // Yaw binning, off when the width is zero
+  double yaw_bin_width_;
+  int yaw_bin_count_;
+  std::vector<int> sample_bins_;
+  std::vector<int> bin_starts_;
+  std::vector<int> sample_order_;
+  // The points rotated to the yaw of rotated_bin_, in voxels, or -1
+  int rotated_bin_;
+  std::vector<int> rotated_i_;
+  std::vector<int> rotated_j_;
+  std::vector<int> rotated_k_;
 };
 
 }  // namespace amcl
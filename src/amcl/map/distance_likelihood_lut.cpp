@@ -0,0 +1,45 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "map/distance_likelihood_lut.h"
+
+namespace badger_amcl
+{
+
+void DistanceLikelihoodLUT::update(const std::function<double(double)>& fn, double max_distance,
+                                   uint32_t step_count)
+{
+  values_.resize(step_count + 1);
+  for (uint32_t step = 0; step <= step_count; step++)
+  {
+    values_[step] = fn(step * max_distance / step_count);
+  }
+}
+
+void DistanceLikelihoodLUT::clear()
+{
+  values_.clear();
+}
+
+bool DistanceLikelihoodLUT::empty() const
+{
+  return values_.empty();
+}
+
+}  // namespace amcl
@@ -0,0 +1,437 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "map/distances_lut_cache.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <ros/console.h>
+
+namespace badger_amcl
+{
+
+namespace
+{
+
+const char CACHE_MAGIC[8] = {'B', 'A', 'M', 'C', 'L', 'L', 'U', 'T'};
+const char SHARED_MAGIC[8] = {'B', 'A', 'M', 'C', 'L', 'S', 'H', 'M'};
+const int MAX_SECTIONS = 4;
+// Arrays start on this boundary in the file, and so in memory when mapped
+const size_t SECTION_ALIGNMENT = 64;
+
+struct CacheHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t section_count;
+  uint64_t key;
+  uint64_t checksum;
+  uint64_t section_sizes[MAX_SECTIONS];
+};
+static_assert(sizeof(CacheHeader) == SECTION_ALIGNMENT, "cache header must keep sections aligned");
+
+// Only changed with the segment locked.  ready is set once the arrays are
+// written, and unlinked once the last user has removed the name, so a
+// process that opened the name just before can tell to open it again.
+struct SharedHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t section_count;
+  uint64_t key;
+  uint32_t ready;
+  uint32_t unlinked;
+  uint32_t refcount;
+  uint32_t reserved;
+  uint64_t section_sizes[MAX_SECTIONS];
+  char padding[2 * SECTION_ALIGNMENT - 72];
+};
+static_assert(sizeof(SharedHeader) == 2 * SECTION_ALIGNMENT, "shared header must keep sections aligned");
+
+size_t alignSize(size_t size)
+{
+  return (size + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+bool writeAll(int fd, const void* data, size_t size)
+{
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0)
+  {
+    ssize_t written = ::write(fd, bytes, size);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool readHeader(int fd, SharedHeader* header)
+{
+  return ::pread(fd, header, sizeof(*header), 0) == sizeof(*header);
+}
+
+bool writeHeader(int fd, const SharedHeader& header)
+{
+  return ::pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+}
+
+// Drop this process's reference to a segment, removing it if it was the last
+void releaseSegment(int fd, const std::string& name)
+{
+  ::flock(fd, LOCK_EX);
+  SharedHeader header;
+  if (readHeader(fd, &header))
+  {
+    if (header.refcount > 0)
+      header.refcount--;
+    if (header.refcount == 0)
+    {
+      header.unlinked = 1;
+      ::shm_unlink(name.c_str());
+    }
+    writeHeader(fd, header);
+  }
+  ::flock(fd, LOCK_UN);
+  ::close(fd);
+}
+
+// Map a whole segment read only, releasing the reference when the mapping goes
+std::shared_ptr<const void> mapSegment(int fd, const std::string& name, size_t size)
+{
+  void* address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (address == MAP_FAILED)
+    return std::shared_ptr<const void>();
+  return std::shared_ptr<const void>(address, [fd, name, size](const void* p)
+  {
+    ::munmap(const_cast<void*>(p), size);
+    releaseSegment(fd, name);
+  });
+}
+
+void pointSections(const void* address, const SharedHeader& header, std::vector<DistancesLUTCache::Section>* sections)
+{
+  const char* bytes = static_cast<const char*>(address);
+  size_t offset = sizeof(SharedHeader);
+  for (int i = 0; i < sections->size(); i++)
+  {
+    (*sections)[i].data = bytes + offset;
+    (*sections)[i].size = header.section_sizes[i];
+    offset += alignSize(header.section_sizes[i]);
+  }
+}
+
+}  // namespace
+
+FNVHash::FNVHash() : hash_(14695981039346656037ULL) {}
+
+void FNVHash::add(const void* data, size_t size)
+{
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  uint64_t hash = hash_;
+  for (size_t i = 0; i < size; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  hash_ = hash;
+}
+
+uint64_t FNVHash::get() const
+{
+  return hash_;
+}
+
+DistancesLUTCache::DistancesLUTCache(const std::string& dir, const std::string& name, uint64_t key)
+    : key_(key)
+{
+  char key_str[17];
+  std::snprintf(key_str, sizeof(key_str), "%016" PRIx64, key);
+  path_ = dir + "/" + name + "_" + key_str + ".lut";
+}
+
+std::string DistancesLUTCache::getPath() const
+{
+  return path_;
+}
+
+bool DistancesLUTCache::load(std::vector<Section>* sections, std::shared_ptr<const void>* mapping) const
+{
+  int fd = ::open(path_.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CacheHeader))
+  {
+    ::close(fd);
+    return false;
+  }
+  size_t file_size = st.st_size;
+  void* address = ::mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (address == MAP_FAILED)
+  {
+    ROS_WARN("Failed to map distances LUT cache %s: %s", path_.c_str(), std::strerror(errno));
+    return false;
+  }
+  std::shared_ptr<const void> file_mapping(address, [file_size](const void* p)
+  {
+    ::munmap(const_cast<void*>(p), file_size);
+  });
+
+  const CacheHeader* header = static_cast<const CacheHeader*>(address);
+  if (std::memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+      || header->version != VERSION
+      || header->key != key_
+      || header->section_count != sections->size())
+  {
+    ROS_WARN("Ignoring distances LUT cache %s, it has a different format", path_.c_str());
+    return false;
+  }
+  size_t offset = sizeof(CacheHeader);
+  for (int i = 0; i < sections->size(); i++)
+  {
+    offset += alignSize(header->section_sizes[i]);
+  }
+  if (offset != file_size)
+  {
+    ROS_WARN("Ignoring distances LUT cache %s, it is truncated", path_.c_str());
+    return false;
+  }
+
+  FNVHash checksum;
+  const char* bytes = static_cast<const char*>(address);
+  offset = sizeof(CacheHeader);
+  for (int i = 0; i < sections->size(); i++)
+  {
+    (*sections)[i].data = bytes + offset;
+    (*sections)[i].size = header->section_sizes[i];
+    checksum.add(bytes + offset, header->section_sizes[i]);
+    offset += alignSize(header->section_sizes[i]);
+  }
+  if (checksum.get() != header->checksum)
+  {
+    ROS_WARN("Ignoring distances LUT cache %s, its checksum does not match", path_.c_str());
+    return false;
+  }
+  *mapping = file_mapping;
+  return true;
+}
+
+bool DistancesLUTCache::save(const std::vector<Section>& sections) const
+{
+  if (sections.size() > MAX_SECTIONS)
+    return false;
+  CacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.version = VERSION;
+  header.section_count = sections.size();
+  header.key = key_;
+  FNVHash checksum;
+  for (int i = 0; i < sections.size(); i++)
+  {
+    header.section_sizes[i] = sections[i].size;
+    checksum.add(sections[i].data, sections[i].size);
+  }
+  header.checksum = checksum.get();
+
+  std::string tmp_path = path_ + ".tmp." + std::to_string(::getpid());
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    ROS_WARN("Failed to write distances LUT cache %s: %s", tmp_path.c_str(), std::strerror(errno));
+    return false;
+  }
+  static const char padding[SECTION_ALIGNMENT] = {};
+  bool ok = writeAll(fd, &header, sizeof(header));
+  for (int i = 0; ok && i < sections.size(); i++)
+  {
+    ok = writeAll(fd, sections[i].data, sections[i].size)
+         && writeAll(fd, padding, alignSize(sections[i].size) - sections[i].size);
+  }
+  ok = ok && ::fsync(fd) == 0;
+  ok = (::close(fd) == 0) && ok;
+  ok = ok && ::rename(tmp_path.c_str(), path_.c_str()) == 0;
+  if (!ok)
+  {
+    ROS_WARN("Failed to write distances LUT cache %s: %s", path_.c_str(), std::strerror(errno));
+    ::unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+SharedDistancesLUT::SharedDistancesLUT(const std::string& name, uint64_t key)
+    : key_(key),
+      fd_(-1)
+{
+  char key_str[17];
+  std::snprintf(key_str, sizeof(key_str), "%016" PRIx64, key);
+  name_ = "/badger_amcl_" + name + "_" + key_str;
+}
+
+SharedDistancesLUT::~SharedDistancesLUT()
+{
+  // Never published; the empty segment is left for the next process to build into
+  if (fd_ >= 0)
+  {
+    ::flock(fd_, LOCK_UN);
+    ::close(fd_);
+  }
+}
+
+std::string SharedDistancesLUT::getName() const
+{
+  return name_;
+}
+
+bool SharedDistancesLUT::attach(std::vector<Section>* sections, std::shared_ptr<const void>* mapping)
+{
+  while (true)
+  {
+    int fd = ::shm_open(name_.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+      ROS_WARN("Failed to open shared distances LUT %s: %s", name_.c_str(), std::strerror(errno));
+      return false;
+    }
+    // Blocks while another process builds the table
+    ::flock(fd, LOCK_EX);
+    struct stat st;
+    SharedHeader header;
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SharedHeader) || !readHeader(fd, &header)
+        || !header.ready)
+    {
+      // Nothing published, or its builder died part way; build it here
+      fd_ = fd;
+      return false;
+    }
+    if (header.unlinked)
+    {
+      // Removed after this opened it; the name may now hold a newer segment
+      ::flock(fd, LOCK_UN);
+      ::close(fd);
+      continue;
+    }
+    size_t size = sizeof(SharedHeader);
+    for (int i = 0; i < header.section_count && i < MAX_SECTIONS; i++)
+    {
+      size += alignSize(header.section_sizes[i]);
+    }
+    if (std::memcmp(header.magic, SHARED_MAGIC, sizeof(SHARED_MAGIC)) != 0
+        || header.version != VERSION
+        || header.key != key_
+        || header.section_count != sections->size()
+        || size != static_cast<size_t>(st.st_size))
+    {
+      ROS_WARN("Not sharing distances LUT %s, the segment has a different format", name_.c_str());
+      ::flock(fd, LOCK_UN);
+      ::close(fd);
+      return false;
+    }
+    std::shared_ptr<const void> segment_mapping = mapSegment(fd, name_, size);
+    if (!segment_mapping)
+    {
+      ROS_WARN("Failed to map shared distances LUT %s: %s", name_.c_str(), std::strerror(errno));
+      ::flock(fd, LOCK_UN);
+      ::close(fd);
+      return false;
+    }
+    header.refcount++;
+    writeHeader(fd, header);
+    ::flock(fd, LOCK_UN);
+    pointSections(segment_mapping.get(), header, sections);
+    *mapping = segment_mapping;
+    return true;
+  }
+}
+
+bool SharedDistancesLUT::publish(const std::vector<Section>& sections, std::vector<Section>* shared_sections,
+                                 std::shared_ptr<const void>* mapping)
+{
+  if (fd_ < 0 || sections.size() > MAX_SECTIONS)
+    return false;
+  int fd = fd_;
+  fd_ = -1;
+  SharedHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, SHARED_MAGIC, sizeof(SHARED_MAGIC));
+  header.version = VERSION;
+  header.section_count = sections.size();
+  header.key = key_;
+  size_t size = sizeof(SharedHeader);
+  for (int i = 0; i < sections.size(); i++)
+  {
+    header.section_sizes[i] = sections[i].size;
+    size += alignSize(sections[i].size);
+  }
+
+  // Reserve the memory up front, as running out while copying would be a SIGBUS
+  int err = ::ftruncate(fd, 0) == 0 ? ::posix_fallocate(fd, 0, size) : errno;
+  void* address = err == 0 ? ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  if (address == MAP_FAILED)
+  {
+    ROS_WARN("Failed to publish shared distances LUT %s: %s", name_.c_str(), std::strerror(err ? err : errno));
+    ::ftruncate(fd, 0);
+    ::flock(fd, LOCK_UN);
+    ::close(fd);
+    return false;
+  }
+  char* bytes = static_cast<char*>(address);
+  size_t offset = sizeof(SharedHeader);
+  for (int i = 0; i < sections.size(); i++)
+  {
+    std::memcpy(bytes + offset, sections[i].data, sections[i].size);
+    offset += alignSize(sections[i].size);
+  }
+  ::munmap(address, size);
+  header.ready = 1;
+  header.refcount = 1;
+  writeHeader(fd, header);
+
+  std::shared_ptr<const void> segment_mapping = mapSegment(fd, name_, size);
+  ::flock(fd, LOCK_UN);
+  if (!segment_mapping)
+  {
+    // Published for the others, but this process keeps its own copy
+    releaseSegment(fd, name_);
+    return false;
+  }
+  shared_sections->resize(sections.size());
+  pointSections(segment_mapping.get(), header, shared_sections);
+  *mapping = segment_mapping;
+  return true;
+}
+
+}  // namespace amcl
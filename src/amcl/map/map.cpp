@@ -20,11 +20,18 @@
 
 #include "map/map.h"
 
+#include <limits>
+
 namespace badger_amcl
 {
 
 // Create a new map
-Map::Map(double resolution) : resolution_(resolution)
+Map::Map(double resolution)
+    : resolution_(resolution),
+      distances_lut_builder_(DISTANCES_LUT_BRUSHFIRE),
+      thread_pool_(std::make_shared<ThreadPool>(1)),
+      share_distances_lut_(false),
+      distances_lut_layout_(DISTANCES_LUT_ROW_MAJOR)
 {
   origin_ = pcl::PointXYZ();
   distances_lut_created_ = false;
@@ -40,4 +47,63 @@ bool Map::isDistancesLUTCreated()
   return distances_lut_created_;
 }
 
+void Map::setDistancesLUTBuilder(DistancesLUTBuilderType builder)
+{
+  distances_lut_builder_ = builder;
+}
+
+void Map::setThreadPool(std::shared_ptr<ThreadPool> thread_pool)
+{
+  thread_pool_ = thread_pool;
+}
+
+void Map::setDistancesLUTCacheDir(const std::string& dir)
+{
+  distances_lut_cache_dir_ = dir;
+}
+
+void Map::setShareDistancesLUT(bool share)
+{
+  share_distances_lut_ = share;
+}
+
+void Map::setDistancesLUTLayout(DistancesLUTLayout layout)
+{
+  distances_lut_layout_ = layout;
+}
+
+void Map::distanceTransform1D(const float* f, int n, float* d, int* v, double* z)
+{
+  // Build the lower envelope of the parabolas rooted at (q, f[q]).  v holds
+  // the roots of the parabolas in the envelope, and z the boundaries between them.
+  int k = 0;
+  v[0] = 0;
+  z[0] = -std::numeric_limits<double>::infinity();
+  z[1] = std::numeric_limits<double>::infinity();
+  for (int q = 1; q < n; q++)
+  {
+    // z[0] is -inf, so this stops at the first parabola at the latest
+    double s = ((f[q] + double(q) * q) - (f[v[k]] + double(v[k]) * v[k])) / (2.0 * (q - v[k]));
+    while (s <= z[k])
+    {
+      k--;
+      s = ((f[q] + double(q) * q) - (f[v[k]] + double(v[k]) * v[k])) / (2.0 * (q - v[k]));
+    }
+    k++;
+    v[k] = q;
+    z[k] = s;
+    z[k + 1] = std::numeric_limits<double>::infinity();
+  }
+
+  // Read the envelope back out
+  k = 0;
+  for (int q = 0; q < n; q++)
+  {
+    while (z[k + 1] < q)
+      k++;
+    double dq = q - v[k];
+    d[q] = dq * dq + f[v[k]];
+  }
+}
+
 }  // namespace amcl
@@ -21,22 +21,98 @@
 #include "map/occupancy_map.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <cstdlib>
+#include <functional>
+#include <limits>
 
+#include <ros/assert.h>
 #include <ros/console.h>
 
 namespace badger_amcl
 {
 
+// Steps getDistanceStep rounds a float table to
+static const uint32_t FLOAT_DISTANCE_STEPS = 4095;
+// Largest clearance, in cells, the clearance table holds
+static const int MAX_CLEARANCE = std::numeric_limits<uint8_t>::max();
+// Range table entry for a ray that hits nothing within the table's max range
+static const uint16_t RANGE_LUT_NO_HIT = std::numeric_limits<uint16_t>::max();
+// Range table row of a cell that has none
+static const uint32_t RANGE_LUT_NO_ROW = std::numeric_limits<uint32_t>::max();
+// Cells a ray visits are within a cell on each axis of the ray, and no more
+// than its length and the diagonal of a cell from its start
+static const double RAY_CELL_MARGIN = 2.0;
+
+// Whether the segment from x, y running length along the unit vector dx, dy
+// passes through the box from min_x, min_y to max_x, max_y
+static bool segmentMeetsBox(double x, double y, double dx, double dy, double length, double min_x, double min_y,
+                            double max_x, double max_y)
+{
+  double t0 = 0.0;
+  double t1 = length;
+  double origins[2] = { x, y };
+  double directions[2] = { dx, dy };
+  double mins[2] = { min_x, min_y };
+  double maxes[2] = { max_x, max_y };
+  for (int axis = 0; axis < 2; axis++)
+  {
+    if (std::abs(directions[axis]) < 1e-12)
+    {
+      if (origins[axis] < mins[axis] or origins[axis] > maxes[axis])
+        return false;
+      continue;
+    }
+    double a = (mins[axis] - origins[axis]) / directions[axis];
+    double b = (maxes[axis] - origins[axis]) / directions[axis];
+    t0 = std::max(t0, std::min(a, b));
+    t1 = std::min(t1, std::max(a, b));
+    if (t0 > t1)
+      return false;
+  }
+  return true;
+}
+
+// Round a distance to the nearest step
+template <typename T>
+static T quantizeDistance(float distance, float inverse_scale)
+{
+  return std::min(std::round(distance * inverse_scale), float(std::numeric_limits<T>::max()));
+}
+
+template <typename T>
+static void quantize(const std::vector<float>& distances, float scale, T* steps)
+{
+  float inverse_scale = 1.0f / scale;
+  for (size_t i = 0; i < distances.size(); i++)
+  {
+    steps[i] = quantizeDistance<T>(distances[i], inverse_scale);
+  }
+}
+
 OccupancyMap::OccupancyMap(double resolution)
     : Map(resolution),
       size_x_(0),
       size_y_(0),
+      cells_changed_(true),
+      distances_lut_data_(nullptr),
+      distances_lut_precision_(DISTANCES_LUT_FLOAT),
+      distances_lut_data_precision_(DISTANCES_LUT_FLOAT),
+      distances_lut_scale_(0.0),
+      distance_step_count_(FLOAT_DISTANCE_STEPS),
+      distances_lut_data_layout_(DISTANCES_LUT_ROW_MAJOR),
+      distances_lut_tiles_x_(0),
+      distances_lut_size_(0),
+      range_lut_data_(nullptr),
+      range_lut_row_count_(0),
+      range_lut_bearing_count_(0),
+      range_lut_max_range_(0.0),
+      range_lut_scale_(0.0),
       cdm_(resolution, 0.0)
 {
   max_distance_to_object_ = 0.0;
-  world_vec_.resize(2);
-  map_vec_.resize(2);
 }
 
 void OccupancyMap::setOrigin(const pcl::PointXYZ& origin)
@@ -54,6 +130,9 @@ void OccupancyMap::setSize(std::vector<int> size_vec)
   size_x_ = size_vec[0];
   size_y_ = size_vec[1];
   cells_.resize(size_vec[0] * size_vec[1]);
+  cells_changed_ = true;
+  clearance_lut_.clear();
+  range_lut_data_ = nullptr;
 }
 
 double OccupancyMap::getMaxDistanceToObject()
@@ -63,15 +142,50 @@ double OccupancyMap::getMaxDistanceToObject()
 
 float OccupancyMap::getDistanceToObject(int i, int j)
 {
-  map_vec_[0] = i;
-  map_vec_[1] = j;
-  if (isValid(map_vec_))
+  // Check bounds directly rather than through a shared coordinate vector so
+  // this may be called from several threads at once.
+  if ((i >= 0) && (i < size_x_) && (j >= 0) && (j < size_y_))
   {
-    return distances_lut_[computeCellIndex(i, j)];
+    uint32_t index = computeDistancesLUTIndex(i, j);
+    switch (distances_lut_data_precision_)
+    {
+      case DISTANCES_LUT_UINT8:
+        return static_cast<const uint8_t*>(distances_lut_data_)[index] * distances_lut_scale_;
+      case DISTANCES_LUT_UINT16:
+        return static_cast<const uint16_t*>(distances_lut_data_)[index] * distances_lut_scale_;
+      default:
+        return static_cast<const float*>(distances_lut_data_)[index];
+    }
   }
   return max_distance_to_object_;
 }
 
+uint32_t OccupancyMap::getDistanceStep(int i, int j)
+{
+  if ((i >= 0) && (i < size_x_) && (j >= 0) && (j < size_y_))
+  {
+    uint32_t index = computeDistancesLUTIndex(i, j);
+    switch (distances_lut_data_precision_)
+    {
+      case DISTANCES_LUT_UINT8:
+        return static_cast<const uint8_t*>(distances_lut_data_)[index];
+      case DISTANCES_LUT_UINT16:
+        return static_cast<const uint16_t*>(distances_lut_data_)[index];
+      default:
+      {
+        float step = static_cast<const float*>(distances_lut_data_)[index] / distances_lut_scale_ + 0.5f;
+        return std::min(static_cast<uint32_t>(step), distance_step_count_);
+      }
+    }
+  }
+  return distance_step_count_;
+}
+
+uint32_t OccupancyMap::getDistanceStepCount()
+{
+  return distance_step_count_;
+}
+
 void OccupancyMap::convertMapToWorld(const std::vector<int>& map_coords,
                                      std::vector<double>* world_coords)
 {
@@ -112,6 +226,9 @@ unsigned int OccupancyMap::computeCellIndex(int i, int j)
 void OccupancyMap::setCellState(int index, MapCellState state)
 {
   cells_[index] = state;
+  cells_changed_ = true;
+  clearance_lut_.clear();
+  range_lut_data_ = nullptr;
 }
 
 MapCellState OccupancyMap::getCellState(int i, int j)
@@ -119,6 +236,11 @@ MapCellState OccupancyMap::getCellState(int i, int j)
   return cells_[computeCellIndex(i, j)];
 }
 
+void OccupancyMap::setDistancesLUTPrecision(DistancesLUTPrecision precision)
+{
+  distances_lut_precision_ = precision;
+}
+
 CachedDistanceOccupancyMap::CachedDistanceOccupancyMap(double resolution, double max_dist)
     : resolution_(resolution), max_dist_(max_dist)
 {
@@ -137,6 +259,13 @@ CachedDistanceOccupancyMap::CachedDistanceOccupancyMap(double resolution, double
 // Update the distance values
 void OccupancyMap::updateDistancesLUT(double max_distance_to_object)
 {
+  if (distances_lut_created_ and not cells_changed_ and max_distance_to_object == max_distance_to_object_
+      and distances_lut_data_precision_ == distances_lut_precision_
+      and distances_lut_data_layout_ == distances_lut_layout_)
+  {
+    ROS_DEBUG("Occupancy Map Distances LUT is up to date");
+    return;
+  }
   max_distance_to_object_ = max_distance_to_object;
   if(max_distance_to_object_ == 0.0)
   {
@@ -145,18 +274,554 @@ void OccupancyMap::updateDistancesLUT(double max_distance_to_object)
   }
 
   ROS_INFO("Updating Occupancy Map Distances LUT");
-  std::priority_queue<OccupancyMapCellData> q = std::priority_queue<OccupancyMapCellData>();
-  unsigned s = unsigned(size_x_) * size_y_;
-  std::vector<bool> marked = std::vector<bool>(s, false);
-  distances_lut_.resize(unsigned(size_x_) * size_y_);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  cells_changed_ = false;
+  distances_lut_mapping_.reset();
+  if (distances_lut_layout_ == DISTANCES_LUT_TILED)
+  {
+    distances_lut_tiles_x_ = computeTileCount(size_x_);
+    distances_lut_size_ = size_t(distances_lut_tiles_x_) * computeTileCount(size_y_) * TILE_SIZE * TILE_SIZE;
+  }
+  else
+  {
+    distances_lut_size_ = size_t(size_x_) * size_y_;
+  }
+  distances_lut_data_layout_ = distances_lut_layout_;
+  if (distances_lut_precision_ == DISTANCES_LUT_UINT8)
+    distance_step_count_ = std::numeric_limits<uint8_t>::max();
+  else if (distances_lut_precision_ == DISTANCES_LUT_UINT16)
+    distance_step_count_ = std::numeric_limits<uint16_t>::max();
+  else
+    distance_step_count_ = FLOAT_DISTANCE_STEPS;
+  distances_lut_scale_ = max_distance_to_object_ / distance_step_count_;
+  size_t lut_bytes = distances_lut_size_ * getDistancesLUTEntrySize();
+  std::unique_ptr<SharedDistancesLUT> shared;
+  std::unique_ptr<DistancesLUTCache> cache;
+  if (share_distances_lut_ or !distances_lut_cache_dir_.empty())
+  {
+    uint64_t key = computeDistancesLUTKey();
+    if (share_distances_lut_)
+      shared.reset(new SharedDistancesLUT("occupancy_map", key));
+    if (!distances_lut_cache_dir_.empty())
+      cache.reset(new DistancesLUTCache(distances_lut_cache_dir_, "occupancy_map", key));
+  }
+  std::vector<DistancesLUTCache::Section> sections(1);
+  std::shared_ptr<const void> mapping;
+  if (shared and shared->attach(&sections, &mapping) and useDistancesLUT(sections, mapping))
+  {
+    distances_lut_created_ = true;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ROS_INFO("Attached Occupancy Map Distances Lookup Table %s in %.3f seconds", shared->getName().c_str(), elapsed);
+    return;
+  }
+  if (cache and cache->load(&sections, &mapping) and useDistancesLUT(sections, mapping))
+  {
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ROS_INFO("Loaded Occupancy Map Distances Lookup Table from %s in %.3f seconds", cache->getPath().c_str(),
+             elapsed);
+  }
+  else
+  {
+    std::vector<uint8_t>().swap(quantized_distances_lut_);
+    // Cells padding out the last tiles are never looked up, but stay at the max
+    // distance so the table is the same whichever way it is built
+    distances_lut_.assign(distances_lut_size_, max_distance_to_object_);
+    distances_lut_data_ = distances_lut_.data();
+    distances_lut_data_precision_ = DISTANCES_LUT_FLOAT;
+    if ((cdm_.resolution_ != resolution_) || (cdm_.max_dist_ != max_distance_to_object_))
+    {
+      cdm_ = CachedDistanceOccupancyMap(resolution_, max_distance_to_object_);
+    }
+    if (distances_lut_builder_ == DISTANCES_LUT_EDT)
+    {
+      computeDistancesWithEDT();
+    }
+    else
+    {
+      std::priority_queue<OccupancyMapCellData> q = std::priority_queue<OccupancyMapCellData>();
+      unsigned s = unsigned(size_x_) * size_y_;
+      std::vector<bool> marked = std::vector<bool>(s, false);
+      iterateObstacleCells(q, marked);
+      iterateEmptyCells(q, marked);
+    }
+    quantizeDistancesLUT();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ROS_INFO("Done updating Occupancy Map Distances Lookup Table in %.3f seconds, %.1f MB", elapsed,
+             lut_bytes / 1e6);
+    if (cache and cache->save({ { distances_lut_data_, lut_bytes } }))
+    {
+      ROS_INFO("Saved Occupancy Map Distances Lookup Table to %s", cache->getPath().c_str());
+    }
+  }
+  // Hand the table over to the other processes, and use their copy from now on
+  if (shared and shared->publish({ { distances_lut_data_, lut_bytes } }, &sections, &mapping)
+      and useDistancesLUT(sections, mapping))
+  {
+    ROS_INFO("Shared Occupancy Map Distances Lookup Table as %s", shared->getName().c_str());
+  }
+  distances_lut_created_ = true;
+}
+
+void OccupancyMap::applyPatch(int min_i, int min_j, int width, int height, const std::vector<MapCellState>& states,
+                              std::vector<int>* updated_min, std::vector<int>* updated_max)
+{
+  ROS_ASSERT(states.size() == size_t(width) * height);
+  // Cells the patch frees need rows in the range table
+  std::vector<uint32_t> freed_cells;
+  for (int j = 0; j < height; j++)
+  {
+    for (int i = 0; i < width; i++)
+    {
+      if ((min_i + i >= 0) && (min_i + i < size_x_) && (min_j + j >= 0) && (min_j + j < size_y_))
+      {
+        uint32_t index = computeCellIndex(min_i + i, min_j + j);
+        MapCellState state = states[i + j * width];
+        bool was_free = cells_[index] == MapCellState::CELL_FREE;
+        if (range_lut_data_ != nullptr and was_free != (state == MapCellState::CELL_FREE))
+        {
+          if (state == MapCellState::CELL_FREE)
+            freed_cells.push_back(index);
+          else
+            range_lut_rows_[index] = RANGE_LUT_NO_ROW;
+        }
+        cells_[index] = state;
+      }
+    }
+  }
+  if (not clearance_lut_.empty())
+  {
+    // A ray can be stopped by a changed cell up to the largest clearance away
+    computeClearances(std::max(min_i - MAX_CLEARANCE, 0), std::max(min_j - MAX_CLEARANCE, 0),
+                      std::min(min_i + width + MAX_CLEARANCE, size_x_),
+                      std::min(min_j + height + MAX_CLEARANCE, size_y_));
+  }
+  if (range_lut_data_ != nullptr)
+    patchRangeLUT(min_i, min_j, min_i + width, min_j + height, freed_cells);
+  // Without a distances table only the patch's own cells changed
+  *updated_min = { std::max(min_i, 0), std::max(min_j, 0) };
+  *updated_max = { std::min(min_i + width, size_x_), std::min(min_j + height, size_y_) };
+  if (not distances_lut_created_)
+    return;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
   if ((cdm_.resolution_ != resolution_) || (cdm_.max_dist_ != max_distance_to_object_))
   {
     cdm_ = CachedDistanceOccupancyMap(resolution_, max_distance_to_object_);
   }
-  iterateObstacleCells(q, marked);
-  iterateEmptyCells(q, marked);
-  distances_lut_created_ = true;
-  ROS_INFO("Done updating Occupancy Map Distances Lookup Table");
+  // Only cells within the radius of a changed cell can change distance, and
+  // only obstacles within the radius of those cells can be nearest to them
+  int radius = cdm_.cell_radius_ + 1;
+  *updated_min = { std::max(min_i - radius, 0), std::max(min_j - radius, 0) };
+  *updated_max = { std::min(min_i + width + radius, size_x_), std::min(min_j + height + radius, size_y_) };
+  int box_min_i = std::max((*updated_min)[0] - radius, 0);
+  int box_min_j = std::max((*updated_min)[1] - radius, 0);
+  int box_max_i = std::min((*updated_max)[0] + radius, size_x_);
+  int box_max_j = std::min((*updated_max)[1] + radius, size_y_);
+  if (box_min_i >= box_max_i or box_min_j >= box_max_j)
+    return;
+
+  copyMappedDistancesLUT();
+  int box_width = box_max_i - box_min_i;
+  std::vector<float> squared(size_t(box_width) * (box_max_j - box_min_j));
+  computeBoxDistancesWithEDT(box_min_i, box_min_j, box_max_i, box_max_j, cdm_.cell_radius_,
+                             [](MapCellState state) { return state == MapCellState::CELL_OCCUPIED; },
+                             [&](int i, int j) -> float& {
+                               return squared[(i - box_min_i) + size_t(j - box_min_j) * box_width];
+                             },
+                             [&](int i, int j, double d) {
+                               if (i >= (*updated_min)[0] and i < (*updated_max)[0] and j >= (*updated_min)[1]
+                                   and j < (*updated_max)[1])
+                                 storeDistance(computeDistancesLUTIndex(i, j), cellsToDistance(d));
+                             });
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  ROS_DEBUG("Patched %d by %d cells of the Occupancy Map Distances Lookup Table in %.3f seconds",
+            (*updated_max)[0] - (*updated_min)[0], (*updated_max)[1] - (*updated_min)[1], elapsed);
+}
+
+void OccupancyMap::updateClearanceLUT()
+{
+  if (not clearance_lut_.empty())
+    return;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  clearance_lut_.resize(size_t(size_x_) * size_y_);
+  computeClearances(0, 0, size_x_, size_y_);
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  ROS_INFO("Done updating Occupancy Map Clearance Lookup Table in %.3f seconds, %.1f MB", elapsed,
+           clearance_lut_.size() / 1e6);
+}
+
+void OccupancyMap::updateRangeLUT(double max_range, int bearing_count)
+{
+  if (range_lut_data_ != nullptr and max_range == range_lut_max_range_ and bearing_count == range_lut_bearing_count_)
+  {
+    ROS_DEBUG("Occupancy Map Range LUT is up to date");
+    return;
+  }
+  dropRangeLUT();
+  if (max_range <= 0.0 or bearing_count <= 0)
+    return;
+
+  ROS_INFO("Updating Occupancy Map Range LUT");
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  range_lut_max_range_ = max_range;
+  range_lut_bearing_count_ = bearing_count;
+  range_lut_scale_ = max_range / (RANGE_LUT_NO_HIT - 1);
+  // Only free cells get a row, numbered in cell order
+  std::vector<uint32_t> row_cells;
+  range_lut_rows_.assign(cells_.size(), RANGE_LUT_NO_ROW);
+  for (uint32_t index = 0; index < cells_.size(); index++)
+  {
+    if (cells_[index] == MapCellState::CELL_FREE)
+    {
+      range_lut_rows_[index] = row_cells.size();
+      row_cells.push_back(index);
+    }
+  }
+  size_t lut_bytes = row_cells.size() * size_t(bearing_count) * sizeof(uint16_t);
+  double total_mb = (lut_bytes + range_lut_rows_.size() * sizeof(uint32_t)) / 1e6;
+  std::unique_ptr<DistancesLUTCache> cache;
+  if (!distances_lut_cache_dir_.empty())
+    cache.reset(new DistancesLUTCache(distances_lut_cache_dir_, "range_lut", computeRangeLUTKey()));
+  std::vector<DistancesLUTCache::Section> sections(1);
+  std::shared_ptr<const void> mapping;
+  range_lut_row_count_ = row_cells.size();
+  if (cache and cache->load(&sections, &mapping) and sections[0].size == lut_bytes)
+  {
+    range_lut_data_ = static_cast<const uint16_t*>(sections[0].data);
+    range_lut_mapping_ = mapping;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ROS_INFO("Loaded Occupancy Map Range Lookup Table from %s in %.3f seconds, %.1f MB", cache->getPath().c_str(),
+             elapsed, total_mb);
+    return;
+  }
+
+  updateClearanceLUT();
+  range_lut_.resize(row_cells.size() * size_t(bearing_count));
+  std::function<void(int, int)> row_block = [&](int begin, int end)
+  {
+    for (int row = begin; row < end; row++)
+    {
+      int i = row_cells[row] % size_x_;
+      int j = row_cells[row] / size_x_;
+      uint16_t* ranges = &range_lut_[size_t(row) * bearing_count];
+      for (int bearing = 0; bearing < bearing_count; bearing++)
+      {
+        ranges[bearing] = computeRangeLUTEntry(i, j, bearing);
+      }
+    }
+  };
+  thread_pool_->parallelFor(row_cells.size(), 64, row_block);
+  range_lut_data_ = range_lut_.data();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  ROS_INFO("Done updating Occupancy Map Range Lookup Table for %zu cells at %d bearings in %.3f seconds, %.1f MB",
+           row_cells.size(), bearing_count, elapsed, total_mb);
+  if (cache and cache->save({ { range_lut_.data(), lut_bytes } }))
+  {
+    ROS_INFO("Saved Occupancy Map Range Lookup Table to %s", cache->getPath().c_str());
+  }
+}
+
+double OccupancyMap::lookupRange(double ox, double oy, double oa, double max_range)
+{
+  if (range_lut_data_ == nullptr)
+    return calcRange(ox, oy, oa, max_range);
+  int i, j;
+  convertWorldToMap(ox, oy, &i, &j);
+  if (i < 0 or i >= size_x_ or j < 0 or j >= size_y_)
+    return calcRange(ox, oy, oa, max_range);
+  uint32_t row = range_lut_rows_[computeCellIndex(i, j)];
+  if (row == RANGE_LUT_NO_ROW)
+    return calcRange(ox, oy, oa, max_range);
+  int bearing = int(std::floor(oa * range_lut_bearing_count_ / (2 * M_PI) + 0.5)) % range_lut_bearing_count_;
+  if (bearing < 0)
+    bearing += range_lut_bearing_count_;
+  uint16_t range = range_lut_data_[size_t(row) * range_lut_bearing_count_ + bearing];
+  // No hit within the table's range says nothing about walls past it
+  if (range == RANGE_LUT_NO_HIT)
+    return max_range > range_lut_max_range_ ? calcRange(ox, oy, oa, max_range) : max_range;
+  return std::min(range * range_lut_scale_, max_range);
+}
+
+uint64_t OccupancyMap::computeRangeLUTKey()
+{
+  FNVHash hash;
+  hash.add(resolution_);
+  hash.add(range_lut_max_range_);
+  hash.add(range_lut_bearing_count_);
+  hash.add(size_x_);
+  hash.add(size_y_);
+  hash.add(cells_.data(), cells_.size() * sizeof(MapCellState));
+  return hash.get();
+}
+
+void OccupancyMap::dropRangeLUT()
+{
+  range_lut_data_ = nullptr;
+  range_lut_mapping_.reset();
+  std::vector<uint16_t>().swap(range_lut_);
+  std::vector<uint32_t>().swap(range_lut_rows_);
+  range_lut_row_count_ = 0;
+}
+
+uint16_t OccupancyMap::computeRangeLUTEntry(int i, int j, int bearing)
+{
+  double x = origin_.x + (i - size_x_ / 2) * resolution_;
+  double y = origin_.y + (j - size_y_ / 2) * resolution_;
+  double range = calcRange(x, y, 2 * M_PI * bearing / range_lut_bearing_count_, range_lut_max_range_);
+  return range >= range_lut_max_range_ ? RANGE_LUT_NO_HIT : uint16_t(range / range_lut_scale_ + 0.5);
+}
+
+void OccupancyMap::patchRangeLUT(int min_i, int min_j, int max_i, int max_j, const std::vector<uint32_t>& freed_cells)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int bearing_count = range_lut_bearing_count_;
+  if (range_lut_mapping_)
+  {
+    range_lut_.assign(range_lut_data_, range_lut_data_ + range_lut_row_count_ * bearing_count);
+    range_lut_mapping_.reset();
+  }
+  // Freed cells get new rows on the end, which the box test below always
+  // recasts as they are in the patch
+  for (uint32_t index : freed_cells)
+  {
+    range_lut_rows_[index] = range_lut_row_count_++;
+  }
+  range_lut_.resize(range_lut_row_count_ * bearing_count, 0);
+  range_lut_data_ = range_lut_.data();
+
+  // A ray can only have changed if it reached a patch cell before it hit
+  // anything, so recast those that pass near the patch within their range.
+  // Work in cells, where cell i, j is centred on i, j.
+  double reach = range_lut_max_range_ / resolution_ + RAY_CELL_MARGIN;
+  int reach_cells = std::ceil(reach + RAY_CELL_MARGIN);
+  int region_min_i = std::max(min_i - reach_cells, 0);
+  int region_min_j = std::max(min_j - reach_cells, 0);
+  int region_max_i = std::min(max_i + reach_cells, size_x_);
+  int region_max_j = std::min(max_j + reach_cells, size_y_);
+  if (region_min_i >= region_max_i or region_min_j >= region_max_j)
+    return;
+  double box_min_x = min_i - RAY_CELL_MARGIN;
+  double box_min_y = min_j - RAY_CELL_MARGIN;
+  double box_max_x = max_i - 1 + RAY_CELL_MARGIN;
+  double box_max_y = max_j - 1 + RAY_CELL_MARGIN;
+  std::vector<double> cosines(bearing_count), sines(bearing_count);
+  for (int bearing = 0; bearing < bearing_count; bearing++)
+  {
+    cosines[bearing] = std::cos(2 * M_PI * bearing / bearing_count);
+    sines[bearing] = std::sin(2 * M_PI * bearing / bearing_count);
+  }
+  double cells_per_step = range_lut_scale_ / resolution_;
+  std::atomic<size_t> recast_count(0);
+  std::function<void(int, int)> row_block = [&](int begin, int end)
+  {
+    size_t recast = 0;
+    for (int j = region_min_j + begin; j < region_min_j + end; j++)
+    {
+      for (int i = region_min_i; i < region_max_i; i++)
+      {
+        uint32_t row = range_lut_rows_[computeCellIndex(i, j)];
+        if (row == RANGE_LUT_NO_ROW)
+          continue;
+        uint16_t* ranges = &range_lut_[size_t(row) * bearing_count];
+        for (int bearing = 0; bearing < bearing_count; bearing++)
+        {
+          double length = ranges[bearing] == RANGE_LUT_NO_HIT ? reach
+                                                              : ranges[bearing] * cells_per_step + RAY_CELL_MARGIN;
+          if (segmentMeetsBox(i, j, cosines[bearing], sines[bearing], length, box_min_x, box_min_y, box_max_x,
+                              box_max_y))
+          {
+            ranges[bearing] = computeRangeLUTEntry(i, j, bearing);
+            recast++;
+          }
+        }
+      }
+    }
+    recast_count += recast;
+  };
+  thread_pool_->parallelFor(region_max_j - region_min_j, 4, row_block);
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  ROS_DEBUG("Recast %zu rays of the Occupancy Map Range Lookup Table in %.3f seconds", size_t(recast_count),
+            elapsed);
+}
+
+void OccupancyMap::copyMappedDistancesLUT()
+{
+  if (not distances_lut_mapping_)
+    return;
+  if (distances_lut_data_precision_ == DISTANCES_LUT_FLOAT)
+  {
+    const float* distances = static_cast<const float*>(distances_lut_data_);
+    distances_lut_.assign(distances, distances + distances_lut_size_);
+    distances_lut_data_ = distances_lut_.data();
+  }
+  else
+  {
+    const uint8_t* data = static_cast<const uint8_t*>(distances_lut_data_);
+    quantized_distances_lut_.assign(data, data + distances_lut_size_ * getDistancesLUTEntrySize());
+    distances_lut_data_ = quantized_distances_lut_.data();
+  }
+  distances_lut_mapping_.reset();
+}
+
+void OccupancyMap::storeDistance(uint32_t index, float d)
+{
+  switch (distances_lut_data_precision_)
+  {
+    case DISTANCES_LUT_UINT8:
+      quantized_distances_lut_[index] = quantizeDistance<uint8_t>(d, 1.0f / distances_lut_scale_);
+      break;
+    case DISTANCES_LUT_UINT16:
+      reinterpret_cast<uint16_t*>(quantized_distances_lut_.data())[index] =
+          quantizeDistance<uint16_t>(d, 1.0f / distances_lut_scale_);
+      break;
+    default:
+      distances_lut_[index] = d;
+  }
+}
+
+uint64_t OccupancyMap::computeDistancesLUTKey()
+{
+  FNVHash hash;
+  hash.add(distances_lut_builder_);
+  hash.add(resolution_);
+  hash.add(max_distance_to_object_);
+  hash.add(distances_lut_precision_);
+  hash.add(distances_lut_layout_);
+  hash.add(size_x_);
+  hash.add(size_y_);
+  hash.add(cells_.data(), cells_.size() * sizeof(MapCellState));
+  return hash.get();
+}
+
+bool OccupancyMap::useDistancesLUT(const std::vector<DistancesLUTCache::Section>& sections,
+                                   std::shared_ptr<const void> mapping)
+{
+  if (sections[0].size != distances_lut_size_ * getDistancesLUTEntrySize())
+  {
+    ROS_WARN("Ignoring distances LUT from outside the process, it is for a map of another size");
+    return false;
+  }
+  std::vector<float>().swap(distances_lut_);
+  std::vector<uint8_t>().swap(quantized_distances_lut_);
+  distances_lut_data_ = sections[0].data;
+  distances_lut_data_precision_ = distances_lut_precision_;
+  distances_lut_mapping_ = mapping;
+  return true;
+}
+
+void OccupancyMap::quantizeDistancesLUT()
+{
+  if (distances_lut_precision_ == DISTANCES_LUT_FLOAT)
+    return;
+  quantized_distances_lut_.resize(distances_lut_.size() * getDistancesLUTEntrySize());
+  if (distances_lut_precision_ == DISTANCES_LUT_UINT8)
+    quantize(distances_lut_, distances_lut_scale_, quantized_distances_lut_.data());
+  else
+    quantize(distances_lut_, distances_lut_scale_, reinterpret_cast<uint16_t*>(quantized_distances_lut_.data()));
+  std::vector<float>().swap(distances_lut_);
+  distances_lut_data_ = quantized_distances_lut_.data();
+  distances_lut_data_precision_ = distances_lut_precision_;
+}
+
+size_t OccupancyMap::getDistancesLUTEntrySize()
+{
+  switch (distances_lut_precision_)
+  {
+    case DISTANCES_LUT_UINT8:
+      return sizeof(uint8_t);
+    case DISTANCES_LUT_UINT16:
+      return sizeof(uint16_t);
+    default:
+      return sizeof(float);
+  }
+}
+
+// Exact Euclidean distances, by a one dimensional squared distance transform
+// along each row and then along each column.  Matches the brushfire result:
+// cells more than cell_radius_ cells from an obstacle get the max distance.
+void OccupancyMap::computeDistancesWithEDT()
+{
+  computeBoxDistancesWithEDT(0, 0, size_x_, size_y_, cdm_.cell_radius_,
+                             [](MapCellState state) { return state == MapCellState::CELL_OCCUPIED; },
+                             [&](int i, int j) -> float& { return distances_lut_[computeDistancesLUTIndex(i, j)]; },
+                             [&](int i, int j, double d) {
+                               distances_lut_[computeDistancesLUTIndex(i, j)] = cellsToDistance(d);
+                             });
+}
+
+template <typename IsObstacle, typename Buffer, typename Store>
+void OccupancyMap::computeBoxDistancesWithEDT(int min_i, int min_j, int max_i, int max_j, int radius,
+                                              IsObstacle is_obstacle, Buffer buffer, Store store)
+{
+  // Anything beyond the radius is clamped, so squared distances can start at
+  // just past the radius instead of infinity.
+  const float far_sq = float(radius + 1) * (radius + 1);
+  const int block_size = 16;
+  const int size_x = max_i - min_i;
+  const int size_y = max_j - min_j;
+
+  std::function<void(int, int)> row_block = [&](int begin, int end)
+  {
+    std::vector<float> f(size_x), d(size_x);
+    std::vector<int> v(size_x);
+    std::vector<double> z(size_x + 1);
+    for (int j = min_j + begin; j < min_j + end; j++)
+    {
+      for (int i = 0; i < size_x; i++)
+      {
+        f[i] = is_obstacle(cells_[computeCellIndex(min_i + i, j)]) ? 0.0f : far_sq;
+      }
+      distanceTransform1D(f.data(), size_x, d.data(), v.data(), z.data());
+      for (int i = 0; i < size_x; i++)
+      {
+        buffer(min_i + i, j) = std::min(d[i], far_sq);
+      }
+    }
+  };
+  thread_pool_->parallelFor(size_y, block_size, row_block);
+
+  std::function<void(int, int)> column_block = [&](int begin, int end)
+  {
+    std::vector<float> f(size_y), d(size_y);
+    std::vector<int> v(size_y);
+    std::vector<double> z(size_y + 1);
+    for (int i = min_i + begin; i < min_i + end; i++)
+    {
+      for (int j = 0; j < size_y; j++)
+      {
+        f[j] = buffer(i, min_j + j);
+      }
+      distanceTransform1D(f.data(), size_y, d.data(), v.data(), z.data());
+      for (int j = 0; j < size_y; j++)
+      {
+        store(i, min_j + j, std::sqrt(double(d[j])));
+      }
+    }
+  };
+  thread_pool_->parallelFor(size_x, block_size, column_block);
+}
+
+void OccupancyMap::computeClearances(int min_i, int min_j, int max_i, int max_j)
+{
+  // Only cells within the largest clearance of the box can be nearest to it
+  int box_min_i = std::max(min_i - MAX_CLEARANCE, 0);
+  int box_min_j = std::max(min_j - MAX_CLEARANCE, 0);
+  int box_max_i = std::min(max_i + MAX_CLEARANCE, size_x_);
+  int box_max_j = std::min(max_j + MAX_CLEARANCE, size_y_);
+  int box_width = box_max_i - box_min_i;
+  std::vector<float> squared(size_t(box_width) * (box_max_j - box_min_j));
+  computeBoxDistancesWithEDT(box_min_i, box_min_j, box_max_i, box_max_j, MAX_CLEARANCE - 1,
+                             [](MapCellState state) { return state != MapCellState::CELL_FREE; },
+                             [&](int i, int j) -> float& {
+                               return squared[(i - box_min_i) + size_t(j - box_min_j) * box_width];
+                             },
+                             [&](int i, int j, double d) {
+                               if (i < min_i or i >= max_i or j < min_j or j >= max_j)
+                                 return;
+                               // The nearest cell off the map is straight out from the nearest edge
+                               int edge = std::min(std::min(i + 1, size_x_ - i), std::min(j + 1, size_y_ - j));
+                               clearance_lut_[computeCellIndex(i, j)] = std::min(int(d), edge);
+                             });
 }
 
 void OccupancyMap::iterateObstacleCells(std::priority_queue<OccupancyMapCellData>& q,
@@ -243,11 +908,9 @@ bool OccupancyMap::enqueue(int i, int j, int src_i, int src_j,
 
 void OccupancyMap::setDistanceToObject(int i, int j, float d)
 {
-  map_vec_[0] = i;
-  map_vec_[1] = j;
-  if (isValid(map_vec_))
+  if ((i >= 0) && (i < size_x_) && (j >= 0) && (j < size_y_))
   {
-    distances_lut_[computeCellIndex(i, j)] = d;
+    distances_lut_[computeDistancesLUTIndex(i, j)] = d;
   }
 }
 
@@ -258,106 +921,101 @@ double OccupancyMap::calcRange(double ox, double oy, double oa, double max_range
 {
   // Bresenham raytracing
   int x0, x1, y0, y1;
-  int x, y;
   int xstep, ystep;
   bool steep;
-  int placeholder;
-  int deltax, deltay, error, deltaerr;
-
-  world_vec_[0] = ox;
-  world_vec_[1] = oy;
-  convertWorldToMap(world_vec_, &map_vec_);
-  x0 = map_vec_[0];
-  y0 = map_vec_[1];
-  world_vec_[0] = ox + max_range * std::cos(oa);
-  world_vec_[1] = oy + max_range * std::sin(oa);
+  int deltax, deltay;
 
-  convertWorldToMap(world_vec_, &map_vec_);
-  x1 = map_vec_[0];
-  y1 = map_vec_[1];
+  convertWorldToMap(ox, oy, &x0, &y0);
+  convertWorldToMap(ox + max_range * std::cos(oa), oy + max_range * std::sin(oa), &x1, &y1);
 
   if (x0 == x1 and y0 == y1)
     return max_range;
 
-  if (std::abs(y1 - y0) > std::abs(x1 - x0))
-    steep = true;
-  else
-    steep = false;
-
+  steep = std::abs(y1 - y0) > std::abs(x1 - x0);
   if (steep)
   {
-    placeholder = x0;
-    x0 = y0;
-    y0 = placeholder;
-
-    placeholder = x1;
-    x1 = y1;
-    y1 = placeholder;
+    std::swap(x0, y0);
+    std::swap(x1, y1);
   }
 
   deltax = std::abs(x1 - x0);
   deltay = std::abs(y1 - y0);
-  error = 0;
-  deltaerr = deltay;
+  xstep = x0 < x1 ? 1 : -1;
+  ystep = y0 < y1 ? 1 : -1;
 
-  x = x0;
-  y = y0;
-
-  if (x0 < x1)
-    xstep = 1;
-  else
-    xstep = -1;
-  if (y0 < y1)
-    ystep = 1;
-  else
-    ystep = -1;
-
-  if (steep)
-  {
-    map_vec_[0] = y;
-    map_vec_[1] = x;
-    if (!isValid(map_vec_) || cells_[computeCellIndex(y, x)] != MapCellState::CELL_FREE)
-    {
-      return std::sqrt((x - x0) * (x - x0) + (y - y0) * (y - y0)) * resolution_;
-    }
-  }
-  else
+  if (clearance_lut_.empty())
   {
-    map_vec_[0] = x;
-    map_vec_[1] = y;
-    if (!isValid(map_vec_) || cells_[computeCellIndex(x, y)] != MapCellState::CELL_FREE)
+    int x = x0;
+    int y = y0;
+    int error = 0;
+    while (true)
     {
-      return std::sqrt((x - x0) * (x - x0) + (y - y0) * (y - y0)) * resolution_;
+      int i = steep ? y : x;
+      int j = steep ? x : y;
+      if (i < 0 or i >= size_x_ or j < 0 or j >= size_y_ or cells_[computeCellIndex(i, j)] != MapCellState::CELL_FREE)
+      {
+        return std::sqrt((x - x0) * (x - x0) + (y - y0) * (y - y0)) * resolution_;
+      }
+      if (x == x1 + xstep)
+        break;
+      x += xstep;
+      error += deltay;
+      if (2 * error >= deltax)
+      {
+        y += ystep;
+        error -= deltax;
+      }
     }
+    return max_range;
   }
 
-  while (x != (x1 + xstep * 1))
+  // Visit the same cells, skipping over open space.  Cells n steps on are
+  // within n * step length + 1 cells of this one, as rounding the line to
+  // cells moves each by at most half a cell, and no cell nearer than the
+  // clearance stops the ray; so the steps that stay nearer can be passed
+  // over.  Cells that stop the ray have no clearance, so the table is all
+  // this needs to read.
+  const double inverse_step_length = 1.0 / std::sqrt(1.0 + double(deltay) * deltay / (double(deltax) * deltax));
+  int x = x0;
+  int y = y0;
+  int error = 0;
+  while (true)
   {
-    x += xstep;
-    error += deltaerr;
-    if (2 * error >= deltax)
+    int i = steep ? y : x;
+    int j = steep ? x : y;
+    int clearance = 0;
+    if (i >= 0 and i < size_x_ and j >= 0 and j < size_y_)
+      clearance = clearance_lut_[computeCellIndex(i, j)];
+    if (clearance == 0)
     {
-      y += ystep;
-      error -= deltax;
+      return std::sqrt((x - x0) * (x - x0) + (y - y0) * (y - y0)) * resolution_;
     }
-
-    if (steep)
+    if (clearance <= 2)
     {
-      map_vec_[0] = y;
-      map_vec_[1] = x;
-      if (!isValid(map_vec_) || cells_[computeCellIndex(y, x)] != MapCellState::CELL_FREE)
+      // Within a step of a hit, so step exactly
+      if (x == x1 + xstep)
+        break;
+      x += xstep;
+      error += deltay;
+      if (2 * error >= deltax)
       {
-        return std::sqrt((x - x0) * (x - x0) + (y - y0) * (y - y0)) * resolution_;
+        y += ystep;
+        error -= deltax;
       }
+      continue;
     }
-    else
+    int steps = std::ceil((clearance - 1) * inverse_step_length);
+    if (steps > std::abs(x1 + xstep - x))
+      break;
+    x += xstep * steps;
+    error += deltay * steps;
+    if (2 * error >= deltax)
     {
-      map_vec_[0] = x;
-      map_vec_[1] = y;
-      if (!isValid(map_vec_) || cells_[computeCellIndex(x, y)] != MapCellState::CELL_FREE)
-      {
-        return std::sqrt((x - x0) * (x - x0) + (y - y0) * (y - y0)) * resolution_;
-      }
+      // y moves once for each time the error passed half of deltax, leaving
+      // it in [-deltax / 2, deltax / 2) as after single steps
+      int carry = (2 * error + deltax) / (2 * deltax);
+      y += ystep * carry;
+      error -= carry * deltax;
     }
   }
   return max_range;
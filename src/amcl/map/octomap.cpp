@@ -20,8 +20,10 @@
 #include "map/octomap.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <cstdlib>
+#include <functional>
 
 #include <octomap/OcTreeKey.h>
 #include <octomap/OcTreeDataNode.h>
@@ -39,11 +41,17 @@ OctoMap::OctoMap(double resolution)
 
 OctoMap::OctoMap(double resolution, bool publish_distances_lut)
     : Map(resolution),
+      pose_indices_data_(nullptr),
+      distance_ratios_data_(nullptr),
       publish_distances_lut_(publish_distances_lut),
-      cdm_(resolution, 0.0)
+      cdm_(resolution, 0.0),
+      pose_indices_layout_(DISTANCES_LUT_ROW_MAJOR),
+      pose_tiles_x_(0)
 {
   cropped_min_cells_ = std::vector<int>(3);
   cropped_max_cells_ = std::vector<int>(3);
+  std::fill(lut_min_cells_, lut_min_cells_ + 3, 0);
+  std::fill(lut_max_cells_, lut_max_cells_ + 3, 0);
   map_min_bounds_ = std::vector<double>(2);
   map_max_bounds_ = std::vector<double>(2);
   octree_ = std::make_shared<octomap::OcTree>(resolution_);
@@ -68,9 +76,31 @@ void OctoMap::initFromOctree(std::shared_ptr<octomap::OcTree> octree, double max
   map_vec[1] = max_y;
   map_vec[2] = max_z;
   convertWorldToMap(map_vec, &cropped_max_cells_);
-  map_cells_width_ = cropped_max_cells_[0] - cropped_min_cells_[0] + 1;
-  num_poses_ = map_cells_width_ * (cropped_max_cells_[1] - cropped_min_cells_[1] + 1);
-  num_z_column_indices_ = cropped_max_cells_[2] - cropped_min_cells_[2] + 1;
+  updateCroppedSize();
+}
+
+// Sets the sizes that follow from the cropped bounds and the layout
+void OctoMap::updateCroppedSize()
+{
+  int guard_cells = static_cast<int>(std::ceil(max_distance_to_object_ / resolution_)) + 1;
+  for (int i = 0; i < 3; i++)
+  {
+    lut_min_cells_[i] = cropped_min_cells_[i] - guard_cells;
+    lut_max_cells_[i] = cropped_max_cells_[i] + guard_cells;
+  }
+  map_cells_width_ = lut_max_cells_[0] - lut_min_cells_[0] + 1;
+  int map_cells_height = lut_max_cells_[1] - lut_min_cells_[1] + 1;
+  num_z_column_indices_ = lut_max_cells_[2] - lut_min_cells_[2] + 1;
+  pose_indices_layout_ = distances_lut_layout_;
+  if (pose_indices_layout_ == DISTANCES_LUT_TILED)
+  {
+    pose_tiles_x_ = computeTileCount(map_cells_width_);
+    num_poses_ = pose_tiles_x_ * computeTileCount(map_cells_height) * TILE_SIZE * TILE_SIZE;
+  }
+  else
+  {
+    num_poses_ = map_cells_width_ * map_cells_height;
+  }
 }
 
 void OctoMap::getMinMaxCells(std::vector<int>* min_cells, std::vector<int>* max_cells)
@@ -120,6 +150,13 @@ bool OctoMap::isVoxelValid(const int i, const int j, const int k)
   return isPoseValid(i, j) and k <= cropped_max_cells_[2] and k >= cropped_min_cells_[2];
 }
 
+// returns true if the voxel is in the map or its guard band
+bool OctoMap::isVoxelInDistancesLUT(int i, int j, int k)
+{
+  return (i >= lut_min_cells_[0] and i <= lut_max_cells_[0] and j >= lut_min_cells_[1] and j <= lut_max_cells_[1]
+          and k >= lut_min_cells_[2] and k <= lut_max_cells_[2]);
+}
+
 double OctoMap::getMaxDistanceToObject()
 {
   return max_distance_to_object_;
@@ -143,9 +180,7 @@ void OctoMap::setMapBounds(const std::vector<double>& map_min, const std::vector
     cropped_min_cells_[i] = std::max(cropped_min_cells_[i], cells_min[i]);
     cropped_max_cells_[i] = std::min(cropped_max_cells_[i], cells_max[i]);
   }
-  map_cells_width_ = cropped_max_cells_[0] - cropped_min_cells_[0] + 1;
-  num_poses_ = map_cells_width_ * (cropped_max_cells_[1] - cropped_min_cells_[1] + 1);
-  num_z_column_indices_ = cropped_max_cells_[2] - cropped_min_cells_[2] + 1;
+  updateCroppedSize();
   updateDistancesLUT();
 }
 
@@ -180,24 +215,52 @@ void OctoMap::updateDistancesLUT()
   }
 
   ROS_INFO("Updating OctoMap Distances LUT");
-  CellDataQueue q = CellDataQueue();
-  pose_indices_.clear();
-  pose_indices_.resize(num_poses_, 0);
-  pose_indices_.shrink_to_fit();
-  distance_ratios_.clear();
-  distance_ratios_.resize(num_z_column_indices_, std::numeric_limits<uint8_t>::max());
-  distance_ratios_.reserve(num_z_column_indices_ * (num_poses_ / 16));
-
-  if ((cdm_.resolution_ != resolution_) || (std::fabs(cdm_.max_dist_ - max_distance_to_object_) > EPSILON))
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  distances_lut_mapping_.reset();
+  updateCroppedSize();
+  std::unique_ptr<SharedDistancesLUT> shared;
+  std::unique_ptr<DistancesLUTCache> cache;
+  if (share_distances_lut_ or !distances_lut_cache_dir_.empty())
   {
-    cdm_ = CachedDistanceOctoMap(resolution_, max_distance_to_object_);
+    uint64_t key = computeDistancesLUTKey();
+    if (share_distances_lut_)
+      shared.reset(new SharedDistancesLUT("octomap", key));
+    if (!distances_lut_cache_dir_.empty())
+      cache.reset(new DistancesLUTCache(distances_lut_cache_dir_, "octomap", key));
+  }
+  std::vector<DistancesLUTCache::Section> sections(2);
+  std::shared_ptr<const void> mapping;
+  if (shared and shared->attach(&sections, &mapping) and useDistancesLUT(sections, mapping))
+  {
+    octree_.reset();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ROS_INFO("Attached OctoMap Distances Lookup Table %s in %.3f seconds", shared->getName().c_str(), elapsed);
+  }
+  else if (cache and cache->load(&sections, &mapping) and useDistancesLUT(sections, mapping))
+  {
+    octree_.reset();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ROS_INFO("Loaded OctoMap Distances Lookup Table from %s in %.3f seconds", cache->getPath().c_str(), elapsed);
+  }
+  else
+  {
+    buildDistancesLUT();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ROS_INFO("Done updating OctoMap Distances Lookup Table in %.3f seconds, %.1f MB", elapsed,
+             (pose_indices_.size() * sizeof(uint32_t) + distance_ratios_.size()) / 1e6);
+    sections = { { pose_indices_.data(), pose_indices_.size() * sizeof(uint32_t) },
+                 { distance_ratios_.data(), distance_ratios_.size() } };
+    if (cache and cache->save(sections))
+    {
+      ROS_INFO("Saved OctoMap Distances Lookup Table to %s", cache->getPath().c_str());
+    }
+  }
+  // Hand the table over to the other processes, and use their copy from now on
+  std::vector<DistancesLUTCache::Section> shared_sections;
+  if (shared and shared->publish(sections, &shared_sections, &mapping) and useDistancesLUT(shared_sections, mapping))
+  {
+    ROS_INFO("Shared OctoMap Distances Lookup Table as %s", shared->getName().c_str());
   }
-  ROS_INFO("Iterating obstacle cells");
-  iterateObstacleCells(q);
-  octree_.reset();
-  ROS_INFO("Iterating empty cells");
-  iterateEmptyCells(q);
-  ROS_INFO("Done updating OctoMap Distances Lookup Table");
   if (publish_distances_lut_)
   {
     publishDistancesLUT();
@@ -206,6 +269,265 @@ void OctoMap::updateDistancesLUT()
   distances_lut_created_ = true;
 }
 
+// Build the distances lookup table from the octree, and release the octree
+void OctoMap::buildDistancesLUT()
+{
+  if (distances_lut_builder_ == DISTANCES_LUT_EDT)
+  {
+    computeDistancesWithEDT();
+    octree_.reset();
+  }
+  else
+  {
+    CellDataQueue q = CellDataQueue();
+    pose_indices_.clear();
+    pose_indices_.resize(num_poses_, 0);
+    pose_indices_.shrink_to_fit();
+    distance_ratios_.clear();
+    distance_ratios_.resize(num_z_column_indices_, std::numeric_limits<uint8_t>::max());
+    distance_ratios_.reserve(num_z_column_indices_ * (num_poses_ / 16));
+    pose_indices_data_ = pose_indices_.data();
+    distance_ratios_data_ = distance_ratios_.data();
+
+    if ((cdm_.resolution_ != resolution_) || (std::fabs(cdm_.max_dist_ - max_distance_to_object_) > EPSILON))
+    {
+      cdm_ = CachedDistanceOctoMap(resolution_, max_distance_to_object_);
+    }
+    ROS_INFO("Iterating obstacle cells");
+    iterateObstacleCells(q);
+    octree_.reset();
+    ROS_INFO("Iterating empty cells");
+    iterateEmptyCells(q);
+  }
+  if (pose_indices_layout_ == DISTANCES_LUT_TILED)
+    sortColumnsByPose();
+}
+
+// Exact Euclidean distances, by one dimensional squared distance transforms
+// along z, x and then y.  The map is cut into slabs of rows along y which are
+// transformed in parallel, each with a halo of rows on both sides wide enough
+// to hold any obstacle within the max distance.  Only columns with a voxel
+// near an obstacle are stored, as the brushfire does.
+void OctoMap::computeDistancesWithEDT()
+{
+  const int size_x = map_cells_width_;
+  const int size_y = lut_max_cells_[1] - lut_min_cells_[1] + 1;
+  const int size_z = num_z_column_indices_;
+  const uint8_t max_ratio = std::numeric_limits<uint8_t>::max();
+  pose_indices_.assign(num_poses_, 0);
+  pose_indices_.shrink_to_fit();
+  distance_ratios_.assign(size_z, max_ratio);
+  pose_indices_data_ = pose_indices_.data();
+  distance_ratios_data_ = distance_ratios_.data();
+  if (size_x <= 0 || size_y <= 0 || size_z <= 0)
+    return;
+
+  // Voxels at least radius cells from every obstacle are at the max distance,
+  // so squared distances can start there instead of at infinity.
+  const int radius = static_cast<int>(std::ceil(max_distance_to_object_ / resolution_));
+  const float far_sq = float(radius) * radius;
+
+  // Occupied voxels as (i, k) pairs for each row j, all relative to the table
+  std::vector<std::vector<std::pair<int, int>>> occupied_rows(size_y);
+  collectOccupiedVoxels(&occupied_rows);
+
+  const int slab_rows = std::max(16, 2 * radius);
+  const int num_slabs = (size_y + slab_rows - 1) / slab_rows;
+  std::vector<std::vector<uint8_t>> slab_columns(num_slabs);
+
+  std::function<void(int, int)> slab_block = [&](int begin, int end)
+  {
+    int n = std::max(std::max(size_x, size_z), slab_rows + 2 * radius);
+    std::vector<float> f(n), d(n);
+    std::vector<int> v(n);
+    std::vector<double> z(n + 1);
+    std::vector<float> grid;
+    for (int s = begin; s < end; s++)
+    {
+      int y0 = s * slab_rows;
+      int y1 = std::min(size_y, y0 + slab_rows);
+      int h0 = std::max(0, y0 - radius);
+      int h1 = std::min(size_y, y1 + radius);
+      int rows = h1 - h0;
+      // Voxel (i, j, k) of the slab is at ((j - h0) * size_x + i) * size_z + k
+      grid.assign(size_t(size_x) * rows * size_z, far_sq);
+      for (int j = h0; j < h1; j++)
+      {
+        for (const std::pair<int, int>& voxel : occupied_rows[j])
+        {
+          grid[(size_t(j - h0) * size_x + voxel.first) * size_z + voxel.second] = 0.0f;
+        }
+      }
+
+      // Along z, where columns are contiguous
+      for (size_t c = 0; c < size_t(size_x) * rows; c++)
+      {
+        float* column = &grid[c * size_z];
+        distanceTransform1D(column, size_z, d.data(), v.data(), z.data());
+        std::copy(d.begin(), d.begin() + size_z, column);
+      }
+      // Along x
+      for (int jl = 0; jl < rows; jl++)
+      {
+        float* row = &grid[size_t(jl) * size_x * size_z];
+        for (int k = 0; k < size_z; k++)
+        {
+          for (int i = 0; i < size_x; i++)
+            f[i] = row[size_t(i) * size_z + k];
+          distanceTransform1D(f.data(), size_x, d.data(), v.data(), z.data());
+          for (int i = 0; i < size_x; i++)
+            row[size_t(i) * size_z + k] = d[i];
+        }
+      }
+      // Along y, keeping only the rows inside the slab
+      const size_t row_stride = size_t(size_x) * size_z;
+      for (size_t c = 0; c < row_stride; c++)
+      {
+        for (int jl = 0; jl < rows; jl++)
+          f[jl] = grid[jl * row_stride + c];
+        distanceTransform1D(f.data(), rows, d.data(), v.data(), z.data());
+        for (int j = y0; j < y1; j++)
+          grid[(j - h0) * row_stride + c] = d[j - h0];
+      }
+
+      // Store the columns that come near an obstacle.  Offsets are local to
+      // the slab, plus one so zero still means the shared far column.
+      std::vector<uint8_t>& columns = slab_columns[s];
+      std::vector<uint8_t> ratios(size_z);
+      for (int j = y0; j < y1; j++)
+      {
+        for (int i = 0; i < size_x; i++)
+        {
+          const float* column = &grid[(size_t(j - h0) * size_x + i) * size_z];
+          bool near = false;
+          for (int k = 0; k < size_z; k++)
+          {
+            double distance = std::min(std::sqrt(column[k]) * resolution_, max_distance_to_object_);
+            ratios[k] = static_cast<uint8_t>(std::floor(distance / max_distance_to_object_ * max_ratio));
+            near = near || ratios[k] < max_ratio;
+          }
+          if (near)
+          {
+            pose_indices_[makePoseIndex(i, j)] = columns.size() + 1;
+            columns.insert(columns.end(), ratios.begin(), ratios.end());
+          }
+        }
+      }
+    }
+  };
+  thread_pool_->parallelFor(num_slabs, 1, slab_block);
+
+  // Lay the slabs out one after another, after the shared far column
+  std::vector<size_t> slab_starts(num_slabs + 1);
+  slab_starts[0] = size_z;
+  for (int s = 0; s < num_slabs; s++)
+  {
+    slab_starts[s + 1] = slab_starts[s] + slab_columns[s].size();
+  }
+  distance_ratios_.resize(slab_starts[num_slabs]);
+  std::function<void(int, int)> layout_block = [&](int begin, int end)
+  {
+    for (int s = begin; s < end; s++)
+    {
+      std::copy(slab_columns[s].begin(), slab_columns[s].end(), distance_ratios_.begin() + slab_starts[s]);
+      std::vector<uint8_t>().swap(slab_columns[s]);
+      for (int j = s * slab_rows; j < std::min(size_y, (s + 1) * slab_rows); j++)
+      {
+        for (int i = 0; i < size_x; i++)
+        {
+          uint32_t& pose_index = pose_indices_[makePoseIndex(i, j)];
+          if (pose_index != 0)
+            pose_index += slab_starts[s] - 1;
+        }
+      }
+    }
+  };
+  thread_pool_->parallelFor(num_slabs, 1, layout_block);
+  pose_indices_data_ = pose_indices_.data();
+  distance_ratios_data_ = distance_ratios_.data();
+
+  int threads = std::min(num_slabs, thread_pool_->getNumThreads());
+  double slab_mb = double(size_x) * std::min(size_y, slab_rows + 2 * radius) * size_z * sizeof(float) / 1e6;
+  ROS_INFO("Distance transform used %d slabs of %d rows, with peak slab buffers of %.1f MB on %d threads",
+           num_slabs, slab_rows, slab_mb * threads, threads);
+}
+
+// Find every occupied voxel inside the crop.  Pruned leaves cover several
+// voxels, so the octree is walked as is rather than expanded.
+void OctoMap::collectOccupiedVoxels(std::vector<std::vector<std::pair<int, int>>>* occupied_rows)
+{
+  std::vector<double> world_coords(3);
+  std::vector<int> map_coords(3);
+  for (octomap::OcTree::leaf_iterator it = octree_->begin_leafs(), end = octree_->end_leafs(); it != end; ++it)
+  {
+    if (!octree_->isNodeOccupied(*it))
+      continue;
+    // Voxel centers are computed the way the octree computes them for its
+    // smallest leaves, so they convert to the same map coords as when expanded.
+    double half_size = it.getSize() / 2;
+    int voxels = std::max(1, static_cast<int>(std::round(it.getSize() / resolution_)));
+    int first_x = static_cast<int>(std::round((it.getX() - half_size) / resolution_));
+    int first_y = static_cast<int>(std::round((it.getY() - half_size) / resolution_));
+    int first_z = static_cast<int>(std::round((it.getZ() - half_size) / resolution_));
+    for (int a = 0; a < voxels; a++)
+    {
+      for (int b = 0; b < voxels; b++)
+      {
+        for (int c = 0; c < voxels; c++)
+        {
+          world_coords[0] = (double(first_x + a) + 0.5) * resolution_;
+          world_coords[1] = (double(first_y + b) + 0.5) * resolution_;
+          world_coords[2] = (double(first_z + c) + 0.5) * resolution_;
+          convertWorldToMap(world_coords, &map_coords);
+          if (!isVoxelValid(map_coords[0], map_coords[1], map_coords[2]))
+            continue;
+          (*occupied_rows)[map_coords[1] - lut_min_cells_[1]].push_back(
+              std::make_pair(map_coords[0] - lut_min_cells_[0], map_coords[2] - lut_min_cells_[2]));
+        }
+      }
+    }
+  }
+}
+
+uint64_t OctoMap::computeDistancesLUTKey()
+{
+  FNVHash hash;
+  hash.add(distances_lut_builder_);
+  hash.add(resolution_);
+  hash.add(max_distance_to_object_);
+  hash.add(distances_lut_layout_);
+  for (int i = 0; i < 3; i++)
+  {
+    hash.add(lut_min_cells_[i]);
+    hash.add(lut_max_cells_[i]);
+  }
+  for (octomap::OcTree::leaf_iterator it = octree_->begin_leafs(), end = octree_->end_leafs(); it != end; ++it)
+  {
+    hash.add(it.getX());
+    hash.add(it.getY());
+    hash.add(it.getZ());
+    hash.add(it.getSize());
+    hash.add(octree_->isNodeOccupied(*it));
+  }
+  return hash.get();
+}
+
+bool OctoMap::useDistancesLUT(const std::vector<DistancesLUTCache::Section>& sections,
+                              std::shared_ptr<const void> mapping)
+{
+  if (sections[0].size != size_t(num_poses_) * sizeof(uint32_t) || sections[1].size < num_z_column_indices_)
+  {
+    ROS_WARN("Ignoring distances LUT from outside the process, it is for a map of another size");
+    return false;
+  }
+  std::vector<uint32_t>().swap(pose_indices_);
+  std::vector<uint8_t>().swap(distance_ratios_);
+  pose_indices_data_ = static_cast<const uint32_t*>(sections[0].data);
+  distance_ratios_data_ = static_cast<const uint8_t*>(sections[1].data);
+  distances_lut_mapping_ = mapping;
+  return true;
+}
+
 void OctoMap::iterateObstacleCells(CellDataQueue& q)
 {
   // Enqueue all the obstacle cells
@@ -256,27 +578,27 @@ void OctoMap::iterateEmptyCells(CellDataQueue& q)
   while (!q.empty())
   {
     OctoMapCellData current_cell = q.front();
-    if (current_cell.i > cropped_min_cells_[0])
+    if (current_cell.i > lut_min_cells_[0])
     {
       enqueue(0, current_cell, q);
     }
-    if (current_cell.j > cropped_min_cells_[1])
+    if (current_cell.j > lut_min_cells_[1])
     {
       enqueue(1, current_cell, q);
     }
-    if (current_cell.k > cropped_min_cells_[2])
+    if (current_cell.k > lut_min_cells_[2])
     {
       enqueue(2, current_cell, q);
     }
-    if (current_cell.i < cropped_max_cells_[0])
+    if (current_cell.i < lut_max_cells_[0])
     {
       enqueue(3, current_cell, q);
     }
-    if (current_cell.j < cropped_max_cells_[1])
+    if (current_cell.j < lut_max_cells_[1])
     {
       enqueue(4, current_cell, q);
     }
-    if (current_cell.k < cropped_max_cells_[2])
+    if (current_cell.k < lut_max_cells_[2])
     {
       enqueue(5, current_cell, q);
     }
@@ -314,9 +636,9 @@ void OctoMap::enqueue(const int shift_index, const OctoMapCellData& current_cell
 // Sets the distance from the voxel to the nearest object in the static map
 void OctoMap::setDistanceToObject(int i, int j, int k, double d)
 {
-  int i_shifted = i - cropped_min_cells_[0];
-  int j_shifted = j - cropped_min_cells_[1];
-  int k_shifted = k - cropped_min_cells_[2];
+  int i_shifted = i - lut_min_cells_[0];
+  int j_shifted = j - lut_min_cells_[1];
+  int k_shifted = k - lut_min_cells_[2];
   uint32_t pose_index = makePoseIndex(i_shifted, j_shifted);
   uint32_t distances_lut_start_index = pose_indices_[pose_index];
   if(distances_lut_start_index == 0)
@@ -324,6 +646,7 @@ void OctoMap::setDistanceToObject(int i, int j, int k, double d)
     distances_lut_start_index = distance_ratios_.size();
     pose_indices_[pose_index] = distances_lut_start_index;
     distance_ratios_.resize(distances_lut_start_index + num_z_column_indices_, std::numeric_limits<uint8_t>::max());
+    distance_ratios_data_ = distance_ratios_.data();
   }
   ROS_ASSERT(d >= 0.0);
   d = std::min(d, max_distance_to_object_);
@@ -337,23 +660,59 @@ double OctoMap::getDistanceToObject(int i, int j, int k)
 {
   // Checking if distances lut is created first will prevent checking validity while creating distances lut.
   // The distances lut container is assumed to not send invalid coordinates and checking every time is inefficient.
-  if(distances_lut_created_ and !isVoxelValid(i, j, k))
+  if(distances_lut_created_ and !isVoxelInDistancesLUT(i, j, k))
     return max_distance_to_object_;
-  int i_shifted = i - cropped_min_cells_[0];
-  int j_shifted = j - cropped_min_cells_[1];
-  int k_shifted = k - cropped_min_cells_[2];
+  int i_shifted = i - lut_min_cells_[0];
+  int j_shifted = j - lut_min_cells_[1];
+  int k_shifted = k - lut_min_cells_[2];
   uint32_t pose_index = makePoseIndex(i_shifted, j_shifted);
-  uint32_t distances_lut_start_index = pose_indices_[pose_index];
-  uint8_t distance_ratio = distance_ratios_[distances_lut_start_index + k_shifted];
+  uint32_t distances_lut_start_index = pose_indices_data_[pose_index];
+  uint8_t distance_ratio = distance_ratios_data_[distances_lut_start_index + k_shifted];
   double distance = distance_ratio * max_distance_ratio_;
   return distance;
 }
 
+uint32_t OctoMap::getDistanceStep(int i, int j, int k)
+{
+  if (distances_lut_created_ and !isVoxelInDistancesLUT(i, j, k))
+    return std::numeric_limits<uint8_t>::max();
+  uint32_t pose_index = makePoseIndex(i - lut_min_cells_[0], j - lut_min_cells_[1]);
+  return distance_ratios_data_[pose_indices_data_[pose_index] + k - lut_min_cells_[2]];
+}
+
+uint32_t OctoMap::getDistanceStepCount()
+{
+  return std::numeric_limits<uint8_t>::max();
+}
+
 uint32_t OctoMap::makePoseIndex(int i, int j)
 {
+  if (pose_indices_layout_ == DISTANCES_LUT_TILED)
+    return computeTiledIndex(i, j, pose_tiles_x_);
   return j * map_cells_width_ + i;
 }
 
+// Store the columns in the order of their poses, so with a tiled layout the
+// columns of nearby poses are near each other too
+void OctoMap::sortColumnsByPose()
+{
+  std::vector<uint8_t> sorted_ratios;
+  sorted_ratios.reserve(distance_ratios_.size());
+  // The shared column of max distances stays first
+  sorted_ratios.insert(sorted_ratios.end(), distance_ratios_.begin(), distance_ratios_.begin() + num_z_column_indices_);
+  for (uint32_t& start_index : pose_indices_)
+  {
+    if (start_index == 0)
+      continue;
+    uint32_t sorted_index = sorted_ratios.size();
+    sorted_ratios.insert(sorted_ratios.end(), distance_ratios_.begin() + start_index,
+                         distance_ratios_.begin() + start_index + num_z_column_indices_);
+    start_index = sorted_index;
+  }
+  distance_ratios_.swap(sorted_ratios);
+  distance_ratios_data_ = distance_ratios_.data();
+}
+
 void OctoMap::publishDistancesLUT()
 {
   using PointCloud = pcl::PointCloud<pcl::PointXYZI>;
@@ -21,7 +21,9 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
 #include <cstdlib>
+#include <ctime>
 #include <functional>
 
 #include <angles/angles.h>
@@ -53,6 +55,7 @@ Node::Node()
     first_reconfigure_call_(true),
     publish_transform_spinner_(1, &publish_transform_queue_),
     global_localization_active_(false),
+    free_space_min_row_(0),
     dsrv_(ros::NodeHandle("~")),
     tf_listener_(tf_buffer_)
 {
@@ -60,6 +63,16 @@ Node::Node()
 
   private_nh_.param("map_type", map_type_, 0);
 
+  // All of the filter's random numbers derive from this seed.  A negative
+  // seed is taken from the clock, and logged so the run can be replayed.
+  int random_seed;
+  private_nh_.param("random_seed", random_seed, -1);
+  if (random_seed < 0)
+    random_seed = std::time(nullptr) & 0x7fffffff;
+  ROS_INFO("Using random seed %d", random_seed);
+  RandomService::seed(random_seed);
+  random_stream_ = RandomService::createStream(RANDOM_STREAM_NODE, 0);
+
   double param_val;
   private_nh_.param("transform_publish_rate", param_val, 50.0);
   transform_publish_period_ = ros::Duration(1.0 / param_val);
@@ -70,6 +83,35 @@ Node::Node()
   private_nh_.param("max_particles", max_particles_, 5000);
   private_nh_.param("kld_err", pf_err_, 0.01);
   private_nh_.param("kld_z", pf_z_, 0.99);
+  int num_threads;
+  private_nh_.param("num_threads", num_threads, 1);
+  thread_pool_ = std::make_shared<ThreadPool>(num_threads);
+  ROS_INFO("Updating particles on %d threads", thread_pool_->getNumThreads());
+  odom_.setThreadPool(thread_pool_);
+  std::string builder_str;
+  private_nh_.param("distances_lut_builder", builder_str, std::string("brushfire"));
+  if (builder_str == "brushfire")
+    distances_lut_builder_ = DISTANCES_LUT_BRUSHFIRE;
+  else if (builder_str == "edt")
+    distances_lut_builder_ = DISTANCES_LUT_EDT;
+  else
+  {
+    ROS_WARN_STREAM("Unknown distances lut builder \"" << builder_str << "\"; defaulting to brushfire");
+    distances_lut_builder_ = DISTANCES_LUT_BRUSHFIRE;
+  }
+  private_nh_.param("distances_lut_cache_dir", distances_lut_cache_dir_, std::string(""));
+  private_nh_.param("share_distances_lut", share_distances_lut_, false);
+  std::string layout_str;
+  private_nh_.param("distances_lut_layout", layout_str, std::string("row_major"));
+  if (layout_str == "row_major")
+    distances_lut_layout_ = DISTANCES_LUT_ROW_MAJOR;
+  else if (layout_str == "tiled")
+    distances_lut_layout_ = DISTANCES_LUT_TILED;
+  else
+  {
+    ROS_WARN_STREAM("Unknown distances lut layout \"" << layout_str << "\"; defaulting to row_major");
+    distances_lut_layout_ = DISTANCES_LUT_ROW_MAJOR;
+  }
   private_nh_.param("odom_integrator_enabled", odom_integrator_enabled_, true);
   private_nh_.param("odom_alpha1", alpha1_, 0.2);
   private_nh_.param("odom_alpha2", alpha2_, 0.2);
@@ -323,6 +365,31 @@ std::shared_ptr<ParticleFilter> Node::getPfPtr()
   return pf_;
 }
 
+std::shared_ptr<ThreadPool> Node::getThreadPool()
+{
+  return thread_pool_;
+}
+
+DistancesLUTBuilderType Node::getDistancesLUTBuilder()
+{
+  return distances_lut_builder_;
+}
+
+std::string Node::getDistancesLUTCacheDir()
+{
+  return distances_lut_cache_dir_;
+}
+
+bool Node::getShareDistancesLUT()
+{
+  return share_distances_lut_;
+}
+
+DistancesLUTLayout Node::getDistancesLUTLayout()
+{
+  return distances_lut_layout_;
+}
+
 void Node::publishParticleCloud()
 {
   std::shared_ptr<PFSampleSet> set = pf_->getCurrentSet();
@@ -334,9 +401,9 @@ void Node::publishParticleCloud()
   tf2::Quaternion q;
   for (int i = 0; i < set->sample_count; i++)
   {
-    q.setRPY(0.0, 0.0, set->samples[i].pose[2]);
-    tf2::toMsg(tf2::Transform(q, tf2::Vector3(set->samples[i].pose[0], set->samples[i].pose[1], 0)),
-               cloud_msg.poses[i]);
+    Eigen::Vector3d pose = set->samples.getPose(i);
+    q.setRPY(0.0, 0.0, pose[2]);
+    tf2::toMsg(tf2::Transform(q, tf2::Vector3(pose[0], pose[1], 0)), cloud_msg.poses[i]);
   }
   particlecloud_pub_.publish(cloud_msg);
   if (global_alt_frame_id_.size() > 0)
@@ -669,7 +736,67 @@ void Node::initFromNewMap(std::shared_ptr<Map> new_map, bool use_initial_pose)
 
 void Node::updateFreeSpaceIndices(std::vector<std::pair<int, int>> fsi)
 {
-  free_space_indices_ = fsi;
+  free_space_rows_.clear();
+  if (not fsi.empty())
+  {
+    auto rows = std::minmax_element(fsi.begin(), fsi.end(),
+                                    [](const std::pair<int, int>& a, const std::pair<int, int>& b)
+                                    {
+                                      return a.second < b.second;
+                                    });
+    free_space_min_row_ = rows.first->second;
+    free_space_rows_.resize(rows.second->second - free_space_min_row_ + 1);
+    for (const std::pair<int, int>& index : fsi)
+    {
+      free_space_rows_[index.second - free_space_min_row_].push_back(index);
+    }
+  }
+  countFreeSpaceIndices();
+}
+
+void Node::updateFreeSpaceIndices(const std::vector<std::pair<int, int>>& fsi, const std::vector<int>& min,
+                                  const std::vector<int>& max)
+{
+  int min_row = std::max(min[1] - free_space_min_row_, 0);
+  int max_row = std::min(max[1] - free_space_min_row_, int(free_space_rows_.size()));
+  for (int row = min_row; row < max_row; row++)
+  {
+    std::vector<std::pair<int, int>>& indices = free_space_rows_[row];
+    indices.erase(std::remove_if(indices.begin(), indices.end(),
+                                 [&](const std::pair<int, int>& index)
+                                 {
+                                   return index.first >= min[0] and index.first < max[0];
+                                 }),
+                  indices.end());
+  }
+  for (const std::pair<int, int>& index : fsi)
+  {
+    // Rows that had no free space before may have none indexed yet
+    if (free_space_rows_.empty())
+      free_space_min_row_ = index.second;
+    if (index.second < free_space_min_row_)
+    {
+      free_space_rows_.insert(free_space_rows_.begin(), free_space_min_row_ - index.second,
+                              std::vector<std::pair<int, int>>());
+      free_space_min_row_ = index.second;
+    }
+    size_t row = index.second - free_space_min_row_;
+    if (row >= free_space_rows_.size())
+      free_space_rows_.resize(row + 1);
+    free_space_rows_[row].push_back(index);
+  }
+  countFreeSpaceIndices();
+}
+
+void Node::countFreeSpaceIndices()
+{
+  free_space_row_ends_.resize(free_space_rows_.size());
+  size_t count = 0;
+  for (size_t row = 0; row < free_space_rows_.size(); row++)
+  {
+    count += free_space_rows_[row].size();
+    free_space_row_ends_[row] = count;
+  }
 }
 
 void Node::initOdomIntegrator()
@@ -782,18 +909,23 @@ bool Node::getOdomPose(const ros::Time& t, Eigen::Vector3d* map_pose)
 Eigen::Vector3d Node::randomFreeSpacePose()
 {
   Eigen::Vector3d p;
-  if (free_space_indices_.size() == 0)
+  if (free_space_row_ends_.empty() or free_space_row_ends_.back() == 0)
   {
     ROS_WARN("Free space indices have not been initialized");
     return p;
   }
-  unsigned int rand_index = drand48() * free_space_indices_.size();
-  std::pair<int, int> free_point = free_space_indices_.at(rand_index);
+  size_t rand_index = std::min<size_t>(random_stream_.uniform() * free_space_row_ends_.back(),
+                                       free_space_row_ends_.back() - 1);
+  // The first row ending past the index holds it
+  size_t row = std::upper_bound(free_space_row_ends_.begin(), free_space_row_ends_.end(), rand_index)
+               - free_space_row_ends_.begin();
+  size_t row_start = row > 0 ? free_space_row_ends_[row - 1] : 0;
+  std::pair<int, int> free_point = free_space_rows_[row].at(rand_index - row_start);
   std::vector<double> p_vec(2);
   map_->convertMapToWorld({ free_point.first, free_point.second }, &p_vec);
   p[0] = p_vec[0];
   p[1] = p_vec[1];
-  p[2] = drand48() * 2 * M_PI - M_PI;
+  p[2] = random_stream_.uniform() * 2 * M_PI - M_PI;
   return p;
 }
 
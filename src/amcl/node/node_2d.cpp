@@ -19,6 +19,7 @@
 
 #include "node/node_2d.h"
 
+#include <cmath>
 #include <functional>
 
 #include <angles/angles.h>
@@ -36,17 +37,31 @@
 namespace badger_amcl
 {
 
+// Cell state for a nav_msgs/OccupancyGrid value
+static MapCellState convertCellState(int8_t value)
+{
+  if (value == 0)
+    return MapCellState::CELL_FREE;
+  else if (value == 100)
+    return MapCellState::CELL_OCCUPIED;
+  else
+    return MapCellState::CELL_UNKNOWN;
+}
+
 Node2D::Node2D(Node* node, std::mutex& configuration_mutex)
     : node_(node),
       configuration_mutex_(configuration_mutex),
       private_nh_("~"),
       resample_count_(0),
-      tf_listener_(tf_buffer_)
+      tf_listener_(tf_buffer_),
+      map_spinner_(1, &map_queue_)
 {
   map_ = nullptr;
   latest_scan_data_ = NULL;
   fake_sample_set_ = std::make_shared<PFSampleSet>();
+  scanner_.setThreadPool(node_->getThreadPool());
   private_nh_.param("first_map_only", first_map_only_, false);
+  private_nh_.param("keep_pose_on_new_map", keep_pose_on_new_map_, true);
   private_nh_.param("laser_min_range", sensor_min_range_, -1.0);
   private_nh_.param("laser_max_range", sensor_max_range_, -1.0);
   private_nh_.param("laser_max_beams", max_beams_, 30);
@@ -57,6 +72,12 @@ Node2D::Node2D(Node* node, std::mutex& configuration_mutex)
   private_nh_.param("laser_sigma_hit", sigma_hit_, 0.2);
   private_nh_.param("laser_lambda_short", lambda_short_, 0.1);
   private_nh_.param("laser_likelihood_max_dist", sensor_likelihood_max_dist_, 2.0);
+  bool use_likelihood_lut;
+  private_nh_.param("laser_likelihood_lut", use_likelihood_lut, false);
+  scanner_.setUseLikelihoodLUT(use_likelihood_lut);
+  private_nh_.param("laser_range_lut_bearings", range_lut_bearing_count_, 0);
+  private_nh_.param("laser_range_lut_max_range", range_lut_max_range_, 30.0);
+  scanner_.setRangeLUT(range_lut_bearing_count_, range_lut_max_range_);
   private_nh_.param("laser_gompertz_a", gompertz_a_, 1.0);
   private_nh_.param("laser_gompertz_b", gompertz_b_, 1.0);
   private_nh_.param("laser_gompertz_c", gompertz_c_, 1.0);
@@ -96,6 +117,19 @@ Node2D::Node2D(Node* node, std::mutex& configuration_mutex)
     map_scale_up_factor_ = 1;
   if (map_scale_up_factor_ > 16)
     map_scale_up_factor_ = 16;
+  std::string precision_str;
+  private_nh_.param("distances_lut_precision", precision_str, std::string("float"));
+  if (precision_str == "float")
+    distances_lut_precision_ = DISTANCES_LUT_FLOAT;
+  else if (precision_str == "uint16")
+    distances_lut_precision_ = DISTANCES_LUT_UINT16;
+  else if (precision_str == "uint8")
+    distances_lut_precision_ = DISTANCES_LUT_UINT8;
+  else
+  {
+    ROS_WARN_STREAM("Unknown distances lut precision \"" << precision_str << "\"; defaulting to float");
+    distances_lut_precision_ = DISTANCES_LUT_FLOAT;
+  }
 
   scan_topic_ = "scan";
   scan_sub_ = std::unique_ptr<message_filters::Subscriber<sensor_msgs::LaserScan>>(
@@ -111,11 +145,20 @@ Node2D::Node2D(Node* node, std::mutex& configuration_mutex)
 
   force_update_ = false;
   first_map_received_ = false;
-  map_sub_ = nh_.subscribe("map", 1, &Node2D::mapMsgReceived, this);
+  // Builds on the map thread get a pool of their own, so they do not hold up
+  // the scans using the node's pool
+  map_thread_pool_ = std::make_shared<ThreadPool>(node_->getThreadPool()->getNumThreads());
+  map_nh_.setCallbackQueue(&map_queue_);
+  map_sub_ = map_nh_.subscribe("map", 1, &Node2D::mapMsgReceived, this);
+  // Each patch changes the map for good, so keep a backlog of them rather than dropping any
+  map_updates_sub_ = map_nh_.subscribe("map_updates", 100, &Node2D::mapUpdateReceived, this);
+  map_spinner_.start();
 }
 
 Node2D::~Node2D()
 {
+  // Let any map being built finish before the members it uses go away
+  map_spinner_.stop();
   // TF message filters must be destroyed before the underlying subsriber.
   scan_filter_.reset();
 }
@@ -207,20 +250,79 @@ void Node2D::mapMsgReceived(const nav_msgs::OccupancyGridConstPtr& msg)
     return;
   }
 
-  std::lock_guard<std::mutex> cfl(configuration_mutex_);
   ROS_INFO("Received a %d X %d occupancy map @ %.3f m/pix\n", msg->info.width, msg->info.height, msg->info.resolution);
-  map_ = convertMap(*msg);
+  // Build the new map's distances while the scans are still matched against
+  // the old map, then swap it in between scans
+  std::shared_ptr<OccupancyMap> new_map = convertMap(*msg);
+  double max_distance;
+  PlanarModelType model_type;
+  {
+    std::lock_guard<std::mutex> cfl(configuration_mutex_);
+    max_distance = sensor_likelihood_max_dist_;
+    model_type = model_type_;
+  }
+  if (model_type == PLANAR_MODEL_BEAM)
+  {
+    new_map->updateClearanceLUT();
+    new_map->updateRangeLUT(range_lut_max_range_, range_lut_bearing_count_);
+  }
+  else
+  {
+    new_map->updateDistancesLUT(max_distance);
+  }
+
+  std::lock_guard<std::mutex> cfl(configuration_mutex_);
+  bool keep_pose = keepPoseOnNewMap(first_map_received_, keep_pose_on_new_map_, map_frame_id_, msg->header.frame_id);
+  if (first_map_received_ and not keep_pose)
+    ROS_INFO("Reinitializing the particle filter for the new map");
+  map_ = new_map;
+  map_frame_id_ = msg->header.frame_id;
   // Clear queued planar scanner objects because they hold pointers to the existing map
   scanners_.clear();
   scanners_update_.clear();
   frame_to_scanner_.clear();
   latest_scan_data_ = NULL;
-  initFromNewMap();
+  initFromNewMap(not keep_pose);
   updateFreeSpaceIndices();
   first_map_received_ = true;
 }
 
-void Node2D::initFromNewMap()
+void Node2D::mapUpdateReceived(const map_msgs::OccupancyGridUpdateConstPtr& msg)
+{
+  std::lock_guard<std::mutex> cfl(configuration_mutex_);
+  if (map_ == nullptr)
+  {
+    ROS_WARN("Ignoring an occupancy map update received before the map");
+    return;
+  }
+  std::vector<int> size_vec = map_->getSize();
+  int min_i = msg->x * map_scale_up_factor_;
+  int min_j = msg->y * map_scale_up_factor_;
+  int width = msg->width * map_scale_up_factor_;
+  int height = msg->height * map_scale_up_factor_;
+  if (msg->data.size() != size_t(msg->width) * msg->height or min_i + width > size_vec[0]
+      or min_j + height > size_vec[1])
+  {
+    ROS_WARN("Ignoring a %d X %d occupancy map update at %d, %d that does not fit the map", msg->width,
+             msg->height, msg->x, msg->y);
+    return;
+  }
+  ROS_DEBUG("Received a %d X %d occupancy map update at %d, %d", msg->width, msg->height, msg->x, msg->y);
+  std::vector<MapCellState> states(size_t(width) * height);
+  for (int y = 0; y < height; y++)
+  {
+    const int msg_row = (y / map_scale_up_factor_) * msg->width;
+    for (int x = 0; x < width; x++)
+    {
+      states[x + y * width] = convertCellState(msg->data[msg_row + x / map_scale_up_factor_]);
+    }
+  }
+  std::vector<int> updated_min, updated_max;
+  map_->applyPatch(min_i, min_j, width, height, states, &updated_min, &updated_max);
+  node_->updateFreeSpaceIndices(findFreeSpaceIndices(updated_min, updated_max), updated_min, updated_max);
+}
+
+void Node2D::initFromNewMap(bool use_initial_pose)
 {
   scanner_.init(max_beams_, map_);
   if (model_type_ == PLANAR_MODEL_BEAM)
@@ -254,7 +356,7 @@ void Node2D::initFromNewMap()
     ROS_INFO("Done initializing likelihood field model.");
   }
   scanner_.setMapFactors(off_map_factor_, non_free_space_factor_, non_free_space_radius_);
-  node_->initFromNewMap(map_, not first_map_received_);
+  node_->initFromNewMap(map_, use_initial_pose);
   pf_ = node_->getPfPtr();
 }
 
@@ -271,6 +373,12 @@ std::shared_ptr<OccupancyMap> Node2D::convertMap(const nav_msgs::OccupancyGrid&
   size_vec.push_back(map_msg.info.width * map_scale_up_factor_);
   size_vec.push_back(map_msg.info.height * map_scale_up_factor_);
   occupancy_map->setSize(size_vec);
+  occupancy_map->setDistancesLUTBuilder(node_->getDistancesLUTBuilder());
+  occupancy_map->setThreadPool(map_thread_pool_);
+  occupancy_map->setDistancesLUTCacheDir(node_->getDistancesLUTCacheDir());
+  occupancy_map->setShareDistancesLUT(node_->getShareDistancesLUT());
+  occupancy_map->setDistancesLUTPrecision(distances_lut_precision_);
+  occupancy_map->setDistancesLUTLayout(node_->getDistancesLUTLayout());
   double x_origin, y_origin;
   x_origin = map_msg.info.origin.position.x + (size_vec[0] / 2) * resolution;
   y_origin = map_msg.info.origin.position.y + (size_vec[1] / 2) * resolution;
@@ -282,13 +390,7 @@ std::shared_ptr<OccupancyMap> Node2D::convertMap(const nav_msgs::OccupancyGrid&
     for (int x = 0; x < size_vec[0]; x++, i++)
     {
       const int msg_i = msg_row + x / map_scale_up_factor_;
-
-      if (map_msg.data[msg_i] == 0)
-        occupancy_map->setCellState(i, MapCellState::CELL_FREE);
-      else if (map_msg.data[msg_i] == 100)
-        occupancy_map->setCellState(i, MapCellState::CELL_OCCUPIED);
-      else
-        occupancy_map->setCellState(i, MapCellState::CELL_UNKNOWN);
+      occupancy_map->setCellState(i, convertCellState(map_msg.data[msg_i]));
     }
   }
   return occupancy_map;
@@ -302,15 +404,13 @@ double Node2D::scorePose(const Eigen::Vector3d& p)
   if (latest_scan_data_ != NULL)
   {
     // Create a fake "sample set" of just this pose to score it.
-    fake_sample_.pose[0] = p[0];
-    fake_sample_.pose[1] = p[1];
-    fake_sample_.pose[2] = p[2];
-    fake_sample_.weight = 1.0;
     fake_sample_set_->sample_count = 1;
-    fake_sample_set_->samples = { fake_sample_ };
+    fake_sample_set_->samples.resize(1);
+    fake_sample_set_->samples.setPose(0, p);
+    fake_sample_set_->samples.setLogWeight(0, 0.0);
     fake_sample_set_->converged = 0;
     scanner_.applyModelToSampleSet(latest_scan_data_, fake_sample_set_);
-    score = fake_sample_.weight;
+    score = std::exp(fake_sample_set_->samples.getLogWeight(0));
   }
   return score;
 }
@@ -319,27 +419,37 @@ void Node2D::updateFreeSpaceIndices()
 {
   // Index of free space
   // Must be calculated after the distances lut is set by the planar model
+  node_->updateFreeSpaceIndices(findFreeSpaceIndices({ 0, 0 }, map_->getSize()));
+}
+
+// Free cells from min (inclusive) to max (exclusive) far enough from obstacles
+std::vector<std::pair<int, int>> Node2D::findFreeSpaceIndices(const std::vector<int>& min,
+                                                              const std::vector<int>& max)
+{
   std::vector<std::pair<int, int>> fsi;
-  std::vector<int> size_vec = map_->getSize();
-  for (int i = 0; i < size_vec[0]; i++)
+  bool has_distances = map_->isDistancesLUTCreated();
+  for (int i = min[0]; i < max[0]; i++)
   {
-    for (int j = 0; j < size_vec[1]; j++)
+    for (int j = min[1]; j < max[1]; j++)
     {
       if (map_->getCellState(i, j) == MapCellState::CELL_FREE)
       {
-        if (map_->getDistanceToObject(i, j) > non_free_space_radius_)
+        // The beam model builds no distances, so every free cell counts
+        if (not has_distances or map_->getDistanceToObject(i, j) > non_free_space_radius_)
         {
           fsi.push_back(std::make_pair(i, j));
         }
       }
     }
   }
-  node_->updateFreeSpaceIndices(fsi);
+  return fsi;
 }
 
 void Node2D::scanReceived(const sensor_msgs::LaserScanConstPtr& planar_scan)
 {
   latest_scan_received_ts_ = ros::Time::now();
+  // Hold the configuration for the whole scan, so map updates and new maps only land between scans
+  std::lock_guard<std::mutex> cfl(configuration_mutex_);
   if(!isMapInitialized())
     return;
 
@@ -375,7 +485,7 @@ bool Node2D::updateScanner(const sensor_msgs::LaserScanConstPtr& planar_scan,
   if(getAngleStats(planar_scan, &angle_min, &angle_increment))
   {
     ROS_DEBUG("Planar scanner %d angles in base frame: min: %.3f inc: %.3f", scanner_index, angle_min, angle_increment);
-    updateLatestScanData(planar_scan, angle_min, angle_increment);
+    updateLatestScanData(planar_scan, scanner_index, angle_min, angle_increment);
     scanners_[scanner_index]->updateSensor(pf_, std::dynamic_pointer_cast<SensorData>(latest_scan_data_));
     scanners_update_.at(scanner_index) = false;
     if(!(++resample_count_ % resample_interval_))
@@ -413,9 +523,9 @@ bool Node2D::isMapInitialized()
   return true;
 }
 
+// Called with the configuration mutex held
 void Node2D::deactivateGlobalLocalizationParams()
 {
-  std::lock_guard<std::mutex> cfl(configuration_mutex_);
   // Handle corner cases like getting dynamically reconfigured or getting a
   // new map by de-activating the global localization parameters here if we are
   // no longer globally localizing.
@@ -533,7 +643,7 @@ bool Node2D::getAngleStats(const sensor_msgs::LaserScanConstPtr& planar_scan, do
   return success;
 }
 
-void Node2D::updateLatestScanData(const sensor_msgs::LaserScanConstPtr& planar_scan,
+void Node2D::updateLatestScanData(const sensor_msgs::LaserScanConstPtr& planar_scan, int scanner_index,
                                   double angle_min, double angle_increment)
 {
   // Apply range min/max thresholds, if the user supplied them
@@ -547,7 +657,6 @@ void Node2D::updateLatestScanData(const sensor_msgs::LaserScanConstPtr& planar_s
   else
     range_min = planar_scan->range_min;
   latest_scan_data_->ranges_.resize(latest_scan_data_->range_count_);
-  latest_scan_data_->angles_.resize(latest_scan_data_->range_count_);
   for (int i = 0; i < latest_scan_data_->range_count_; i++)
   {
     // amcl doesn't (yet) have a concept of min range.  So we'll map short
@@ -556,9 +665,10 @@ void Node2D::updateLatestScanData(const sensor_msgs::LaserScanConstPtr& planar_s
       latest_scan_data_->ranges_[i] = latest_scan_data_->range_max_;
     else
       latest_scan_data_->ranges_[i] = planar_scan->ranges[i];
-    // Compute bearing
-    latest_scan_data_->angles_[i] = angle_min + (i * angle_increment);
   }
+  // The bearings only change with the scanner's mounting, so they are shared between scans
+  latest_scan_data_->bearings_ = scanners_[scanner_index]->getBearings(angle_min, angle_increment,
+                                                                       latest_scan_data_->range_count_);
 }
 
 void Node2D::resampleParticles()
@@ -20,15 +20,11 @@
 
 #include "node/node_3d.h"
 
+#include <cmath>
 #include <functional>
 
 #include <geometry_msgs/PoseArray.h>
 #include <geometry_msgs/Pose2D.h>
-#include <pcl/conversions.h>
-#include <pcl/PCLPointCloud2.h>
-#include <pcl/impl/point_types.hpp>
-#include <pcl_conversions/pcl_conversions.h>
-#include <pcl/common/projection_matrix.h>
 #include <octomap/AbstractOcTree.h>
 #include <octomap/OcTree.h>
 #include <octomap_msgs/conversions.h>
@@ -49,13 +45,15 @@ Node3D::Node3D(Node* node, std::mutex& configuration_mutex)
       configuration_mutex_(configuration_mutex),
       private_nh_("~"),
       resample_count_(0),
-      tf_listener_(tf_buffer_)
+      tf_listener_(tf_buffer_),
+      map_spinner_(1, &map_queue_)
 {
   map_ = nullptr;
   octree_ = nullptr;
   latest_scan_data_ = NULL;
   fake_sample_set_ = std::make_shared<PFSampleSet>();
   private_nh_.param("first_map_only", first_map_only_, false);
+  private_nh_.param("keep_pose_on_new_map", keep_pose_on_new_map_, true);
   private_nh_.param("wait_for_occupancy_map", wait_for_occupancy_map_, false);
   private_nh_.param("laser_max_beams", max_beams_, 256);
   private_nh_.param("laser_z_hit", z_hit_, 0.95);
@@ -65,6 +63,39 @@ Node3D::Node3D(Node* node, std::mutex& configuration_mutex)
   private_nh_.param("laser_non_free_space_factor", non_free_space_factor_, 1.0);
   private_nh_.param("laser_non_free_space_radius", non_free_space_radius_, 0.0);
   private_nh_.param("laser_likelihood_max_dist", max_distance_to_object_, 0.36);
+  bool use_likelihood_lut;
+  private_nh_.param("laser_likelihood_lut", use_likelihood_lut, false);
+  scanner_.setUseLikelihoodLUT(use_likelihood_lut);
+  double yaw_bin_width;
+  private_nh_.param("laser_yaw_bin_width", yaw_bin_width, 0.0);
+  scanner_.setYawBinWidth(yaw_bin_width);
+  double voxel_size, min_height, max_height;
+  private_nh_.param("laser_voxel_size", voxel_size, 0.0);
+  private_nh_.param("laser_min_height", min_height, 0.0);
+  private_nh_.param("laser_max_height", max_height, 0.0);
+  preprocessor_.setVoxelSize(voxel_size);
+  preprocessor_.setHeightBand(min_height, max_height);
+  preprocessor_.setMaxPoints(max_beams_);
+  std::string subsample_type_str;
+  private_nh_.param("laser_subsample_type", subsample_type_str, std::string("stride"));
+  if (subsample_type_str == "stride")
+  {
+    preprocessor_.setSubsampleType(POINT_CLOUD_SUBSAMPLE_STRIDE);
+  }
+  else if (subsample_type_str == "random")
+  {
+    preprocessor_.setSubsampleType(POINT_CLOUD_SUBSAMPLE_RANDOM);
+  }
+  else if (subsample_type_str == "farthest_point")
+  {
+    preprocessor_.setSubsampleType(POINT_CLOUD_SUBSAMPLE_FARTHEST);
+  }
+  else
+  {
+    ROS_WARN_STREAM("Unknown point cloud subsample type \"" << subsample_type_str
+                    << "\"; defaulting to stride");
+    preprocessor_.setSubsampleType(POINT_CLOUD_SUBSAMPLE_STRIDE);
+  }
   private_nh_.param("resample_interval", resample_interval_, 2);
   private_nh_.param("laser_gompertz_a", gompertz_a_, 1.0);
   private_nh_.param("laser_gompertz_b", gompertz_b_, 1.0);
@@ -107,12 +138,19 @@ Node3D::Node3D(Node* node, std::mutex& configuration_mutex)
   first_occupancy_map_received_ = false;
   first_octomap_received_ = false;
   occupancy_bounds_received_ = false;
-  octo_map_sub_ = nh_.subscribe("octomap", 1, &Node3D::octoMapMsgReceived, this);
-  occupancy_map_sub_ = nh_.subscribe("map", 1, &Node3D::occupancyMapMsgReceived, this);
+  // Builds on the map thread get a pool of their own, so they do not hold up
+  // the scans using the node's pool
+  map_thread_pool_ = std::make_shared<ThreadPool>(node_->getThreadPool()->getNumThreads());
+  map_nh_.setCallbackQueue(&map_queue_);
+  octo_map_sub_ = map_nh_.subscribe("octomap", 1, &Node3D::octoMapMsgReceived, this);
+  occupancy_map_sub_ = map_nh_.subscribe("map", 1, &Node3D::occupancyMapMsgReceived, this);
+  map_spinner_.start();
 }
 
 Node3D::~Node3D()
 {
+  // Let any map being built finish before the members it uses go away
+  map_spinner_.stop();
   // TF message filters must be destroyed before the underlying subsriber.
   cloud_filter_.reset();
 }
@@ -121,6 +159,10 @@ void Node3D::reconfigure(AMCLConfig& config)
 {
   resample_interval_ = config.resample_interval;
   max_beams_ = config.laser_max_beams;
+  {
+    std::lock_guard<std::mutex> pl(preprocess_mutex_);
+    preprocessor_.setMaxPoints(max_beams_);
+  }
   z_hit_ = config.laser_z_hit;
   z_short_ = config.laser_z_short;
   z_max_ = config.laser_z_max;
@@ -177,22 +219,25 @@ void Node3D::reconfigure(AMCLConfig& config)
 
 void Node3D::occupancyMapMsgReceived(const nav_msgs::OccupancyGridConstPtr& msg)
 {
-  std::lock_guard<std::mutex> cfl(configuration_mutex_);
-  if(not wait_for_occupancy_map_ or (first_map_only_ && first_occupancy_map_received_))
-    return;
+  {
+    std::lock_guard<std::mutex> cfl(configuration_mutex_);
+    if(not wait_for_occupancy_map_ or (first_map_only_ && first_occupancy_map_received_))
+      return;
 
-  first_occupancy_map_received_ = true;
-  std::vector<int> size_vec;
-  double resolution = (*msg).info.resolution / occupancy_map_scale_up_factor_;
-  size_vec.push_back((*msg).info.width * occupancy_map_scale_up_factor_);
-  size_vec.push_back((*msg).info.height * occupancy_map_scale_up_factor_);
-  occupancy_map_min_ = {0.0, 0.0};
-  occupancy_map_max_ = {size_vec[0] * resolution, size_vec[1] * resolution};
-  occupancy_bounds_received_ = true;
-  if(first_octomap_received_)
-  {
-    map_->setMapBounds(occupancy_map_min_, occupancy_map_max_);
-    updateFreeSpaceIndices();
+    first_occupancy_map_received_ = true;
+    std::vector<int> size_vec;
+    double resolution = (*msg).info.resolution / occupancy_map_scale_up_factor_;
+    size_vec.push_back((*msg).info.width * occupancy_map_scale_up_factor_);
+    size_vec.push_back((*msg).info.height * occupancy_map_scale_up_factor_);
+    occupancy_map_min_ = {0.0, 0.0};
+    occupancy_map_max_ = {size_vec[0] * resolution, size_vec[1] * resolution};
+    occupancy_bounds_received_ = true;
+  }
+  // Rebuild the octomap within the new bounds, off the lock like a new octomap
+  if (octomap_msg_)
+  {
+    ROS_INFO("Rebuilding the Octomap within the new occupancy map bounds");
+    swapInMap(octomap_msg_, true);
   }
 }
 
@@ -204,20 +249,52 @@ void Node3D::octoMapMsgReceived(const octomap_msgs::OctomapConstPtr& msg)
     return;
   }
 
-  std::lock_guard<std::mutex> cfl(configuration_mutex_);
   ROS_INFO("Received a new Octomap");
-  map_ = convertMap(*msg);
+  // Kept to rebuild within the bounds of an occupancy map that comes later
+  if (wait_for_occupancy_map_)
+    octomap_msg_ = msg;
+  swapInMap(msg, false);
+}
+
+void Node3D::swapInMap(const octomap_msgs::OctomapConstPtr& msg, bool new_bounds)
+{
+  // Build the new map's distances while the scans are still matched against
+  // the old map, then swap it in between scans
+  std::shared_ptr<OctoMap> new_map = convertMap(*msg);
+  bool bounds_received;
+  std::vector<double> bounds_min, bounds_max;
+  {
+    std::lock_guard<std::mutex> cfl(configuration_mutex_);
+    bounds_received = occupancy_bounds_received_;
+    bounds_min = occupancy_map_min_;
+    bounds_max = occupancy_map_max_;
+  }
+  // If we are using both maps as bounds, wait for the occupancy map before building
+  if (wait_for_occupancy_map_ and bounds_received)
+    new_map->setMapBounds(bounds_min, bounds_max);
+  else if (!wait_for_occupancy_map_)
+    new_map->updateDistancesLUT();
+
+  std::lock_guard<std::mutex> cfl(configuration_mutex_);
+  // The same octomap in new bounds keeps the particles
+  bool keep_pose = (first_octomap_received_ and new_bounds)
+                   or keepPoseOnNewMap(first_octomap_received_, keep_pose_on_new_map_, map_frame_id_,
+                                       msg->header.frame_id);
+  if (first_octomap_received_ and not keep_pose)
+    ROS_INFO("Reinitializing the particle filter for the new map");
+  map_ = new_map;
+  map_frame_id_ = msg->header.frame_id;
 
   // Clear queued point cloud objects because they hold pointers to the existing map
   scanners_.clear();
   scanners_update_.clear();
   frame_to_scanner_.clear();
   latest_scan_data_ = NULL;
-  initFromNewMap();
+  initFromNewMap(not keep_pose);
   first_octomap_received_ = true;
 }
 
-void Node3D::initFromNewMap()
+void Node3D::initFromNewMap(bool use_initial_pose)
 {
   scanner_.init(max_beams_, map_);
   if (model_type_ == POINT_CLOUD_MODEL)
@@ -239,20 +316,11 @@ void Node3D::initFromNewMap()
     ROS_INFO("Done initializing likelihood (gompertz) field model.");
   }
   scanner_.setMapFactors(off_map_factor_, non_free_space_factor_, non_free_space_radius_);
-  node_->initFromNewMap(map_, not first_octomap_received_);
+  node_->initFromNewMap(map_, use_initial_pose);
   pf_ = node_->getPfPtr();
-  // if we are using both maps as bounds
-  // and the occupancy map has already arrived
-  if (wait_for_occupancy_map_ and occupancy_bounds_received_)
-  {
-    map_->setMapBounds(occupancy_map_min_, occupancy_map_max_);
+  // The distances are built with the map, unless it is waiting for the occupancy map bounds
+  if (map_->isDistancesLUTCreated())
     updateFreeSpaceIndices();
-  }
-  else if(!wait_for_occupancy_map_)
-  {
-    map_->updateDistancesLUT();
-    updateFreeSpaceIndices();
-  }
 }
 
 /**
@@ -278,6 +346,11 @@ std::shared_ptr<OctoMap> Node3D::convertMap(const octomap_msgs::Octomap& map_msg
   double resolution = map_msg.resolution;
   std::shared_ptr<OctoMap> octomap = std::make_shared<OctoMap>(resolution);
   ROS_ASSERT(octomap);
+  octomap->setDistancesLUTBuilder(node_->getDistancesLUTBuilder());
+  octomap->setThreadPool(map_thread_pool_);
+  octomap->setDistancesLUTCacheDir(node_->getDistancesLUTCacheDir());
+  octomap->setShareDistancesLUT(node_->getShareDistancesLUT());
+  octomap->setDistancesLUTLayout(node_->getDistancesLUTLayout());
   octomap->initFromOctree(octree_, max_distance_to_object_);
   octree_.reset();
   return octomap;
@@ -290,15 +363,13 @@ double Node3D::scorePose(const Eigen::Vector3d& p)
   if (latest_scan_data_ != NULL)
   {
     // Create a fake "sample set" of just this pose to score it.
-    fake_sample_.pose[0] = p[0];
-    fake_sample_.pose[1] = p[1];
-    fake_sample_.pose[2] = p[2];
-    fake_sample_.weight = 1.0;
     fake_sample_set_->sample_count = 1;
-    fake_sample_set_->samples = { fake_sample_ };
+    fake_sample_set_->samples.resize(1);
+    fake_sample_set_->samples.setPose(0, p);
+    fake_sample_set_->samples.setLogWeight(0, 0.0);
     fake_sample_set_->converged = 0;
     scanner_.applyModelToSampleSet(latest_scan_data_, fake_sample_set_);
-    score = fake_sample_.weight;
+    score = std::exp(fake_sample_set_->samples.getLogWeight(0));
   }
   return score;
 }
@@ -320,26 +391,56 @@ void Node3D::updateFreeSpaceIndices()
 void Node3D::scanReceived(const sensor_msgs::PointCloud2ConstPtr& point_cloud_scan)
 {
   latest_scan_received_ts_ = ros::Time::now();
-  if(!isMapInitialized())
+  geometry_msgs::Transform scanner_to_footprint_tf;
+  if (!getScannerToFootprintTransform(point_cloud_scan->header.frame_id, &scanner_to_footprint_tf))
     return;
 
-  if (!global_localization_active_)
-    deactivateGlobalLocalizationParams();
-
   ros::Time stamp = point_cloud_scan->header.stamp;
-  int scanner_index = getFrameToScannerIndex(point_cloud_scan->header.frame_id);
-  if(scanner_index >= 0)
+  int scanner_index;
+  bool force_publication = false, resampled = false, success;
+  std::shared_ptr<OctoMap> map;
   {
-    bool force_publication = false, resampled = false, success;
+    std::lock_guard<std::mutex> cfl(configuration_mutex_);
+    if(!isMapInitialized())
+      return;
+
+    if (!global_localization_active_)
+      deactivateGlobalLocalizationParams();
+
+    scanner_index = getFrameToScannerIndex(point_cloud_scan->header.frame_id, scanner_to_footprint_tf);
+    if(scanner_index < 0)
+      return;
     success = updateNodePf(stamp, scanner_index, &force_publication);
-    if(scanners_update_.at(scanner_index))
-      updateScanner(point_cloud_scan, scanner_index, &resampled);
-    if(force_publication or resampled)
-      success = success and resamplePose(stamp);
-    if(success)
+    if(not scanners_update_.at(scanner_index))
     {
-      node_->attemptSavePose(false);
+      // The filter has not moved enough to use the scan, so it is never reduced
+      if(force_publication)
+        success = success and resamplePose(stamp);
+      if(success)
+        node_->attemptSavePose(false);
+      return;
     }
+    map = map_;
+  }
+
+  // Reduce the scan without the configuration, so map swaps and pose
+  // scoring are not held up by it
+  std::shared_ptr<PointCloudData> scan_data = preprocessScan(point_cloud_scan, scanner_to_footprint_tf);
+  if (scan_data == nullptr)
+    return;
+
+  std::lock_guard<std::mutex> cfl(configuration_mutex_);
+  // A map swapped in meanwhile dropped the scanner this scan was for
+  if (map_ != map)
+    return;
+  // Another scan from the scanner may have used the update meanwhile
+  if(scanners_update_.at(scanner_index))
+    updateScanner(scan_data, scanner_index, &resampled);
+  if(force_publication or resampled)
+    success = success and resamplePose(stamp);
+  if(success)
+  {
+    node_->attemptSavePose(false);
   }
 }
 
@@ -349,13 +450,9 @@ bool Node3D::updateNodePf(const ros::Time& stamp, int scanner_index, bool* force
                          force_publication, &force_update_);
 }
 
-void Node3D::updateScanner(const sensor_msgs::PointCloud2ConstPtr& point_cloud_scan,
-                           int scanner_index, bool* resampled)
+void Node3D::updateScanner(std::shared_ptr<PointCloudData> scan_data, int scanner_index, bool* resampled)
 {
-  initLatestScanData(point_cloud_scan, scanner_index);
-  pcl::PointCloud<pcl::PointXYZ>::Ptr point_cloud(new pcl::PointCloud<pcl::PointXYZ>);
-  makePointCloudFromScan(point_cloud_scan, point_cloud);
-  updateLatestScanData(point_cloud, scanner_index);
+  latest_scan_data_ = scan_data;
   scanners_[scanner_index]->updateSensor(pf_, std::dynamic_pointer_cast<SensorData>(
                                                 latest_scan_data_));
   scanners_update_.at(scanner_index) = false;
@@ -388,9 +485,9 @@ bool Node3D::isMapInitialized()
   return true;
 }
 
+// Called with the configuration mutex held
 void Node3D::deactivateGlobalLocalizationParams()
 {
-  std::lock_guard<std::mutex> cfl(configuration_mutex_);
   // Handle corner cases like getting dynamically reconfigured or getting a
   // new map by de-activating the global localization parameters here.
   node_->setPfDecayRateNormal();
@@ -401,7 +498,8 @@ void Node3D::deactivateGlobalLocalizationParams()
   }
 }
 
-int Node3D::getFrameToScannerIndex(const std::string& scanner_frame_id)
+int Node3D::getFrameToScannerIndex(const std::string& scanner_frame_id,
+                                   const geometry_msgs::Transform& scanner_to_footprint_tf)
 {
   int scanner_index;
   // Do we have the base->base_lidar Tx yet?
@@ -410,16 +508,8 @@ int Node3D::getFrameToScannerIndex(const std::string& scanner_frame_id)
     scanner_index = initFrameToScanner();
     if(scanner_index >= 0)
     {
-      geometry_msgs::Transform scanner_to_footprint_tf;
-      if(getFootprintToFrameTransform(scanner_frame_id, &scanner_to_footprint_tf))
-      {
-        frame_to_scanner_[scanner_frame_id] = scanner_index;
-        scanners_[scanner_index]->setPointCloudScannerToFootprintTF(scanner_to_footprint_tf);
-      }
-      else
-      {
-        scanner_index = -1;
-      }
+      frame_to_scanner_[scanner_frame_id] = scanner_index;
+      scanners_[scanner_index]->setPointCloudScannerToFootprintTF(scanner_to_footprint_tf);
     }
   }
   else
@@ -454,33 +544,42 @@ int Node3D::initFrameToScanner()
   return scanner_index;
 }
 
-void Node3D::initLatestScanData(const sensor_msgs::PointCloud2ConstPtr& point_cloud_scan, int scanner_index)
-{
-  latest_scan_data_ = std::make_shared<PointCloudData>();
-  latest_scan_data_->frame_id_ = point_cloud_scan->header.frame_id;
-}
-
-void Node3D::makePointCloudFromScan(const sensor_msgs::PointCloud2ConstPtr& point_cloud_scan,
-                                    pcl::PointCloud<pcl::PointXYZ>::Ptr point_cloud)
+// Called without the configuration mutex held
+bool Node3D::getScannerToFootprintTransform(const std::string& frame_id, geometry_msgs::Transform* tf)
 {
-  pcl::PCLPointCloud2 pc2;
-  pcl_conversions::toPCL(*point_cloud_scan, pc2);
-  pcl::fromPCLPointCloud2(pc2, *point_cloud);
+  std::lock_guard<std::mutex> pl(preprocess_mutex_);
+  // The base->base_lidar Tx is looked up the first time a frame is seen
+  auto footprint_tf_it = scanner_to_footprint_tfs_.find(frame_id);
+  if (footprint_tf_it == scanner_to_footprint_tfs_.end())
+  {
+    geometry_msgs::Transform tf_msg;
+    if (!getFootprintToFrameTransform(frame_id, &tf_msg))
+      return false;
+    footprint_tf_it = scanner_to_footprint_tfs_.insert(std::make_pair(frame_id, tf_msg)).first;
+  }
+  *tf = footprint_tf_it->second;
+  return true;
 }
 
-void Node3D::updateLatestScanData(const pcl::PointCloud<pcl::PointXYZ>::Ptr point_cloud, int scanner_index)
+std::shared_ptr<PointCloudData> Node3D::preprocessScan(const sensor_msgs::PointCloud2ConstPtr& point_cloud_scan,
+                                                       const geometry_msgs::Transform& scanner_to_footprint_tf)
 {
-  int max_beams = scanners_[scanner_index]->getMaxBeams();
-  int data_count = point_cloud->size();
-  int step = (data_count - 1) / (max_beams - 1);
-  step = std::max(step, 1);
-  // Sample point cloud scan to max_beams number of points
-  for (int i = 0; i < data_count; i += step)
-  {
-    pcl::PointXYZ point = point_cloud->at(i);
-    latest_scan_data_->points_.push_back(point);
-  }
-  latest_scan_data_->points_.header = point_cloud->header;
+  std::lock_guard<std::mutex> pl(preprocess_mutex_);
+  const std::string& frame_id = point_cloud_scan->header.frame_id;
+  tf2::Transform scanner_to_footprint;
+  tf2::fromMsg(scanner_to_footprint_tf, scanner_to_footprint);
+
+  std::shared_ptr<PointCloudData> scan_data = std::make_shared<PointCloudData>();
+  scan_data->frame_id_ = frame_id;
+  if (!preprocessor_.process(*point_cloud_scan, scanner_to_footprint, scan_data.get()))
+  {
+    ROS_WARN_THROTTLE(5.0, "Point cloud from %s has no float x, y and z fields", frame_id.c_str());
+    return nullptr;
+  }
+  const PointCloudPreprocessorStats& stats = preprocessor_.getStats();
+  ROS_DEBUG("Preprocessed point cloud in %.3f ms: %d points, %d voxels, %d in height band, %d kept",
+            1e3 * stats.seconds, stats.input_count, stats.voxel_count, stats.band_count, stats.output_count);
+  return scan_data;
 }
 
 void Node3D::resampleParticles()
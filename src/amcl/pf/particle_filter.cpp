@@ -22,25 +22,38 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
 #include <cmath>
 #include <cstddef>
 #include <cstdlib>
+#include <limits>
+#include <utility>
 
 #include <ros/assert.h>
 
 #include "pf/pdf_gaussian.h"
+#include "pf/random.h"
 #include "sensors/sensor.h"
 
 namespace badger_amcl
 {
 
+void PFSampleArray::resize(int count)
+{
+  x_.resize(count);
+  y_.resize(count);
+  yaw_.resize(count);
+  weight_.resize(count);
+  log_weight_.resize(count);
+  bin_.resize(count);
+}
+
 // Create a new filter
 ParticleFilter::ParticleFilter(int min_samples, int max_samples, double alpha_slow,
                                double alpha_fast, std::function<Eigen::Vector3d()> random_pose_fn)
 {
   int i, j;
   std::shared_ptr<PFSampleSet> set;
-  PFSample* sample;
 
   resample_model_ = PF_RESAMPLE_MULTINOMIAL;
   random_pose_fn_ = random_pose_fn;
@@ -65,18 +78,15 @@ ParticleFilter::ParticleFilter(int min_samples, int max_samples, double alpha_sl
     set = sets_[j];
 
     set->sample_count = max_samples_;
-    set->samples = std::vector<PFSample>(max_samples);
+    set->samples.resize(max_samples);
 
     for (i = 0; i < set->sample_count; i++)
     {
-      sample = &(set->samples[i]);
-      sample->pose[0] = 0.0;
-      sample->pose[1] = 0.0;
-      sample->pose[2] = 0.0;
-      sample->weight = 1.0 / max_samples_;
+      set->samples.setPose(i, Eigen::Vector3d::Zero());
+      set->samples.setWeight(i, 1.0 / max_samples_);
     }
 
-    set->kdtree = std::make_shared<PFKDTree>();
+    set->histogram = std::make_shared<PFHashGrid>();
 
     set->cluster_count = 0;
     set->cluster_max_count = max_samples_;
@@ -86,12 +96,15 @@ ParticleFilter::ParticleFilter(int min_samples, int max_samples, double alpha_sl
     set->cov = Eigen::Matrix3d();
   }
 
-  w_slow_ = 0.0;
-  w_fast_ = 0.0;
+  log_w_slow_ = -std::numeric_limits<double>::infinity();
+  log_w_fast_ = -std::numeric_limits<double>::infinity();
 
   alpha_slow_ = alpha_slow;
   alpha_fast_ = alpha_fast;
 
+  init_count_ = 0;
+  resample_count_ = 0;
+
   initConverged();
 }
 
@@ -105,24 +118,23 @@ void ParticleFilter::initWithGaussian(const Eigen::Vector3d& mean, const Eigen::
 {
   int i;
   std::shared_ptr<PFSampleSet> set;
-  PFSample* sample;
   set = sets_[current_set_];
   // Create the kd tree for adaptive sampling
-  set->kdtree->clearKDTree();
+  set->histogram->clear();
   set->sample_count = max_samples_;
-  PDFGaussian pdf(mean, cov);
+  PDFGaussian pdf(mean, cov, RandomService::createStream(RANDOM_STREAM_INIT, init_count_++));
   // Compute the new sample poses
   for (i = 0; i < set->sample_count; i++)
   {
-    sample = &(set->samples[i]);
-    sample->weight = 1.0 / max_samples_;
-    sample->pose = pdf.sample();
+    Eigen::Vector3d pose = pdf.sample();
+    set->samples.setPose(i, pose);
+    set->samples.setWeight(i, 1.0 / max_samples_);
 
     // Add sample to histogram
-    set->kdtree->insertPose(sample->pose, sample->weight);
+    set->samples.setBin(i, set->histogram->insertPose(pose, set->samples.getWeight(i)));
   }
 
-  w_slow_ = w_fast_ = 0.0;
+  log_w_slow_ = log_w_fast_ = -std::numeric_limits<double>::infinity();
 
   // Re-compute cluster statistics
   computeClusterStatsForSet(set);
@@ -135,24 +147,23 @@ void ParticleFilter::initWithPoseFn(std::function<Eigen::Vector3d()> pose_fn)
 {
   int i;
   std::shared_ptr<PFSampleSet> set;
-  PFSample* sample;
 
   set = sets_[current_set_];
 
   // Create the kd tree for adaptive sampling
-  set->kdtree->clearKDTree();
+  set->histogram->clear();
   set->sample_count = max_samples_;
 
   // Compute the new sample poses
   for (i = 0; i < set->sample_count; i++)
   {
-    sample = &(set->samples[i]);
-    sample->weight = 1.0 / max_samples_;
-    sample->pose = pose_fn();
+    Eigen::Vector3d pose = pose_fn();
+    set->samples.setPose(i, pose);
+    set->samples.setWeight(i, 1.0 / max_samples_);
     // Add sample to histogram
-    set->kdtree->insertPose(sample->pose, sample->weight);
+    set->samples.setBin(i, set->histogram->insertPose(pose, set->samples.getWeight(i)));
   }
-  w_slow_ = w_fast_ = 0.0;
+  log_w_slow_ = log_w_fast_ = -std::numeric_limits<double>::infinity();
   // Re-compute cluster statistics
   computeClusterStatsForSet(set);
 
@@ -167,84 +178,87 @@ void ParticleFilter::initConverged()
 
 void ParticleFilter::updateConverged()
 {
-  int i;
-  std::shared_ptr<PFSampleSet> set;
-  PFSample* sample;
-  double total;
-
-  set = sets_[current_set_];
-  double mean_x = 0, mean_y = 0;
-
-  for (i = 0; i < set->sample_count; i++)
-  {
-    sample = &(set->samples[i]);
-
-    mean_x += sample->pose[0];
-    mean_y += sample->pose[1];
-  }
-  mean_x /= set->sample_count;
-  mean_y /= set->sample_count;
+  std::shared_ptr<PFSampleSet> set = sets_[current_set_];
 
-  set->converged = true;
-  converged_ = true;
-  for (i = 0; i < set->sample_count; i++)
-  {
-    sample = &(set->samples[i]);
-    if (std::fabs(sample->pose[0] - mean_x) > dist_threshold_
-        || std::fabs(sample->pose[1] - mean_y) > dist_threshold_)
-    {
-      set->converged = false;
-      converged_ = false;
-      break;
-    }
-  }
+  // Every sample lies within the threshold of the mean exactly when the
+  // bounding box does, and computeClusterStatsForSet already found both.
+  Eigen::Vector2d above = set->position_max - set->position_mean;
+  Eigen::Vector2d below = set->position_mean - set->position_min;
+  set->converged = above.maxCoeff() <= dist_threshold_ && below.maxCoeff() <= dist_threshold_;
+  converged_ = set->converged;
 }
 
 // Update the filter with some new sensor observation
-void ParticleFilter::updateSensor(std::function<double(std::shared_ptr<SensorData>, std::shared_ptr<PFSampleSet>)
+void ParticleFilter::updateSensor(std::function<bool(std::shared_ptr<SensorData>, std::shared_ptr<PFSampleSet>)
                                                > sensor_fn,
                                   std::shared_ptr<SensorData> sensor_data)
 {
   int i;
   std::shared_ptr<PFSampleSet> update_set;
-  PFSample* update_sample;
-  double total;
 
   update_set = sets_[current_set_];
+  double* weight = update_set->samples.weight();
+  double* log_weight = update_set->samples.log_weight();
+
+  // The sensor models add to the log weights.  A product of many small beam
+  // likelihoods would underflow, but their sum of logs does not.
+  for (i = 0; i < update_set->sample_count; i++)
+  {
+    log_weight[i] = std::log(weight[i]);
+  }
 
   // Compute the sample weights
-  total = sensor_fn(sensor_data, update_set);
+  if (!sensor_fn(sensor_data, update_set))
+    return;
 
-  if (total > 0.0)
+  // Normalize weights, subtracting the largest log weight before
+  // exponentiating so the largest weight is exactly one (log-sum-exp).
+  double max_log_weight = -std::numeric_limits<double>::infinity();
+  for (i = 0; i < update_set->sample_count; i++)
   {
-    // Normalize weights
-    double w_avg = 0.0;
-    for (i = 0; i < update_set->sample_count; i++)
-    {
-      update_sample = &(update_set->samples[i]);
-      w_avg += update_sample->weight;
-      update_sample->weight /= total;
-    }
-    // Update running averages of likelihood of samples (from Probabilistic Robotics 'Augmented_MCL' algorithm)
-    w_avg /= update_set->sample_count;
-    if (w_slow_ == 0.0)
-      w_slow_ = w_avg;
-    else
-      w_slow_ += alpha_slow_ * (w_avg - w_slow_);
-    if (w_fast_ == 0.0)
-      w_fast_ = w_avg;
-    else
-      w_fast_ += alpha_fast_ * (w_avg - w_fast_);
+    max_log_weight = std::max(max_log_weight, log_weight[i]);
   }
-  else
+  if (max_log_weight == -std::numeric_limits<double>::infinity())
   {
     // Handle zero total
     for (i = 0; i < update_set->sample_count; i++)
     {
-      update_sample = &(update_set->samples[i]);
-      update_sample->weight = 1.0 / update_set->sample_count;
+      weight[i] = 1.0 / update_set->sample_count;
     }
+    return;
+  }
+  double total = 0.0;
+  for (i = 0; i < update_set->sample_count; i++)
+  {
+    weight[i] = std::exp(log_weight[i] - max_log_weight);
+    total += weight[i];
   }
+  for (i = 0; i < update_set->sample_count; i++)
+  {
+    weight[i] /= total;
+  }
+
+  // Update running averages of likelihood of samples (from Probabilistic Robotics 'Augmented_MCL' algorithm).
+  // The averages are kept as logs too, since the average likelihood can be far smaller than a double.
+  double log_w_avg = max_log_weight + std::log(total / update_set->sample_count);
+  if (log_w_slow_ == -std::numeric_limits<double>::infinity())
+    log_w_slow_ = log_w_avg;
+  else
+    log_w_slow_ = logAddExp(std::log(1.0 - alpha_slow_) + log_w_slow_, std::log(alpha_slow_) + log_w_avg);
+  if (log_w_fast_ == -std::numeric_limits<double>::infinity())
+    log_w_fast_ = log_w_avg;
+  else
+    log_w_fast_ = logAddExp(std::log(1.0 - alpha_fast_) + log_w_fast_, std::log(alpha_fast_) + log_w_avg);
+}
+
+// Compute log(exp(a) + exp(b)) without overflow or underflow
+double ParticleFilter::logAddExp(double a, double b)
+{
+  if (a < b)
+    std::swap(a, b);
+  if (b == -std::numeric_limits<double>::infinity())
+    return a;
+  return a + std::log1p(std::exp(b - a));
 }
 
 double ParticleFilter::resampleSystematic(double w_diff)
@@ -252,7 +266,6 @@ double ParticleFilter::resampleSystematic(double w_diff)
   int i;
   double total;
   std::shared_ptr<PFSampleSet> set_a, set_b;
-  PFSample *sample_a, *sample_b;
 
   set_a = sets_[current_set_];
   set_b = sets_[(current_set_ + 1) % 2];
@@ -262,7 +275,7 @@ double ParticleFilter::resampleSystematic(double w_diff)
   c[0] = 0.0;
   for (i = 0; i < set_a->sample_count; i++)
   {
-    c[i + 1] = c[i] + set_a->samples[i].weight;
+    c[i + 1] = c[i] + set_a->samples.getWeight(i);
   }
 
   // Draw samples from set a to create set b.
@@ -270,7 +283,7 @@ double ParticleFilter::resampleSystematic(double w_diff)
   set_b->sample_count = 0;
 
   // Approximate set_b's leaf_count from set_a's
-  int new_count = resampleLimit(set_a->kdtree->getLeafCount());
+  int new_count = resampleLimit(set_a->histogram->getLeafCount());
   // Try to add particles for randomness.
   // No need to throw away our (possibly good) particles when we have free space in the filter
   // for random ones.
@@ -287,7 +300,8 @@ double ParticleFilter::resampleSystematic(double w_diff)
   int num_systematic_sampled_poses = set_b->sample_count - num_random_poses;
 
   // Find the starting point for systematic sampling.
-  double systematic_sample_start = drand48();
+  RandomStream rng = RandomService::createStream(RANDOM_STREAM_RESAMPLE, resample_count_++);
+  double systematic_sample_start = rng.uniform();
   double systematic_sample_delta = 1.0 / num_systematic_sampled_poses;
   int c_i;
   for (c_i = 0; c_i < set_a->sample_count; c_i++)
@@ -297,12 +311,12 @@ double ParticleFilter::resampleSystematic(double w_diff)
   }
   for (i = 0; i < num_random_poses; ++i)
   {
-    sample_b = &(set_b->samples[i]);
-    sample_b->pose = random_pose_fn_();
-    sample_b->weight = 1.0;
-    total += sample_b->weight;
+    Eigen::Vector3d pose = random_pose_fn_();
+    set_b->samples.setPose(i, pose);
+    set_b->samples.setWeight(i, 1.0);
+    total += 1.0;
     // Add sample to histogram
-    set_b->kdtree->insertPose(sample_b->pose, sample_b->weight);
+    set_b->samples.setBin(i, set_b->histogram->insertPose(pose, 1.0));
   }
   double target = systematic_sample_start;
   for (; i < set_b->sample_count; ++i)
@@ -320,15 +334,14 @@ double ParticleFilter::resampleSystematic(double w_diff)
     {
       target -= 1.0;
     }
-    sample_a = &(set_a->samples[c_i]);
-    sample_b = &(set_b->samples[i]);
-    sample_b->pose = sample_a->pose;
+    Eigen::Vector3d pose = set_a->samples.getPose(c_i);
+    set_b->samples.setPose(i, pose);
 
-    sample_b->weight = 1.0;
-    total += sample_b->weight;
+    set_b->samples.setWeight(i, 1.0);
+    total += 1.0;
 
     // Add sample to histogram
-    set_b->kdtree->insertPose(sample_b->pose, sample_b->weight);
+    set_b->samples.setBin(i, set_b->histogram->insertPose(pose, 1.0));
   }
 
   return total;
@@ -339,62 +352,47 @@ double ParticleFilter::resampleMultinomial(double w_diff)
   int i;
   double total;
   std::shared_ptr<PFSampleSet> set_a, set_b;
-  PFSample *sample_a, *sample_b;
-
-  // double count_inv;
-  std::vector<double> c;
 
   set_a = sets_[current_set_];
   set_b = sets_[(current_set_ + 1) % 2];
 
-  // Build up cumulative probability table for resampling.
-  // TODO: Replace this with a more efficient procedure
-  // (e.g., http://www.network-theory.co.uk/docs/gslref/GeneralDiscreteDistributions.html)
-  c = std::vector<double>(set_a->sample_count + 1);
-  c[0] = 0.0;
-  for (i = 0; i < set_a->sample_count; i++)
-    c[i + 1] = c[i] + set_a->samples[i].weight;
+  // Build up the alias table for resampling, so each draw is constant time.
+  alias_table_.build(set_a->samples.weight(), set_a->sample_count);
 
   // Draw samples from set a to create set b.
+  RandomStream rng = RandomService::createStream(RANDOM_STREAM_RESAMPLE, resample_count_++);
   total = 0;
   set_b->sample_count = 0;
 
   while (set_b->sample_count < max_samples_)
   {
-    sample_b = &(set_b->samples[set_b->sample_count++]);
+    int b = set_b->sample_count++;
+    Eigen::Vector3d pose;
 
-    if (drand48() < w_diff)
+    if (rng.uniform() < w_diff)
     {
-      sample_b->pose = random_pose_fn_();
+      pose = random_pose_fn_();
     }
     else
     {
-      // Naive discrete event sampler
-      double r;
-      r = drand48();
-      for (i = 0; i < set_a->sample_count; i++)
-      {
-        if ((c[i] <= r) && (r < c[i + 1]))
-          break;
-      }
+      i = alias_table_.draw(rng.uniform());
       ROS_ASSERT(i < set_a->sample_count);
 
-      sample_a = &(set_a->samples[i]);
-
-      ROS_ASSERT(sample_a->weight > 0);
+      ROS_ASSERT(set_a->samples.getWeight(i) > 0);
 
       // Add sample to list
-      sample_b->pose = sample_a->pose;
+      pose = set_a->samples.getPose(i);
     }
+    set_b->samples.setPose(b, pose);
 
-    sample_b->weight = 1.0;
-    total += sample_b->weight;
+    set_b->samples.setWeight(b, 1.0);
+    total += 1.0;
 
     // Add sample to histogram
-    set_b->kdtree->insertPose(sample_b->pose, sample_b->weight);
+    set_b->samples.setBin(b, set_b->histogram->insertPose(pose, 1.0));
 
     // See if we have enough samples yet
-    if (set_b->sample_count > resampleLimit(set_b->kdtree->getLeafCount()))
+    if (set_b->sample_count > resampleLimit(set_b->histogram->getLeafCount()))
       break;
   }
   return total;
@@ -406,7 +404,6 @@ void ParticleFilter::updateResample()
   int i;
   double total;
   std::shared_ptr<PFSampleSet> set_a, set_b;
-  PFSample *sample_a, *sample_b;
 
   double w_diff;
 
@@ -414,9 +411,13 @@ void ParticleFilter::updateResample()
   set_b = sets_[(current_set_ + 1) % 2];
 
   // Create the kd tree for adaptive sampling
-  set_b->kdtree->clearKDTree();
+  set_b->histogram->clear();
 
-  w_diff = 1.0 - w_fast_ / w_slow_;
+  // No random poses until there are averages to compare
+  if (log_w_slow_ == -std::numeric_limits<double>::infinity())
+    w_diff = 0.0;
+  else
+    w_diff = 1.0 - std::exp(log_w_fast_ - log_w_slow_);
   if (w_diff < 0.0)
     w_diff = 0.0;
 
@@ -433,13 +434,13 @@ void ParticleFilter::updateResample()
 
   // Reset averages, to avoid spiraling off into complete randomness.
   if (w_diff > 0.0)
-    w_slow_ = w_fast_ = 0.0;
+    log_w_slow_ = log_w_fast_ = -std::numeric_limits<double>::infinity();
 
   // Normalize weights
+  double* weight = set_b->samples.weight();
   for (i = 0; i < set_b->sample_count; i++)
   {
-    sample_b = &(set_b->samples[i]);
-    sample_b->weight /= total;
+    weight[i] /= total;
   }
 
   // Re-compute cluster statistics
@@ -488,27 +489,49 @@ void ParticleFilter::computeClusterStatsForSet(std::shared_ptr<PFSampleSet> set)
   double m[4] = {0.0, 0.0, 0.0, 0.0}, c[2*2] = {0.0, 0.0, 0.0, 0.0};
   double weight = 0.0;
 
-  // Cluster the samples
-  set->kdtree->cluster();
-  for (int i = 0; i < set->cluster_max_count; i++)
+  // Cluster the samples, and reset only the clusters that will be used
+  set->histogram->cluster();
+  set->cluster_count = std::min(set->histogram->getClusterCount(), set->cluster_max_count);
+  for (int i = 0; i < set->cluster_count; i++)
   {
     initCluster(&(set->clusters[i]));
   }
-  set->cluster_count = 0;
   set->mean = Eigen::Vector3d();
   set->cov = Eigen::Matrix3d();
 
-  // Compute cluster stats
+  // Compute cluster stats, set stats and position bounds in one pass,
+  // using the bin each sample was inserted into to find its cluster.
+  const double* x = set->samples.x();
+  const double* y = set->samples.y();
+  const double* yaw = set->samples.yaw();
+  const double* w = set->samples.weight();
+  const int* bin = set->samples.bin();
+  double sum_x = 0.0, sum_y = 0.0;
+  double min_x = std::numeric_limits<double>::infinity(), max_x = -min_x;
+  double min_y = min_x, max_y = -min_x;
   for (int i = 0; i < set->sample_count; i++)
   {
-    PFSample* sample = &(set->samples[i]);
-    int cidx = getClusterIndexOfSampleInSet(set, sample);
-    if(cidx >= 0)
-    {
-      addSampleStatsToCluster(sample, &(set->clusters[cidx]));
-      addSampleStatsToSet(sample, &weight, m, c);
-    }
+    sum_x += x[i];
+    sum_y += y[i];
+    min_x = std::min(min_x, x[i]);
+    max_x = std::max(max_x, x[i]);
+    min_y = std::min(min_y, y[i]);
+    max_y = std::max(max_y, y[i]);
+
+    int cidx = set->histogram->getBinCluster(bin[i]);
+    ROS_ASSERT(cidx >= 0);
+    if (cidx >= set->cluster_max_count)
+      continue;
+    double cos_yaw = std::cos(yaw[i]);
+    double sin_yaw = std::sin(yaw[i]);
+    PFCluster* cluster = &(set->clusters[cidx]);
+    cluster->count += 1;
+    addSampleStats(x[i], y[i], cos_yaw, sin_yaw, w[i], &cluster->weight, cluster->m, &cluster->c[0][0]);
+    addSampleStats(x[i], y[i], cos_yaw, sin_yaw, w[i], &weight, m, c);
   }
+  set->position_mean = Eigen::Vector2d(sum_x, sum_y) / set->sample_count;
+  set->position_min = Eigen::Vector2d(min_x, min_y);
+  set->position_max = Eigen::Vector2d(max_x, max_y);
 
   // Normalize
   for (int i = 0; i < set->cluster_count; i++)
@@ -548,54 +571,19 @@ void ParticleFilter::normalizeCluster(PFCluster* cluster)
   cluster->cov(2, 2) = -2 * std::log(std::sqrt(cluster->m[2] * cluster->m[2] + cluster->m[3] * cluster->m[3]));
 }
 
-int ParticleFilter::getClusterIndexOfSampleInSet(std::shared_ptr<PFSampleSet> set, PFSample* sample)
-{
-  // Get the cluster label for this sample
-  int cidx = set->kdtree->getCluster(sample->pose);
-  ROS_ASSERT(cidx >= 0);
-  if (cidx >= set->cluster_max_count)
-    return -1;
-  if (cidx + 1 > set->cluster_count)
-    set->cluster_count = cidx + 1;
-  return cidx;
-}
-
-void ParticleFilter::addSampleStatsToCluster(const PFSample* sample, PFCluster* cluster)
+void ParticleFilter::addSampleStats(double x, double y, double cos_yaw, double sin_yaw, double weight,
+                                    double* total_weight, double m[], double c[])
 {
-  cluster->count += 1;
-  cluster->weight += sample->weight;
-
-  // Compute mean
-  cluster->m[0] += sample->weight * sample->pose[0];
-  cluster->m[1] += sample->weight * sample->pose[1];
-  cluster->m[2] += sample->weight * std::cos(sample->pose[2]);
-  cluster->m[3] += sample->weight * std::sin(sample->pose[2]);
-
-  // Compute covariance in linear components
-  for (int j = 0; j < 2; j++)
-  {
-    for (int k = 0; k < 2; k++)
-    {
-      cluster->c[j][k] += sample->weight * sample->pose[j] * sample->pose[k];
-    }
-  }
-}
-
-void ParticleFilter::addSampleStatsToSet(const PFSample* sample, double* weight, double* m, double* c)
-{
-  *weight += sample->weight;
-  *(m+0) += sample->weight * sample->pose[0];
-  *(m+1) += sample->weight * sample->pose[1];
-  *(m+2) += sample->weight * std::cos(sample->pose[2]);
-  *(m+3) += sample->weight * std::sin(sample->pose[2]);
+  *total_weight += weight;
+  m[0] += weight * x;
+  m[1] += weight * y;
+  m[2] += weight * cos_yaw;
+  m[3] += weight * sin_yaw;
   // Compute covariance in linear components
-  for (int j = 0; j < 2; j++)
-  {
-    for (int k = 0; k < 2; k++)
-    {
-      *(c+2*j+k) += sample->weight * sample->pose[j] * sample->pose[k];
-    }
-  }
+  c[0] += weight * x * x;
+  c[1] += weight * x * y;
+  c[2] += weight * y * x;
+  c[3] += weight * y * y;
 }
 
 void ParticleFilter::computeSetStats(double weight, const double m[], const double c[],
@@ -20,8 +20,6 @@
 
 #include "pf/pdf_gaussian.h"
 
-#include <stdlib.h>
-
 #include <cmath>
 
 #include <Eigen/Eigenvalues>
@@ -29,7 +27,8 @@
 namespace badger_amcl
 {
 
-PDFGaussian::PDFGaussian(const Eigen::Vector3d& x, const Eigen::Matrix3d& cx)
+PDFGaussian::PDFGaussian(const Eigen::Vector3d& x, const Eigen::Matrix3d& cx, const RandomStream& rng)
+    : rng_(rng)
 {
   Eigen::Matrix3d m;
 
@@ -44,9 +43,9 @@ PDFGaussian::PDFGaussian(const Eigen::Vector3d& x, const Eigen::Matrix3d& cx)
   cd_[2] = std::sqrt(m(2, 2));
 }
 
-PDFGaussian::PDFGaussian(const Eigen::Vector3d& x, const Eigen::Matrix3d& cx, int seed) : PDFGaussian(x, cx)
+PDFGaussian::PDFGaussian(const Eigen::Vector3d& x, const Eigen::Matrix3d& cx, int seed)
+    : PDFGaussian(x, cx, RandomStream(seed, 0))
 {
-  srand48(seed);
 }
 
 // Generate a sample from the the pdf.
@@ -58,7 +57,7 @@ Eigen::Vector3d PDFGaussian::sample()
   // Generate a random vector
   for (i = 0; i < 3; i++)
   {
-    r[i] = PDFGaussian::draw(cd_[i]);
+    r[i] = PDFGaussian::draw(cd_[i], &rng_);
   }
 
   for (i = 0; i < 3; i++)
@@ -74,7 +73,7 @@ Eigen::Vector3d PDFGaussian::sample()
 // deviation sigma.
 // We use the polar form of the Box-Muller transformation, explained here:
 //   http://www.taygeta.com/random/gaussian.html
-double PDFGaussian::draw(double sigma)
+double PDFGaussian::draw(double sigma, RandomStream* rng)
 {
   double x1, x2, w, r;
 
@@ -82,12 +81,12 @@ double PDFGaussian::draw(double sigma)
   {
     do
     {
-      r = drand48();
+      r = rng->uniform();
     } while (r == 0.0);
     x1 = 2.0 * r - 1.0;
     do
     {
-      r = drand48();
+      r = rng->uniform();
     } while (r == 0.0);
     x2 = 2.0 * r - 1.0;
     w = x1 * x1 + x2 * x2;
@@ -0,0 +1,94 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "pf/pf_alias_table.h"
+
+#include <ros/assert.h>
+
+namespace badger_amcl
+{
+
+void PFAliasTable::build(const double* weights, int count)
+{
+  ROS_ASSERT(count > 0);
+  prob_.resize(count);
+  alias_.resize(count);
+  small_.clear();
+  large_.clear();
+
+  double total = 0.0;
+  for (int i = 0; i < count; i++)
+  {
+    total += weights[i];
+  }
+  ROS_ASSERT(total > 0.0);
+
+  // Scale the weights so they average one, and split them into the entries
+  // below and above the average.
+  double scale = count / total;
+  for (int i = 0; i < count; i++)
+  {
+    prob_[i] = weights[i] * scale;
+    alias_[i] = i;
+    if (prob_[i] < 1.0)
+      small_.push_back(i);
+    else
+      large_.push_back(i);
+  }
+
+  // Fill each small entry up to one using mass from a large entry
+  while (!small_.empty() && !large_.empty())
+  {
+    int s = small_.back();
+    small_.pop_back();
+    int l = large_.back();
+    alias_[s] = l;
+    prob_[l] = (prob_[l] + prob_[s]) - 1.0;
+    if (prob_[l] < 1.0)
+    {
+      large_.pop_back();
+      small_.push_back(l);
+    }
+  }
+
+  // Whatever is left is one up to rounding error
+  for (int i : large_)
+  {
+    prob_[i] = 1.0;
+  }
+  for (int i : small_)
+  {
+    prob_[i] = 1.0;
+  }
+}
+
+int PFAliasTable::draw(double r) const
+{
+  // The integer part of r * count picks a column and the fraction picks
+  // between the column and its alias.
+  double u = r * prob_.size();
+  int i = static_cast<int>(u);
+  if (i >= static_cast<int>(prob_.size()))
+    i = prob_.size() - 1;
+  if (u - i < prob_[i])
+    return i;
+  return alias_[i];
+}
+
+}  // namespace amcl
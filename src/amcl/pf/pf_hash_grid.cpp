@@ -0,0 +1,207 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "pf/pf_hash_grid.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <ros/assert.h>
+
+namespace badger_amcl
+{
+
+// Starting table size, must be a power of two
+static const uint32_t INITIAL_SLOT_COUNT = 1024;
+
+PFHashGrid::PFHashGrid()
+    : slots_(INITIAL_SLOT_COUNT, Slot{0, -1}),
+      mask_(INITIAL_SLOT_COUNT - 1),
+      stamp_(1),
+      cluster_count_(0)
+{
+  cell_size_[0] = 0.50;
+  cell_size_[1] = 0.50;
+  cell_size_[2] = (10 * M_PI / 180);
+  // Round the yaw cell size so a whole number of bins covers the circle
+  yaw_bins_ = std::max(1, static_cast<int>(std::round(2 * M_PI / cell_size_[2])));
+  cell_size_[2] = 2 * M_PI / yaw_bins_;
+}
+
+void PFHashGrid::clear()
+{
+  bins_.clear();
+  cluster_count_ = 0;
+  stamp_++;
+  if (stamp_ == 0)
+  {
+    // The stamp wrapped, so old slots could look valid again
+    for (Slot& slot : slots_)
+      slot.stamp = 0;
+    stamp_ = 1;
+  }
+}
+
+int PFHashGrid::insertPose(const Eigen::Vector3d& pose, double value)
+{
+  int key[3];
+  computeKey(pose, key);
+  uint32_t i = hashKey(key) & mask_;
+  while (slots_[i].stamp == stamp_)
+  {
+    PFHashGridBin& bin = bins_[slots_[i].bin];
+    if (bin.key[0] == key[0] && bin.key[1] == key[1] && bin.key[2] == key[2])
+    {
+      bin.value += value;
+      return slots_[i].bin;
+    }
+    i = (i + 1) & mask_;
+  }
+
+  int index = bins_.size();
+  bins_.push_back(PFHashGridBin{{key[0], key[1], key[2]}, value, -1});
+  slots_[i].stamp = stamp_;
+  slots_[i].bin = index;
+
+  // Keep the table at most half full so probe sequences stay short
+  if (2 * bins_.size() > slots_.size())
+    grow();
+  return index;
+}
+
+void PFHashGrid::cluster()
+{
+  for (PFHashGridBin& bin : bins_)
+  {
+    bin.cluster = -1;
+  }
+
+  // Breadth first search over the 26 neighbours of each bin, with an
+  // explicit queue so large connected sets cannot overflow the stack.
+  int cluster_count = 0;
+  for (int i = 0; i < bins_.size(); i++)
+  {
+    if (bins_[i].cluster != -1)
+      continue;
+    bins_[i].cluster = cluster_count;
+    queue_.clear();
+    queue_.push_back(i);
+    for (int q = 0; q < queue_.size(); q++)
+    {
+      const int* key = bins_[queue_[q]].key;
+      for (int n = 0; n < 3 * 3 * 3; n++)
+      {
+        if (n == 13)
+          continue;
+        int next_key[3];
+        next_key[0] = key[0] + (n / 9) - 1;
+        next_key[1] = key[1] + ((n % 9) / 3) - 1;
+        next_key[2] = (key[2] + (n % 3) - 1 + yaw_bins_) % yaw_bins_;
+        int next = findBin(next_key);
+        if (next < 0)
+          continue;
+        if (bins_[next].cluster >= 0)
+        {
+          ROS_ASSERT(bins_[next].cluster == cluster_count);
+          continue;
+        }
+        bins_[next].cluster = cluster_count;
+        queue_.push_back(next);
+      }
+    }
+    cluster_count++;
+  }
+  cluster_count_ = cluster_count;
+}
+
+// Determine the cluster label for the given pose
+int PFHashGrid::getCluster(const Eigen::Vector3d& pose)
+{
+  int key[3];
+  computeKey(pose, key);
+  int bin = findBin(key);
+  if (bin < 0)
+    return -1;
+  return bins_[bin].cluster;
+}
+
+int PFHashGrid::getBinCluster(int bin)
+{
+  return bins_[bin].cluster;
+}
+
+int PFHashGrid::getClusterCount()
+{
+  return cluster_count_;
+}
+
+int PFHashGrid::getLeafCount()
+{
+  return bins_.size();
+}
+
+void PFHashGrid::computeKey(const Eigen::Vector3d& pose, int key[])
+{
+  key[0] = std::floor(pose[0] / cell_size_[0]);
+  key[1] = std::floor(pose[1] / cell_size_[1]);
+  double yaw = std::fmod(pose[2], 2 * M_PI);
+  if (yaw < 0)
+    yaw += 2 * M_PI;
+  key[2] = std::min(static_cast<int>(yaw / cell_size_[2]), yaw_bins_ - 1);
+}
+
+uint32_t PFHashGrid::hashKey(const int key[])
+{
+  uint32_t h = static_cast<uint32_t>(key[0]) * 0x9e3779b1u;
+  h ^= static_cast<uint32_t>(key[1]) * 0x85ebca77u;
+  h ^= static_cast<uint32_t>(key[2]) * 0xc2b2ae3du;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  return h;
+}
+
+int PFHashGrid::findBin(const int key[])
+{
+  uint32_t i = hashKey(key) & mask_;
+  while (slots_[i].stamp == stamp_)
+  {
+    const PFHashGridBin& bin = bins_[slots_[i].bin];
+    if (bin.key[0] == key[0] && bin.key[1] == key[1] && bin.key[2] == key[2])
+      return slots_[i].bin;
+    i = (i + 1) & mask_;
+  }
+  return -1;
+}
+
+void PFHashGrid::grow()
+{
+  slots_.assign(2 * slots_.size(), Slot{0, -1});
+  mask_ = slots_.size() - 1;
+  for (int b = 0; b < bins_.size(); b++)
+  {
+    uint32_t i = hashKey(bins_[b].key) & mask_;
+    while (slots_[i].stamp == stamp_)
+      i = (i + 1) & mask_;
+    slots_[i].stamp = stamp_;
+    slots_[i].bin = b;
+  }
+}
+
+}  // namespace amcl
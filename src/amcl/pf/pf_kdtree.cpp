@@ -37,22 +37,26 @@ PFKDTree::PFKDTree()
   cell_size_[2] = (10 * M_PI / 180);
   root_ = NULL;
   leaf_count_ = 0;
+  cluster_count_ = 0;
 }
 
 void PFKDTree::clearKDTree()
 {
   root_ = NULL;
   leaf_count_ = 0;
+  cluster_count_ = 0;
   nodes_.clear();
 }
 
-void PFKDTree::insertPose(const Eigen::Vector3d& pose, double value)
+int PFKDTree::insertPose(const Eigen::Vector3d& pose, double value)
 {
+  int index;
   int key[3];
   key[0] = std::floor(pose[0] / cell_size_[0]);
   key[1] = std::floor(pose[1] / cell_size_[1]);
   key[2] = std::floor(pose[2] / cell_size_[2]);
-  root_ = insertNode(root_, key, value, 0);
+  root_ = insertNode(root_, key, value, 0, &index);
+  return index;
 }
 
 void PFKDTree::cluster()
@@ -73,6 +77,7 @@ void PFKDTree::cluster()
     nodes_[i].cluster = cluster_count++;
     clusterNode(&nodes_[i]);
   }
+  cluster_count_ = cluster_count;
 }
 
 // Determine the cluster label for the given pose
@@ -89,26 +94,38 @@ int PFKDTree::getCluster(const Eigen::Vector3d& pose)
   return node->cluster;
 }
 
+int PFKDTree::getBinCluster(int bin)
+{
+  return nodes_[bin].cluster;
+}
+
+int PFKDTree::getClusterCount()
+{
+  return cluster_count_;
+}
+
 int PFKDTree::getLeafCount()
 {
   return leaf_count_;
 }
 
-PFKDTreeNode* PFKDTree::insertNode(PFKDTreeNode* node, int key[], double value, int depth)
+PFKDTreeNode* PFKDTree::insertNode(PFKDTreeNode* node, int key[], double value, int depth, int* index)
 {
   if (node == NULL)
   {
     node = makeLeafNode(key, value, depth);
+    *index = node->index;
   }
   else
   {
     if (equals(key, node->key))
     {
       node->value += value;
+      *index = node->index;
     }
     else
     {
-      traverseNode(node, key, value, depth);
+      traverseNode(node, key, value, depth, index);
     }
   }
   return node;
@@ -118,6 +135,7 @@ PFKDTreeNode* PFKDTree::makeLeafNode(int key[], double value, int depth)
 {
   nodes_.push_back(PFKDTreeNode());
   PFKDTreeNode* node = &nodes_.back();
+  node->index = nodes_.size() - 1;
   node->depth = depth;
   for (int i = 0; i < 3; i++)
     node->key[i] = key[i];
@@ -128,7 +146,7 @@ PFKDTreeNode* PFKDTree::makeLeafNode(int key[], double value, int depth)
   return node;
 }
 
-void PFKDTree::traverseNode(PFKDTreeNode* node, int key[], double value, int depth)
+void PFKDTree::traverseNode(PFKDTreeNode* node, int key[], double value, int depth, int* index)
 {
   if (node->pivot_dim == -1)
   {
@@ -146,7 +164,7 @@ void PFKDTree::traverseNode(PFKDTreeNode* node, int key[], double value, int dep
     leaf_count_ -= 1;
   }
   int child = key[node->pivot_dim] > node->key[node->pivot_dim];
-  node->children[child] = insertNode(node->children[child], key, value, depth+1);
+  node->children[child] = insertNode(node->children[child], key, value, depth+1, index);
 }
 
 PFKDTreeNode* PFKDTree::findNode(PFKDTreeNode* node, int key[])
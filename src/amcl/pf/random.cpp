@@ -0,0 +1,126 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "pf/random.h"
+
+#include <cmath>
+
+namespace badger_amcl
+{
+
+// Philox4x32 round multipliers and key increments
+static const uint32_t PHILOX_M0 = 0xD2511F53;
+static const uint32_t PHILOX_M1 = 0xCD9E8D57;
+static const uint32_t PHILOX_W0 = 0x9E3779B9;
+static const uint32_t PHILOX_W1 = 0xBB67AE85;
+static const int PHILOX_ROUNDS = 10;
+
+RandomStream::RandomStream() : RandomStream(0, 0)
+{
+}
+
+RandomStream::RandomStream(uint64_t seed, uint64_t stream)
+    : key_({ static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32) }),
+      stream_(stream),
+      position_(0),
+      block_index_(4),
+      spare_gaussian_(0.0),
+      has_spare_gaussian_(false)
+{
+}
+
+std::array<uint32_t, 4> RandomStream::philox(std::array<uint32_t, 4> counter, std::array<uint32_t, 2> key)
+{
+  for (int round = 0; round < PHILOX_ROUNDS; round++)
+  {
+    if (round > 0)
+    {
+      key[0] += PHILOX_W0;
+      key[1] += PHILOX_W1;
+    }
+    uint64_t product0 = static_cast<uint64_t>(PHILOX_M0) * counter[0];
+    uint64_t product1 = static_cast<uint64_t>(PHILOX_M1) * counter[2];
+    counter = { static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key[0], static_cast<uint32_t>(product1),
+                static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key[1], static_cast<uint32_t>(product0) };
+  }
+  return counter;
+}
+
+uint32_t RandomStream::next()
+{
+  if (block_index_ == 4)
+  {
+    // The low half of the counter is the position in the stream, and the
+    // high half is the stream id.
+    block_ = philox({ static_cast<uint32_t>(position_), static_cast<uint32_t>(position_ >> 32),
+                      static_cast<uint32_t>(stream_), static_cast<uint32_t>(stream_ >> 32) },
+                    key_);
+    position_++;
+    block_index_ = 0;
+  }
+  return block_[block_index_++];
+}
+
+double RandomStream::uniform()
+{
+  // 53 random bits, the full precision of a double
+  uint64_t a = next() >> 5;
+  uint64_t b = next() >> 6;
+  return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0);
+}
+
+double RandomStream::gaussian()
+{
+  if (has_spare_gaussian_)
+  {
+    has_spare_gaussian_ = false;
+    return spare_gaussian_;
+  }
+  // Basic Box-Muller transform, with the first uniform moved to (0, 1]
+  double r = std::sqrt(-2.0 * std::log(1.0 - uniform()));
+  double theta = 2.0 * M_PI * uniform();
+  spare_gaussian_ = r * std::sin(theta);
+  has_spare_gaussian_ = true;
+  return r * std::cos(theta);
+}
+
+std::atomic<uint64_t> RandomService::seed_(0);
+
+void RandomService::seed(uint64_t seed)
+{
+  seed_ = seed;
+}
+
+uint64_t RandomService::getSeed()
+{
+  return seed_;
+}
+
+uint64_t RandomService::makeStreamId(RandomStreamOwner owner, uint64_t sequence, uint64_t index)
+{
+  // The owner in the top byte, then 32 bits of sequence and 24 of index
+  return (static_cast<uint64_t>(owner) << 56) | ((sequence & 0xffffffff) << 24) | (index & 0xffffff);
+}
+
+RandomStream RandomService::createStream(RandomStreamOwner owner, uint64_t sequence, uint64_t index)
+{
+  return RandomStream(seed_, makeStreamId(owner, sequence, index));
+}
+
+}  // namespace amcl
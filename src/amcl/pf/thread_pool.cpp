@@ -0,0 +1,160 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "pf/thread_pool.h"
+
+#include <algorithm>
+
+#include <ros/assert.h>
+
+namespace badger_amcl
+{
+
+ThreadPool::ThreadPool(int num_threads)
+    : job_(nullptr),
+      job_blocks_(0),
+      next_block_(0),
+      busy_workers_(0),
+      generation_(0),
+      stop_(false)
+{
+  if (num_threads <= 0)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (int i = 1; i < num_threads; i++)
+  {
+    workers_.emplace_back(&ThreadPool::workerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (std::thread& worker : workers_)
+  {
+    worker.join();
+  }
+}
+
+int ThreadPool::getNumThreads() const
+{
+  return workers_.size() + 1;
+}
+
+void ThreadPool::parallelFor(int count, int block_size, const std::function<void(int, int)>& fn)
+{
+  ROS_ASSERT(block_size > 0);
+  if (count <= 0)
+    return;
+  int num_blocks = (count + block_size - 1) / block_size;
+  std::function<void(int)> block_fn = [&](int block)
+  {
+    int begin = block * block_size;
+    fn(begin, std::min(count, begin + block_size));
+  };
+  run(num_blocks, block_fn);
+}
+
+double ThreadPool::parallelSum(int count, int block_size, const std::function<double(int, int)>& fn)
+{
+  ROS_ASSERT(block_size > 0);
+  if (count <= 0)
+    return 0.0;
+  int num_blocks = (count + block_size - 1) / block_size;
+  std::vector<double> block_sums(num_blocks, 0.0);
+  std::function<void(int)> block_fn = [&](int block)
+  {
+    int begin = block * block_size;
+    block_sums[block] = fn(begin, std::min(count, begin + block_size));
+  };
+  run(num_blocks, block_fn);
+
+  double sum = 0.0;
+  for (double block_sum : block_sums)
+  {
+    sum += block_sum;
+  }
+  return sum;
+}
+
+void ThreadPool::run(int num_blocks, const std::function<void(int)>& block_fn)
+{
+  if (workers_.empty() || num_blocks == 1)
+  {
+    for (int block = 0; block < num_blocks; block++)
+    {
+      block_fn(block);
+    }
+    return;
+  }
+
+  std::lock_guard<std::mutex> run_lock(run_mutex_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    job_ = &block_fn;
+    job_blocks_ = num_blocks;
+    next_block_ = 0;
+    busy_workers_ = workers_.size();
+    generation_++;
+  }
+  work_cv_.notify_all();
+
+  runBlocks();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return busy_workers_ == 0; });
+  job_ = nullptr;
+}
+
+void ThreadPool::runBlocks()
+{
+  int block;
+  while ((block = next_block_++) < job_blocks_)
+  {
+    (*job_)(block);
+  }
+}
+
+void ThreadPool::workerLoop()
+{
+  uint64_t seen_generation = 0;
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+      if (stop_)
+        return;
+      seen_generation = generation_;
+    }
+
+    runBlocks();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      busy_workers_--;
+    }
+    done_cv_.notify_one();
+  }
+}
+
+}  // namespace amcl
@@ -22,14 +22,21 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
 
 #include <angles/angles.h>
 
-#include "pf/pdf_gaussian.h"
+#include "pf/random.h"
 
 namespace badger_amcl
 {
 
+Odom::Odom()
+    : thread_pool_(std::make_shared<ThreadPool>(1)),
+      update_count_(0)
+{
+}
+
 void Odom::setModelDiff(double alpha1, double alpha2, double alpha3, double alpha4)
 {
   model_type_ = ODOM_MODEL_DIFF;
@@ -71,6 +78,11 @@ void Odom::setModel(OdomModelType type, double alpha1, double alpha2, double alp
   alpha5_ = alpha5;
 }
 
+void Odom::setThreadPool(std::shared_ptr<ThreadPool> thread_pool)
+{
+  thread_pool_ = thread_pool;
+}
+
 bool Odom::updateAction(std::shared_ptr<ParticleFilter> pf, std::shared_ptr<SensorData> data)
 {
   std::shared_ptr<OdomData> ndata;
@@ -78,144 +90,91 @@ bool Odom::updateAction(std::shared_ptr<ParticleFilter> pf, std::shared_ptr<Sens
 
   // Compute the new sample poses
   std::shared_ptr<PFSampleSet> set = pf->getCurrentSet();
+  int sample_count = set->sample_count;
+  double* x = set->samples.x();
+  double* y = set->samples.y();
+  double* yaw = set->samples.yaw();
   Eigen::Vector3d old_pose;
   old_pose[0] = ndata->pose[0] - ndata->delta[0];
   old_pose[1] = ndata->pose[1] - ndata->delta[1];
   old_pose[2] = ndata->pose[2] - ndata->delta[2];
 
+  // Every model takes three standard normal draws per sample, from a random
+  // stream of the sample's own.  The noise is the same for any number of threads.
+  noise_.resize(3 * sample_count);
+  double* noise1 = noise_.data();
+  double* noise2 = noise1 + sample_count;
+  double* noise3 = noise2 + sample_count;
+  uint64_t update = update_count_++;
+  auto draw_block = [&](int begin, int end)
+  {
+    for (int i = begin; i < end; i++)
+    {
+      RandomStream rng = RandomService::createStream(RANDOM_STREAM_ODOM, update, i);
+      noise1[i] = rng.gaussian();
+      noise2[i] = rng.gaussian();
+      noise3[i] = rng.gaussian();
+    }
+  };
+  thread_pool_->parallelFor(sample_count, PF_SAMPLE_BLOCK_SIZE, draw_block);
+
+  double delta_trans = std::sqrt(ndata->delta[0] * ndata->delta[0]
+                                 + ndata->delta[1] * ndata->delta[1]);
+
   switch (model_type_)
   {
     case ODOM_MODEL_OMNI:
+    case ODOM_MODEL_OMNI_CORRECTED:
     {
-      double delta_trans, delta_rot, delta_bearing;
-      double delta_trans_hat, delta_rot_hat, delta_strafe_hat;
+      double delta_rot = ndata->delta[2];
 
-      delta_trans = std::sqrt(ndata->delta[0] * ndata->delta[0]
-                         + ndata->delta[1] * ndata->delta[1]);
-      delta_rot = ndata->delta[2];
-
-      // Precompute a couple of things
+      // Precompute a couple of things.  The uncorrected model uses the
+      // variances as standard deviations.
       double trans_hat_stddev = (alpha3_ * (delta_trans * delta_trans)
                                  + alpha1_ * (delta_rot * delta_rot));
       double rot_hat_stddev = (alpha4_ * (delta_rot * delta_rot)
                                + alpha2_ * (delta_trans * delta_trans));
       double strafe_hat_stddev = (alpha1_ * (delta_rot * delta_rot)
                                   + alpha5_ * (delta_trans * delta_trans));
-
-      for (int i = 0; i < set->sample_count; i++)
+      if (model_type_ == ODOM_MODEL_OMNI_CORRECTED)
       {
-        PFSample* sample = &(set->samples[i]);
-
-        double turn_angle = std::atan2(ndata->delta[1], ndata->delta[0]);
-        delta_bearing = angleDiff(turn_angle, old_pose[2]) + sample->pose[2];
-        double cs_bearing = std::cos(delta_bearing);
-        double sn_bearing = std::sin(delta_bearing);
-
-        // Sample pose differences
-        delta_trans_hat = delta_trans + PDFGaussian::draw(trans_hat_stddev);
-        delta_rot_hat = delta_rot + PDFGaussian::draw(rot_hat_stddev);
-        delta_strafe_hat = 0 + PDFGaussian::draw(strafe_hat_stddev);
-        // Apply sampled update to particle pose
-        sample->pose[0] += (delta_trans_hat * cs_bearing + delta_strafe_hat * sn_bearing);
-        sample->pose[1] += (delta_trans_hat * sn_bearing - delta_strafe_hat * cs_bearing);
-        sample->pose[2] += delta_rot_hat;
+        trans_hat_stddev = std::sqrt(trans_hat_stddev);
+        rot_hat_stddev = std::sqrt(rot_hat_stddev);
+        strafe_hat_stddev = std::sqrt(strafe_hat_stddev);
       }
-    }
-    break;
-    case ODOM_MODEL_DIFF:
-    {
-      // Implement sample_motion_odometry (Prob Rob p 136)
-      double delta_rot1, delta_trans, delta_rot2;
-      double delta_rot1_hat, delta_trans_hat, delta_rot2_hat;
-      double delta_rot1_noise, delta_rot2_noise;
-
-      // Avoid computing a bearing from two poses that are extremely near each
-      // other (happens on in-place rotation).
-      if (std::sqrt(ndata->delta[1] * ndata->delta[1]
-                    + ndata->delta[0] * ndata->delta[0]) < 0.01)
-        delta_rot1 = 0.0;
-      else
-        delta_rot1 = angleDiff(std::atan2(ndata->delta[1], ndata->delta[0]), old_pose[2]);
-      delta_trans = std::sqrt(ndata->delta[0] * ndata->delta[0]
-                              + ndata->delta[1] * ndata->delta[1]);
-      delta_rot2 = angleDiff(ndata->delta[2], delta_rot1);
-
-      // We want to treat backward and forward motion symmetrically for the
-      // noise model to be applied below.  The standard model seems to assume
-      // forward motion.
-      delta_rot1_noise = std::min(std::fabs(angleDiff(delta_rot1, 0.0)),
-                                  std::fabs(angleDiff(delta_rot1, M_PI)));
-      delta_rot2_noise = std::min(std::fabs(angleDiff(delta_rot2, 0.0)),
-                                  std::fabs(angleDiff(delta_rot2, M_PI)));
+      double turn_angle = std::atan2(ndata->delta[1], ndata->delta[0]);
+      double bearing_offset = angleDiff(turn_angle, old_pose[2]);
 
-      for (int i = 0; i < set->sample_count; i++)
-      {
-        PFSample* sample = &(set->samples[i]);
-
-        // Sample pose differences
-        delta_rot1_hat = angleDiff(delta_rot1, PDFGaussian::draw(alpha1_ * delta_rot1_noise * delta_rot1_noise
-                                                                 + alpha2_ * delta_trans * delta_trans));
-        delta_trans_hat = (delta_trans - PDFGaussian::draw(alpha3_ * delta_trans * delta_trans +
-                                                           alpha4_ * delta_rot1_noise * delta_rot1_noise +
-                                                           alpha4_ * delta_rot2_noise * delta_rot2_noise));
-        delta_rot2_hat = angleDiff(delta_rot2, PDFGaussian::draw(alpha1_ * delta_rot2_noise * delta_rot2_noise
-                                                                 + alpha2_ * delta_trans * delta_trans));
-
-        // Apply sampled update to particle pose
-        sample->pose[0] += delta_trans_hat * std::cos(sample->pose[2] + delta_rot1_hat);
-        sample->pose[1] += delta_trans_hat * std::sin(sample->pose[2] + delta_rot1_hat);
-        sample->pose[2] += delta_rot1_hat + delta_rot2_hat;
-      }
-    }
-    break;
-    case ODOM_MODEL_OMNI_CORRECTED:
-    {
-      double delta_trans, delta_rot, delta_bearing;
-      double delta_trans_hat, delta_rot_hat, delta_strafe_hat;
-
-      delta_trans = std::sqrt(ndata->delta[0] * ndata->delta[0]
-                              + ndata->delta[1] * ndata->delta[1]);
-      delta_rot = ndata->delta[2];
-
-      // Precompute a couple of things
-      double trans_hat_stddev = std::sqrt(alpha3_ * (delta_trans * delta_trans)
-                                          + alpha1_ * (delta_rot * delta_rot));
-      double rot_hat_stddev = std::sqrt(alpha4_ * (delta_rot * delta_rot)
-                                        + alpha2_ * (delta_trans * delta_trans));
-      double strafe_hat_stddev = std::sqrt(alpha1_ * (delta_rot * delta_rot)
-                                           + alpha5_ * (delta_trans * delta_trans));
-
-      for (int i = 0; i < set->sample_count; i++)
+      auto update_block = [&](int begin, int end)
       {
-        PFSample* sample = &(set->samples[i]);
-
-        double turn_angle = std::atan2(ndata->delta[1], ndata->delta[0]);
-        delta_bearing = angleDiff(turn_angle,  old_pose[2]) + sample->pose[2];
-        double cs_bearing = std::cos(delta_bearing);
-        double sn_bearing = std::sin(delta_bearing);
-
-        // Sample pose differences
-        delta_trans_hat = delta_trans + PDFGaussian::draw(trans_hat_stddev);
-        delta_rot_hat = delta_rot + PDFGaussian::draw(rot_hat_stddev);
-        delta_strafe_hat = 0 + PDFGaussian::draw(strafe_hat_stddev);
-        // Apply sampled update to particle pose
-        sample->pose[0] += (delta_trans_hat * cs_bearing + delta_strafe_hat * sn_bearing);
-        sample->pose[1] += (delta_trans_hat * sn_bearing - delta_strafe_hat * cs_bearing);
-        sample->pose[2] += delta_rot_hat;
-      }
+        for (int i = begin; i < end; i++)
+        {
+          double delta_bearing = bearing_offset + yaw[i];
+          double cs_bearing = std::cos(delta_bearing);
+          double sn_bearing = std::sin(delta_bearing);
+
+          // Sample pose differences
+          double delta_trans_hat = delta_trans + trans_hat_stddev * noise1[i];
+          double delta_rot_hat = delta_rot + rot_hat_stddev * noise2[i];
+          double delta_strafe_hat = 0 + strafe_hat_stddev * noise3[i];
+          // Apply sampled update to particle pose
+          x[i] += (delta_trans_hat * cs_bearing + delta_strafe_hat * sn_bearing);
+          y[i] += (delta_trans_hat * sn_bearing - delta_strafe_hat * cs_bearing);
+          yaw[i] += delta_rot_hat;
+        }
+      };
+      thread_pool_->parallelFor(sample_count, PF_SAMPLE_BLOCK_SIZE, update_block);
     }
     break;
+    case ODOM_MODEL_DIFF:
     case ODOM_MODEL_DIFF_CORRECTED:
     {
       // Implement sample_motion_odometry (Prob Rob p 136)
-      double delta_rot1, delta_trans, delta_rot2;
-      double delta_rot1_hat, delta_trans_hat, delta_rot2_hat;
+      double delta_rot1, delta_rot2;
       double delta_rot1_noise, delta_rot2_noise;
 
       // Avoid computing a bearing from two poses that are extremely near each
       // other (happens on in-place rotation).
-      delta_trans = std::sqrt(ndata->delta[0] * ndata->delta[0]
-                              + ndata->delta[1] * ndata->delta[1]);
       if (delta_trans < 0.01)
         delta_rot1 = 0.0;
       else
@@ -230,80 +189,87 @@ bool Odom::updateAction(std::shared_ptr<ParticleFilter> pf, std::shared_ptr<Sens
       delta_rot2_noise = std::min(std::fabs(angleDiff(delta_rot2, 0.0)),
                                   std::fabs(angleDiff(delta_rot2, M_PI)));
 
-      for (int i = 0; i < set->sample_count; i++)
+      // Precompute a couple of things.  The uncorrected model uses the
+      // variances as standard deviations.
+      double rot1_hat_stddev = (alpha1_ * delta_rot1_noise * delta_rot1_noise
+                                + alpha2_ * delta_trans * delta_trans);
+      double trans_hat_stddev = (alpha3_ * delta_trans * delta_trans
+                                 + alpha4_ * delta_rot1_noise * delta_rot1_noise
+                                 + alpha4_ * delta_rot2_noise * delta_rot2_noise);
+      double rot2_hat_stddev = (alpha1_ * delta_rot2_noise * delta_rot2_noise
+                                + alpha2_ * delta_trans * delta_trans);
+      if (model_type_ == ODOM_MODEL_DIFF_CORRECTED)
       {
-        PFSample* sample = &(set->samples[i]);
-
-        // Sample pose differences
-        double draw;
-        draw = PDFGaussian::draw(std::sqrt(alpha1_ * delta_rot1_noise * delta_rot1_noise
-                                           + alpha2_ * delta_trans * delta_trans));
-        delta_rot1_hat = angleDiff(delta_rot1, draw);
-        draw = PDFGaussian::draw(std::sqrt(alpha3_ * delta_trans * delta_trans
-                                           + alpha4_ * delta_rot1_noise * delta_rot1_noise
-                                           + alpha4_ * delta_rot2_noise * delta_rot2_noise));
-        delta_trans_hat = (delta_trans - draw);
-        draw = PDFGaussian::draw(std::sqrt(alpha1_ * delta_rot2_noise * delta_rot2_noise
-                                           + alpha2_ * delta_trans * delta_trans));
-        delta_rot2_hat = angleDiff(delta_rot2, draw);
-
-        // Apply sampled update to particle pose
-        sample->pose[0] += delta_trans_hat * std::cos(sample->pose[2] + delta_rot1_hat);
-        sample->pose[1] += delta_trans_hat * std::sin(sample->pose[2] + delta_rot1_hat);
-        sample->pose[2] += delta_rot1_hat + delta_rot2_hat;
+        rot1_hat_stddev = std::sqrt(rot1_hat_stddev);
+        trans_hat_stddev = std::sqrt(trans_hat_stddev);
+        rot2_hat_stddev = std::sqrt(rot2_hat_stddev);
       }
+
+      auto update_block = [&](int begin, int end)
+      {
+        for (int i = begin; i < end; i++)
+        {
+          // Sample pose differences
+          double delta_rot1_hat = angleDiff(delta_rot1, rot1_hat_stddev * noise1[i]);
+          double delta_trans_hat = delta_trans - trans_hat_stddev * noise2[i];
+          double delta_rot2_hat = angleDiff(delta_rot2, rot2_hat_stddev * noise3[i]);
+
+          // Apply sampled update to particle pose
+          x[i] += delta_trans_hat * std::cos(yaw[i] + delta_rot1_hat);
+          y[i] += delta_trans_hat * std::sin(yaw[i] + delta_rot1_hat);
+          yaw[i] += delta_rot1_hat + delta_rot2_hat;
+        }
+      };
+      thread_pool_->parallelFor(sample_count, PF_SAMPLE_BLOCK_SIZE, update_block);
     }
     break;
     case ODOM_MODEL_GAUSSIAN:
     {
-      double delta_trans, delta_rot;
-      double abs_delta_trans, abs_delta_strafe, abs_delta_rot;
-      double abs_delta_trans2, abs_delta_strafe2, abs_delta_rot2;
-      double delta_trans_hat, delta_rot_hat, delta_strafe_hat;
+      double delta_rot = ndata->delta[2];
 
-      delta_trans = std::sqrt(ndata->delta[0] * ndata->delta[0]
-                              + ndata->delta[1] * ndata->delta[1]);
-      delta_rot = ndata->delta[2];
+      double abs_delta_trans = ndata->absolute_motion[0];
+      double abs_delta_strafe = ndata->absolute_motion[1];
+      double abs_delta_rot = ndata->absolute_motion[2];
 
-      abs_delta_trans = ndata->absolute_motion[0];
-      abs_delta_strafe = ndata->absolute_motion[1];
-      abs_delta_rot = ndata->absolute_motion[2];
-
-      abs_delta_trans2 = abs_delta_trans * abs_delta_trans;
-      abs_delta_strafe2 = abs_delta_strafe * abs_delta_strafe;
-      abs_delta_rot2 = abs_delta_rot * abs_delta_rot;
+      double abs_delta_trans2 = abs_delta_trans * abs_delta_trans;
+      double abs_delta_strafe2 = abs_delta_strafe * abs_delta_strafe;
+      double abs_delta_rot2 = abs_delta_rot * abs_delta_rot;
 
       double rot_hat_stddev = std::sqrt(alpha1_ * abs_delta_rot2 + alpha2_ * abs_delta_trans2);
       double trans_hat_stddev = std::sqrt(alpha3_ * abs_delta_trans2 + alpha4_ * abs_delta_rot2);
       double strafe_hat_stddev = std::sqrt(alpha4_ * abs_delta_rot2 + alpha5_ * abs_delta_strafe2);
 
-      for (int i = 0; i < set->sample_count; i++)
+      // relative direction we moved
+      double ndata_angle = std::atan2(ndata->delta[1], ndata->delta[0]);
+      double bearing_offset = angleDiff(ndata_angle, old_pose[2]);
+
+      auto update_block = [&](int begin, int end)
       {
-        PFSample* sample = &(set->samples[i]);
-
-        // estimated direction pointed during motion
-        double heading = sample->pose[2] + ndata->delta[2] / 2;
-        double cs_heading = std::cos(heading);
-        double sn_heading = std::sin(heading);
-
-        // relative direction we moved
-        double ndata_angle = std::atan2(ndata->delta[1], ndata->delta[0]);
-        double delta_bearing = angleDiff(ndata_angle, old_pose[2]) + sample->pose[2];
-        double cs_bearing = std::cos(delta_bearing);
-        double sn_bearing = std::sin(delta_bearing);
-
-        // Sample pose differences
-        delta_trans_hat = PDFGaussian::draw(trans_hat_stddev);
-        delta_strafe_hat = PDFGaussian::draw(strafe_hat_stddev);
-        delta_rot_hat = PDFGaussian::draw(rot_hat_stddev);
-        // Apply sampled update to particle pose
-        sample->pose[0] += (delta_trans * cs_bearing);
-        sample->pose[1] += (delta_trans * sn_bearing);
-        sample->pose[2] += delta_rot;
-        sample->pose[0] += (delta_trans_hat * cs_heading + delta_strafe_hat * sn_heading);
-        sample->pose[1] += (delta_trans_hat * sn_heading - delta_strafe_hat * cs_heading);
-        sample->pose[2] += delta_rot_hat;
-      }
+        for (int i = begin; i < end; i++)
+        {
+          // estimated direction pointed during motion
+          double heading = yaw[i] + delta_rot / 2;
+          double cs_heading = std::cos(heading);
+          double sn_heading = std::sin(heading);
+
+          double delta_bearing = bearing_offset + yaw[i];
+          double cs_bearing = std::cos(delta_bearing);
+          double sn_bearing = std::sin(delta_bearing);
+
+          // Sample pose differences
+          double delta_trans_hat = trans_hat_stddev * noise1[i];
+          double delta_strafe_hat = strafe_hat_stddev * noise2[i];
+          double delta_rot_hat = rot_hat_stddev * noise3[i];
+          // Apply sampled update to particle pose
+          x[i] += (delta_trans * cs_bearing);
+          y[i] += (delta_trans * sn_bearing);
+          yaw[i] += delta_rot;
+          x[i] += (delta_trans_hat * cs_heading + delta_strafe_hat * sn_heading);
+          y[i] += (delta_trans_hat * sn_heading - delta_strafe_hat * cs_heading);
+          yaw[i] += delta_rot_hat;
+        }
+      };
+      thread_pool_->parallelFor(sample_count, PF_SAMPLE_BLOCK_SIZE, update_block);
     }
     break;
   }
@@ -23,6 +23,8 @@
 #include <cmath>
 #include <cstdlib>
 #include <functional>
+#include <limits>
+#include <mutex>
 
 #include <angles/angles.h>
 #include <ros/assert.h>
@@ -36,38 +38,50 @@ namespace badger_amcl
 PlanarScanner::PlanarScanner()
     : Sensor(),
       max_beams_(0),
-      max_samples_(0),
-      max_obs_(0)
+      use_likelihood_lut_(false),
+      likelihood_lut_range_max_(0.0),
+      range_lut_bearing_count_(0),
+      range_lut_max_range_(0.0),
+      thread_pool_(std::make_shared<ThreadPool>(1))
 {
   off_map_factor_ = 1.0;
   non_free_space_factor_ = 1.0;
   non_free_space_radius_ = 0.0;
-  map_vec_.resize(2);
-  world_vec_.resize(2);
 }
 
 void PlanarScanner::init(int max_beams, std::shared_ptr<OccupancyMap> map)
 {
   max_beams_ = max_beams;
   map_ = map;
+  likelihood_lut_.clear();
+}
+
+void PlanarScanner::setThreadPool(std::shared_ptr<ThreadPool> thread_pool)
+{
+  thread_pool_ = thread_pool;
 }
 
 void PlanarScanner::setModelBeam(double z_hit, double z_short, double z_max, double z_rand,
                                  double sigma_hit, double lambda_short)
 {
   model_type_ = PLANAR_MODEL_BEAM;
+  likelihood_lut_.clear();
   z_hit_ = z_hit;
   z_short_ = z_short;
   z_max_ = z_max;
   z_rand_ = z_rand;
   sigma_hit_ = sigma_hit;
   lambda_short_ = lambda_short;
+  map_->updateClearanceLUT();
+  if (range_lut_bearing_count_ > 0)
+    map_->updateRangeLUT(range_lut_max_range_, range_lut_bearing_count_);
 }
 
 void PlanarScanner::setModelLikelihoodField(double z_hit, double z_rand, double sigma_hit,
                                             double max_distance_to_object)
 {
   model_type_ = PLANAR_MODEL_LIKELIHOOD_FIELD;
+  likelihood_lut_.clear();
   z_hit_ = z_hit;
   z_rand_ = z_rand;
   sigma_hit_ = sigma_hit;
@@ -81,6 +95,7 @@ void PlanarScanner::setModelLikelihoodFieldProb(double z_hit, double z_rand, dou
                                                 double beam_skip_error_threshold)
 {
   model_type_ = PLANAR_MODEL_LIKELIHOOD_FIELD_PROB;
+  likelihood_lut_.clear();
   z_hit_ = z_hit;
   z_rand_ = z_rand;
   sigma_hit_ = sigma_hit;
@@ -99,6 +114,7 @@ void PlanarScanner::setModelLikelihoodFieldGompertz(double z_hit, double z_rand,
 {
   ROS_INFO("Initializing model likelihood field gompertz");
   model_type_ = PLANAR_MODEL_LIKELIHOOD_FIELD_GOMPERTZ;
+  likelihood_lut_.clear();
   z_hit_ = z_hit;
   z_rand_ = z_rand;
   sigma_hit_ = sigma_hit;
@@ -112,6 +128,17 @@ void PlanarScanner::setModelLikelihoodFieldGompertz(double z_hit, double z_rand,
   map_->updateDistancesLUT(max_distance_to_object);
 }
 
+void PlanarScanner::setUseLikelihoodLUT(bool use_likelihood_lut)
+{
+  use_likelihood_lut_ = use_likelihood_lut;
+}
+
+void PlanarScanner::setRangeLUT(int bearing_count, double max_range)
+{
+  range_lut_bearing_count_ = bearing_count;
+  range_lut_max_range_ = max_range;
+}
+
 void PlanarScanner::setMapFactors(double off_map_factor, double non_free_space_factor,
                                   double non_free_space_radius)
 {
@@ -120,6 +147,89 @@ void PlanarScanner::setMapFactors(double off_map_factor, double non_free_space_f
   non_free_space_radius_ = non_free_space_radius;
 }
 
+std::shared_ptr<const PlanarBearings> PlanarScanner::getBearings(double angle_min, double angle_increment,
+                                                                  int range_count)
+{
+  if (bearings_ and bearings_->angle_min == angle_min and bearings_->angle_increment == angle_increment
+      and bearings_->angles.size() == range_count)
+    return bearings_;
+  std::shared_ptr<PlanarBearings> bearings = std::make_shared<PlanarBearings>();
+  bearings->angle_min = angle_min;
+  bearings->angle_increment = angle_increment;
+  bearings->angles.resize(range_count);
+  bearings->cos.resize(range_count);
+  bearings->sin.resize(range_count);
+  for (int i = 0; i < range_count; i++)
+  {
+    bearings->angles[i] = angle_min + (i * angle_increment);
+    bearings->cos[i] = std::cos(bearings->angles[i]);
+    bearings->sin[i] = std::sin(bearings->angles[i]);
+  }
+  bearings_ = bearings;
+  return bearings_;
+}
+
+void PlanarScanner::updateEndpoints(std::shared_ptr<PlanarData> data, int step)
+{
+  if (data->endpoints_step_ == step and data->endpoints_scanner_pose_ == planar_scanner_pose_)
+    return;
+  data->endpoints_step_ = step;
+  data->endpoints_scanner_pose_ = planar_scanner_pose_;
+  data->endpoints_x_.clear();
+  data->endpoints_y_.clear();
+  data->endpoint_beams_.clear();
+  const PlanarBearings& bearings = *data->bearings_;
+  double cos_yaw = std::cos(planar_scanner_pose_[2]);
+  double sin_yaw = std::sin(planar_scanner_pose_[2]);
+  int beam_ind = 0;
+  for (int i = 0; i < data->range_count_; i += step, beam_ind++)
+  {
+    double obs_range = data->ranges_[i];
+
+    // These models ignore max range readings
+    if (obs_range >= data->range_max_)
+      continue;
+
+    // Check for NaN
+    if (obs_range != obs_range)
+      continue;
+
+    double cos_bearing = cos_yaw * bearings.cos[i] - sin_yaw * bearings.sin[i];
+    double sin_bearing = sin_yaw * bearings.cos[i] + cos_yaw * bearings.sin[i];
+    data->endpoints_x_.push_back(planar_scanner_pose_[0] + obs_range * cos_bearing);
+    data->endpoints_y_.push_back(planar_scanner_pose_[1] + obs_range * sin_bearing);
+    data->endpoint_beams_.push_back(beam_ind);
+  }
+}
+
+void PlanarScanner::updateLikelihoodLUT(double range_max)
+{
+  if (!likelihood_lut_.empty() and likelihood_lut_range_max_ == range_max)
+    return;
+  double z_hit_denom = 2 * sigma_hit_ * sigma_hit_;
+  double z_rand = z_rand_ / range_max;
+  std::function<double(double)> fn;
+  if (model_type_ == PLANAR_MODEL_LIKELIHOOD_FIELD)
+  {
+    fn = [&](double z)
+    {
+      double pz = z_hit_ * std::exp(-(z * z) / z_hit_denom) + z_rand;
+      return pz * pz * pz;
+    };
+  }
+  else if (model_type_ == PLANAR_MODEL_LIKELIHOOD_FIELD_PROB)
+  {
+    fn = [&](double z) { return std::log(z_hit_ * std::exp(-(z * z) / z_hit_denom) + z_rand); };
+  }
+  else
+  {
+    // The Gompertz model's random term does not depend on range_max
+    fn = [&](double z) { return z_hit_ * std::exp(-(z * z) / z_hit_denom) + z_rand_; };
+  }
+  likelihood_lut_.update(fn, map_->getMaxDistanceToObject(), map_->getDistanceStepCount());
+  likelihood_lut_range_max_ = range_max;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Apply the planar sensor model
 bool PlanarScanner::updateSensor(std::shared_ptr<ParticleFilter> pf,
@@ -129,7 +239,7 @@ bool PlanarScanner::updateSensor(std::shared_ptr<ParticleFilter> pf,
     return false;
 
   // Apply the planar sensor model
-  std::function<double(std::shared_ptr<SensorData>, std::shared_ptr<PFSampleSet>)> sensor_fn = (
+  std::function<bool(std::shared_ptr<SensorData>, std::shared_ptr<PFSampleSet>)> sensor_fn = (
           std::bind(&PlanarScanner::applyModelToSampleSet, this,
                     std::placeholders::_1, std::placeholders::_2));
   pf->updateSensor(sensor_fn, data);
@@ -138,205 +248,176 @@ bool PlanarScanner::updateSensor(std::shared_ptr<ParticleFilter> pf,
 
 ////////////////////////////////////////////////////////////////////////////////
 // Apply the planar sensor model to a sample set
-double PlanarScanner::applyModelToSampleSet(std::shared_ptr<SensorData> data,
-                                            std::shared_ptr<PFSampleSet> set)
+bool PlanarScanner::applyModelToSampleSet(std::shared_ptr<SensorData> data,
+                                          std::shared_ptr<PFSampleSet> set)
 {
   if (max_beams_ < 2)
-    return 0.0;
+    return false;
 
-  double rv = 0.0;
   // Apply the planar sensor model
   if (model_type_ == PLANAR_MODEL_BEAM)
-    rv = calcBeamModel(std::dynamic_pointer_cast<PlanarData>(data), set);
+    calcBeamModel(std::dynamic_pointer_cast<PlanarData>(data), set);
   else if (model_type_ == PLANAR_MODEL_LIKELIHOOD_FIELD)
-    rv = calcLikelihoodFieldModel(std::dynamic_pointer_cast<PlanarData>(data), set);
+    calcLikelihoodFieldModel(std::dynamic_pointer_cast<PlanarData>(data), set);
   else if (model_type_ == PLANAR_MODEL_LIKELIHOOD_FIELD_PROB)
-    rv = calcLikelihoodFieldModelProb(std::dynamic_pointer_cast<PlanarData>(data), set);
+    calcLikelihoodFieldModelProb(std::dynamic_pointer_cast<PlanarData>(data), set);
   else if (model_type_ == PLANAR_MODEL_LIKELIHOOD_FIELD_GOMPERTZ)
-    rv = calcLikelihoodFieldModelGompertz(std::dynamic_pointer_cast<PlanarData>(data), set);
+    calcLikelihoodFieldModelGompertz(std::dynamic_pointer_cast<PlanarData>(data), set);
 
   // Apply the any configured correction factors from map
-  if (rv > 0.0)
-  {
-    rv = recalcWeight(set);
-  }
-  return rv;
+  recalcWeight(set);
+  return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Determine the probability for the given pose
-double PlanarScanner::calcBeamModel(std::shared_ptr<PlanarData> data,
-                                    std::shared_ptr<PFSampleSet> set)
+void PlanarScanner::calcBeamModel(std::shared_ptr<PlanarData> data,
+                                  std::shared_ptr<PFSampleSet> set)
 {
-  int i, j, step;
-  double z, pz;
-  double p;
-  double map_range;
-  double obs_range, obs_bearing;
-  double total_weight;
-  PFSample* sample;
-  Eigen::Vector3d pose;
-
-  total_weight = 0.0;
-
-  // Compute the sample weights
-  for (j = 0; j < set->sample_count; j++)
-  {
-    sample = &(set->samples[j]);
-    pose = sample->pose;
-
-    // Take account of the planar scanner pose relative to the robot
-    pose = coordAdd(planar_scanner_pose_, pose);
-
-    p = 1.0;
+  double* log_weight = set->samples.log_weight();
+  int step = (data->range_count_ - 1) / (max_beams_ - 1);
 
-    step = (data->range_count_ - 1) / (max_beams_ - 1);
-    for (i = 0; i < data->range_count_; i += step)
+  // Compute the sample weights, a block of samples at a time
+  auto calc_block = [&](int begin, int end)
+  {
+    for (int j = begin; j < end; j++)
     {
-      obs_range = data->ranges_[i];
-      obs_bearing = data->angles_[i];
-
-      // Compute the range according to the map
-      map_range = map_->calcRange(pose[0], pose[1], pose[2] + obs_bearing, data->range_max_);
-      pz = 0.0;
-
-      // Part 1: good, but noisy, hit
-      z = obs_range - map_range;
-      pz += z_hit_ * std::exp(-(z * z) / (2 * sigma_hit_ * sigma_hit_));
+      // Take account of the planar scanner pose relative to the robot
+      Eigen::Vector3d pose = coordAdd(planar_scanner_pose_, set->samples.getPose(j));
 
-      // Part 2: short reading from unexpected obstacle (e.g., a person)
-      if (z < 0)
-        pz += z_short_ * lambda_short_ * std::exp(-lambda_short_ * obs_range);
+      double p = 1.0;
 
-      // Part 3: Failure to detect obstacle, reported as max-range
-      if (obs_range == data->range_max_)
-        pz += z_max_ * 1.0;
-
-      // Part 4: Random measurements
-      if (obs_range < data->range_max_)
-        pz += z_rand_ * 1.0 / data->range_max_;
-
-      // TODO: outlier rejection for short readings
+      for (int i = 0; i < data->range_count_; i += step)
+      {
+        double obs_range = data->ranges_[i];
+        double obs_bearing = data->bearings_->angles[i];
+
+        // Compute the range according to the map
+        double map_range;
+        if (range_lut_bearing_count_ > 0)
+          map_range = map_->lookupRange(pose[0], pose[1], pose[2] + obs_bearing, data->range_max_);
+        else
+          map_range = map_->calcRange(pose[0], pose[1], pose[2] + obs_bearing, data->range_max_);
+        double pz = 0.0;
+
+        // Part 1: good, but noisy, hit
+        double z = obs_range - map_range;
+        pz += z_hit_ * std::exp(-(z * z) / (2 * sigma_hit_ * sigma_hit_));
+
+        // Part 2: short reading from unexpected obstacle (e.g., a person)
+        if (z < 0)
+          pz += z_short_ * lambda_short_ * std::exp(-lambda_short_ * obs_range);
+
+        // Part 3: Failure to detect obstacle, reported as max-range
+        if (obs_range == data->range_max_)
+          pz += z_max_ * 1.0;
+
+        // Part 4: Random measurements
+        if (obs_range < data->range_max_)
+          pz += z_rand_ * 1.0 / data->range_max_;
+
+        // TODO: outlier rejection for short readings
+
+        ROS_ASSERT(pz <= 1.0);
+        ROS_ASSERT(pz >= 0.0);
+        //      p *= pz;
+        // here we have an ad-hoc weighting scheme for combining beam probs
+        // works well, though...
+        p += pz * pz * pz;
+      }
 
-      ROS_ASSERT(pz <= 1.0);
-      ROS_ASSERT(pz >= 0.0);
-      //      p *= pz;
-      // here we have an ad-hoc weighting scheme for combining beam probs
-      // works well, though...
-      p += pz * pz * pz;
+      log_weight[j] += std::log(p);
     }
+  };
 
-    sample->weight *= p;
-    total_weight += sample->weight;
-  }
-
-  return total_weight;
+  thread_pool_->parallelFor(set->sample_count, PF_SAMPLE_BLOCK_SIZE, calc_block);
 }
 
-double PlanarScanner::calcLikelihoodFieldModel(std::shared_ptr<PlanarData> data,
-                                               std::shared_ptr<PFSampleSet> set)
+void PlanarScanner::calcLikelihoodFieldModel(std::shared_ptr<PlanarData> data,
+                                             std::shared_ptr<PFSampleSet> set)
 {
-  int i, j, step;
-  double z, pz;
-  double p;
-  double obs_range, obs_bearing;
-  double total_weight;
-  PFSample* sample;
-  Eigen::Vector3d pose;
-  Eigen::Vector3d hit;
-
-  total_weight = 0.0;
-
-  // Compute the sample weights
-  for (j = 0; j < set->sample_count; j++)
-  {
-    sample = &(set->samples[j]);
-    pose = sample->pose;
+  double* log_weight = set->samples.log_weight();
 
-    // Take account of the planar scanner pose relative to the robot
-    pose = coordAdd(planar_scanner_pose_, pose);
+  // Pre-compute a couple of things
+  double z_hit_denom = 2 * sigma_hit_ * sigma_hit_;
+  double z_rand_mult = 1.0 / data->range_max_;
 
-    p = 1.0;
+  int step = (data->range_count_ - 1) / (max_beams_ - 1);
 
-    // Pre-compute a couple of things
-    double z_hit_denom = 2 * sigma_hit_ * sigma_hit_;
-    double z_rand_mult = 1.0 / data->range_max_;
+  // Step size must be at least 1
+  if (step < 1)
+    step = 1;
 
-    step = (data->range_count_ - 1) / (max_beams_ - 1);
+  if (use_likelihood_lut_)
+    updateLikelihoodLUT(data->range_max_);
 
-    // Step size must be at least 1
-    if (step < 1)
-      step = 1;
+  updateEndpoints(data, step);
+  const double* endpoints_x = data->endpoints_x_.data();
+  const double* endpoints_y = data->endpoints_y_.data();
+  int endpoint_count = data->endpoints_x_.size();
 
-    for (i = 0; i < data->range_count_; i += step)
+  // Compute the sample weights, a block of samples at a time
+  auto calc_block = [&](int begin, int end)
+  {
+    for (int j = begin; j < end; j++)
     {
-      obs_range = data->ranges_[i];
-      obs_bearing = data->angles_[i];
+      // The endpoints already take account of the planar scanner pose relative to the robot
+      Eigen::Vector3d pose = set->samples.getPose(j);
+      double cos_yaw = std::cos(pose[2]);
+      double sin_yaw = std::sin(pose[2]);
 
-      // This model ignores max range readings
-      if (obs_range >= data->range_max_)
-        continue;
+      double p = 1.0;
 
-      // Check for NaN
-      if (obs_range != obs_range)
-        continue;
+      for (int k = 0; k < endpoint_count; k++)
+      {
+        double z;
+        double pz = 0.0;
 
-      pz = 0.0;
+        // Compute the endpoint of the beam, in map grid coords
+        int map_i, map_j;
+        map_->convertWorldToMap(pose[0] + cos_yaw * endpoints_x[k] - sin_yaw * endpoints_y[k],
+                                pose[1] + sin_yaw * endpoints_x[k] + cos_yaw * endpoints_y[k], &map_i, &map_j);
 
-      // Compute the endpoint of the beam
-      hit[0] = pose[0] + obs_range * std::cos(pose[2] + obs_bearing);
-      hit[1] = pose[1] + obs_range * std::sin(pose[2] + obs_bearing);
+        if (use_likelihood_lut_)
+        {
+          // Off-map is the last step, the max distance
+          p += likelihood_lut_.get(map_->getDistanceStep(map_i, map_j));
+          continue;
+        }
 
-      // Convert to map_ grid coords.
-      world_vec_[0] = hit[0];
-      world_vec_[1] = hit[1];
-      map_->convertWorldToMap(world_vec_, &map_vec_);
+        // Part 1: Get distance from the hit to closest obstacle.
+        // Off-map penalized as max distance
+        z = map_->getDistanceToObject(map_i, map_j);
+        // Gaussian model
+        // NOTE: this should have a normalization of 1/(sqrt(2pi)*sigma)
+        pz += z_hit_ * std::exp(-(z * z) / z_hit_denom);
+        // Part 2: random measurements
+        pz += z_rand_ * z_rand_mult;
+
+        // TODO: outlier rejection for short readings
+
+        ROS_ASSERT(pz <= 1.0);
+        ROS_ASSERT(pz >= 0.0);
+        //      p *= pz;
+        // here we have an ad-hoc weighting scheme for combining beam probs
+        // works well, though...
+        // TODO: investigate schemes for combining beam probs
+        p += pz * pz * pz;
+      }
 
-      // Part 1: Get distance from the hit to closest obstacle.
-      // Off-map penalized as max distance
-      if (!map_->isValid(map_vec_))
-        z = map_->getMaxDistanceToObject();
-      else
-        z = map_->getDistanceToObject(map_vec_[0], map_vec_[1]);
-      // Gaussian model
-      // NOTE: this should have a normalization of 1/(sqrt(2pi)*sigma)
-      pz += z_hit_ * std::exp(-(z * z) / z_hit_denom);
-      // Part 2: random measurements
-      pz += z_rand_ * z_rand_mult;
-
-      // TODO: outlier rejection for short readings
-
-      ROS_ASSERT(pz <= 1.0);
-      ROS_ASSERT(pz >= 0.0);
-      //      p *= pz;
-      // here we have an ad-hoc weighting scheme for combining beam probs
-      // works well, though...
-      // TODO: investigate schemes for combining beam probs
-      p += pz * pz * pz;
+      log_weight[j] += std::log(p);
     }
+  };
 
-    sample->weight *= p;
-    total_weight += sample->weight;
-  }
-
-  return total_weight;
+  thread_pool_->parallelFor(set->sample_count, PF_SAMPLE_BLOCK_SIZE, calc_block);
 }
 
-double PlanarScanner::calcLikelihoodFieldModelProb(std::shared_ptr<PlanarData> data,
-                                                   std::shared_ptr<PFSampleSet> set)
+void PlanarScanner::calcLikelihoodFieldModelProb(std::shared_ptr<PlanarData> data,
+                                                 std::shared_ptr<PFSampleSet> set)
 {
-  int i, j, step;
-  double z, pz;
-  double log_p;
-  double obs_range, obs_bearing;
-  double total_weight;
-  PFSample* sample;
-  Eigen::Vector3d pose;
-  Eigen::Vector3d hit;
-
-  total_weight = 0.0;
+  double* log_weight = set->samples.log_weight();
 
-  step = std::ceil((data->range_count_) / static_cast<double>(max_beams_));
+  int step = std::ceil((data->range_count_) / static_cast<double>(max_beams_));
 
   // Step size must be at least 1
   if (step < 1)
@@ -363,125 +444,121 @@ double PlanarScanner::calcLikelihoodFieldModelProb(std::shared_ptr<PlanarData> d
     do_beamskip = false;
   }
 
+  // Beam skipping needs each distance, so only tabulate without it
+  bool use_likelihood_lut = use_likelihood_lut_ and !do_beamskip;
+  if (use_likelihood_lut)
+    updateLikelihoodLUT(data->range_max_);
+
   // we need a count the no of particles for which the beam agreed with the map
   std::vector<int> obs_count(max_beams_);
+  std::mutex obs_count_mutex;
 
   // we also need a mask of which observations to integrate
   // (to decide which beams to integrate to all particles)
   std::vector<bool> obs_mask(max_beams_);
 
-  int beam_ind = 0;
-
-  // clear_temp indicates if we need to clear the temp data structure needed to do beamskipping
-  bool clear_temp = false;
-
+  // Beam skipping keeps the probability of every beam for every sample, one row per sample.
+  // Beams that are not integrated keep a probability of one.
   if (do_beamskip)
   {
-    if (max_obs_ < max_beams_)
-    {
-      clear_temp = true;
-    }
-
-    if (max_samples_ < set->sample_count)
-    {
-      clear_temp = true;
-    }
-
-    if (clear_temp)
-    {
-      clearTempData(set->sample_count, max_beams_);
-      ROS_DEBUG_STREAM("Clearing temp weights " << max_samples_ << " - " << max_obs_);
-    }
+    temp_obs_.assign(set->sample_count * max_beams_, 1.0);
   }
 
-  // Compute the sample weights
-  for (j = 0; j < set->sample_count; j++)
-  {
-    sample = &(set->samples[j]);
-    pose = sample->pose;
-
-    // Take account of the planar scanner pose relative to the robot
-    pose = coordAdd(planar_scanner_pose_, pose);
-
-    log_p = 0;
+  updateEndpoints(data, step);
+  const double* endpoints_x = data->endpoints_x_.data();
+  const double* endpoints_y = data->endpoints_y_.data();
+  const int* endpoint_beams = data->endpoint_beams_.data();
+  int endpoint_count = data->endpoints_x_.size();
+  std::vector<int> map_size = map_->getSize();
 
-    beam_ind = 0;
-
-    for (i = 0; i < data->range_count_; i += step, beam_ind++)
+  // Compute the sample weights, a block of samples at a time
+  auto calc_block = [&](int begin, int end)
+  {
+    std::vector<int> block_obs_count(do_beamskip ? max_beams_ : 0);
+    for (int j = begin; j < end; j++)
     {
-      obs_range = data->ranges_[i];
-      obs_bearing = data->angles_[i];
+      // The endpoints already take account of the planar scanner pose relative to the robot
+      Eigen::Vector3d pose = set->samples.getPose(j);
+      double cos_yaw = std::cos(pose[2]);
+      double sin_yaw = std::sin(pose[2]);
 
-      // This model ignores max range readings
-      if (obs_range >= data->range_max_)
-      {
-        continue;
-      }
+      double log_p = 0;
 
-      // Check for NaN
-      if (obs_range != obs_range)
+      for (int k = 0; k < endpoint_count; k++)
       {
-        continue;
-      }
-
-      pz = 0.0;
+        int beam_ind = endpoint_beams[k];
+        double pz = 0.0;
 
-      // Compute the endpoint of the beam
-      hit[0] = pose[0] + obs_range * std::cos(pose[2] + obs_bearing);
-      hit[1] = pose[1] + obs_range * std::sin(pose[2] + obs_bearing);
+        // Compute the endpoint of the beam, in map grid coords
+        int map_i, map_j;
+        map_->convertWorldToMap(pose[0] + cos_yaw * endpoints_x[k] - sin_yaw * endpoints_y[k],
+                                pose[1] + sin_yaw * endpoints_x[k] + cos_yaw * endpoints_y[k], &map_i, &map_j);
 
-      // Convert to map grid coords.
-      world_vec_[0] = hit[0];
-      world_vec_[1] = hit[1];
-      map_->convertWorldToMap(world_vec_, &map_vec_);
+        if (use_likelihood_lut)
+        {
+          log_p += likelihood_lut_.get(map_->getDistanceStep(map_i, map_j));
+          continue;
+        }
 
-      // Part 1: Get distance from the hit to closest obstacle.
-      // Off-map penalized as max distance
+        // Part 1: Get distance from the hit to closest obstacle.
+        // Off-map penalized as max distance
 
-      if (!map_->isValid(map_vec_))
-      {
-        pz += z_hit_ * max_dist_prob;
-      }
-      else
-      {
-        z = map_->getDistanceToObject(map_vec_[0], map_vec_[1]);
-        if (z < beam_skip_distance)
+        if (map_i < 0 or map_i >= map_size[0] or map_j < 0 or map_j >= map_size[1])
         {
-          obs_count[beam_ind] += 1;
+          pz += z_hit_ * max_dist_prob;
+        }
+        else
+        {
+          double z = map_->getDistanceToObject(map_i, map_j);
+          if (do_beamskip && z < beam_skip_distance)
+          {
+            block_obs_count[beam_ind] += 1;
+          }
+          pz += z_hit_ * std::exp(-(z * z) / z_hit_denom);
         }
-        pz += z_hit_ * std::exp(-(z * z) / z_hit_denom);
-      }
 
-      // Gaussian model
-      // NOTE: this should have a normalization of 1/(sqrt(2pi)*sigma)
+        // Gaussian model
+        // NOTE: this should have a normalization of 1/(sqrt(2pi)*sigma)
 
-      // Part 2: random measurements
-      pz += z_rand_ * z_rand_mult;
+        // Part 2: random measurements
+        pz += z_rand_ * z_rand_mult;
 
-      ROS_ASSERT(pz <= 1.0);
-      ROS_ASSERT(pz >= 0.0);
+        ROS_ASSERT(pz <= 1.0);
+        ROS_ASSERT(pz >= 0.0);
 
-      // TODO: outlier rejection for short readings
+        // TODO: outlier rejection for short readings
 
-      if (!do_beamskip)
-      {
-        log_p += std::log(pz);
+        if (!do_beamskip)
+        {
+          log_p += std::log(pz);
+        }
+        else
+        {
+          temp_obs_[j * max_beams_ + beam_ind] = pz;
+        }
       }
-      else
+      if (!do_beamskip)
       {
-        temp_obs_[j][beam_ind] = pz;
+        log_weight[j] += log_p;
       }
     }
-    if (!do_beamskip)
+
+    if (do_beamskip)
     {
-      sample->weight *= std::exp(log_p);
-      total_weight += sample->weight;
+      std::lock_guard<std::mutex> lock(obs_count_mutex);
+      for (int beam_ind = 0; beam_ind < max_beams_; beam_ind++)
+      {
+        obs_count[beam_ind] += block_obs_count[beam_ind];
+      }
     }
-  }
+  };
+
+  thread_pool_->parallelFor(set->sample_count, PF_SAMPLE_BLOCK_SIZE, calc_block);
 
   if (do_beamskip)
   {
     int skipped_beam_count = 0;
+    int beam_ind;
     for (beam_ind = 0; beam_ind < max_beams_; beam_ind++)
     {
       if ((obs_count[beam_ind] / static_cast<double>(set->sample_count)) > beam_skip_threshold)
@@ -509,27 +586,27 @@ double PlanarScanner::calcLikelihoodFieldModelProb(std::shared_ptr<PlanarData> d
       error = true;
     }
 
-    for (j = 0; j < set->sample_count; j++)
+    auto integrate_block = [&](int begin, int end)
     {
-      sample = &(set->samples[j]);
-      pose = sample->pose;
-
-      log_p = 0;
-
-      for (beam_ind = 0; beam_ind < max_beams_; beam_ind++)
+      for (int j = begin; j < end; j++)
       {
-        if (error || obs_mask[beam_ind])
+        const double* obs = &temp_obs_[j * max_beams_];
+        double log_p = 0;
+
+        for (int beam_ind = 0; beam_ind < max_beams_; beam_ind++)
         {
-          log_p += std::log(temp_obs_[j][beam_ind]);
+          if (error || obs_mask[beam_ind])
+          {
+            log_p += std::log(obs[beam_ind]);
+          }
         }
+
+        log_weight[j] += log_p;
       }
+    };
 
-      sample->weight *= std::exp(log_p);
-      total_weight += sample->weight;
-    }
+    thread_pool_->parallelFor(set->sample_count, PF_SAMPLE_BLOCK_SIZE, integrate_block);
   }
-
-  return total_weight;
 }
 
 void PlanarScanner::setPlanarScannerPose(const Eigen::Vector3d& scanner_pose)
@@ -549,144 +626,131 @@ double PlanarScanner::applyGompertz(double p)
   return p;
 }
 
-double PlanarScanner::calcLikelihoodFieldModelGompertz(std::shared_ptr<PlanarData> data,
-                                                       std::shared_ptr<PFSampleSet> set)
+void PlanarScanner::calcLikelihoodFieldModelGompertz(std::shared_ptr<PlanarData> data,
+                                                     std::shared_ptr<PFSampleSet> set)
 {
-  int i, j, step;
-  double z, pz;
-  double p;
-  double obs_range, obs_bearing;
-  double total_weight;
-  PFSample* sample;
-  Eigen::Vector3d pose;
-  Eigen::Vector3d hit;
-
-  total_weight = 0.0;
-
-  // Compute the sample weights
-  for (j = 0; j < set->sample_count; j++)
-  {
-    sample = &(set->samples[j]);
-    pose = sample->pose;
+  double* log_weight = set->samples.log_weight();
 
-    // Take account of the planar scanner pose relative to the robot
-    pose = coordAdd(planar_scanner_pose_, pose);
-
-    // Pre-compute a couple of things
-    double z_hit_denom = 2 * sigma_hit_ * sigma_hit_;
-
-    step = (data->range_count_ - 1) / (max_beams_ - 1);
+  // Pre-compute a couple of things
+  double z_hit_denom = 2 * sigma_hit_ * sigma_hit_;
 
-    // Step size must be at least 1
-    if (step < 1)
-      step = 1;
+  int step = (data->range_count_ - 1) / (max_beams_ - 1);
 
-    int valid_beams = 0;
-    double sum_pz = 0.0;
-    for (i = 0; i < data->range_count_; i += step)
-    {
-      obs_range = data->ranges_[i];
-      obs_bearing = data->angles_[i];
+  // Step size must be at least 1
+  if (step < 1)
+    step = 1;
 
-      // This model ignores max range readings
-      if (obs_range >= data->range_max_)
-        continue;
+  if (use_likelihood_lut_)
+    updateLikelihoodLUT(data->range_max_);
 
-      // Check for NaN
-      if (obs_range != obs_range)
-        continue;
+  updateEndpoints(data, step);
+  const double* endpoints_x = data->endpoints_x_.data();
+  const double* endpoints_y = data->endpoints_y_.data();
+  int endpoint_count = data->endpoints_x_.size();
 
-      valid_beams++;
-      pz = 0.0;
+  // Compute the sample weights, a block of samples at a time
+  auto calc_block = [&](int begin, int end)
+  {
+    for (int j = begin; j < end; j++)
+    {
+      // The endpoints already take account of the planar scanner pose relative to the robot
+      Eigen::Vector3d pose = set->samples.getPose(j);
+      double cos_yaw = std::cos(pose[2]);
+      double sin_yaw = std::sin(pose[2]);
+
+      double p;
+      int valid_beams = endpoint_count;
+      double sum_pz = 0.0;
+      for (int k = 0; k < endpoint_count; k++)
+      {
+        double z;
+        double pz = 0.0;
+
+        // Compute the endpoint of the beam, in map grid coords
+        int map_i, map_j;
+        map_->convertWorldToMap(pose[0] + cos_yaw * endpoints_x[k] - sin_yaw * endpoints_y[k],
+                                pose[1] + sin_yaw * endpoints_x[k] + cos_yaw * endpoints_y[k], &map_i, &map_j);
+        if (use_likelihood_lut_)
+        {
+          sum_pz += likelihood_lut_.get(map_->getDistanceStep(map_i, map_j));
+          continue;
+        }
+        // Part 1: Get distance from the hit to closest obstacle.
+        // Off-map penalized as max distance
+        z = map_->getDistanceToObject(map_i, map_j);
+        // Gaussian model
+        pz += z_hit_ * std::exp(-(z * z) / z_hit_denom);
+        // Part 2: random measurements
+        pz += z_rand_;
 
-      // Compute the endpoint of the beam
-      hit[0] = pose[0] + obs_range * std::cos(pose[2] + obs_bearing);
-      hit[1] = pose[1] + obs_range * std::sin(pose[2] + obs_bearing);
+        sum_pz += pz;
+      }
 
-      // Convert to map grid coords.
-      world_vec_[0] = hit[0];
-      world_vec_[1] = hit[1];
-      map_->convertWorldToMap(world_vec_, &map_vec_);
-      // Part 1: Get distance from the hit to closest obstacle.
-      // Off-map penalized as max distance
-      if (!map_->isValid(map_vec_))
-        z = map_->getMaxDistanceToObject();
+      if (valid_beams > 0)
+      {
+        p = sum_pz / valid_beams;
+        p = applyGompertz(p);
+      }
       else
-        z = map_->getDistanceToObject(map_vec_[0], map_vec_[1]);
-      // Gaussian model
-      pz += z_hit_ * std::exp(-(z * z) / z_hit_denom);
-      // Part 2: random measurements
-      pz += z_rand_;
-
-      sum_pz += pz;
-    }
+      {
+        // Hmm. No valid beams. Don't change the weight.
+        p = 1.0;
+      }
 
-    if (valid_beams > 0)
-    {
-      p = sum_pz / valid_beams;
-      p = applyGompertz(p);
-    }
-    else
-    {
-      // Hmm. No valid beams. Don't change the weight.
-      p = 1.0;
+      // The shifted Gompertz function can reach zero or below
+      if (p > 0.0)
+        log_weight[j] += std::log(p);
+      else
+        log_weight[j] = -std::numeric_limits<double>::infinity();
     }
+  };
 
-    sample->weight *= p;
-    total_weight += sample->weight;
-  }
-
-  return total_weight;
+  thread_pool_->parallelFor(set->sample_count, PF_SAMPLE_BLOCK_SIZE, calc_block);
 }
 
-double PlanarScanner::recalcWeight(std::shared_ptr<PFSampleSet> set)
+void PlanarScanner::recalcWeight(std::shared_ptr<PFSampleSet> set)
 {
-  double rv = 0.0;
-  PFSample* sample;
-  Eigen::Vector3d pose;
-  for (int j = 0; j < set->sample_count; j++)
+  double* log_weight = set->samples.log_weight();
+  double log_off_map_factor = std::log(off_map_factor_);
+  double log_non_free_space_factor = std::log(non_free_space_factor_);
+  auto recalc_block = [&](int begin, int end)
   {
-    sample = &(set->samples[j]);
-    pose = sample->pose;
+    std::vector<double> world_vec(2);
+    std::vector<int> map_vec(2);
+    for (int j = begin; j < end; j++)
+    {
+      Eigen::Vector3d pose = set->samples.getPose(j);
 
-    // Convert to map grid coords.
-    world_vec_[0] = pose[0];
-    world_vec_[1] = pose[1];
-    map_->convertWorldToMap(world_vec_, &map_vec_);
+      // Convert to map grid coords.
+      world_vec[0] = pose[0];
+      world_vec[1] = pose[1];
+      map_->convertWorldToMap(world_vec, &map_vec);
 
-    // Apply off map factor
-    if (!map_->isValid(map_vec_))
-    {
-      sample->weight *= off_map_factor_;
-    }
-    // Apply non free space factor
-    else if (map_->getCellState(map_vec_[0], map_vec_[1]) != MapCellState::CELL_FREE)
-    {
-      sample->weight *= non_free_space_factor_;
-    }
-    // Interpolate non free space factor based on radius
-    else
-    {
-      double distance = map_->getDistanceToObject(map_vec_[0], map_vec_[1]);
-      if (distance < non_free_space_radius_)
+      // Apply off map factor
+      if (!map_->isValid(map_vec))
+      {
+        log_weight[j] += log_off_map_factor;
+      }
+      // Apply non free space factor
+      else if (map_->getCellState(map_vec[0], map_vec[1]) != MapCellState::CELL_FREE)
       {
-        double delta_d = map_->getDistanceToObject(map_vec_[0], map_vec_[1]) / non_free_space_radius_;
-        double f = non_free_space_factor_;
-        f += delta_d * (1.0 - non_free_space_factor_);
-        sample->weight *= f;
+        log_weight[j] += log_non_free_space_factor;
+      }
+      // Interpolate non free space factor based on radius
+      else
+      {
+        double distance = map_->getDistanceToObject(map_vec[0], map_vec[1]);
+        if (distance < non_free_space_radius_)
+        {
+          double delta_d = distance / non_free_space_radius_;
+          double f = non_free_space_factor_;
+          f += delta_d * (1.0 - non_free_space_factor_);
+          log_weight[j] += std::log(f);
+        }
       }
     }
-    rv += sample->weight;
-  }
-  return rv;
-}
-
-void PlanarScanner::clearTempData(int new_max_samples, int new_max_obs)
-{
-  max_obs_ = new_max_obs;
-  max_samples_ = fmax(max_samples_, new_max_samples);
-  temp_obs_.clear();
-  temp_obs_.resize(max_samples_, std::vector<double>(max_obs_, 0.0));
+  };
+  thread_pool_->parallelFor(set->sample_count, PF_SAMPLE_BLOCK_SIZE, recalc_block);
 }
 
 // Transform from local to global coords (a + b)
@@ -0,0 +1,332 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "sensors/point_cloud_preprocessor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace badger_amcl
+{
+
+// Voxel coordinates are packed into 21 bits each, offset to be positive
+static const int VOXEL_KEY_BITS = 21;
+static const int64_t VOXEL_KEY_OFFSET = int64_t(1) << (VOXEL_KEY_BITS - 1);
+
+namespace
+{
+
+// Points read in place from the x, y and z fields of a cloud, the same way
+// a PointCloud2ConstIterator steps through them
+class CloudPoints
+{
+public:
+  CloudPoints(const sensor_msgs::PointCloud2& cloud, const uint32_t offsets[3])
+      : data_(cloud.data.data()), point_step_(cloud.point_step)
+  {
+    size_t count = static_cast<size_t>(cloud.width) * cloud.height;
+    size_ = std::min(count, cloud.data.size() / point_step_);
+    for (int axis = 0; axis < 3; axis++)
+      offsets_[axis] = offsets[axis];
+  }
+
+  int size() const
+  {
+    return size_;
+  }
+
+  void get(int i, float* x, float* y, float* z) const
+  {
+    // The fields need not be aligned in the buffer
+    const uint8_t* point = data_ + static_cast<size_t>(i) * point_step_;
+    std::memcpy(x, point + offsets_[0], sizeof(float));
+    std::memcpy(y, point + offsets_[1], sizeof(float));
+    std::memcpy(z, point + offsets_[2], sizeof(float));
+  }
+
+private:
+  const uint8_t* data_;
+  size_t point_step_;
+  int size_;
+  uint32_t offsets_[3];
+};
+
+// Points held one array per axis
+class ArrayPoints
+{
+public:
+  ArrayPoints(const std::vector<float>& x, const std::vector<float>& y, const std::vector<float>& z)
+      : x_(x), y_(y), z_(z)
+  {
+  }
+
+  int size() const
+  {
+    return x_.size();
+  }
+
+  void get(int i, float* x, float* y, float* z) const
+  {
+    *x = x_[i];
+    *y = y_[i];
+    *z = z_[i];
+  }
+
+private:
+  const std::vector<float>& x_;
+  const std::vector<float>& y_;
+  const std::vector<float>& z_;
+};
+
+// Find where the float x, y and z fields are in each point of cloud
+bool findFieldOffsets(const sensor_msgs::PointCloud2& cloud, uint32_t offsets[3])
+{
+  const char* names[3] = {"x", "y", "z"};
+  for (int axis = 0; axis < 3; axis++)
+  {
+    auto field = std::find_if(cloud.fields.begin(), cloud.fields.end(),
+                              [&](const sensor_msgs::PointField& f) { return f.name == names[axis]; });
+    if (field == cloud.fields.end() or field->datatype != sensor_msgs::PointField::FLOAT32
+        or field->offset + sizeof(float) > cloud.point_step)
+      return false;
+    offsets[axis] = field->offset;
+  }
+  return true;
+}
+
+}  // namespace
+
+PointCloudPreprocessor::PointCloudPreprocessor()
+    : voxel_size_(0.0),
+      min_height_(0.0),
+      max_height_(0.0),
+      subsample_type_(POINT_CLOUD_SUBSAMPLE_STRIDE),
+      max_points_(0),
+      scan_count_(0),
+      stats_{0, 0, 0, 0, 0.0}
+{
+}
+
+void PointCloudPreprocessor::setVoxelSize(double voxel_size)
+{
+  voxel_size_ = voxel_size;
+}
+
+void PointCloudPreprocessor::setHeightBand(double min_height, double max_height)
+{
+  min_height_ = min_height;
+  max_height_ = max_height;
+}
+
+void PointCloudPreprocessor::setSubsampleType(PointCloudSubsampleType subsample_type)
+{
+  subsample_type_ = subsample_type;
+}
+
+void PointCloudPreprocessor::setMaxPoints(int max_points)
+{
+  max_points_ = max_points;
+}
+
+bool PointCloudPreprocessor::process(const sensor_msgs::PointCloud2& cloud,
+                                     const tf2::Transform& scanner_to_footprint_tf,
+                                     PointCloudData* data)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  uint32_t offsets[3];
+  if (not findFieldOffsets(cloud, offsets))
+    return false;
+  CloudPoints cloud_points(cloud, offsets);
+  rng_ = RandomService::createStream(RANDOM_STREAM_PREPROCESS, scan_count_++);
+  stats_.input_count = cloud_points.size();
+  if (voxel_size_ > 0.0)
+  {
+    averageVoxels(cloud_points);
+    stats_.voxel_count = voxel_x_.size();
+    selectPoints(ArrayPoints(voxel_x_, voxel_y_, voxel_z_), scanner_to_footprint_tf, data);
+  }
+  else
+  {
+    stats_.voxel_count = stats_.input_count;
+    selectPoints(cloud_points, scanner_to_footprint_tf, data);
+  }
+  stats_.output_count = data->points_x_.size();
+  stats_.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return true;
+}
+
+const PointCloudPreprocessorStats& PointCloudPreprocessor::getStats() const
+{
+  return stats_;
+}
+
+// Fill voxel_x_, voxel_y_ and voxel_z_ with the finite points, averaged
+// over each voxel
+template <typename Points>
+void PointCloudPreprocessor::averageVoxels(const Points& points)
+{
+  voxel_x_.clear();
+  voxel_y_.clear();
+  voxel_z_.clear();
+
+  // Sort the points by voxel, then average each run of the same voxel
+  voxel_keys_.clear();
+  voxel_keys_.reserve(points.size());
+  const uint64_t mask = (uint64_t(1) << VOXEL_KEY_BITS) - 1;
+  for (int i = 0; i < points.size(); i++)
+  {
+    float x, y, z;
+    points.get(i, &x, &y, &z);
+    if (not (std::isfinite(x) and std::isfinite(y) and std::isfinite(z)))
+      continue;
+    uint64_t key = 0;
+    for (float coord : {x, y, z})
+    {
+      int64_t cell = static_cast<int64_t>(std::floor(coord / voxel_size_)) + VOXEL_KEY_OFFSET;
+      key = (key << VOXEL_KEY_BITS) | (static_cast<uint64_t>(cell) & mask);
+    }
+    voxel_keys_.push_back(std::make_pair(key, i));
+  }
+  std::sort(voxel_keys_.begin(), voxel_keys_.end());
+  for (int begin = 0; begin < voxel_keys_.size();)
+  {
+    double sum_x = 0.0, sum_y = 0.0, sum_z = 0.0;
+    int end = begin;
+    for (; end < voxel_keys_.size() and voxel_keys_[end].first == voxel_keys_[begin].first; end++)
+    {
+      float x, y, z;
+      points.get(voxel_keys_[end].second, &x, &y, &z);
+      sum_x += x;
+      sum_y += y;
+      sum_z += z;
+    }
+    int count = end - begin;
+    voxel_x_.push_back(sum_x / count);
+    voxel_y_.push_back(sum_y / count);
+    voxel_z_.push_back(sum_z / count);
+    begin = end;
+  }
+}
+
+// Gather the indices of the finite points within the height band, subsample
+// them, and copy out only the points kept
+template <typename Points>
+void PointCloudPreprocessor::selectPoints(const Points& points, const tf2::Transform& scanner_to_footprint_tf,
+                                          PointCloudData* data)
+{
+  bool crop_heights = max_height_ > min_height_;
+  indices_.clear();
+  indices_.reserve(points.size());
+  for (int i = 0; i < points.size(); i++)
+  {
+    float x, y, z;
+    points.get(i, &x, &y, &z);
+    if (not (std::isfinite(x) and std::isfinite(y) and std::isfinite(z)))
+      continue;
+    if (crop_heights)
+    {
+      double height = (scanner_to_footprint_tf * tf2::Vector3(x, y, z)).z();
+      if (height < min_height_ or height > max_height_)
+        continue;
+    }
+    indices_.push_back(i);
+  }
+  stats_.band_count = indices_.size();
+  subsample(points);
+
+  int count = indices_.size();
+  data->points_x_.resize(count);
+  data->points_y_.resize(count);
+  data->points_z_.resize(count);
+  for (int n = 0; n < count; n++)
+    points.get(indices_[n], &data->points_x_[n], &data->points_y_[n], &data->points_z_[n]);
+}
+
+// Reduce indices_ to at most max_points_ of its points
+template <typename Points>
+void PointCloudPreprocessor::subsample(const Points& points)
+{
+  int count = indices_.size();
+  if (max_points_ <= 0 or count <= max_points_)
+  {
+    return;
+  }
+  else if (subsample_type_ == POINT_CLOUD_SUBSAMPLE_RANDOM)
+  {
+    // A partial Fisher-Yates shuffle picks the points; they are then put
+    // back in scan order
+    for (int i = 0; i < max_points_; i++)
+    {
+      int j = i + std::min(static_cast<int>(rng_.uniform() * (count - i)), count - i - 1);
+      std::swap(indices_[i], indices_[j]);
+    }
+    std::sort(indices_.begin(), indices_.begin() + max_points_);
+    indices_.resize(max_points_);
+  }
+  else if (subsample_type_ == POINT_CLOUD_SUBSAMPLE_FARTHEST)
+  {
+    subsampleFarthest(points);
+  }
+  else
+  {
+    int step = max_points_ > 1 ? std::max(1, (count - 1) / (max_points_ - 1)) : count;
+    int kept = 0;
+    for (int i = 0; i < count; i += step)
+      indices_[kept++] = indices_[i];
+    indices_.resize(kept);
+  }
+}
+
+// Greedy farthest point sampling, starting from the first point
+template <typename Points>
+void PointCloudPreprocessor::subsampleFarthest(const Points& points)
+{
+  int count = indices_.size();
+  distances_.assign(count, std::numeric_limits<float>::max());
+  selected_.clear();
+  selected_.reserve(max_points_);
+  int next = 0;
+  for (int n = 0; n < max_points_; n++)
+  {
+    selected_.push_back(indices_[next]);
+    float taken_x, taken_y, taken_z;
+    points.get(indices_[next], &taken_x, &taken_y, &taken_z);
+    float farthest_distance = -1.0f;
+    for (int i = 0; i < count; i++)
+    {
+      float x, y, z;
+      points.get(indices_[i], &x, &y, &z);
+      float dx = x - taken_x;
+      float dy = y - taken_y;
+      float dz = z - taken_z;
+      distances_[i] = std::min(distances_[i], dx * dx + dy * dy + dz * dz);
+      if (distances_[i] > farthest_distance)
+      {
+        farthest_distance = distances_[i];
+        next = i;
+      }
+    }
+  }
+  indices_.swap(selected_);
+}
+
+}  // namespace amcl
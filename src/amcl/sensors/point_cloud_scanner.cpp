@@ -19,15 +19,13 @@
 
 #include "sensors/point_cloud_scanner.h"
 
+#include <algorithm>
 #include <cmath>
 #include <functional>
+#include <limits>
 
-#include <pcl_conversions/pcl_conversions.h>
-#include <pcl_ros/transforms.h>
 #include <ros/assert.h>
-#include <tf/exceptions.h>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
-#include <tf2_sensor_msgs/tf2_sensor_msgs.h>
 
 namespace badger_amcl
 {
@@ -35,24 +33,28 @@ namespace badger_amcl
 PointCloudScanner::PointCloudScanner() : Sensor()
 {
   max_beams_ = 0;
+  use_likelihood_lut_ = false;
 
   off_map_factor_ = 1.0;
   non_free_space_factor_ = 1.0;
   non_free_space_radius_ = 0.0;
 
-  map_vec_.resize(3);
-  world_vec_.resize(3);
+  yaw_bin_width_ = 0.0;
+  yaw_bin_count_ = 0;
+  rotated_bin_ = -1;
 }
 
 void PointCloudScanner::init(int max_beams, std::shared_ptr<OctoMap> map)
 {
   max_beams_ = max_beams;
   map_ = map;
+  likelihood_lut_.clear();
 }
 
 void PointCloudScanner::setPointCloudModel(double z_hit, double z_rand, double sigma_hit)
 {
   model_type_ = POINT_CLOUD_MODEL;
+  likelihood_lut_.clear();
   z_hit_ = z_hit;
   z_rand_ = z_rand;
   sigma_hit_ = sigma_hit;
@@ -63,6 +65,7 @@ void PointCloudScanner::setPointCloudModelGompertz(double z_hit, double z_rand,
                                                    double input_scale, double output_shift)
 {
   model_type_ = POINT_CLOUD_MODEL_GOMPERTZ;
+  likelihood_lut_.clear();
   z_hit_ = z_hit;
   z_rand_ = z_rand;
   sigma_hit_ = sigma_hit;
@@ -82,6 +85,24 @@ void PointCloudScanner::setMapFactors(double off_map_factor, double non_free_spa
   non_free_space_radius_ = non_free_space_radius;
 }
 
+void PointCloudScanner::setUseLikelihoodLUT(bool use_likelihood_lut)
+{
+  use_likelihood_lut_ = use_likelihood_lut;
+}
+
+void PointCloudScanner::setYawBinWidth(double yaw_bin_width)
+{
+  if (yaw_bin_width <= 0.0)
+  {
+    yaw_bin_width_ = 0.0;
+    yaw_bin_count_ = 0;
+    return;
+  }
+  // Round the width so a whole number of bins covers the circle
+  yaw_bin_count_ = std::max(1, static_cast<int>(std::round(2 * M_PI / yaw_bin_width)));
+  yaw_bin_width_ = 2 * M_PI / yaw_bin_count_;
+}
+
 void PointCloudScanner::setPointCloudScannerToFootprintTF(geometry_msgs::Transform tf_msg)
 {
   tf2::fromMsg(tf_msg, point_cloud_scanner_to_footprint_tf_);
@@ -95,156 +116,250 @@ bool PointCloudScanner::updateSensor(std::shared_ptr<ParticleFilter> pf,
   if (max_beams_ < 2)
     return false;
   // Apply the point cloud scanner sensor model
-  std::function<double(std::shared_ptr<SensorData>, std::shared_ptr<PFSampleSet>)> sensor_fn = (
+  std::function<bool(std::shared_ptr<SensorData>, std::shared_ptr<PFSampleSet>)> sensor_fn = (
           std::bind(&PointCloudScanner::applyModelToSampleSet, this, std::placeholders::_1, std::placeholders::_2));
   pf->updateSensor(sensor_fn, data);
   return true;
 }
 
-// Update a sample set based on the sensor model.
-// Returns total weights of particles, or 0.0 on failure.
-double PointCloudScanner::applyModelToSampleSet(std::shared_ptr<SensorData> data,
-                                                std::shared_ptr<PFSampleSet> set)
+// Update a sample set based on the sensor model, adding the log likelihood
+// of the data to each sample's log weight.  Returns false on failure.
+bool PointCloudScanner::applyModelToSampleSet(std::shared_ptr<SensorData> data,
+                                              std::shared_ptr<PFSampleSet> set)
 {
   if (max_beams_ < 2)
-    return 0.0;
-
-  double rv = 0.0;
+    return false;
 
   if (model_type_ == POINT_CLOUD_MODEL)
   {
-    rv = calcPointCloudModel(std::dynamic_pointer_cast<PointCloudData>(data), set);
+    calcPointCloudModel(std::dynamic_pointer_cast<PointCloudData>(data), set);
   }
   else if (model_type_ == POINT_CLOUD_MODEL_GOMPERTZ)
   {
-    rv = calcPointCloudModelGompertz(std::dynamic_pointer_cast<PointCloudData>(data), set);
+    calcPointCloudModelGompertz(std::dynamic_pointer_cast<PointCloudData>(data), set);
   }
 
   // Apply any configured correction factors from map
-  if (rv > 0.0)
+  recalcWeight(set);
+  return true;
+}
+
+void PointCloudScanner::updateLikelihoodLUT()
+{
+  if (!likelihood_lut_.empty())
+    return;
+  double z_hit_denom = 2 * sigma_hit_ * sigma_hit_;
+  double z_rand = z_rand_;
+  if (model_type_ == POINT_CLOUD_MODEL)
+    z_rand /= map_->getMaxDistanceToObject();
+  std::function<double(double)> fn = [&](double z)
   {
-    rv = recalcWeight(set);
+    double pz = z_hit_ * std::exp(-(z * z) / z_hit_denom) + z_rand;
+    return model_type_ == POINT_CLOUD_MODEL ? pz * pz * pz : pz;
+  };
+  likelihood_lut_.update(fn, map_->getMaxDistanceToObject(), map_->getDistanceStepCount());
+}
+
+void PointCloudScanner::updateFootprintPoints(std::shared_ptr<PointCloudData> data)
+{
+  if (data->footprint_points_valid_ and data->footprint_points_tf_ == point_cloud_scanner_to_footprint_tf_)
+    return;
+  data->footprint_points_valid_ = true;
+  data->footprint_points_tf_ = point_cloud_scanner_to_footprint_tf_;
+  int point_count = data->points_x_.size();
+  data->footprint_x_.resize(point_count);
+  data->footprint_y_.resize(point_count);
+  data->footprint_z_.resize(point_count);
+  for (int i = 0; i < point_count; i++)
+  {
+    tf2::Vector3 point(data->points_x_[i], data->points_y_[i], data->points_z_[i]);
+    tf2::Vector3 footprint_point = point_cloud_scanner_to_footprint_tf_ * point;
+    data->footprint_x_[i] = footprint_point.x();
+    data->footprint_y_[i] = footprint_point.y();
+    data->footprint_z_[i] = footprint_point.z();
   }
-  return rv;
+}
+
+void PointCloudScanner::orderSamples(std::shared_ptr<PFSampleSet> set)
+{
+  // The points may be from another scan since they were last rotated
+  rotated_bin_ = -1;
+  sample_order_.resize(set->sample_count);
+  if (yaw_bin_count_ == 0)
+  {
+    for (int j = 0; j < set->sample_count; j++)
+      sample_order_[j] = j;
+    return;
+  }
+  // Counting sort by bin, keeping the samples of a bin in order
+  const double* yaw = set->samples.yaw();
+  sample_bins_.resize(set->sample_count);
+  bin_starts_.assign(yaw_bin_count_ + 1, 0);
+  for (int j = 0; j < set->sample_count; j++)
+  {
+    sample_bins_[j] = computeYawBin(yaw[j]);
+    bin_starts_[sample_bins_[j] + 1]++;
+  }
+  for (int bin = 0; bin < yaw_bin_count_; bin++)
+    bin_starts_[bin + 1] += bin_starts_[bin];
+  for (int j = 0; j < set->sample_count; j++)
+    sample_order_[bin_starts_[sample_bins_[j]]++] = j;
+}
+
+int PointCloudScanner::computeYawBin(double yaw)
+{
+  int bin = static_cast<int>(std::floor(yaw / yaw_bin_width_ + 0.5)) % yaw_bin_count_;
+  if (bin < 0)
+    bin += yaw_bin_count_;
+  return bin;
+}
+
+template <typename PointFn>
+void PointCloudScanner::forEachPointVoxel(std::shared_ptr<PointCloudData> data, const Eigen::Vector3d& pose,
+                                          PointFn point_fn)
+{
+  const float* footprint_x = data->footprint_x_.data();
+  const float* footprint_y = data->footprint_y_.data();
+  const float* footprint_z = data->footprint_z_.data();
+  int point_count = data->footprint_x_.size();
+  if (yaw_bin_count_ == 0)
+  {
+    double cos_yaw = std::cos(pose[2]);
+    double sin_yaw = std::sin(pose[2]);
+    for (int n = 0; n < point_count; n++)
+    {
+      int map_i, map_j, map_k;
+      map_->convertWorldToMap(pose[0] + cos_yaw * footprint_x[n] - sin_yaw * footprint_y[n],
+                              pose[1] + sin_yaw * footprint_x[n] + cos_yaw * footprint_y[n], footprint_z[n],
+                              &map_i, &map_j, &map_k);
+      point_fn(map_i, map_j, map_k);
+    }
+    return;
+  }
+
+  // The samples come in order of their bins, so this is once per bin
+  int bin = computeYawBin(pose[2]);
+  if (bin != rotated_bin_)
+  {
+    rotated_bin_ = bin;
+    rotated_i_.resize(point_count);
+    rotated_j_.resize(point_count);
+    rotated_k_.resize(point_count);
+    double cos_yaw = std::cos(bin * yaw_bin_width_);
+    double sin_yaw = std::sin(bin * yaw_bin_width_);
+    for (int n = 0; n < point_count; n++)
+    {
+      map_->convertWorldToMap(cos_yaw * footprint_x[n] - sin_yaw * footprint_y[n],
+                              sin_yaw * footprint_x[n] + cos_yaw * footprint_y[n], footprint_z[n],
+                              &rotated_i_[n], &rotated_j_[n], &rotated_k_[n]);
+    }
+  }
+  int shift_i, shift_j, shift_k;
+  map_->convertWorldToMap(pose[0], pose[1], 0.0, &shift_i, &shift_j, &shift_k);
+  for (int n = 0; n < point_count; n++)
+    point_fn(rotated_i_[n] + shift_i, rotated_j_[n] + shift_j, rotated_k_[n]);
 }
 
 // Determine the probability for the given pose
-double PointCloudScanner::calcPointCloudModel(std::shared_ptr<PointCloudData> data,
-                                              std::shared_ptr<PFSampleSet> set)
+void PointCloudScanner::calcPointCloudModel(std::shared_ptr<PointCloudData> data,
+                                            std::shared_ptr<PFSampleSet> set)
 {
-  double total_weight = 0.0, p, z, pz;
-  PFSample* sample;
+  double p, z, pz;
+  double* log_weight = set->samples.log_weight();
   Eigen::Vector3d pose;
 
   double z_hit_denom = 2 * sigma_hit_ * sigma_hit_;
   double z_rand_mult = 1.0 / map_->getMaxDistanceToObject();
 
-  for (int sample_index = 0; sample_index < set->sample_count; sample_index++)
+  if (use_likelihood_lut_)
+    updateLikelihoodLUT();
+
+  // The points only need the particle's pose on the floor applied from here
+  updateFootprintPoints(data);
+  orderSamples(set);
+
+  for (int order_index = 0; order_index < set->sample_count; order_index++)
   {
-    sample = &(set->samples[sample_index]);
-    pose = sample->pose;
+    int sample_index = sample_order_[order_index];
+    pose = set->samples.getPose(sample_index);
     p = 1.0;
-    pcl::PointCloud<pcl::PointXYZ>::iterator it;
-    pcl::PointCloud<pcl::PointXYZ> map_cloud;
-    getMapCloud(data, pose, map_cloud);
-    for (it = map_cloud.begin(); it != map_cloud.end(); ++it)
+    forEachPointVoxel(data, pose, [&](int map_i, int map_j, int map_k)
     {
-      world_vec_[0] = it->x;
-      world_vec_[1] = it->y;
-      world_vec_[2] = it->z;
-      map_->convertWorldToMap(world_vec_, &map_vec_);
-      z = map_->getDistanceToObject(map_vec_[0], map_vec_[1], map_vec_[2]);
+      if (use_likelihood_lut_)
+      {
+        p += likelihood_lut_.get(map_->getDistanceStepFast(map_i, map_j, map_k));
+        return;
+      }
+      z = map_->getDistanceToObjectFast(map_i, map_j, map_k);
       pz = z_hit_ * std::exp(-(z * z) / z_hit_denom);
       pz += z_rand_ * z_rand_mult;
       ROS_ASSERT(pz <= 1.0);
       ROS_ASSERT(pz >= 0.0);
       p += pz * pz * pz;
-    }
-    sample->weight *= p;
-    total_weight += sample->weight;
+    });
+    log_weight[sample_index] += std::log(p);
   }
-  return total_weight;
 }
 
-double PointCloudScanner::calcPointCloudModelGompertz(std::shared_ptr<PointCloudData> data,
-                                                      std::shared_ptr<PFSampleSet> set)
+void PointCloudScanner::calcPointCloudModelGompertz(std::shared_ptr<PointCloudData> data,
+                                                    std::shared_ptr<PFSampleSet> set)
 {
-  double total_weight = 0.0, p, z, pz, sum_pz;
-  PFSample* sample;
+  double p, z, pz, sum_pz;
+  double* log_weight = set->samples.log_weight();
   Eigen::Vector3d pose;
   double z_hit_denom = 2 * sigma_hit_ * sigma_hit_;
-  for (int sample_index = 0; sample_index < set->sample_count; sample_index++)
+  if (use_likelihood_lut_)
+    updateLikelihoodLUT();
+  updateFootprintPoints(data);
+  orderSamples(set);
+  int point_count = data->footprint_x_.size();
+  for (int order_index = 0; order_index < set->sample_count; order_index++)
   {
-    sample = &(set->samples[sample_index]);
-    pose = sample->pose;
-    pcl::PointCloud<pcl::PointXYZ>::iterator it;
-    pcl::PointCloud<pcl::PointXYZ> map_cloud;
-    getMapCloud(data, pose, map_cloud);
+    int sample_index = sample_order_[order_index];
+    pose = set->samples.getPose(sample_index);
     sum_pz = 0;
-    int count = 0;
-    for (it = map_cloud.begin(); it != map_cloud.end(); ++it)
+    forEachPointVoxel(data, pose, [&](int map_i, int map_j, int map_k)
     {
-      world_vec_[0] = it->x;
-      world_vec_[1] = it->y;
-      world_vec_[2] = it->z;
-      map_->convertWorldToMap(world_vec_, &map_vec_);
-      z = map_->getDistanceToObject(map_vec_[0], map_vec_[1], map_vec_[2]);
+      if (use_likelihood_lut_)
+      {
+        sum_pz += likelihood_lut_.get(map_->getDistanceStepFast(map_i, map_j, map_k));
+        return;
+      }
+      z = map_->getDistanceToObjectFast(map_i, map_j, map_k);
       pz = z_hit_ * std::exp(-(z * z) / z_hit_denom);
       pz += z_rand_;
       sum_pz += pz;
-      count++;
-    }
-    p = sum_pz / count;
+    });
+    p = sum_pz / point_count;
     p = applyGompertz(p);
-    sample->weight *= p;
-    total_weight += sample->weight;
+    // The shifted Gompertz function can reach zero or below
+    if (p > 0.0)
+      log_weight[sample_index] += std::log(p);
+    else
+      log_weight[sample_index] = -std::numeric_limits<double>::infinity();
   }
-  return total_weight;
 }
 
-double PointCloudScanner::recalcWeight(std::shared_ptr<PFSampleSet> set)
+void PointCloudScanner::recalcWeight(std::shared_ptr<PFSampleSet> set)
 {
-  PFSample* sample;
+  double* log_weight = set->samples.log_weight();
+  double log_off_map_factor = std::log(off_map_factor_);
   Eigen::Vector3d pose;
-  double rv = 0.0;
   int j;
   for (j = 0; j < set->sample_count; j++)
   {
-    sample = &(set->samples[j]);
-    pose = sample->pose;
+    pose = set->samples.getPose(j);
 
     // Convert to map grid coords.
-    world_vec_[0] = pose[0];
-    world_vec_[1] = pose[1];
-    map_->convertWorldToMap(world_vec_, &map_vec_);
+    int map_i, map_j, map_k;
+    map_->convertWorldToMap(pose[0], pose[1], 0.0, &map_i, &map_j, &map_k);
 
     // Apply off map factor
-    if (!map_->isPoseValid(map_vec_[0], map_vec_[1]))
+    if (!map_->isPoseValid(map_i, map_j))
     {
-      sample->weight *= off_map_factor_;
+      log_weight[j] += log_off_map_factor;
     }
-    rv += sample->weight;
   }
-  return rv;
-}
-
-void PointCloudScanner::getMapCloud(std::shared_ptr<PointCloudData> data, const Eigen::Vector3d& pose,
-                                    pcl::PointCloud<pcl::PointXYZ>& map_cloud)
-{
-  tf2::Vector3 footprint_to_map_origin(pose[0], pose[1], 0.0);
-  tf2::Quaternion footprint_to_map_q;
-  footprint_to_map_q.setRPY(0.0, 0.0, pose[2]);
-  tf2::Transform footprint_to_map_tf(footprint_to_map_q, footprint_to_map_origin);
-  tf2::Transform t = footprint_to_map_tf * point_cloud_scanner_to_footprint_tf_;
-  tf2::Stamped<tf2::Transform> t_s(t, ros::Time::now(), data->frame_id_);
-  geometry_msgs::TransformStamped tf_msg = tf2::toMsg(t_s);
-  pcl::PCLPointCloud2 pcl2;
-  pcl::toPCLPointCloud2(data->points_, pcl2);
-  sensor_msgs::PointCloud2 in_msg, out_msg;
-  pcl_conversions::fromPCL(pcl2, in_msg);
-  tf2::doTransform(in_msg, out_msg, tf_msg);
-  pcl_conversions::toPCL(out_msg, pcl2);
-  pcl::fromPCLPointCloud2(pcl2, map_cloud);
 }
 
 double PointCloudScanner::applyGompertz(double p)
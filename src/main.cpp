@@ -19,9 +19,7 @@
  */
 
 #include <signal.h>
-#include <stdlib.h>
 
-#include <ctime>
 #include <iostream>
 
 #include <ros/init.h>
@@ -36,7 +34,6 @@ void sigHandler(int sig)
 
 int main(int argc, char** argv)
 {
-  srand48(std::time(nullptr));
   ros::init(argc, argv, "amcl", ros::init_options::NoSigintHandler);
 
   // Override default sigint handler
@@ -0,0 +1,375 @@
+/*
+ *  Copyright (C) 2020 Badger Technologies, LLC
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+// Timings for the hot paths of the filter.  Not run as part of the tests;
+// build with catkin and run rosrun badger_amcl benchmark_badger_amcl.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "map/occupancy_map.h"
+#include "map/octomap.h"
+#include "pf/pf_hash_grid.h"
+#include "pf/pf_kdtree.h"
+#include "pf/random.h"
+#include "pf/thread_pool.h"
+#include "sensors/point_cloud_scanner.h"
+
+using namespace badger_amcl;
+
+// Run fn repeatedly for at least min_seconds, and return the mean time per run in microseconds
+static double timeRuns(const std::function<void()>& fn, double min_seconds = 0.5)
+{
+  typedef std::chrono::steady_clock Clock;
+  int runs = 0;
+  Clock::time_point start = Clock::now();
+  double elapsed = 0.0;
+  while (elapsed < min_seconds)
+  {
+    fn();
+    runs++;
+    elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  }
+  return 1e6 * elapsed / runs;
+}
+
+// Poses spread over a 50m square, as in global localization
+static std::vector<Eigen::Vector3d> globalPoses(int count)
+{
+  RandomStream rng(1, 0);
+  std::vector<Eigen::Vector3d> poses(count);
+  for (Eigen::Vector3d& pose : poses)
+  {
+    pose = Eigen::Vector3d(50.0 * rng.uniform(), 50.0 * rng.uniform(), 2 * M_PI * (rng.uniform() - 0.5));
+  }
+  return poses;
+}
+
+// Poses in a tight blob, as when the filter has converged
+static std::vector<Eigen::Vector3d> localPoses(int count)
+{
+  RandomStream rng(1, 1);
+  std::vector<Eigen::Vector3d> poses(count);
+  for (Eigen::Vector3d& pose : poses)
+  {
+    pose = Eigen::Vector3d(10.0 + 0.5 * rng.gaussian(), 10.0 + 0.5 * rng.gaussian(), 0.2 * rng.gaussian());
+  }
+  return poses;
+}
+
+static void benchmarkHistograms()
+{
+  std::printf("histogram insert + cluster (us per set)\n");
+  std::printf("%10s %8s %12s %12s %8s\n", "particles", "spread", "kdtree", "hash grid", "speedup");
+  for (int count : {1000, 10000, 100000})
+  {
+    for (int global = 0; global < 2; global++)
+    {
+      std::vector<Eigen::Vector3d> poses = global ? globalPoses(count) : localPoses(count);
+      PFKDTree kdtree;
+      double kdtree_us = timeRuns([&]
+      {
+        kdtree.clearKDTree();
+        for (const Eigen::Vector3d& pose : poses)
+          kdtree.insertPose(pose, 1.0);
+        kdtree.cluster();
+      });
+      PFHashGrid grid;
+      double grid_us = timeRuns([&]
+      {
+        grid.clear();
+        for (const Eigen::Vector3d& pose : poses)
+          grid.insertPose(pose, 1.0);
+        grid.cluster();
+      });
+      std::printf("%10d %8s %12.1f %12.1f %7.1fx\n", count, global ? "global" : "local",
+                  kdtree_us, grid_us, kdtree_us / grid_us);
+    }
+  }
+}
+
+// Endpoints in map cells of one scan from each pose, particle by particle as
+// the likelihood field model looks them up: 60 beams over 270 degrees, 0.5
+// to 15m long
+static std::vector<std::pair<int, int>> scanEndpoints(const std::vector<Eigen::Vector3d>& poses, double resolution)
+{
+  RandomStream rng(2, 0);
+  std::vector<double> ranges(60);
+  for (double& range : ranges)
+    range = 0.5 + 14.5 * rng.uniform();
+  std::vector<std::pair<int, int>> endpoints;
+  for (const Eigen::Vector3d& pose : poses)
+  {
+    for (int beam = 0; beam < ranges.size(); beam++)
+    {
+      double angle = pose[2] + 1.5 * M_PI * (beam / (ranges.size() - 1.0) - 0.5);
+      endpoints.push_back(std::make_pair(int((pose[0] + ranges[beam] * std::cos(angle)) / resolution),
+                                         int((pose[1] + ranges[beam] * std::sin(angle)) / resolution)));
+    }
+  }
+  return endpoints;
+}
+
+// A 200m square of 5cm cells with walls every 5m, as after scaling up a
+// large map.  Returns the indices of the wall cells.
+static const double MAP_RESOLUTION = 0.05;
+static const int MAP_SIZE = 4000;
+static std::vector<int> mapWallCells()
+{
+  std::vector<int> occupied;
+  for (int x = 0; x < MAP_SIZE; x++)
+  {
+    for (int y = 0; y < MAP_SIZE; y++)
+    {
+      if ((x % 100 == 0 and y % 100 > 20) or (y % 100 == 0 and x % 100 > 20))
+        occupied.push_back(x + y * MAP_SIZE);
+    }
+  }
+  return occupied;
+}
+
+// Particles spread over the map, and converged around one pose, in map
+// coordinates from its corner
+static void mapPoses(std::vector<Eigen::Vector3d>* global_poses, std::vector<Eigen::Vector3d>* local_poses)
+{
+  *global_poses = globalPoses(2000);
+  *local_poses = localPoses(2000);
+  for (Eigen::Vector3d& pose : *global_poses)
+    pose.head<2>() = pose.head<2>() * 3.6 + Eigen::Vector2d(10.0, 10.0);
+  for (Eigen::Vector3d& pose : *local_poses)
+  {
+    pose.head<2>() = (pose.head<2>() - Eigen::Vector2d(10.0, 10.0)) * 0.3 + Eigen::Vector2d(102.5, 102.5);
+    pose[2] *= 0.25;
+  }
+}
+
+static void benchmarkDistanceLookups()
+{
+  const double resolution = MAP_RESOLUTION;
+  const int size = MAP_SIZE;
+  std::shared_ptr<ThreadPool> thread_pool = std::make_shared<ThreadPool>(std::thread::hardware_concurrency());
+  std::vector<int> occupied = mapWallCells();
+  std::vector<Eigen::Vector3d> global_poses, local_poses;
+  mapPoses(&global_poses, &local_poses);
+  std::vector<std::pair<int, int>> global_endpoints = scanEndpoints(global_poses, resolution);
+  std::vector<std::pair<int, int>> local_endpoints = scanEndpoints(local_poses, resolution);
+
+  std::printf("\ndistances LUT lookups, %dx%d cells (ns per lookup)\n", size, size);
+  std::printf("%10s %10s %10s %10s\n", "precision", "layout", "local", "global");
+  const char* precision_names[] = {"float", "uint16", "uint8"};
+  for (DistancesLUTPrecision precision : {DISTANCES_LUT_FLOAT, DISTANCES_LUT_UINT16, DISTANCES_LUT_UINT8})
+  {
+    for (DistancesLUTLayout layout : {DISTANCES_LUT_ROW_MAJOR, DISTANCES_LUT_TILED})
+    {
+      OccupancyMap map(resolution);
+      map.setSize({size, size});
+      map.setDistancesLUTBuilder(DISTANCES_LUT_EDT);
+      map.setThreadPool(thread_pool);
+      map.setDistancesLUTPrecision(precision);
+      map.setDistancesLUTLayout(layout);
+      for (int index : occupied)
+        map.setCellState(index, MapCellState::CELL_OCCUPIED);
+      map.updateDistancesLUT(2.0);
+      double us[2];
+      for (int global = 0; global < 2; global++)
+      {
+        const std::vector<std::pair<int, int>>& endpoints = global ? global_endpoints : local_endpoints;
+        volatile float sink = 0.0f;
+        us[global] = timeRuns([&]
+        {
+          float total = 0.0f;
+          for (const std::pair<int, int>& endpoint : endpoints)
+            total += map.getDistanceToObject(endpoint.first, endpoint.second);
+          sink = total;
+        });
+        us[global] *= 1e3 / endpoints.size();
+      }
+      std::printf("%10s %10s %10.2f %10.2f\n", precision_names[precision],
+                  layout == DISTANCES_LUT_TILED ? "tiled" : "row_major", us[0], us[1]);
+    }
+  }
+}
+
+// The beam model's ray casts, stepping cell by cell and skipping over open
+// space by the clearance table, and how often the two disagree
+static void benchmarkRaycasts()
+{
+  auto beamBearing = [](int beam) { return 1.5 * M_PI * (beam / 59.0 - 0.5); };
+  std::shared_ptr<ThreadPool> thread_pool = std::make_shared<ThreadPool>(std::thread::hardware_concurrency());
+  std::vector<int> occupied = mapWallCells();
+  std::vector<Eigen::Vector3d> global_poses, local_poses;
+  mapPoses(&global_poses, &local_poses);
+  std::shared_ptr<OccupancyMap> maps[2];
+  for (int raymarch = 0; raymarch < 2; raymarch++)
+  {
+    maps[raymarch] = std::make_shared<OccupancyMap>(MAP_RESOLUTION);
+    maps[raymarch]->setSize({MAP_SIZE, MAP_SIZE});
+    maps[raymarch]->setThreadPool(thread_pool);
+    // Origin at the map's corner, so poses are the same in both coordinates
+    maps[raymarch]->setOrigin(pcl::PointXYZ(MAP_SIZE / 2 * MAP_RESOLUTION, MAP_SIZE / 2 * MAP_RESOLUTION, 0.0));
+    for (int index = 0; index < MAP_SIZE * MAP_SIZE; index++)
+      maps[raymarch]->setCellState(index, MapCellState::CELL_FREE);
+    for (int index : occupied)
+      maps[raymarch]->setCellState(index, MapCellState::CELL_OCCUPIED);
+  }
+  maps[1]->updateClearanceLUT();
+
+  std::printf("\nbeam model ray casts, %dx%d cells, 60 beams of up to 15m (ns per ray)\n", MAP_SIZE, MAP_SIZE);
+  std::printf("%10s %12s %12s %8s %10s %12s\n", "spread", "bresenham", "raymarch", "speedup", "mismatch", "max error");
+  for (int global = 0; global < 2; global++)
+  {
+    const std::vector<Eigen::Vector3d>& poses = global ? global_poses : local_poses;
+    double us[2];
+    std::vector<double> ranges[2];
+    for (int raymarch = 0; raymarch < 2; raymarch++)
+    {
+      OccupancyMap& map = *maps[raymarch];
+      volatile double sink = 0.0;
+      us[raymarch] = timeRuns([&]
+      {
+        double total = 0.0;
+        for (const Eigen::Vector3d& pose : poses)
+        {
+          for (int beam = 0; beam < 60; beam++)
+            total += map.calcRange(pose[0], pose[1], pose[2] + beamBearing(beam), 15.0);
+        }
+        sink = total;
+      });
+      us[raymarch] *= 1e3 / (poses.size() * 60);
+      for (const Eigen::Vector3d& pose : poses)
+      {
+        for (int beam = 0; beam < 60; beam++)
+          ranges[raymarch].push_back(map.calcRange(pose[0], pose[1], pose[2] + beamBearing(beam), 15.0));
+      }
+    }
+    int mismatches = 0;
+    double max_error = 0.0;
+    for (int n = 0; n < ranges[0].size(); n++)
+    {
+      if (ranges[0][n] != ranges[1][n])
+        mismatches++;
+      max_error = std::max(max_error, std::abs(ranges[0][n] - ranges[1][n]));
+    }
+    std::printf("%10s %12.1f %12.1f %7.1fx %10d %12.3f\n", global ? "global" : "local", us[0], us[1],
+                us[0] / us[1], mismatches, max_error);
+  }
+}
+
+// The point cloud model, from the scan in the scanner frame to the sample
+// weights, in points times particles per second: a 20m square room of 10cm
+// voxels with walls every 5m, and 1000 points seen by a scanner 1m up and
+// pitched down.  Binned scores the samples in 1 degree bins of yaw.
+static void benchmarkPointCloudModel()
+{
+  const double resolution = 0.1;
+  std::shared_ptr<octomap::OcTree> octree = std::make_shared<octomap::OcTree>(resolution);
+  for (int i = 0; i < 200; i++)
+  {
+    for (int j = 0; j < 200; j++)
+    {
+      for (int k = 0; k < 20; k++)
+      {
+        bool occupied = k == 0 or (i % 50 == 0 and j % 50 > 10) or (j % 50 == 0 and i % 50 > 10);
+        octree->updateNode(octomap::point3d((i + 0.5) * resolution, (j + 0.5) * resolution, (k + 0.5) * resolution),
+                           occupied);
+      }
+    }
+  }
+  std::shared_ptr<OctoMap> map = std::make_shared<OctoMap>(resolution, false);
+  map->initFromOctree(octree, 0.36);
+  map->setDistancesLUTBuilder(DISTANCES_LUT_EDT);
+  map->setThreadPool(std::make_shared<ThreadPool>(std::thread::hardware_concurrency()));
+  map->updateDistancesLUT();
+
+  std::shared_ptr<PointCloudData> data = std::make_shared<PointCloudData>();
+  RandomStream rng(6, 0);
+  for (int n = 0; n < 1000; n++)
+  {
+    double range = 1.0 + 7.0 * rng.uniform();
+    double angle = 2 * M_PI * rng.uniform();
+    data->points_x_.push_back(range * std::cos(angle));
+    data->points_y_.push_back(range * std::sin(angle));
+    data->points_z_.push_back(1.0 * rng.uniform() - 0.5);
+  }
+  geometry_msgs::Transform scanner_tf;
+  scanner_tf.translation.x = 0.2;
+  scanner_tf.translation.y = 0.0;
+  scanner_tf.translation.z = 1.0;
+  // Pitched down by 0.1 radians
+  scanner_tf.rotation.x = 0.0;
+  scanner_tf.rotation.y = std::sin(0.05);
+  scanner_tf.rotation.z = 0.0;
+  scanner_tf.rotation.w = std::cos(0.05);
+
+  std::vector<Eigen::Vector3d> global_poses = globalPoses(2000);
+  std::vector<Eigen::Vector3d> local_poses = localPoses(2000);
+  for (Eigen::Vector3d& pose : global_poses)
+    pose.head<2>() = pose.head<2>() * 0.4;
+
+  std::printf("\npoint cloud model, %d points (M points x particles per second)\n",
+              static_cast<int>(data->points_x_.size()));
+  std::printf("%10s %12s %12s %12s\n", "spread", "computed", "lut", "lut binned");
+  for (int global = 0; global < 2; global++)
+  {
+    const std::vector<Eigen::Vector3d>& poses = global ? global_poses : local_poses;
+    std::shared_ptr<PFSampleSet> set = std::make_shared<PFSampleSet>();
+    set->sample_count = poses.size();
+    set->samples.resize(poses.size());
+    for (int j = 0; j < poses.size(); j++)
+      set->samples.setPose(j, poses[j]);
+    double rates[3];
+    for (int mode = 0; mode < 3; mode++)
+    {
+      PointCloudScanner scanner;
+      scanner.init(data->points_x_.size(), map);
+      scanner.setPointCloudModel(0.6, 0.1, 0.2);
+      scanner.setUseLikelihoodLUT(mode > 0);
+      scanner.setYawBinWidth(mode == 2 ? M_PI / 180 : 0.0);
+      scanner.setPointCloudScannerToFootprintTF(scanner_tf);
+      double us = timeRuns([&]
+      {
+        // Each run is a new scan, transformed into the footprint frame once
+        data->footprint_points_valid_ = false;
+        for (int j = 0; j < poses.size(); j++)
+          set->samples.setLogWeight(j, 0.0);
+        scanner.applyModelToSampleSet(data, set);
+      });
+      rates[mode] = data->points_x_.size() * poses.size() / us;
+    }
+    std::printf("%10s %12.1f %12.1f %12.1f\n", global ? "global" : "local", rates[0], rates[1], rates[2]);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  benchmarkHistograms();
+  benchmarkDistanceLookups();
+  benchmarkRaycasts();
+  benchmarkPointCloudModel();
+  return 0;
+}
@@ -17,14 +17,46 @@
  *
  */
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <Eigen/Dense>
+#include <sensor_msgs/point_cloud2_iterator.h>
 
+#include "map/distance_likelihood_lut.h"
+#include "map/distances_lut_cache.h"
 #include "map/occupancy_map.h"
 #include "map/octomap.h"
+#include "node/node_nd.h"
+#include "pf/particle_filter.h"
 #include "pf/pdf_gaussian.h"
+#include "pf/pf_alias_table.h"
+#include "pf/pf_hash_grid.h"
 #include "pf/pf_kdtree.h"
+#include "pf/random.h"
+#include "pf/thread_pool.h"
+#include "sensors/odom.h"
+#include "sensors/planar_scanner.h"
+#include "sensors/point_cloud_preprocessor.h"
+#include "sensors/point_cloud_scanner.h"
 
 TEST(TestBadgerAmcl, testPdfGaussian)
 {
@@ -32,20 +64,58 @@ TEST(TestBadgerAmcl, testPdfGaussian)
   Eigen::Vector3d x(1, 1, 1);
   Eigen::Matrix3d cx;
   cx << 1, 0, 0, 0, 1, 0, 0, 0, 1;
-  badger_amcl::PDFGaussian pdf_gaussian(x, cx);
+  badger_amcl::PDFGaussian pdf_gaussian(x, cx, 1);
   Eigen::Vector3d sample = pdf_gaussian.sample();
-  EXPECT_DOUBLE_EQ(sample[0], 0.26562654174915334);
-  EXPECT_DOUBLE_EQ(sample[1], 0.97172090090793528);
-  EXPECT_DOUBLE_EQ(sample[2], -1.5856194295513539);
+  EXPECT_DOUBLE_EQ(sample[0], 1.2031925765389644);
+  EXPECT_DOUBLE_EQ(sample[1], 0.71109390887695545);
+  EXPECT_DOUBLE_EQ(sample[2], 1.8298570216273427);
   // Testing pdf gaussian sample function with non-diagonal covariance matrix
   Eigen::Vector3d x2(0, 3, 2);
   Eigen::Matrix3d cx2;
   cx2 << 0.5, 0.1, 0.2, 0.3, 0.6, 0.2, 0.1, 0.7, 0.2, 0.8;
-  badger_amcl::PDFGaussian pdf_gaussian2(x2, cx2);
+  badger_amcl::PDFGaussian pdf_gaussian2(x2, cx2, 1);
   Eigen::Vector3d sample2 = pdf_gaussian.sample();
-  EXPECT_DOUBLE_EQ(sample2[0], 1.6262083813236745);
-  EXPECT_DOUBLE_EQ(sample2[1], 1.1142314205031041);
-  EXPECT_DOUBLE_EQ(sample2[2], 0.37407538872488655);
+  EXPECT_DOUBLE_EQ(sample2[0], 0.42008433244207166);
+  EXPECT_DOUBLE_EQ(sample2[1], 1.7598559626220287);
+  EXPECT_DOUBLE_EQ(sample2[2], 3.0114211686357732);
+}
+
+TEST(TestBadgerAmcl, testRandomStream)
+{
+  // Known answers for Philox4x32-10 from the Random123 distribution
+  std::array<uint32_t, 4> block = badger_amcl::RandomStream::philox({ 0, 0, 0, 0 }, { 0, 0 });
+  EXPECT_EQ(block[0], 0x6627e8d5);
+  EXPECT_EQ(block[1], 0xe169c58d);
+  EXPECT_EQ(block[2], 0xbc57ac4c);
+  EXPECT_EQ(block[3], 0x9b00dbd8);
+  block = badger_amcl::RandomStream::philox({ 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344 },
+                                            { 0xa4093822, 0x299f31d0 });
+  EXPECT_EQ(block[0], 0xd16cfe09);
+  EXPECT_EQ(block[1], 0x94fdcceb);
+  EXPECT_EQ(block[2], 0x5001e420);
+  EXPECT_EQ(block[3], 0x24126ea1);
+
+  // Streams are reproduced from the seed and their owner, and differ from each other
+  badger_amcl::RandomService::seed(7);
+  badger_amcl::RandomStream a = badger_amcl::RandomService::createStream(badger_amcl::RANDOM_STREAM_ODOM, 3, 0);
+  badger_amcl::RandomStream b = badger_amcl::RandomService::createStream(badger_amcl::RANDOM_STREAM_ODOM, 3, 1);
+  badger_amcl::RandomStream a2(7, badger_amcl::RandomService::makeStreamId(badger_amcl::RANDOM_STREAM_ODOM, 3, 0));
+  double mean = 0.0, var = 0.0;
+  const int draws = 100000;
+  for (int i = 0; i < draws; i++)
+  {
+    double u = a.uniform();
+    EXPECT_EQ(u, a2.uniform());
+    EXPECT_NE(u, b.uniform());
+    EXPECT_GE(u, 0.0);
+    EXPECT_LT(u, 1.0);
+    mean += u;
+    var += u * u;
+  }
+  mean /= draws;
+  var = var / draws - mean * mean;
+  EXPECT_NEAR(mean, 0.5, 0.005);
+  EXPECT_NEAR(var, 1.0 / 12.0, 0.002);
 }
 
 TEST(TestBadgerAmcl, testPfKdtree)
@@ -72,15 +142,402 @@ TEST(TestBadgerAmcl, testPfKdtree)
   EXPECT_EQ(pf_kdtree.getCluster(pose3), 2);
   EXPECT_EQ(pf_kdtree.getLeafCount(), 2);
   Eigen::Vector3d pose4(0.5, 1, 1);
-  pf_kdtree.insertPose(pose4, value);
+  int bin4 = pf_kdtree.insertPose(pose4, value);
+  EXPECT_EQ(pf_kdtree.insertPose(pose4, value), bin4);
   pf_kdtree.cluster();
   EXPECT_EQ(pf_kdtree.getCluster(pose), 0);
   EXPECT_EQ(pf_kdtree.getCluster(pose2), 0);
   EXPECT_EQ(pf_kdtree.getCluster(pose3), 1);
   EXPECT_EQ(pf_kdtree.getCluster(pose4), 0);
+  EXPECT_EQ(pf_kdtree.getBinCluster(bin4), 0);
+  EXPECT_EQ(pf_kdtree.getClusterCount(), 2);
   EXPECT_EQ(pf_kdtree.getLeafCount(), 2);
 }
 
+TEST(TestBadgerAmcl, testPfHashGrid)
+{
+  badger_amcl::PFHashGrid grid;
+  EXPECT_EQ(grid.getLeafCount(), 0);
+  Eigen::Vector3d pose(1, 1, 1);
+  int bin = grid.insertPose(pose, 0.0);
+  EXPECT_EQ(grid.insertPose(pose, 0.0), bin);
+  EXPECT_EQ(grid.getLeafCount(), 1);
+  EXPECT_EQ(grid.getCluster(pose), -1);
+  grid.cluster();
+  EXPECT_EQ(grid.getCluster(pose), 0);
+  EXPECT_EQ(grid.getBinCluster(bin), 0);
+  Eigen::Vector3d pose2(0, 1, 1);
+  Eigen::Vector3d pose3(3, 0, 0);
+  grid.insertPose(pose2, 0.0);
+  grid.insertPose(pose3, 0.0);
+  grid.cluster();
+  EXPECT_EQ(grid.getCluster(pose), 0);
+  EXPECT_EQ(grid.getCluster(pose2), 1);
+  EXPECT_EQ(grid.getCluster(pose3), 2);
+  EXPECT_EQ(grid.getLeafCount(), 3);
+  Eigen::Vector3d pose4(0.5, 1, 1);
+  grid.insertPose(pose4, 0.0);
+  grid.cluster();
+  EXPECT_EQ(grid.getCluster(pose), 0);
+  EXPECT_EQ(grid.getCluster(pose2), 0);
+  EXPECT_EQ(grid.getCluster(pose3), 1);
+  EXPECT_EQ(grid.getCluster(pose4), 0);
+  EXPECT_EQ(grid.getClusterCount(), 2);
+  EXPECT_EQ(grid.getLeafCount(), 4);
+  grid.clear();
+  EXPECT_EQ(grid.getLeafCount(), 0);
+  EXPECT_EQ(grid.getCluster(pose), -1);
+
+  // Yaw bins wrap around at +/- pi
+  grid.insertPose(Eigen::Vector3d(1, 1, M_PI - 0.01), 0.0);
+  grid.insertPose(Eigen::Vector3d(1, 1, -M_PI + 0.01), 0.0);
+  grid.insertPose(Eigen::Vector3d(1, 1, 0), 0.0);
+  grid.cluster();
+  EXPECT_EQ(grid.getLeafCount(), 3);
+  EXPECT_EQ(grid.getClusterCount(), 2);
+  EXPECT_EQ(grid.getCluster(Eigen::Vector3d(1, 1, M_PI - 0.01)), 0);
+  EXPECT_EQ(grid.getCluster(Eigen::Vector3d(1, 1, M_PI + 0.01)), 0);
+  EXPECT_EQ(grid.getCluster(Eigen::Vector3d(1, 1, 0)), 1);
+
+  // A long connected chain grows the table, and is still one cluster
+  grid.clear();
+  for (int i = 0; i < 5000; i++)
+  {
+    grid.insertPose(Eigen::Vector3d(0.5 * i, 0, 0), 0.0);
+  }
+  grid.cluster();
+  EXPECT_EQ(grid.getLeafCount(), 5000);
+  EXPECT_EQ(grid.getClusterCount(), 1);
+  EXPECT_EQ(grid.getCluster(Eigen::Vector3d(0.5 * 4999, 0, 0)), 0);
+}
+
+TEST(TestBadgerAmcl, testPfHashGridKLDLimit)
+{
+  // The same samples in the kd-tree and the hash grid, at a local and a
+  // wider spread.  Both find the same bins, but the kd-tree's leaf count
+  // only counted nodes that never got a child, about a third of the bins
+  // here.  The hash grid counts every bin, which is the k of the KLD bound,
+  // so resampling keeps more samples for the same spread than it did.
+  badger_amcl::ParticleFilter pf(500, 100000, 0.001, 0.1, []() { return Eigen::Vector3d::Zero(); });
+  for (double spread : {0.2, 0.5})
+  {
+    badger_amcl::RandomStream rng(10, 0);
+    badger_amcl::PFKDTree pf_kdtree;
+    badger_amcl::PFHashGrid grid;
+    std::set<int> kdtree_bins;
+    for (int i = 0; i < 20000; i++)
+    {
+      Eigen::Vector3d pose(spread * rng.gaussian(), spread * rng.gaussian(),
+                           std::remainder(spread * rng.gaussian(), 2 * M_PI));
+      kdtree_bins.insert(pf_kdtree.insertPose(pose, 1.0));
+      grid.insertPose(pose, 1.0);
+    }
+    EXPECT_EQ(kdtree_bins.size(), grid.getLeafCount());
+    EXPECT_LT(2 * pf_kdtree.getLeafCount(), grid.getLeafCount());
+    EXPECT_LT(pf.resampleLimit(pf_kdtree.getLeafCount()), pf.resampleLimit(grid.getLeafCount()));
+    // The bound is close to linear in k
+    double limit_ratio = double(pf.resampleLimit(grid.getLeafCount())) / pf.resampleLimit(pf_kdtree.getLeafCount());
+    double count_ratio = double(grid.getLeafCount()) / pf_kdtree.getLeafCount();
+    EXPECT_LT(limit_ratio, count_ratio);
+    EXPECT_GT(limit_ratio, 0.7 * count_ratio);
+  }
+}
+
+TEST(TestBadgerAmcl, testPfAliasTable)
+{
+  // Unnormalized weights, including empty and dominant entries
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::vector<double> weights(50);
+  for (int i = 0; i < weights.size(); i++)
+  {
+    weights[i] = uniform(gen);
+  }
+  weights[3] = 0.0;
+  weights[17] = 0.0;
+  weights[25] = 20.0;
+  std::vector<double> c(weights.size() + 1, 0.0);
+  for (int i = 0; i < weights.size(); i++)
+  {
+    c[i + 1] = c[i] + weights[i];
+  }
+
+  badger_amcl::PFAliasTable alias_table;
+  alias_table.build(weights.data(), weights.size());
+
+  // Compare against the cumulative table search used by the original sampler
+  const int draws = 500000;
+  std::vector<int> alias_counts(weights.size(), 0), linear_counts(weights.size(), 0);
+  for (int n = 0; n < draws; n++)
+  {
+    alias_counts[alias_table.draw(uniform(gen))]++;
+    double r = uniform(gen) * c.back();
+    int i;
+    for (i = 0; i < weights.size(); i++)
+    {
+      if ((c[i] <= r) && (r < c[i + 1]))
+        break;
+    }
+    linear_counts[i]++;
+  }
+  EXPECT_EQ(alias_counts[3], 0);
+  EXPECT_EQ(alias_counts[17], 0);
+  for (int i = 0; i < weights.size(); i++)
+  {
+    double expected = weights[i] / c.back();
+    EXPECT_NEAR(static_cast<double>(alias_counts[i]) / draws, expected, 0.003);
+    EXPECT_NEAR(static_cast<double>(alias_counts[i]) / draws,
+                static_cast<double>(linear_counts[i]) / draws, 0.004);
+  }
+}
+
+TEST(TestBadgerAmcl, testThreadPool)
+{
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::vector<double> values(1000);
+  for (int i = 0; i < values.size(); i++)
+  {
+    values[i] = uniform(gen) * 1e6;
+  }
+  std::vector<int> visits(values.size(), 0);
+  auto sum_block = [&](int begin, int end)
+  {
+    double sum = 0.0;
+    for (int i = begin; i < end; i++)
+    {
+      visits[i]++;
+      sum += values[i];
+    }
+    return sum;
+  };
+
+  // Every index is visited once, and the sum is the same to the bit for any number of threads
+  badger_amcl::ThreadPool serial_pool(1);
+  double serial_sum = serial_pool.parallelSum(values.size(), 64, sum_block);
+  for (int num_threads = 2; num_threads <= 4; num_threads++)
+  {
+    badger_amcl::ThreadPool pool(num_threads);
+    EXPECT_EQ(pool.getNumThreads(), num_threads);
+    for (int n = 0; n < 10; n++)
+    {
+      EXPECT_EQ(pool.parallelSum(values.size(), 64, sum_block), serial_sum);
+    }
+  }
+  for (int i = 0; i < visits.size(); i++)
+  {
+    EXPECT_EQ(visits[i], 31);
+  }
+}
+
+TEST(TestBadgerAmcl, testPfLogWeights)
+{
+  const int sample_count = 100;
+  auto origin_fn = []() { return Eigen::Vector3d(0.0, 0.0, 0.0); };
+  badger_amcl::ParticleFilter pf(sample_count, sample_count, 0.001, 0.1, origin_fn);
+  pf.initWithPoseFn(origin_fn);
+
+  // Likelihoods far below the smallest double, as from a product over many beams
+  auto sensor_fn = [](std::shared_ptr<badger_amcl::SensorData> data, std::shared_ptr<badger_amcl::PFSampleSet> set)
+  {
+    for (int i = 0; i < set->sample_count; i++)
+    {
+      set->samples.log_weight()[i] += -5000.0 + 0.01 * i;
+    }
+    return true;
+  };
+  pf.updateSensor(sensor_fn, nullptr);
+
+  std::shared_ptr<badger_amcl::PFSampleSet> set = pf.getCurrentSet();
+  double total = 0.0;
+  for (int i = 0; i < sample_count; i++)
+  {
+    total += set->samples.getWeight(i);
+  }
+  EXPECT_NEAR(total, 1.0, 1e-12);
+  EXPECT_NEAR(set->samples.getWeight(sample_count - 1) / set->samples.getWeight(0), std::exp(0.99), 1e-9);
+
+  // A second update keeps the earlier weights
+  pf.updateSensor(sensor_fn, nullptr);
+  EXPECT_NEAR(set->samples.getWeight(sample_count - 1) / set->samples.getWeight(0), std::exp(1.98), 1e-9);
+}
+
+// Apply one odometry update of 1m straight ahead to samples at the origin,
+// and return the sample mean and variance of x and yaw
+static void odomMoments(badger_amcl::OdomModelType type, std::shared_ptr<badger_amcl::ThreadPool> thread_pool,
+                        Eigen::Vector2d* mean, Eigen::Vector2d* var)
+{
+  const int sample_count = 20000;
+  auto origin_fn = []() { return Eigen::Vector3d(0.0, 0.0, 0.0); };
+  auto pf = std::make_shared<badger_amcl::ParticleFilter>(100, sample_count, 0.0, 0.0, origin_fn);
+  pf->initWithPoseFn(origin_fn);
+
+  badger_amcl::Odom odom;
+  odom.setModel(type, 0.1, 0.2, 0.3, 0.1, 0.2);
+  odom.setThreadPool(thread_pool);
+  auto data = std::make_shared<badger_amcl::OdomData>();
+  data->pose = Eigen::Vector3d(1.0, 0.0, 0.0);
+  data->delta = Eigen::Vector3d(1.0, 0.0, 0.0);
+  data->absolute_motion = Eigen::Vector3d(1.0, 0.0, 0.0);
+  odom.updateAction(pf, data);
+
+  std::shared_ptr<badger_amcl::PFSampleSet> set = pf->getCurrentSet();
+  *mean = Eigen::Vector2d::Zero();
+  *var = Eigen::Vector2d::Zero();
+  for (int i = 0; i < set->sample_count; i++)
+  {
+    Eigen::Vector2d v(set->samples.x()[i], set->samples.yaw()[i]);
+    *mean += v;
+    *var += v.cwiseProduct(v);
+  }
+  *mean /= set->sample_count;
+  *var = *var / set->sample_count - mean->cwiseProduct(*mean);
+}
+
+TEST(TestBadgerAmcl, testOdomModelMoments)
+{
+  // Expected moments for alpha2 = 0.2 and alpha3 = 0.3.  The uncorrected
+  // models use the variances as standard deviations.  The diff models turn
+  // by two noisy rotations, and move in x by the cosine of the first.
+  struct Expected
+  {
+    badger_amcl::OdomModelType type;
+    double x_mean, x_var, yaw_var;
+  };
+  const double rot_var = 0.2, trans_var = 0.3;
+  const double rot_var2 = rot_var * rot_var, trans_var2 = trans_var * trans_var;
+  std::vector<Expected> expected = {
+    { badger_amcl::ODOM_MODEL_DIFF_CORRECTED, std::exp(-rot_var / 2), 0.0, 2 * rot_var },
+    { badger_amcl::ODOM_MODEL_DIFF, std::exp(-rot_var2 / 2), 0.0, 2 * rot_var2 },
+    { badger_amcl::ODOM_MODEL_OMNI_CORRECTED, 1.0, trans_var, rot_var },
+    { badger_amcl::ODOM_MODEL_OMNI, 1.0, trans_var2, rot_var2 },
+    { badger_amcl::ODOM_MODEL_GAUSSIAN, 1.0, trans_var, rot_var },
+  };
+
+  auto serial_pool = std::make_shared<badger_amcl::ThreadPool>(1);
+  auto parallel_pool = std::make_shared<badger_amcl::ThreadPool>(4);
+  for (const Expected& e : expected)
+  {
+    Eigen::Vector2d mean, var, parallel_mean, parallel_var;
+    badger_amcl::RandomService::seed(1);
+    odomMoments(e.type, serial_pool, &mean, &var);
+    EXPECT_NEAR(mean[0], e.x_mean, 0.02);
+    EXPECT_NEAR(mean[1], 0.0, 0.02);
+    if (e.x_var > 0.0)
+      EXPECT_NEAR(var[0], e.x_var, 0.05 * e.x_var);
+    EXPECT_NEAR(var[1], e.yaw_var, 0.05 * e.yaw_var);
+
+    // The same noise gives the same poses on any number of threads
+    badger_amcl::RandomService::seed(1);
+    odomMoments(e.type, parallel_pool, &parallel_mean, &parallel_var);
+    EXPECT_EQ(mean, parallel_mean);
+    EXPECT_EQ(var, parallel_var);
+  }
+}
+
+TEST(TestBadgerAmcl, testPointCloudPreprocessor)
+{
+  // Eight points in each of two voxels of 0.5m, one high and one low, and a
+  // NaN, from a scanner 1m above the footprint
+  std::vector<std::array<float, 3>> cloud_points;
+  for (int n = 0; n < 8; n++)
+  {
+    float offset = 0.05f * n;
+    cloud_points.push_back({0.1f + offset, 0.1f, 0.1f});
+    cloud_points.push_back({1.1f + offset, 0.1f, -0.9f});
+  }
+  float nan = std::numeric_limits<float>::quiet_NaN();
+  cloud_points.push_back({nan, nan, nan});
+  sensor_msgs::PointCloud2 cloud;
+  auto fill_cloud = [&cloud, &cloud_points]()
+  {
+    sensor_msgs::PointCloud2Modifier modifier(cloud);
+    modifier.setPointCloud2FieldsByString(1, "xyz");
+    modifier.resize(cloud_points.size());
+    sensor_msgs::PointCloud2Iterator<float> iter_x(cloud, "x");
+    sensor_msgs::PointCloud2Iterator<float> iter_y(cloud, "y");
+    sensor_msgs::PointCloud2Iterator<float> iter_z(cloud, "z");
+    for (const std::array<float, 3>& point : cloud_points)
+    {
+      *iter_x = point[0];
+      *iter_y = point[1];
+      *iter_z = point[2];
+      ++iter_x;
+      ++iter_y;
+      ++iter_z;
+    }
+  };
+  fill_cloud();
+  tf2::Transform scanner_to_footprint_tf(tf2::Quaternion(0.0, 0.0, 0.0, 1.0), tf2::Vector3(0.0, 0.0, 1.0));
+  badger_amcl::PointCloudData points;
+
+  badger_amcl::PointCloudPreprocessor preprocessor;
+  ASSERT_TRUE(preprocessor.process(cloud, scanner_to_footprint_tf, &points));
+  EXPECT_EQ(16, points.points_x_.size());
+
+  preprocessor.setVoxelSize(0.5);
+  preprocessor.process(cloud, scanner_to_footprint_tf, &points);
+  ASSERT_EQ(2, points.points_x_.size());
+  EXPECT_NEAR(0.275, points.points_x_[0], 1e-6);
+  EXPECT_NEAR(0.1, points.points_z_[0], 1e-6);
+  EXPECT_NEAR(1.275, points.points_x_[1], 1e-6);
+  EXPECT_NEAR(-0.9, points.points_z_[1], 1e-6);
+
+  // Only the low voxel is within 0.5m of the floor
+  preprocessor.setHeightBand(0.0, 0.5);
+  preprocessor.process(cloud, scanner_to_footprint_tf, &points);
+  ASSERT_EQ(1, points.points_x_.size());
+  EXPECT_NEAR(-0.9, points.points_z_[0], 1e-6);
+  EXPECT_EQ(17, preprocessor.getStats().input_count);
+  EXPECT_EQ(2, preprocessor.getStats().voxel_count);
+  EXPECT_EQ(1, preprocessor.getStats().band_count);
+  EXPECT_EQ(1, preprocessor.getStats().output_count);
+
+  // A line of points, subsampled three ways
+  cloud_points.clear();
+  for (int n = 0; n < 100; n++)
+    cloud_points.push_back({0.01f * n, 0.0f, 0.0f});
+  fill_cloud();
+  preprocessor.setVoxelSize(0.0);
+  preprocessor.setHeightBand(0.0, 0.0);
+  preprocessor.setMaxPoints(10);
+  preprocessor.process(cloud, scanner_to_footprint_tf, &points);
+  ASSERT_EQ(10, points.points_x_.size());
+  EXPECT_FLOAT_EQ(0.11f, points.points_x_[1]);
+
+  preprocessor.setSubsampleType(badger_amcl::POINT_CLOUD_SUBSAMPLE_RANDOM);
+  preprocessor.process(cloud, scanner_to_footprint_tf, &points);
+  ASSERT_EQ(10, points.points_x_.size());
+  for (int n = 1; n < points.points_x_.size(); n++)
+    EXPECT_LT(points.points_x_[n - 1], points.points_x_[n]);
+
+  // Each scan draws from a stream of its own, so the same scans pick the
+  // same points whatever was drawn before
+  std::vector<float> random_points = points.points_x_;
+  preprocessor.process(cloud, scanner_to_footprint_tf, &points);
+  EXPECT_NE(random_points, points.points_x_);
+  badger_amcl::PointCloudPreprocessor replay_preprocessor;
+  replay_preprocessor.setSubsampleType(badger_amcl::POINT_CLOUD_SUBSAMPLE_RANDOM);
+  replay_preprocessor.setMaxPoints(10);
+  badger_amcl::PointCloudData replay_points;
+  for (int scan = 0; scan < 5; scan++)
+    replay_preprocessor.process(cloud, scanner_to_footprint_tf, &replay_points);
+  EXPECT_EQ(random_points, replay_points.points_x_);
+
+  // The ends first, then the middle
+  preprocessor.setSubsampleType(badger_amcl::POINT_CLOUD_SUBSAMPLE_FARTHEST);
+  preprocessor.setMaxPoints(3);
+  preprocessor.process(cloud, scanner_to_footprint_tf, &points);
+  ASSERT_EQ(3, points.points_x_.size());
+  EXPECT_FLOAT_EQ(0.0f, points.points_x_[0]);
+  EXPECT_FLOAT_EQ(0.99f, points.points_x_[1]);
+  EXPECT_FLOAT_EQ(0.49f, points.points_x_[2]);
+
+  // Clouds without float coordinates are refused
+  cloud.fields[2].datatype = sensor_msgs::PointField::FLOAT64;
+  EXPECT_FALSE(preprocessor.process(cloud, scanner_to_footprint_tf, &points));
+}
+
 TEST(TestBadgerAmcl, testOctoMapConversions)
 {
   badger_amcl::OctoMap octomap(0.05, false);
@@ -110,6 +567,330 @@ TEST(TestBadgerAmcl, testOctoMapConversions)
   EXPECT_EQ(map_coords_3d, rtn_vec_map);
 }
 
+TEST(TestBadgerAmcl, testOctoMapDistancesEDT)
+{
+  // A floor, a wall and a pillar, with the distances built both ways
+  double resolution = 0.05;
+  double max_distance = 0.3;
+  auto make_octree = [resolution]()
+  {
+    std::shared_ptr<octomap::OcTree> octree = std::make_shared<octomap::OcTree>(resolution);
+    for (int i = 0; i < 64; i++)
+    {
+      for (int j = 0; j < 48; j++)
+      {
+        for (int k = 0; k < 16; k++)
+        {
+          bool occupied = k == 0 or (i == 20 and j > 8) or (i >= 40 and i < 44 and j >= 16 and j < 20);
+          octree->updateNode(octomap::point3d((i + 0.5) * resolution, (j + 0.5) * resolution,
+                                              (k + 0.5) * resolution), occupied);
+        }
+      }
+    }
+    return octree;
+  };
+  badger_amcl::OctoMap brushfire_map(resolution, false);
+  badger_amcl::OctoMap edt_map(resolution, false);
+  brushfire_map.initFromOctree(make_octree(), max_distance);
+  edt_map.initFromOctree(make_octree(), max_distance);
+  edt_map.setDistancesLUTBuilder(badger_amcl::DISTANCES_LUT_EDT);
+  edt_map.setThreadPool(std::make_shared<badger_amcl::ThreadPool>(3));
+  brushfire_map.updateDistancesLUT();
+  edt_map.updateDistancesLUT();
+  std::vector<int> min_cells, max_cells;
+  edt_map.getMinMaxCells(&min_cells, &max_cells);
+  for (int i = min_cells[0]; i <= max_cells[0]; i++)
+  {
+    for (int j = min_cells[1]; j <= max_cells[1]; j++)
+    {
+      for (int k = min_cells[2]; k <= max_cells[2]; k++)
+      {
+        EXPECT_NEAR(edt_map.getDistanceToObject(i, j, k), brushfire_map.getDistanceToObject(i, j, k), resolution);
+      }
+    }
+  }
+}
+
+TEST(TestBadgerAmcl, testOctoMapDistancesGuardBand)
+{
+  // A wall along the edge of the map, so distances carry on past it
+  double resolution = 0.05;
+  double max_distance = 0.3;
+  std::shared_ptr<octomap::OcTree> octree = std::make_shared<octomap::OcTree>(resolution);
+  for (int i = 0; i < 32; i++)
+  {
+    for (int j = 0; j < 32; j++)
+    {
+      for (int k = 0; k < 8; k++)
+      {
+        octree->updateNode(octomap::point3d((i + 0.5) * resolution, (j + 0.5) * resolution,
+                                            (k + 0.5) * resolution), i == 31);
+      }
+    }
+  }
+  badger_amcl::OctoMap map(resolution, false);
+  map.initFromOctree(octree, max_distance);
+  map.updateDistancesLUT();
+  std::vector<int> min_cells, max_cells;
+  map.getMinMaxCells(&min_cells, &max_cells);
+  for (int i = min_cells[0] - 20; i <= max_cells[0] + 20; i++)
+  {
+    for (int j = min_cells[1] - 20; j <= max_cells[1] + 20; j += 3)
+    {
+      for (int k = min_cells[2] - 20; k <= max_cells[2] + 20; k += 3)
+      {
+        EXPECT_EQ(map.getDistanceStep(i, j, k), map.getDistanceStepFast(i, j, k));
+        EXPECT_EQ(map.getDistanceToObject(i, j, k), map.getDistanceToObjectFast(i, j, k));
+      }
+    }
+  }
+  // The wall is on the last cells of the map; one past it, and well past it
+  EXPECT_NEAR(resolution, map.getDistanceToObjectFast(max_cells[0] + 1, 10, 4), max_distance / 255);
+  EXPECT_DOUBLE_EQ(max_distance, map.getDistanceToObjectFast(max_cells[0] + 1000, 10, 4));
+  EXPECT_DOUBLE_EQ(max_distance, map.getDistanceToObjectFast(10, 10, -1000));
+}
+
+TEST(TestBadgerAmcl, testPointCloudScannerYawBins)
+{
+  // A floor, a wall and a pillar, with points up to 0.6m from a scanner in
+  // the open space between them
+  double resolution = 0.05;
+  std::shared_ptr<octomap::OcTree> octree = std::make_shared<octomap::OcTree>(resolution);
+  for (int i = 0; i < 64; i++)
+  {
+    for (int j = 0; j < 48; j++)
+    {
+      for (int k = 0; k < 16; k++)
+      {
+        bool occupied = k == 0 or (i == 20 and j > 8) or (i >= 40 and i < 44 and j >= 16 and j < 20);
+        octree->updateNode(octomap::point3d((i + 0.5) * resolution, (j + 0.5) * resolution,
+                                            (k + 0.5) * resolution), occupied);
+      }
+    }
+  }
+  std::shared_ptr<badger_amcl::OctoMap> map = std::make_shared<badger_amcl::OctoMap>(resolution, false);
+  map->initFromOctree(octree, 0.3);
+  map->updateDistancesLUT();
+  badger_amcl::RandomStream rng(11, 0);
+  std::shared_ptr<badger_amcl::PointCloudData> data = std::make_shared<badger_amcl::PointCloudData>();
+  for (int n = 0; n < 40; n++)
+  {
+    double range = 0.1 + 0.5 * rng.uniform();
+    double angle = 2 * M_PI * rng.uniform();
+    data->points_x_.push_back(range * std::cos(angle));
+    data->points_y_.push_back(range * std::sin(angle));
+    data->points_z_.push_back(0.05 + 0.45 * rng.uniform());
+  }
+  geometry_msgs::Transform scanner_tf;
+  scanner_tf.translation.x = 0.0;
+  scanner_tf.translation.y = 0.0;
+  scanner_tf.translation.z = 0.0;
+  scanner_tf.rotation.x = 0.0;
+  scanner_tf.rotation.y = 0.0;
+  scanner_tf.rotation.z = 0.0;
+  scanner_tf.rotation.w = 1.0;
+
+  // Samples at any yaw, some either side of the turn at pi
+  std::shared_ptr<badger_amcl::PFSampleSet> set = std::make_shared<badger_amcl::PFSampleSet>();
+  set->sample_count = 200;
+  set->samples.resize(set->sample_count);
+  for (int j = 0; j < set->sample_count; j++)
+  {
+    double yaw = j % 4 == 0 ? M_PI + 0.2 * (rng.uniform() - 0.5) : 4 * M_PI * (rng.uniform() - 0.5);
+    set->samples.setPose(j, Eigen::Vector3d(1.3 + 0.6 * rng.uniform(), 0.9 + 0.6 * rng.uniform(), yaw));
+  }
+  double z_hit = 0.9, z_rand = 0.1, sigma_hit = 0.1;
+  auto score = [&](badger_amcl::PointCloudScanner* scanner)
+  {
+    for (int j = 0; j < set->sample_count; j++)
+      set->samples.setLogWeight(j, 0.0);
+    scanner->applyModelToSampleSet(data, set);
+    return std::vector<double>(set->samples.log_weight(), set->samples.log_weight() + set->sample_count);
+  };
+  badger_amcl::PointCloudScanner exact_scanner;
+  exact_scanner.init(data->points_x_.size(), map);
+  exact_scanner.setPointCloudModel(z_hit, z_rand, sigma_hit);
+  exact_scanner.setPointCloudScannerToFootprintTF(scanner_tf);
+  std::vector<double> exact_weights = score(&exact_scanner);
+
+  // Bins are centred on multiples of the width, around the circle either way
+  badger_amcl::PointCloudScanner scanner;
+  scanner.init(data->points_x_.size(), map);
+  scanner.setPointCloudModel(z_hit, z_rand, sigma_hit);
+  scanner.setPointCloudScannerToFootprintTF(scanner_tf);
+  scanner.setYawBinWidth(M_PI / 4);
+  EXPECT_EQ(scanner.computeYawBin(0.0), 0);
+  EXPECT_EQ(scanner.computeYawBin(-0.1), 0);
+  EXPECT_EQ(scanner.computeYawBin(2 * M_PI - 0.1), 0);
+  EXPECT_EQ(scanner.computeYawBin(-M_PI / 4), 7);
+  EXPECT_EQ(scanner.computeYawBin(-M_PI / 2), 6);
+  EXPECT_EQ(scanner.computeYawBin(3 * M_PI / 2), 6);
+  EXPECT_EQ(scanner.computeYawBin(M_PI), 4);
+  EXPECT_EQ(scanner.computeYawBin(-M_PI), 4);
+  EXPECT_EQ(scanner.computeYawBin(M_PI + 0.1), 4);
+  EXPECT_EQ(scanner.computeYawBin(-M_PI - 0.1), 4);
+  EXPECT_EQ(scanner.computeYawBin(-7 * M_PI / 2), 2);
+
+  // Binned, each sample scores as if at its bin's yaw, up to half a bin from
+  // its own, with each point within a voxel of where that puts it
+  double bin_width = M_PI / 18;
+  scanner.setYawBinWidth(bin_width);
+  std::vector<double> binned_weights = score(&scanner);
+  auto pointTerm = [&](int i, int j, int k)
+  {
+    double z = map->getDistanceToObject(i, j, k);
+    double pz = z_hit * std::exp(-(z * z) / (2 * sigma_hit * sigma_hit)) + z_rand / map->getMaxDistanceToObject();
+    return pz * pz * pz;
+  };
+  int differing_count = 0;
+  for (int j = 0; j < set->sample_count; j++)
+  {
+    Eigen::Vector3d pose = set->samples.getPose(j);
+    double bin_yaw = scanner.computeYawBin(pose[2]) * bin_width;
+    EXPECT_LE(std::abs(std::remainder(pose[2] - bin_yaw, 2 * M_PI)), bin_width / 2 + 1e-9);
+    double p_min = 1.0, p_max = 1.0;
+    for (int n = 0; n < data->points_x_.size(); n++)
+    {
+      int map_i, map_j, map_k;
+      map->convertWorldToMap(
+          pose[0] + std::cos(bin_yaw) * data->points_x_[n] - std::sin(bin_yaw) * data->points_y_[n],
+          pose[1] + std::sin(bin_yaw) * data->points_x_[n] + std::cos(bin_yaw) * data->points_y_[n],
+          data->points_z_[n], &map_i, &map_j, &map_k);
+      double term_min = pointTerm(map_i, map_j, map_k), term_max = term_min;
+      for (int di = -1; di <= 1; di++)
+      {
+        for (int dj = -1; dj <= 1; dj++)
+        {
+          term_min = std::min(term_min, pointTerm(map_i + di, map_j + dj, map_k));
+          term_max = std::max(term_max, pointTerm(map_i + di, map_j + dj, map_k));
+        }
+      }
+      p_min += term_min;
+      p_max += term_max;
+    }
+    EXPECT_GE(binned_weights[j], std::log(p_min) - 1e-9);
+    EXPECT_LE(binned_weights[j], std::log(p_max) + 1e-9);
+    if (binned_weights[j] != exact_weights[j])
+      differing_count++;
+  }
+  // Which the exact weights do not all meet
+  EXPECT_GT(differing_count, 0);
+
+  // A width of zero goes back to exact scoring, bit for bit
+  scanner.setYawBinWidth(0.0);
+  std::vector<double> unbinned_weights = score(&scanner);
+  for (int j = 0; j < set->sample_count; j++)
+    EXPECT_EQ(unbinned_weights[j], exact_weights[j]);
+}
+
+TEST(TestBadgerAmcl, testPointCloudScannerFootprintPoints)
+{
+  // A floor, a wall and a pillar, with points up to 0.5m from a scanner in
+  // the open space between them
+  double resolution = 0.05;
+  std::shared_ptr<octomap::OcTree> octree = std::make_shared<octomap::OcTree>(resolution);
+  for (int i = 0; i < 64; i++)
+  {
+    for (int j = 0; j < 48; j++)
+    {
+      for (int k = 0; k < 16; k++)
+      {
+        bool occupied = k == 0 or (i == 20 and j > 8) or (i >= 40 and i < 44 and j >= 16 and j < 20);
+        octree->updateNode(octomap::point3d((i + 0.5) * resolution, (j + 0.5) * resolution,
+                                            (k + 0.5) * resolution), occupied);
+      }
+    }
+  }
+  std::shared_ptr<badger_amcl::OctoMap> map = std::make_shared<badger_amcl::OctoMap>(resolution, false);
+  map->initFromOctree(octree, 0.3);
+  map->updateDistancesLUT();
+  badger_amcl::RandomStream rng(17, 0);
+  std::shared_ptr<badger_amcl::PointCloudData> data = std::make_shared<badger_amcl::PointCloudData>();
+  for (int n = 0; n < 60; n++)
+  {
+    double range = 0.1 + 0.4 * rng.uniform();
+    double angle = 2 * M_PI * rng.uniform();
+    data->points_x_.push_back(range * std::cos(angle));
+    data->points_y_.push_back(range * std::sin(angle));
+    data->points_z_.push_back(0.2 * rng.uniform() - 0.1);
+  }
+  std::shared_ptr<badger_amcl::PFSampleSet> set = std::make_shared<badger_amcl::PFSampleSet>();
+  set->sample_count = 50;
+  set->samples.resize(set->sample_count);
+  for (int j = 0; j < set->sample_count; j++)
+  {
+    set->samples.setPose(j, Eigen::Vector3d(1.3 + 0.6 * rng.uniform(), 0.9 + 0.6 * rng.uniform(),
+                                            2 * M_PI * rng.uniform() - M_PI));
+  }
+
+  // Scanners level at the footprint, and raised, turned and pitched down
+  std::vector<geometry_msgs::Transform> scanner_tfs;
+  for (int turned = 0; turned < 3; turned++)
+  {
+    double yaw = turned * 0.7, pitch = turned * 0.1;
+    geometry_msgs::Transform scanner_tf;
+    scanner_tf.translation.x = turned * 0.1;
+    scanner_tf.translation.y = turned * -0.05;
+    scanner_tf.translation.z = turned ? 0.3 : 0.2;
+    scanner_tf.rotation.x = -std::sin(yaw / 2) * std::sin(pitch / 2);
+    scanner_tf.rotation.y = std::cos(yaw / 2) * std::sin(pitch / 2);
+    scanner_tf.rotation.z = std::sin(yaw / 2) * std::cos(pitch / 2);
+    scanner_tf.rotation.w = std::cos(yaw / 2) * std::cos(pitch / 2);
+    scanner_tfs.push_back(scanner_tf);
+  }
+
+  // Each point taken through the scanner pose and then the sample pose, as
+  // the models did before they kept the footprint points on the scan
+  double z_hit = 0.9, z_rand = 0.1, sigma_hit = 0.1;
+  auto referenceLogWeight = [&](badger_amcl::PointCloudScanner* scanner, bool gompertz,
+                                const geometry_msgs::Transform& scanner_tf, const Eigen::Vector3d& pose)
+  {
+    tf2::Transform tf(tf2::Quaternion(scanner_tf.rotation.x, scanner_tf.rotation.y, scanner_tf.rotation.z,
+                                      scanner_tf.rotation.w),
+                      tf2::Vector3(scanner_tf.translation.x, scanner_tf.translation.y, scanner_tf.translation.z));
+    double p = 1.0, sum_pz = 0.0;
+    for (int n = 0; n < data->points_x_.size(); n++)
+    {
+      tf2::Vector3 point = tf * tf2::Vector3(data->points_x_[n], data->points_y_[n], data->points_z_[n]);
+      int map_i, map_j, map_k;
+      map->convertWorldToMap(pose[0] + std::cos(pose[2]) * point.x() - std::sin(pose[2]) * point.y(),
+                             pose[1] + std::sin(pose[2]) * point.x() + std::cos(pose[2]) * point.y(), point.z(),
+                             &map_i, &map_j, &map_k);
+      double z = map->getDistanceToObject(map_i, map_j, map_k);
+      double pz = z_hit * std::exp(-(z * z) / (2 * sigma_hit * sigma_hit));
+      sum_pz += pz + z_rand;
+      pz += z_rand / map->getMaxDistanceToObject();
+      p += pz * pz * pz;
+    }
+    if (gompertz)
+      return std::log(scanner->applyGompertz(sum_pz / data->points_x_.size()));
+    return std::log(p);
+  };
+
+  // Each model, with the scanner moved between updates from the same scan
+  for (bool gompertz : { false, true })
+  {
+    badger_amcl::PointCloudScanner scanner;
+    scanner.init(data->points_x_.size(), map);
+    if (gompertz)
+      scanner.setPointCloudModelGompertz(z_hit, z_rand, sigma_hit, 1.0, 1.0, 1.0, 0.0, 1.0, 0.0);
+    else
+      scanner.setPointCloudModel(z_hit, z_rand, sigma_hit);
+    for (const geometry_msgs::Transform& scanner_tf : scanner_tfs)
+    {
+      scanner.setPointCloudScannerToFootprintTF(scanner_tf);
+      for (int j = 0; j < set->sample_count; j++)
+        set->samples.setLogWeight(j, 0.0);
+      ASSERT_TRUE(scanner.applyModelToSampleSet(data, set));
+      for (int j = 0; j < set->sample_count; j++)
+      {
+        EXPECT_NEAR(set->samples.getLogWeight(j),
+                    referenceLogWeight(&scanner, gompertz, scanner_tf, set->samples.getPose(j)), 1e-9);
+      }
+    }
+  }
+}
+
 TEST(TestBadgerAmcl, testOccupancyMapConversions)
 {
   badger_amcl::OccupancyMap occupancy_map(0.05);
@@ -170,6 +951,756 @@ TEST(TestBadgerAmcl, testOccupancyMapDistances)
   EXPECT_DOUBLE_EQ(range, 0.15);
 }
 
+TEST(TestBadgerAmcl, testOccupancyMapDistancesEDT)
+{
+  // Random clutter plus some walls, with the distances built both ways
+  double resolution = 0.05;
+  double max_distance = 0.6;
+  std::vector<int> size_vec = {120, 90};
+  badger_amcl::OccupancyMap brushfire_map(resolution);
+  badger_amcl::OccupancyMap edt_map(resolution);
+  brushfire_map.setSize(size_vec);
+  edt_map.setSize(size_vec);
+  edt_map.setDistancesLUTBuilder(badger_amcl::DISTANCES_LUT_EDT);
+  edt_map.setThreadPool(std::make_shared<badger_amcl::ThreadPool>(3));
+  badger_amcl::RandomStream rng(3, 0);
+  for (int x = 0; x < size_vec[0]; x++)
+  {
+    for (int y = 0; y < size_vec[1]; y++)
+    {
+      badger_amcl::MapCellState state = badger_amcl::MapCellState::CELL_FREE;
+      if (rng.uniform() < 0.01 or (x == 40 and y > 10) or (y == 70 and x < 100))
+        state = badger_amcl::MapCellState::CELL_OCCUPIED;
+      brushfire_map.setCellState(brushfire_map.computeCellIndex(x, y), state);
+      edt_map.setCellState(edt_map.computeCellIndex(x, y), state);
+    }
+  }
+  brushfire_map.updateDistancesLUT(max_distance);
+  edt_map.updateDistancesLUT(max_distance);
+  for (int x = 0; x < size_vec[0]; x++)
+  {
+    for (int y = 0; y < size_vec[1]; y++)
+    {
+      float edt_distance = edt_map.getDistanceToObject(x, y);
+      EXPECT_NEAR(edt_distance, brushfire_map.getDistanceToObject(x, y), resolution);
+      EXPECT_LE(edt_distance, static_cast<float>(max_distance));
+      if (edt_map.getCellState(x, y) == badger_amcl::MapCellState::CELL_OCCUPIED)
+        EXPECT_EQ(edt_distance, 0.0);
+    }
+  }
+  // Exact distance to the wall at x == 40, away from other obstacles' influence
+  EXPECT_NEAR(edt_map.getDistanceToObject(43, 30), 3 * resolution, 1e-6);
+}
+
+// A directory for a test's files, removed with everything in it however the
+// test leaves
+class TempDir
+{
+public:
+  TempDir()
+  {
+    char dir_template[] = "/tmp/badger_amcl_test_XXXXXX";
+    if (mkdtemp(dir_template))
+      path_ = dir_template;
+  }
+
+  ~TempDir()
+  {
+    for (const std::string& name : list())
+    {
+      std::remove((path_ + "/" + name).c_str());
+    }
+    rmdir(path_.c_str());
+  }
+
+  const std::string& path() const
+  {
+    return path_;
+  }
+
+  // Names of the files in the directory
+  std::vector<std::string> list() const
+  {
+    std::vector<std::string> names;
+    DIR* d = opendir(path_.c_str());
+    if (!d)
+      return names;
+    while (dirent* entry = readdir(d))
+    {
+      if (entry->d_name[0] != '.')
+        names.push_back(entry->d_name);
+    }
+    closedir(d);
+    return names;
+  }
+
+private:
+  std::string path_;
+};
+
+TEST(TestBadgerAmcl, testOccupancyMapDistancesLUTCache)
+{
+  TempDir dir;
+  ASSERT_FALSE(dir.path().empty());
+  double max_distance = 0.5;
+  std::vector<int> size_vec = {80, 60};
+  auto makeMap = [&](int wall_x)
+  {
+    std::shared_ptr<badger_amcl::OccupancyMap> map = std::make_shared<badger_amcl::OccupancyMap>(0.05);
+    map->setSize(size_vec);
+    map->setDistancesLUTCacheDir(dir.path());
+    for (int y = 0; y < size_vec[1]; y++)
+    {
+      map->setCellState(map->computeCellIndex(wall_x, y), badger_amcl::MapCellState::CELL_OCCUPIED);
+    }
+    map->updateDistancesLUT(max_distance);
+    return map;
+  };
+
+  // Building the table saves it under the map's key
+  std::shared_ptr<badger_amcl::OccupancyMap> built_map = makeMap(30);
+  std::vector<std::string> names = dir.list();
+  ASSERT_EQ(names.size(), 1);
+  std::string prefix = "occupancy_map_";
+  ASSERT_EQ(names[0].compare(0, prefix.size(), prefix), 0);
+  uint64_t key = std::strtoull(names[0].c_str() + prefix.size(), nullptr, 16);
+  badger_amcl::DistancesLUTCache cache(dir.path(), "occupancy_map", key);
+  ASSERT_EQ(cache.getPath(), dir.path() + "/" + names[0]);
+
+  // The same map loads it back instead of building, which shows with a table
+  // that could not have been built
+  std::vector<float> fake_lut(size_vec[0] * size_vec[1], 0.25);
+  ASSERT_TRUE(cache.save({ { fake_lut.data(), fake_lut.size() * sizeof(float) } }));
+  std::shared_ptr<badger_amcl::OccupancyMap> loaded_map = makeMap(30);
+  EXPECT_FLOAT_EQ(loaded_map->getDistanceToObject(30, 20), 0.25);
+  EXPECT_FLOAT_EQ(loaded_map->getDistanceToObject(70, 50), 0.25);
+
+  // A different map gets its own file
+  makeMap(31);
+  EXPECT_EQ(dir.list().size(), 2);
+
+  // A corrupt or truncated file is ignored and the table rebuilt
+  ASSERT_TRUE(cache.save({ { fake_lut.data(), fake_lut.size() * sizeof(float) } }));
+  {
+    std::fstream file(cache.getPath(), std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(-64, std::ios::end);
+    file.put(0x7f);
+  }
+  EXPECT_NEAR(makeMap(30)->getDistanceToObject(33, 20), built_map->getDistanceToObject(33, 20), 1e-6);
+  ASSERT_TRUE(cache.save({ { fake_lut.data(), fake_lut.size() * sizeof(float) } }));
+  ASSERT_EQ(truncate(cache.getPath().c_str(), 1000), 0);
+  EXPECT_NEAR(makeMap(30)->getDistanceToObject(33, 20), 0.15, 1e-6);
+}
+
+TEST(TestBadgerAmcl, testOccupancyMapDistancesUpToDate)
+{
+  TempDir dir;
+  ASSERT_FALSE(dir.path().empty());
+  std::vector<int> size_vec = {40, 30};
+  badger_amcl::OccupancyMap map(0.05);
+  map.setSize(size_vec);
+  map.setDistancesLUTCacheDir(dir.path());
+  map.setCellState(map.computeCellIndex(20, 15), badger_amcl::MapCellState::CELL_OCCUPIED);
+  map.updateDistancesLUT(0.5);
+  std::vector<std::string> names = dir.list();
+  ASSERT_EQ(names.size(), 1);
+  uint64_t key = std::strtoull(names[0].c_str() + std::string("occupancy_map_").size(), nullptr, 16);
+  badger_amcl::DistancesLUTCache cache(dir.path(), "occupancy_map", key);
+  std::vector<float> fake_lut(size_vec[0] * size_vec[1], 0.25);
+  ASSERT_TRUE(cache.save({ { fake_lut.data(), fake_lut.size() * sizeof(float) } }));
+
+  // The table is already up to date, so it is neither rebuilt nor loaded
+  map.updateDistancesLUT(0.5);
+  EXPECT_FLOAT_EQ(map.getDistanceToObject(20, 15), 0.0);
+  // Setting a cell makes it out of date, even to the state it had
+  map.setCellState(map.computeCellIndex(20, 15), badger_amcl::MapCellState::CELL_OCCUPIED);
+  map.updateDistancesLUT(0.5);
+  EXPECT_FLOAT_EQ(map.getDistanceToObject(20, 15), 0.25);
+}
+
+// A shared memory segment a test expects to be created, unlinked before the
+// test in case an earlier run died holding it, and after however it leaves
+class SharedSegmentGuard
+{
+public:
+  explicit SharedSegmentGuard(const std::string& name)
+      : name_(name)
+  {
+    shm_unlink(name_.c_str());
+  }
+
+  ~SharedSegmentGuard()
+  {
+    shm_unlink(name_.c_str());
+  }
+
+  bool exists() const
+  {
+    int fd = shm_open(name_.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+      return false;
+    close(fd);
+    return true;
+  }
+
+private:
+  std::string name_;
+};
+
+TEST(TestBadgerAmcl, testOccupancyMapSharedDistancesLUT)
+{
+  std::vector<int> size_vec = {70, 50};
+  int wall_x = 37;
+  auto makeMap = [&](bool share, const std::string& cache_dir)
+  {
+    std::shared_ptr<badger_amcl::OccupancyMap> map = std::make_shared<badger_amcl::OccupancyMap>(0.05);
+    map->setSize(size_vec);
+    map->setShareDistancesLUT(share);
+    map->setDistancesLUTCacheDir(cache_dir);
+    for (int y = 0; y < size_vec[1]; y++)
+    {
+      map->setCellState(map->computeCellIndex(wall_x, y), badger_amcl::MapCellState::CELL_OCCUPIED);
+    }
+    map->updateDistancesLUT(0.5);
+    return map;
+  };
+
+  // The segment is named from the map's key, which the map's cache file
+  // gives, so the test knows which one is its own
+  std::string segment;
+  {
+    TempDir dir;
+    ASSERT_FALSE(dir.path().empty());
+    makeMap(false, dir.path());
+    std::vector<std::string> names = dir.list();
+    ASSERT_EQ(names.size(), 1);
+    uint64_t key = std::strtoull(names[0].c_str() + std::string("occupancy_map_").size(), nullptr, 16);
+    segment = badger_amcl::SharedDistancesLUT("occupancy_map", key).getName();
+  }
+  SharedSegmentGuard guard(segment);
+  ASSERT_FALSE(guard.exists());
+
+  std::shared_ptr<badger_amcl::OccupancyMap> first_map = makeMap(true, "");
+  EXPECT_TRUE(guard.exists());
+  std::shared_ptr<badger_amcl::OccupancyMap> second_map = makeMap(true, "");
+  for (int x = 0; x < size_vec[0]; x++)
+  {
+    for (int y = 0; y < size_vec[1]; y++)
+    {
+      EXPECT_EQ(second_map->getDistanceToObject(x, y), first_map->getDistanceToObject(x, y));
+    }
+  }
+  EXPECT_NEAR(second_map->getDistanceToObject(wall_x, 10), 0.0, 1e-6);
+
+  // The segment outlives the map that built it, and goes with the last user
+  first_map.reset();
+  EXPECT_TRUE(guard.exists());
+  EXPECT_NEAR(second_map->getDistanceToObject(wall_x + 2, 10), 0.1, 1e-6);
+  second_map.reset();
+  EXPECT_FALSE(guard.exists());
+}
+
+TEST(TestBadgerAmcl, testOccupancyMapDistancesQuantized)
+{
+  double resolution = 0.05;
+  double max_distance = 0.8;
+  std::vector<int> size_vec = {100, 80};
+  std::vector<badger_amcl::DistancesLUTPrecision> precisions = {
+    badger_amcl::DISTANCES_LUT_FLOAT, badger_amcl::DISTANCES_LUT_UINT16, badger_amcl::DISTANCES_LUT_UINT8 };
+  std::vector<std::shared_ptr<badger_amcl::OccupancyMap>> maps;
+  badger_amcl::RandomStream rng(4, 0);
+  std::vector<int> occupied;
+  for (int n = 0; n < 40; n++)
+  {
+    occupied.push_back(int(rng.uniform() * size_vec[0] * size_vec[1]));
+  }
+  for (badger_amcl::DistancesLUTPrecision precision : precisions)
+  {
+    std::shared_ptr<badger_amcl::OccupancyMap> map = std::make_shared<badger_amcl::OccupancyMap>(resolution);
+    map->setSize(size_vec);
+    map->setDistancesLUTPrecision(precision);
+    for (int index : occupied)
+    {
+      map->setCellState(index, badger_amcl::MapCellState::CELL_OCCUPIED);
+    }
+    map->updateDistancesLUT(max_distance);
+    maps.push_back(map);
+  }
+  // Within half a step of the float table, with obstacles and the max distance exact
+  std::vector<double> steps = { 0.0, max_distance / 65535, max_distance / 255 };
+  for (int p = 1; p < precisions.size(); p++)
+  {
+    for (int x = 0; x < size_vec[0]; x++)
+    {
+      for (int y = 0; y < size_vec[1]; y++)
+      {
+        float expected = maps[0]->getDistanceToObject(x, y);
+        EXPECT_NEAR(maps[p]->getDistanceToObject(x, y), expected, steps[p] / 2 + 1e-6);
+        if (expected == 0.0f)
+          EXPECT_EQ(maps[p]->getDistanceToObject(x, y), 0.0f);
+      }
+    }
+    EXPECT_FLOAT_EQ(maps[p]->getDistanceToObject(-1, 0), max_distance);
+  }
+  EXPECT_EQ(sizeof(badger_amcl::MapCellState), 1);
+}
+
+TEST(TestBadgerAmcl, testOccupancyMapDistancesTiled)
+{
+  // Sizes that are not a whole number of tiles, so the last tiles are padded
+  std::vector<int> size_vec = {45, 37};
+  badger_amcl::RandomStream rng(6, 0);
+  std::vector<int> occupied;
+  for (int n = 0; n < 12; n++)
+  {
+    occupied.push_back(int(rng.uniform() * size_vec[0] * size_vec[1]));
+  }
+  for (badger_amcl::DistancesLUTBuilderType builder : { badger_amcl::DISTANCES_LUT_BRUSHFIRE,
+                                                        badger_amcl::DISTANCES_LUT_EDT })
+  {
+    badger_amcl::OccupancyMap row_major_map(0.05);
+    badger_amcl::OccupancyMap tiled_map(0.05);
+    tiled_map.setDistancesLUTLayout(badger_amcl::DISTANCES_LUT_TILED);
+    for (badger_amcl::OccupancyMap* map : { &row_major_map, &tiled_map })
+    {
+      map->setSize(size_vec);
+      map->setDistancesLUTBuilder(builder);
+      for (int index : occupied)
+      {
+        map->setCellState(index, badger_amcl::MapCellState::CELL_OCCUPIED);
+      }
+      map->updateDistancesLUT(0.4);
+    }
+    for (int x = -1; x <= size_vec[0]; x++)
+    {
+      for (int y = -1; y <= size_vec[1]; y++)
+      {
+        EXPECT_EQ(tiled_map.getDistanceToObject(x, y), row_major_map.getDistanceToObject(x, y));
+      }
+    }
+  }
+}
+
+TEST(TestBadgerAmcl, testOccupancyMapPatch)
+{
+  double max_distance = 0.4;
+  std::vector<int> size_vec = {90, 70};
+  badger_amcl::RandomStream rng(8, 0);
+  std::vector<badger_amcl::MapCellState> cells(size_vec[0] * size_vec[1], badger_amcl::MapCellState::CELL_FREE);
+  for (int n = 0; n < 30; n++)
+  {
+    cells[int(rng.uniform() * cells.size())] = badger_amcl::MapCellState::CELL_OCCUPIED;
+  }
+  // Close an aisle and clear a rack, in a patch hanging off the map's edge
+  int min_i = 70, min_j = 20, width = 30, height = 12;
+  std::vector<badger_amcl::MapCellState> patch(width * height, badger_amcl::MapCellState::CELL_FREE);
+  for (int j = 0; j < height; j++)
+  {
+    patch[5 + j * width] = badger_amcl::MapCellState::CELL_OCCUPIED;
+  }
+  std::vector<badger_amcl::MapCellState> patched_cells = cells;
+  for (int j = 0; j < height; j++)
+  {
+    for (int i = 0; i < width and min_i + i < size_vec[0]; i++)
+    {
+      patched_cells[min_i + i + (min_j + j) * size_vec[0]] = patch[i + j * width];
+    }
+  }
+  TempDir dir;
+  ASSERT_FALSE(dir.path().empty());
+  for (badger_amcl::DistancesLUTPrecision precision : { badger_amcl::DISTANCES_LUT_FLOAT,
+                                                         badger_amcl::DISTANCES_LUT_UINT8 })
+  {
+    for (badger_amcl::DistancesLUTLayout layout : { badger_amcl::DISTANCES_LUT_ROW_MAJOR,
+                                                    badger_amcl::DISTANCES_LUT_TILED })
+    {
+      auto makeMap = [&](const std::vector<badger_amcl::MapCellState>& states)
+      {
+        std::shared_ptr<badger_amcl::OccupancyMap> map = std::make_shared<badger_amcl::OccupancyMap>(0.05);
+        map->setSize(size_vec);
+        map->setDistancesLUTBuilder(badger_amcl::DISTANCES_LUT_EDT);
+        map->setDistancesLUTPrecision(precision);
+        map->setDistancesLUTLayout(layout);
+        map->setDistancesLUTCacheDir(dir.path());
+        for (int index = 0; index < states.size(); index++)
+        {
+          map->setCellState(index, states[index]);
+        }
+        map->updateDistancesLUT(max_distance);
+        return map;
+      };
+      std::shared_ptr<badger_amcl::OccupancyMap> rebuilt_map = makeMap(patched_cells);
+      // The first map builds the table, the second maps it from the cache
+      // and must not change the file for the first
+      std::shared_ptr<badger_amcl::OccupancyMap> built_map = makeMap(cells);
+      std::shared_ptr<badger_amcl::OccupancyMap> loaded_map = makeMap(cells);
+      std::vector<int> updated_min, updated_max;
+      loaded_map->applyPatch(min_i, min_j, width, height, patch, &updated_min, &updated_max);
+      EXPECT_EQ(updated_min, std::vector<int>({ 61, 11 }));
+      EXPECT_EQ(updated_max, std::vector<int>({ 90, 41 }));
+      built_map->applyPatch(min_i, min_j, width, height, patch, &updated_min, &updated_max);
+      std::shared_ptr<badger_amcl::OccupancyMap> reloaded_map = makeMap(cells);
+      for (int x = 0; x < size_vec[0]; x++)
+      {
+        for (int y = 0; y < size_vec[1]; y++)
+        {
+          EXPECT_EQ(built_map->getCellState(x, y), patched_cells[x + y * size_vec[0]]);
+          EXPECT_EQ(built_map->getDistanceToObject(x, y), rebuilt_map->getDistanceToObject(x, y));
+          EXPECT_EQ(loaded_map->getDistanceToObject(x, y), rebuilt_map->getDistanceToObject(x, y));
+          EXPECT_EQ(reloaded_map->getCellState(x, y), cells[x + y * size_vec[0]]);
+        }
+      }
+      EXPECT_FLOAT_EQ(reloaded_map->getDistanceToObject(min_i + 5, min_j), max_distance);
+    }
+  }
+}
+
+TEST(TestBadgerAmcl, testOccupancyMapRaymarch)
+{
+  // Open floor with racks, unknown patches, and a gap in the outer wall
+  // that lets rays run off the map
+  double resolution = 0.05;
+  std::vector<int> size_vec = {400, 300};
+  badger_amcl::RandomStream rng(9, 0);
+  auto makeMap = [&]()
+  {
+    std::shared_ptr<badger_amcl::OccupancyMap> map = std::make_shared<badger_amcl::OccupancyMap>(resolution);
+    map->setSize(size_vec);
+    for (int x = 0; x < size_vec[0]; x++)
+    {
+      for (int y = 0; y < size_vec[1]; y++)
+      {
+        badger_amcl::MapCellState state = badger_amcl::MapCellState::CELL_FREE;
+        if ((x == 5 or x == size_vec[0] - 6 or y == 5 or y == size_vec[1] - 6) and not (y > 100 and y < 160))
+          state = badger_amcl::MapCellState::CELL_OCCUPIED;
+        else if (x < 5 or x > size_vec[0] - 6 or y < 5 or y > size_vec[1] - 6)
+          state = badger_amcl::MapCellState::CELL_UNKNOWN;
+        else if (x % 60 > 40 and x % 60 < 44 and y % 100 > 30)
+          state = badger_amcl::MapCellState::CELL_OCCUPIED;
+        else if (x > 200 and x < 230 and y > 200 and y < 215)
+          state = badger_amcl::MapCellState::CELL_UNKNOWN;
+        map->setCellState(map->computeCellIndex(x, y), state);
+      }
+    }
+    return map;
+  };
+  std::shared_ptr<badger_amcl::OccupancyMap> bresenham_map = makeMap();
+  std::shared_ptr<badger_amcl::OccupancyMap> raymarch_map = makeMap();
+  raymarch_map->updateClearanceLUT();
+  auto compareRanges = [&]()
+  {
+    for (int n = 0; n < 5000; n++)
+    {
+      double x = (rng.uniform() * 1.2 - 0.6) * size_vec[0] * resolution;
+      double y = (rng.uniform() * 1.2 - 0.6) * size_vec[1] * resolution;
+      double a = 2 * M_PI * rng.uniform();
+      double max_range = 30.0 * rng.uniform();
+      EXPECT_EQ(raymarch_map->calcRange(x, y, a, max_range), bresenham_map->calcRange(x, y, a, max_range));
+    }
+  };
+  compareRanges();
+
+  // A patch keeps the table up to date, and setting a cell drops it
+  int width = 20, height = 10;
+  std::vector<badger_amcl::MapCellState> patch(width * height, badger_amcl::MapCellState::CELL_OCCUPIED);
+  std::vector<int> updated_min, updated_max;
+  bresenham_map->applyPatch(100, 150, width, height, patch, &updated_min, &updated_max);
+  raymarch_map->applyPatch(100, 150, width, height, patch, &updated_min, &updated_max);
+  // Without a distances table only the patch itself changed
+  EXPECT_EQ(updated_min, std::vector<int>({ 100, 150 }));
+  EXPECT_EQ(updated_max, std::vector<int>({ 120, 160 }));
+  compareRanges();
+  bresenham_map->setCellState(bresenham_map->computeCellIndex(300, 80), badger_amcl::MapCellState::CELL_UNKNOWN);
+  raymarch_map->setCellState(raymarch_map->computeCellIndex(300, 80), badger_amcl::MapCellState::CELL_UNKNOWN);
+  compareRanges();
+  raymarch_map->updateClearanceLUT();
+  compareRanges();
+}
+
+TEST(TestBadgerAmcl, testOccupancyMapRangeLUT)
+{
+  double resolution = 0.05;
+  std::vector<int> size_vec = {120, 80};
+  int bearing_count = 72;
+  double max_range = 4.0;
+  TempDir dir;
+  ASSERT_FALSE(dir.path().empty());
+  // The patched map has a block on the open floor and a door in the inner wall
+  auto makeMap = [&](bool patched)
+  {
+    std::shared_ptr<badger_amcl::OccupancyMap> map = std::make_shared<badger_amcl::OccupancyMap>(resolution);
+    map->setSize(size_vec);
+    map->setDistancesLUTCacheDir(dir.path());
+    for (int x = 0; x < size_vec[0]; x++)
+    {
+      for (int y = 0; y < size_vec[1]; y++)
+      {
+        badger_amcl::MapCellState state = badger_amcl::MapCellState::CELL_FREE;
+        if (patched and x >= 30 and x < 32 and y >= 40 and y < 42)
+          state = badger_amcl::MapCellState::CELL_OCCUPIED;
+        else if (patched and x == 60 and y >= 20 and y < 26)
+          state = badger_amcl::MapCellState::CELL_FREE;
+        else if (x == 10 or x == 110 or y == 10 or y == 70 or (x == 60 and y < 50))
+          state = badger_amcl::MapCellState::CELL_OCCUPIED;
+        else if (x < 10 or x > 110 or y < 10 or y > 70)
+          state = badger_amcl::MapCellState::CELL_UNKNOWN;
+        map->setCellState(map->computeCellIndex(x, y), state);
+      }
+    }
+    map->updateRangeLUT(max_range, bearing_count);
+    return map;
+  };
+  auto cellCenter = [&](int i, int j)
+  {
+    return std::make_pair((i - size_vec[0] / 2) * resolution, (j - size_vec[1] / 2) * resolution);
+  };
+  std::shared_ptr<badger_amcl::OccupancyMap> built_map = makeMap(false);
+  std::shared_ptr<badger_amcl::OccupancyMap> loaded_map = makeMap(false);
+  double step = max_range / 65534;
+  for (int i = 0; i < size_vec[0]; i += 7)
+  {
+    for (int j = 0; j < size_vec[1]; j += 3)
+    {
+      std::pair<double, double> center = cellCenter(i, j);
+      for (int bearing = 0; bearing < bearing_count; bearing += 5)
+      {
+        double a = 2 * M_PI * bearing / bearing_count;
+        // calcRange can hit the cell just past max_range
+        double range = std::min(built_map->calcRange(center.first, center.second, a, max_range), max_range);
+        // From anywhere in the cell, and near the bearing, on whichever turn
+        double x = center.first + 0.4 * resolution;
+        double y = center.second - 0.4 * resolution;
+        double near_a = a - 0.4 * 2 * M_PI / bearing_count - 2 * M_PI;
+        EXPECT_NEAR(built_map->lookupRange(x, y, near_a, max_range), range, step);
+        EXPECT_NEAR(loaded_map->lookupRange(x, y, near_a, max_range), range, step);
+        EXPECT_NEAR(built_map->lookupRange(x, y, near_a, 1.0), std::min(range, 1.0), step);
+      }
+    }
+  }
+  // Cells without a row cast the ray
+  std::pair<double, double> wall = cellCenter(60, 20);
+  EXPECT_DOUBLE_EQ(built_map->lookupRange(wall.first, wall.second, 0.3, max_range), 0.0);
+
+  // Patches recast the rays that could pass through them, in a built or a
+  // loaded table, to what a table built for the patched map holds.  One
+  // blocks the open floor and one opens a door in the inner wall, whose
+  // cells get rows.
+  std::vector<badger_amcl::MapCellState> block(4, badger_amcl::MapCellState::CELL_OCCUPIED);
+  std::vector<badger_amcl::MapCellState> door(6, badger_amcl::MapCellState::CELL_FREE);
+  std::vector<int> updated_min, updated_max;
+  for (std::shared_ptr<badger_amcl::OccupancyMap> map : { built_map, loaded_map })
+  {
+    map->applyPatch(30, 40, 2, 2, block, &updated_min, &updated_max);
+    map->applyPatch(60, 20, 1, 6, door, &updated_min, &updated_max);
+  }
+  std::shared_ptr<badger_amcl::OccupancyMap> patched_map = makeMap(true);
+  for (int i = 0; i < size_vec[0]; i++)
+  {
+    for (int j = 0; j < size_vec[1]; j++)
+    {
+      std::pair<double, double> center = cellCenter(i, j);
+      for (int bearing = 0; bearing < bearing_count; bearing++)
+      {
+        double a = 2 * M_PI * bearing / bearing_count;
+        double range = patched_map->lookupRange(center.first, center.second, a, max_range);
+        EXPECT_EQ(built_map->lookupRange(center.first, center.second, a, max_range), range);
+        EXPECT_EQ(loaded_map->lookupRange(center.first, center.second, a, max_range), range);
+      }
+    }
+  }
+  std::pair<double, double> center = cellCenter(20, 40);
+  EXPECT_NEAR(built_map->lookupRange(center.first, center.second, 0.0, max_range), 0.5, step);
+  EXPECT_NEAR(built_map->lookupRange(wall.first, wall.second, 0.0, max_range), 2.5, step);
+
+  // A table of shorter range still finds the walls past it for a longer
+  // query, and caps a query within it
+  std::shared_ptr<badger_amcl::OccupancyMap> short_map = makeMap(false);
+  short_map->updateRangeLUT(1.0, bearing_count);
+  EXPECT_DOUBLE_EQ(short_map->lookupRange(center.first, center.second, 0.0, max_range),
+                   short_map->calcRange(center.first, center.second, 0.0, max_range));
+  EXPECT_NEAR(short_map->lookupRange(center.first, center.second, 0.0, max_range), 2.0, resolution);
+  EXPECT_DOUBLE_EQ(short_map->lookupRange(center.first, center.second, 0.0, 1.0), 1.0);
+  EXPECT_NEAR(short_map->lookupRange(center.first, center.second, M_PI, max_range), 0.5, step);
+}
+
+TEST(TestBadgerAmcl, testPlanarScannerEndpoints)
+{
+  // A room with an inner wall, scanned from around its middle
+  double resolution = 0.05;
+  double max_distance = 0.5;
+  std::vector<int> size_vec = {120, 80};
+  std::shared_ptr<badger_amcl::OccupancyMap> map = std::make_shared<badger_amcl::OccupancyMap>(resolution);
+  map->setSize(size_vec);
+  for (int x = 0; x < size_vec[0]; x++)
+  {
+    for (int y = 0; y < size_vec[1]; y++)
+    {
+      badger_amcl::MapCellState state = badger_amcl::MapCellState::CELL_FREE;
+      if (x == 10 or x == 110 or y == 10 or y == 70 or (x == 60 and y < 50))
+        state = badger_amcl::MapCellState::CELL_OCCUPIED;
+      else if (x < 10 or x > 110 or y < 10 or y > 70)
+        state = badger_amcl::MapCellState::CELL_UNKNOWN;
+      map->setCellState(map->computeCellIndex(x, y), state);
+    }
+  }
+
+  // A scan with NaN and max range beams among the hits
+  badger_amcl::PlanarScanner scanner;
+  badger_amcl::RandomStream rng(13, 0);
+  std::shared_ptr<badger_amcl::PlanarData> data = std::make_shared<badger_amcl::PlanarData>();
+  data->range_count_ = 181;
+  data->range_max_ = 4.0;
+  data->bearings_ = scanner.getBearings(-M_PI / 2, M_PI / 180, data->range_count_);
+  EXPECT_EQ(scanner.getBearings(-M_PI / 2, M_PI / 180, data->range_count_), data->bearings_);
+  for (int i = 0; i < data->range_count_; i++)
+  {
+    if (i % 5 == 0)
+      data->ranges_.push_back(std::numeric_limits<double>::quiet_NaN());
+    else if (i % 7 == 0)
+      data->ranges_.push_back(i % 2 ? data->range_max_ : data->range_max_ + 1.0);
+    else
+      data->ranges_.push_back(0.3 + 1.5 * rng.uniform());
+  }
+  std::shared_ptr<badger_amcl::PFSampleSet> set = std::make_shared<badger_amcl::PFSampleSet>();
+  set->sample_count = 50;
+  set->samples.resize(set->sample_count);
+  for (int j = 0; j < set->sample_count; j++)
+  {
+    set->samples.setPose(j, Eigen::Vector3d(1.6 * rng.uniform() - 0.8, rng.uniform() - 0.5,
+                                            2 * M_PI * rng.uniform() - M_PI));
+  }
+
+  // Each beam taken through the scanner pose and then the sample pose, as
+  // the models did before they kept the endpoints on the scan
+  double z_hit = 0.8, z_rand = 0.2, sigma_hit = 0.1;
+  auto referenceLogWeight = [&](badger_amcl::PlanarModelType model_type, int max_beams,
+                                const Eigen::Vector3d& scanner_pose, const Eigen::Vector3d& sample_pose)
+  {
+    Eigen::Vector3d pose;
+    pose[0] = sample_pose[0] + scanner_pose[0] * std::cos(sample_pose[2]) - scanner_pose[1] * std::sin(sample_pose[2]);
+    pose[1] = sample_pose[1] + scanner_pose[0] * std::sin(sample_pose[2]) + scanner_pose[1] * std::cos(sample_pose[2]);
+    pose[2] = sample_pose[2] + scanner_pose[2];
+    int step = (data->range_count_ - 1) / (max_beams - 1);
+    if (model_type == badger_amcl::PLANAR_MODEL_LIKELIHOOD_FIELD_PROB)
+      step = std::ceil(data->range_count_ / static_cast<double>(max_beams));
+    step = std::max(step, 1);
+    double p = 1.0, log_p = 0.0, sum_pz = 0.0;
+    int valid_beams = 0;
+    for (int i = 0; i < data->range_count_; i += step)
+    {
+      double range = data->ranges_[i];
+      if (range >= data->range_max_ or std::isnan(range))
+        continue;
+      valid_beams++;
+      double bearing = pose[2] + data->bearings_->angles[i];
+      int map_i, map_j;
+      map->convertWorldToMap(pose[0] + range * std::cos(bearing), pose[1] + range * std::sin(bearing), &map_i,
+                             &map_j);
+      double z = max_distance;
+      if (map_i >= 0 and map_i < size_vec[0] and map_j >= 0 and map_j < size_vec[1])
+        z = map->getDistanceToObject(map_i, map_j);
+      double pz = z_hit * std::exp(-(z * z) / (2 * sigma_hit * sigma_hit));
+      if (model_type == badger_amcl::PLANAR_MODEL_LIKELIHOOD_FIELD_GOMPERTZ)
+      {
+        sum_pz += pz + z_rand;
+        continue;
+      }
+      pz += z_rand / data->range_max_;
+      p += pz * pz * pz;
+      log_p += std::log(pz);
+    }
+    if (model_type == badger_amcl::PLANAR_MODEL_LIKELIHOOD_FIELD)
+      return std::log(p);
+    if (model_type == badger_amcl::PLANAR_MODEL_LIKELIHOOD_FIELD_PROB)
+      return log_p;
+    return valid_beams > 0 ? std::log(scanner.applyGompertz(sum_pz / valid_beams)) : 0.0;
+  };
+
+  // Each model, striding over the beams or not, with the scanner moved
+  // between updates from the same scan
+  std::vector<Eigen::Vector3d> scanner_poses = { Eigen::Vector3d(0.0, 0.0, 0.0), Eigen::Vector3d(0.2, -0.1, 0.3),
+                                                 Eigen::Vector3d(-0.15, 0.05, -2.5) };
+  for (badger_amcl::PlanarModelType model_type : { badger_amcl::PLANAR_MODEL_LIKELIHOOD_FIELD,
+                                                   badger_amcl::PLANAR_MODEL_LIKELIHOOD_FIELD_PROB,
+                                                   badger_amcl::PLANAR_MODEL_LIKELIHOOD_FIELD_GOMPERTZ })
+  {
+    for (int max_beams : { 30, data->range_count_ })
+    {
+      scanner.init(max_beams, map);
+      if (model_type == badger_amcl::PLANAR_MODEL_LIKELIHOOD_FIELD)
+        scanner.setModelLikelihoodField(z_hit, z_rand, sigma_hit, max_distance);
+      else if (model_type == badger_amcl::PLANAR_MODEL_LIKELIHOOD_FIELD_PROB)
+        scanner.setModelLikelihoodFieldProb(z_hit, z_rand, sigma_hit, max_distance, false, 0.0, 0.0, 0.0);
+      else
+        scanner.setModelLikelihoodFieldGompertz(z_hit, z_rand, sigma_hit, max_distance, 1.0, 1.0, 1.0, 0.0, 1.0,
+                                                0.0);
+      for (const Eigen::Vector3d& scanner_pose : scanner_poses)
+      {
+        scanner.setPlanarScannerPose(scanner_pose);
+        for (int j = 0; j < set->sample_count; j++)
+          set->samples.setLogWeight(j, 0.0);
+        ASSERT_TRUE(scanner.applyModelToSampleSet(data, set));
+        for (int j = 0; j < set->sample_count; j++)
+        {
+          EXPECT_NEAR(set->samples.getLogWeight(j),
+                      referenceLogWeight(model_type, max_beams, scanner_pose, set->samples.getPose(j)), 1e-9);
+        }
+      }
+    }
+  }
+}
+
+TEST(TestBadgerAmcl, testDistanceLikelihoodLUT)
+{
+  double max_distance = 0.8;
+  std::vector<int> size_vec = {60, 50};
+  std::function<double(double)> fn = [](double z) { return 0.9 * std::exp(-(z * z) / (2 * 0.2 * 0.2)) + 0.1; };
+  badger_amcl::RandomStream rng(7, 0);
+  std::vector<int> occupied;
+  for (int n = 0; n < 20; n++)
+  {
+    occupied.push_back(int(rng.uniform() * size_vec[0] * size_vec[1]));
+  }
+  // A float table is rounded to the nearest step, the integer tables are exact
+  std::vector<std::pair<badger_amcl::DistancesLUTPrecision, double>> precisions = {
+    { badger_amcl::DISTANCES_LUT_FLOAT, 1e-3 }, { badger_amcl::DISTANCES_LUT_UINT8, 1e-6 } };
+  for (const auto& precision : precisions)
+  {
+    badger_amcl::OccupancyMap map(0.05);
+    map.setSize(size_vec);
+    map.setDistancesLUTPrecision(precision.first);
+    for (int index : occupied)
+    {
+      map.setCellState(index, badger_amcl::MapCellState::CELL_OCCUPIED);
+    }
+    map.updateDistancesLUT(max_distance);
+    badger_amcl::DistanceLikelihoodLUT lut;
+    EXPECT_TRUE(lut.empty());
+    lut.update(fn, max_distance, map.getDistanceStepCount());
+    EXPECT_FALSE(lut.empty());
+    for (int x = -1; x <= size_vec[0]; x++)
+    {
+      for (int y = -1; y <= size_vec[1]; y++)
+      {
+        EXPECT_NEAR(lut.get(map.getDistanceStep(x, y)), fn(map.getDistanceToObject(x, y)), precision.second);
+      }
+    }
+    EXPECT_DOUBLE_EQ(lut.get(map.getDistanceStep(-1, 0)), fn(max_distance));
+  }
+}
+
+TEST(TestBadgerAmcl, testKeepPoseOnNewMap)
+{
+  // The first map always starts the filter from the initial pose
+  EXPECT_FALSE(badger_amcl::NodeND::keepPoseOnNewMap(false, true, "", "map"));
+  // Later maps in the same frame keep the particles, unless told not to
+  EXPECT_TRUE(badger_amcl::NodeND::keepPoseOnNewMap(true, true, "map", "map"));
+  EXPECT_FALSE(badger_amcl::NodeND::keepPoseOnNewMap(true, false, "map", "map"));
+  // A map in another frame restarts the filter, whatever the parameter says
+  EXPECT_FALSE(badger_amcl::NodeND::keepPoseOnNewMap(true, true, "map", "map_floor_2"));
+  EXPECT_FALSE(badger_amcl::NodeND::keepPoseOnNewMap(true, false, "map", "map_floor_2"));
+}
+
 int main(int argc, char* argv[])
 {
   testing::InitGoogleTest(&argc, argv);